@@ -0,0 +1,82 @@
+// index_map against adaptive_index_map on dense, semi-dense and sparse ids.
+// The default is 10M ids, use --size=N to change it.
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include "index_map_adaptive.h"
+#include "bench_harness.h"
+#include "timer.h"
+
+struct Data {
+  float f1;
+  float f2;
+  float f3;
+  Data(): Data(0, 0, 0) {}
+  Data(float _f1, float _f2, float _f3) {
+    f1 = _f1;
+    f2 = _f2;
+    f3 = _f3;
+  }
+};
+
+// Ids 1000.. in shuffled order, 'fill' of them present
+static std::vector<uint64_t> make_ids(uint64_t n, double fill) {
+  std::vector<uint64_t> ids;
+  ids.reserve(n);
+  std::mt19937_64 rng(12345);
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  for (uint64_t id = 1000; ids.size() < n; ++id) {
+    if (coin(rng) < fill) {
+      ids.push_back(id);
+    }
+  }
+  std::shuffle(ids.begin(), ids.end(), rng);
+  return ids;
+}
+
+template<typename MAP>
+void bench(const char *name, const std::vector<uint64_t> &ids) {
+  unsigned long long n = ids.size();
+  MAP m;
+  {
+    std::string s = std::string(name) + "::insert";
+    Timer t(s.c_str(), PerElement(n));
+    for (uint64_t i = 0; i < n; ++i) {
+      m.insert(std::make_pair(ids[i], Data(1.0f, 2.0f, 3.0f)));
+    }
+  }
+  unsigned int found = 0;
+  {
+    std::string s = std::string(name) + "::find (50% misses)";
+    Timer t(s.c_str(), PerElement(n));
+    for (uint64_t i = 0; i < n; ++i) {
+      // id + 1 is absent about half the time for semi-dense ids
+      found += (m.find(ids[i] + (i & 1)) != m.end());
+    }
+  }
+  do_not_optimize(found);
+  cout << name << ": " << m.memory_usage() / 1048576.0 << " MB" << endl;
+}
+
+int main(int argc, char **argv) {
+  uint64_t element_size = 10000000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      element_size = strtoull(arg.c_str() + 7, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N]" << endl;
+      return 1;
+    }
+  }
+
+  const char *names[] = { "dense", "semi-dense", "sparse" };
+  const double fills[] = { 1.0, 0.6, 0.05 };
+  for (int d = 0; d < 3; ++d) {
+    std::vector<uint64_t> ids = make_ids(element_size, fills[d]);
+    cout << "--- " << names[d] << " ids (" << fills[d] * 100 << "% of the range) ---" << endl;
+    bench<index_map<uint64_t, Data> >("         index_map", ids);
+    bench<adaptive_index_map<uint64_t, Data> >("adaptive_index_map", ids);
+  }
+  return 0;
+}
@@ -0,0 +1,98 @@
+// Periodic persistence of a large map where each interval changes 1% of the
+// keys: a full snapshot per interval against one image plus a delta per
+// interval with track_changes(). Reports bytes written, write time and the
+// time to load the result back. Built once per engine:
+//   bench_checkpoint_find       (index_map_for_find.h)
+//   bench_checkpoint_iteration  (index_map_for_iteration.h, -DBENCH_ITERATION_MAP)
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include "bench_harness.h"
+#include "timer.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+#else
+#include "index_map_for_find.h"
+#endif
+
+typedef index_map<uint64_t, uint64_t> Map;
+
+static const int intervals = 10;
+
+// Overwrite 1% of the keys, erase 0.5% and insert as many new ones
+static void run_interval(Map &m, const std::vector<uint64_t> &keys, std::vector<uint64_t> &fresh, int round) {
+  size_t n = keys.size() / 100;
+  for (size_t i = 0; i < n; ++i) {
+    m[keys[(round * n + i * 97) % keys.size()]] += 1;
+  }
+  for (size_t i = 0; i < n / 2 && !fresh.empty(); ++i) {
+    m.erase(keys[(round * n + i * 89 + 1) % keys.size()]);
+    m[fresh.back()] = round;
+    fresh.pop_back();
+  }
+}
+
+static void run(const char *label, const std::vector<uint64_t> &keys, bool deltas, const std::string &path) {
+  std::vector<uint64_t> fresh = generate_keys(KEYS_UNIFORM, keys.size() / 2, 999);
+  Map m;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    m[keys[i]] = i;
+  }
+  if (deltas) {
+    m.track_changes();
+  }
+
+  // Snapshots rewrite the file, deltas are appended to it
+  std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+  m.write_checkpoint(out);
+  size_t bytes = 0;
+  {
+    Timer t(label, PerElement(intervals));
+    for (int r = 0; r < intervals; ++r) {
+      run_interval(m, keys, fresh, r);
+      if (!deltas) {
+        out.close();
+        out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+      }
+      bytes += m.write_checkpoint(out);
+    }
+  }
+  out.close();
+  cout << "  " << bytes / 1048576.0 / intervals << " MB written per interval" << endl;
+
+  Map loaded;
+  std::ifstream in(path.c_str(), std::ios::binary);
+  size_t applied;
+  {
+    Timer t("  load", PerElement(m.size()));
+    applied = loaded.load_checkpoints(in);
+  }
+  cout << "  " << applied << " checkpoints loaded" << endl;
+  if (loaded.size() != m.size()) {
+    cerr << "loaded " << loaded.size() << " keys instead of " << m.size() << endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  uint64_t count = 2000000;
+  std::string path = "/tmp/bench_checkpoint_index_map";
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoull(arg.c_str() + 7, NULL, 10);
+    } else if (arg.compare(0, 7, "--path=") == 0) {
+      path = arg.substr(7);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N] [--path=FILE]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, count, 12345);
+  run("full snapshot per interval", keys, false, path);
+  run("image + delta per interval", keys, true, path);
+  unlink(path.c_str());
+  return 0;
+}
@@ -0,0 +1,65 @@
+// What-if evaluation: fork a large map and change a few keys in each fork.
+// Compares copying an index_map with snapshot() of a cow_index_map, and
+// reports the memory each fork owns.
+#include <iostream>
+#include "bench_harness.h"
+#include "timer.h"
+#include "index_map_cow.h"
+
+static const int forks = 20;
+static const int writes_per_fork = 100;
+
+int main(int argc, char **argv) {
+  uint64_t count = 10000000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoull(arg.c_str() + 7, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, count, 12345);
+  uint64_t sum = 0;
+
+  {
+    index_map<uint64_t, uint64_t> m;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      m[keys[i]] = i;
+    }
+    Timer t("index_map copy + writes", PerElement(forks));
+    for (int f = 0; f < forks; ++f) {
+      index_map<uint64_t, uint64_t> fork(m);
+      for (int w = 0; w < writes_per_fork; ++w) {
+        fork[keys[(f * writes_per_fork + w) % keys.size()]] += 1;
+      }
+      sum += fork.size();
+    }
+  }
+
+  {
+    cow_index_map<uint64_t, uint64_t> m;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      m[keys[i]] = i;
+    }
+    uint64_t owned = 0;
+    {
+      Timer t("cow_index_map snapshot + writes", PerElement(forks));
+      for (int f = 0; f < forks; ++f) {
+        cow_index_map<uint64_t, uint64_t> fork = m.snapshot();
+        for (int w = 0; w < writes_per_fork; ++w) {
+          fork[keys[(f * writes_per_fork + w) % keys.size()]] += 1;
+        }
+        sum += fork.size();
+        owned += fork.owned_memory_usage();
+      }
+    }
+    cout << "  base " << m.owned_memory_usage() / 1048576.0 << " MB, "
+         << owned / forks / 1048576.0 << " MB owned per fork" << endl;
+  }
+
+  do_not_optimize(sum);
+  return 0;
+}
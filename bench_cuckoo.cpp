@@ -0,0 +1,128 @@
+// cuckoo_index_map against index_map at increasing loads of the cuckoo table:
+// insert, hit and miss lookups, find_batch, memory and the longest bucket a
+// lookup may scan. The cuckoo map keeps a fixed bucket count and is filled to
+// 50%, 90% and 95% of its slots; index_map holds the same keys at its own
+// load factor. Two key sets:
+//   uniform  random 64-bit keys
+//   skewed   every key falls in 1/64 of the buckets of index_map, about 32
+//            keys per used bucket
+#include <iostream>
+#include "bench_harness.h"
+#include "timer.h"
+#include "index_map_for_find.h"
+#include "index_map_cuckoo.h"
+
+typedef index_map<uint64_t, uint64_t> FindMap;
+typedef cuckoo_index_map<uint64_t, uint64_t> CuckooMap;
+
+// Keys and misses congruent to the first bucket_count / 64 buckets
+static void skewed_keys(uint64_t n, uint64_t bucket_count, std::vector<uint64_t> &keys,
+                        std::vector<uint64_t> &misses) {
+  uint64_t hot = bucket_count / 64;
+  keys.resize(n);
+  misses.resize(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    keys[i] = (i / hot) * bucket_count + i % hot;
+    misses[i] = (i / hot + n) * bucket_count + i % hot;
+  }
+  std::mt19937_64 rng(7);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  std::shuffle(misses.begin(), misses.end(), rng);
+}
+
+static size_t longest_bucket(const FindMap &m) {
+  size_t longest = 0;
+  for (size_t b = 0; b < m.bucket_count(); ++b) {
+    longest = std::max<size_t>(longest, m.bucket_size(b));
+  }
+  return longest;
+}
+
+static size_t longest_bucket(const CuckooMap &m) {
+  (void)m;
+  return 2 * CuckooMap::ways;
+}
+
+template<typename M>
+static void run(const char *label, M &m, const std::vector<uint64_t> &keys,
+                const std::vector<uint64_t> &misses) {
+  unsigned long long n = keys.size();
+  cout << label << endl;
+  {
+    Timer t("  insert", PerElement(n));
+    for (size_t i = 0; i < keys.size(); ++i) {
+      m[keys[i]] = i;
+    }
+  }
+  uint64_t found = 0;
+  {
+    Timer t("  find, hits", PerElement(n));
+    for (size_t i = 0; i < keys.size(); ++i) {
+      found += m.find(keys[i]) != m.end();
+    }
+  }
+  {
+    Timer t("  find, misses", PerElement(n));
+    for (size_t i = 0; i < misses.size(); ++i) {
+      found += m.find(misses[i]) != m.end();
+    }
+  }
+  {
+    std::vector<uint64_t *> values(1024);
+    Timer t("  find_batch, hits", PerElement(n));
+    for (size_t i = 0; i < keys.size(); i += values.size()) {
+      size_t batch = std::min(values.size(), keys.size() - i);
+      found += m.find_batch(&keys[i], batch, values.data());
+    }
+  }
+  do_not_optimize(found);
+  if (found != 2 * keys.size()) {
+    cerr << "found " << found << " keys instead of " << 2 * keys.size() << endl;
+    exit(1);
+  }
+  cout << "  " << m.memory_usage() / (double)n << " bytes/key, load " << m.load_factor()
+       << ", longest scan " << longest_bucket(m) << " records" << endl;
+}
+
+int main(int argc, char **argv) {
+  uint64_t buckets = 1 << 19;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 10, "--buckets=") == 0) {
+      buckets = strtoull(arg.c_str() + 10, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--buckets=N]  (cuckoo buckets, a power of two)" << endl;
+      return 1;
+    }
+  }
+
+  const double loads[] = {0.5, 0.9, 0.95};
+  for (int skewed = 0; skewed < 2; ++skewed) {
+    for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]); ++l) {
+      uint64_t n = (uint64_t)(loads[l] * buckets * CuckooMap::ways);
+      FindMap find_map;
+      find_map.reserve(n);
+      std::vector<uint64_t> keys, misses;
+      if (skewed) {
+        skewed_keys(n, find_map.bucket_count(), keys, misses);
+      } else {
+        keys = generate_keys(KEYS_UNIFORM, n, 12345);
+        misses = generate_keys(KEYS_UNIFORM, n, 54321);
+        for (size_t i = 0; i < misses.size(); ++i) {
+          misses[i] |= 1ull << 63;
+        }
+      }
+
+      cout << "== " << (skewed ? "skewed" : "uniform") << " keys, " << n << " keys, cuckoo load "
+           << loads[l] << endl;
+      run("index_map", find_map, keys, misses);
+      CuckooMap cuckoo(buckets);
+      cuckoo.max_load_factor(0.99f);
+      run("cuckoo_index_map", cuckoo, keys, misses);
+      if (cuckoo.bucket_count() != buckets) {
+        cout << "  cuckoo_index_map grew to " << cuckoo.bucket_count() << " buckets" << endl;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,91 @@
+// Expiry job: drop 20% of the entries of a map. Compares a scan collecting
+// the expired keys followed by one erase per key, erase_batch on the known
+// keys, and a single erase_if sweep. Built once per engine:
+//   bench_expiry_find       (index_map_for_find.h)
+//   bench_expiry_iteration  (index_map_for_iteration.h, -DBENCH_ITERATION_MAP)
+#include <iostream>
+#include "bench_harness.h"
+#include "timer.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+#else
+#include "index_map_for_find.h"
+#endif
+
+typedef bench_payload<16> Value;
+typedef index_map<uint64_t, Value> Map;
+
+// The entry expires when its value's first byte says so
+static bool expired(const std::pair<uint64_t, Value> &p) {
+  return p.second.data[0] == 'e';
+}
+
+static void fill(Map &m, const std::vector<uint64_t> &keys) {
+  for (size_t i = 0; i < keys.size(); ++i) {
+    // Every 5th entry expires
+    m.insert(std::make_pair(keys[i], Value(i % 5 == 0 ? 'e' : 'x')));
+  }
+}
+
+int main(int argc, char **argv) {
+  uint64_t count = 10000000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoull(arg.c_str() + 7, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, count, 12345);
+  std::vector<uint64_t> expiring;
+  for (size_t i = 0; i < keys.size(); i += 5) {
+    expiring.push_back(keys[i]);
+  }
+  unsigned long long n = expiring.size();
+
+  {
+    Map m;
+    fill(m, keys);
+    uint64_t erased = 0;
+    {
+      Timer t("scan + erase per key", PerElement(n));
+      std::vector<uint64_t> found;
+      for (Map::iterator it = m.begin(); it != m.end(); ++it) {
+        if (expired(*it)) {
+          found.push_back(it->first);
+        }
+      }
+      for (size_t i = 0; i < found.size(); ++i) {
+        erased += m.erase(found[i]);
+      }
+    }
+    cout << "  erased " << erased << ", left " << m.size() << endl;
+  }
+
+  {
+    Map m;
+    fill(m, keys);
+    uint64_t erased = 0;
+    {
+      Timer t("erase_batch", PerElement(n));
+      erased = m.erase_batch(expiring.data(), expiring.size());
+    }
+    cout << "  erased " << erased << ", left " << m.size() << endl;
+  }
+
+  {
+    Map m;
+    fill(m, keys);
+    uint64_t erased = 0;
+    {
+      Timer t("erase_if", PerElement(n));
+      erased = m.erase_if(expired);
+    }
+    cout << "  erased " << erased << ", left " << m.size() << endl;
+  }
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include "index_map_for_find.h"
 #include "timer.h"
+#include "bench_harness.h"
 
 struct Data {
   float f1;
@@ -26,7 +27,7 @@ void bench_index_map(index_map<uint64_t, Data> &m, uint64_t *keys) {
     {
     std::ostringstream s;
     s << "    index_map::insert (" << (element_size / loops) << " elements)";
-    Timer t(s.str().c_str());
+    Timer t(s.str().c_str(), PerElement(element_size / loops));
     for (int i = 0; i < element_size / loops; ++i) {
       m.insert(std::make_pair(keys[index++], Data(1.0f, 2.0f, 3.0f)));
     }
@@ -36,10 +37,15 @@ void bench_index_map(index_map<uint64_t, Data> &m, uint64_t *keys) {
     index_map<uint64_t, Data>::size_type size = m.size();
     std::ostringstream s;
     s << "    index_map::find   (" << size << " elements)";
-    Timer t(s.str().c_str());
+    unsigned int found = 0;
+    {
+    Timer t(s.str().c_str(), PerElement(size));
     for (unsigned int i = 0; i < size; ++i) {
-      m.find(keys[i]);
+      // Use the result, otherwise the lookup may be optimized away
+      found += (m.find(keys[i]) != m.end());
+    }
     }
+    do_not_optimize(found);
     }
   } // end for
 }
@@ -51,7 +57,7 @@ void bench_unordered_map(unordered_map<uint64_t, Data> &m, uint64_t *keys) {
     {
     std::ostringstream s;
     s << "unordered_map::insert (" << (element_size / loops) << " elements)";
-    Timer t(s.str().c_str());
+    Timer t(s.str().c_str(), PerElement(element_size / loops));
     for (unsigned int i = 0; i < element_size / loops; ++i) {
       m.insert(std::make_pair(keys[index++], Data(1.0f, 2.0f, 3.0f)));
     }
@@ -61,14 +67,63 @@ void bench_unordered_map(unordered_map<uint64_t, Data> &m, uint64_t *keys) {
     unordered_map<uint64_t, Data>::size_type size = m.size();
     std::ostringstream s;
     s << "unordered_map::find   (" << size << " elements)";
-    Timer t(s.str().c_str());
+    unsigned int found = 0;
+    {
+    Timer t(s.str().c_str(), PerElement(size));
     for (unsigned int i = 0; i < size; ++i) {
-      m.find(keys[i]);
+      // Use the result, otherwise the lookup may be optimized away
+      found += (m.find(keys[i]) != m.end());
     }
     }
+    do_not_optimize(found);
+    }
   } // end for
 }
 
+// 70% misses, the lookups the negative-lookup filter is meant for
+void bench_index_map_misses(index_map<uint64_t, Data> &m, uint64_t *keys) {
+  const int lookups = element_size / 10;
+  uint64_t *probe = new uint64_t[lookups];
+  for (int i = 0; i < lookups; ++i) {
+    // Flipping the top bit gives a key that is almost surely absent
+    probe[i] = (i % 10 < 7) ? (keys[i] ^ (1ull << 63)) : keys[i];
+  }
+  Data **values = new Data*[lookups];
+
+  const char *modes[] = { "no filter", "bloom", "xor" };
+  for (int mode = 0; mode < 3; ++mode) {
+    if (mode == 1) {
+      m.enable_filter();
+    } else if (mode == 2) {
+      m.freeze();
+    }
+    index_map_filter_stats fs = m.filter_stats();
+    cout << "    filter: " << modes[mode] << ", " << fs.memory_bytes / 1048576 << " MB, "
+         << fs.bits_per_key << " bits/key, expected fpp " << fs.expected_fpp << endl;
+
+    unsigned int found = 0;
+    {
+    std::ostringstream s;
+    s << "    index_map::find   (" << lookups << " lookups, 70% misses, " << modes[mode] << ")";
+    Timer t(s.str().c_str(), PerElement(lookups));
+    for (int i = 0; i < lookups; ++i) {
+      found += (m.find(probe[i]) != m.end());
+    }
+    }
+    {
+    std::ostringstream s;
+    s << "    index_map::find_batch (" << lookups << " lookups, 70% misses, " << modes[mode] << ")";
+    Timer t(s.str().c_str(), PerElement(lookups));
+    found += m.find_batch(probe, lookups, values);
+    }
+    do_not_optimize(found);
+  }
+  m.disable_filter();
+
+  delete[] values;
+  delete[] probe;
+}
+
 int main() {
   // Prepare random keys
   srand(time(NULL));
@@ -85,6 +140,11 @@ int main() {
   cout << "-----------------------------------------------------" << endl;
   
   bench_index_map(m2, keys);
+  bench_index_map_misses(m2, keys);
+
+#ifdef INDEX_MAP_ENABLE_STATS
+  index_map_stats_collect().print(cout);
+#endif
 
   // Cleanup
   delete[] keys;
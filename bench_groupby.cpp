@@ -0,0 +1,92 @@
+// Hash aggregation on the iteration map: sum a value per key over a stream of
+// rows, with m[key] += x, accumulate() and accumulate_batch(), against
+// std::unordered_map. The keys are drawn uniformly from 1K, 1M and 10M
+// distinct keys, or from --groups=N.
+#include <iostream>
+#include <unordered_map>
+#include "bench_harness.h"
+#include "timer.h"
+#include "index_map_for_iteration.h"
+
+typedef index_map<uint64_t, int64_t> Map;
+
+template<typename M>
+static int64_t checksum(M &m) {
+  int64_t sum = 0;
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    sum += it->second * (int64_t)(it->first & 0xff);
+  }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  uint64_t rows = 50000000;
+  std::vector<uint64_t> group_counts = {1000, 1000000, 10000000};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--rows=") == 0) {
+      rows = strtoull(arg.c_str() + 7, NULL, 10);
+    } else if (arg.compare(0, 9, "--groups=") == 0) {
+      group_counts.assign(1, strtoull(arg.c_str() + 9, NULL, 10));
+    } else {
+      cerr << "usage: " << argv[0] << " [--rows=N] [--groups=N]" << endl;
+      return 1;
+    }
+  }
+
+  for (size_t g = 0; g < group_counts.size(); ++g) {
+    std::vector<uint64_t> groups = generate_keys(KEYS_UNIFORM, group_counts[g], 12345);
+    std::vector<uint64_t> keys(rows);
+    std::vector<int64_t> deltas(rows);
+    std::mt19937_64 rng(777);
+    for (uint64_t i = 0; i < rows; ++i) {
+      keys[i] = groups[rng() % groups.size()];
+      deltas[i] = (int64_t)(rng() % 100);
+    }
+    cout << "== " << rows << " rows, " << groups.size() << " groups" << endl;
+    unsigned long long n = rows;
+
+    int64_t expected;
+    {
+      std::unordered_map<uint64_t, int64_t> m;
+      Timer t("std::unordered_map, m[key] += x", PerElement(n));
+      for (uint64_t i = 0; i < rows; ++i) {
+        m[keys[i]] += deltas[i];
+      }
+      expected = checksum(m);
+    }
+    int64_t sums[3];
+    {
+      Map m;
+      Timer t("index_map, m[key] += x", PerElement(n));
+      for (uint64_t i = 0; i < rows; ++i) {
+        m[keys[i]] += deltas[i];
+      }
+      sums[0] = checksum(m);
+    }
+    {
+      Map m;
+      Timer t("index_map, accumulate()", PerElement(n));
+      for (uint64_t i = 0; i < rows; ++i) {
+        m.accumulate(keys[i], deltas[i]);
+      }
+      sums[1] = checksum(m);
+    }
+    {
+      Map m;
+      Timer t("index_map, accumulate_batch()", PerElement(n));
+      const uint64_t batch = 1024;
+      for (uint64_t i = 0; i < rows; i += batch) {
+        m.accumulate_batch(&keys[i], &deltas[i], std::min(batch, rows - i));
+      }
+      sums[2] = checksum(m);
+    }
+    for (int s = 0; s < 3; ++s) {
+      if (sums[s] != expected) {
+        cerr << "wrong sums" << endl;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
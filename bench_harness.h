@@ -0,0 +1,433 @@
+#ifndef __BENCH_HARNESS_H_
+#define __BENCH_HARNESS_H_
+
+// Helpers shared by the benchmark programs: dead-code elimination barriers,
+// key generators, repeated trials with summary statistics, and JSON/CSV
+// output of the results.
+
+#include <stdint.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Force the compiler to materialize 'value', so the computation producing it
+// cannot be dropped
+template<typename T>
+inline void do_not_optimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Make all pending memory writes visible to the optimizer barrier
+inline void clobber_memory() {
+  asm volatile("" : : : "memory");
+}
+
+// Value payload of a given size in bytes
+template<int SIZE>
+struct bench_payload {
+  char data[SIZE];
+  bench_payload() {
+    memset(data, 0, sizeof(data));
+  }
+  explicit bench_payload(char c) {
+    memset(data, c, sizeof(data));
+  }
+};
+
+enum key_distribution {
+  KEYS_SEQUENTIAL,    // 0, 1, 2, ...
+  KEYS_STRIDED,       // 0, stride, 2*stride, ...
+  KEYS_UNIFORM,       // uniform random 64-bit keys
+  KEYS_ZIPFIAN        // uniform keys, lookups skewed with a Zipf(0.99) popularity
+};
+
+inline const char *key_distribution_name(key_distribution d) {
+  switch (d) {
+  case KEYS_SEQUENTIAL: return "sequential";
+  case KEYS_STRIDED:    return "strided";
+  case KEYS_UNIFORM:    return "uniform";
+  case KEYS_ZIPFIAN:    return "zipfian";
+  }
+  return "unknown";
+}
+
+// Draws ranks in [0, n) with probability proportional to 1 / (rank + 1)^s
+class zipf_generator {
+public:
+  zipf_generator(uint64_t n, double s, uint64_t seed) : rng(seed), cdf(n) {
+    double sum = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      sum += 1.0 / std::pow((double)(i + 1), s);
+      cdf[i] = sum;
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+      cdf[i] /= sum;
+    }
+  }
+
+  uint64_t next() {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    return std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+  }
+
+private:
+  std::mt19937_64 rng;
+  std::vector<double> cdf;
+};
+
+// Generate 'n' distinct keys for the map. Keys never have the top bit set, so
+// keys with the top bit set are guaranteed misses.
+inline std::vector<uint64_t> generate_keys(key_distribution d, uint64_t n, uint64_t seed) {
+  std::vector<uint64_t> keys(n);
+  const uint64_t stride = 64;
+  if (d == KEYS_SEQUENTIAL) {
+    for (uint64_t i = 0; i < n; ++i) {
+      keys[i] = i;
+    }
+  } else if (d == KEYS_STRIDED) {
+    for (uint64_t i = 0; i < n; ++i) {
+      keys[i] = i * stride;
+    }
+  } else {
+    std::mt19937_64 rng(seed);
+    for (uint64_t i = 0; i < n; ++i) {
+      keys[i] = rng() >> 1;
+    }
+    // Remove duplicates, the map sizes must be exact
+    std::vector<uint64_t> sorted(keys);
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+      sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+      std::shuffle(sorted.begin(), sorted.end(), rng);
+      while (sorted.size() < n) {
+        uint64_t k = rng() >> 1;
+        if (!std::binary_search(sorted.begin(), sorted.end(), k)) {
+          sorted.push_back(k);
+        }
+      }
+      keys.swap(sorted);
+    }
+  }
+  return keys;
+}
+
+// Build a lookup stream of 'n' keys from 'keys', where 'hit_ratio' of them
+// are present in the map
+inline std::vector<uint64_t> generate_lookups(key_distribution d, const std::vector<uint64_t> &keys,
+                                              uint64_t n, double hit_ratio, uint64_t seed) {
+  std::vector<uint64_t> lookups(n);
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  zipf_generator *zipf = NULL;
+  if (d == KEYS_ZIPFIAN) {
+    zipf = new zipf_generator(keys.size(), 0.99, seed + 1);
+  }
+  for (uint64_t i = 0; i < n; ++i) {
+    uint64_t pos = zipf ? zipf->next() : rng() % keys.size();
+    if (coin(rng) < hit_ratio) {
+      lookups[i] = keys[pos];
+    } else {
+      // The top bit is never set in generated keys
+      lookups[i] = keys[pos] | (1ull << 63);
+    }
+  }
+  delete zipf;
+  return lookups;
+}
+
+struct bench_result {
+  std::string map;
+  std::string op;
+  std::string distribution;
+  double hit_ratio;
+  int value_size;
+  uint64_t map_size;
+  uint64_t ops;
+  int trials;
+  double median_ns;
+  double mean_ns;
+  double stddev_ns;
+  double min_ns;
+};
+
+struct bench_options {
+  int warmup;
+  int trials;
+  std::vector<uint64_t> sizes;
+  std::string json_path;
+  std::string csv_path;
+
+  bench_options() : warmup(1), trials(5) {
+    sizes.push_back(10000);
+    sizes.push_back(1000000);
+  }
+
+  // Parse --warmup=N --trials=N --sizes=a,b,c --json=path --csv=path
+  bool parse(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg(argv[i]);
+      if (arg.compare(0, 9, "--warmup=") == 0) {
+        warmup = atoi(arg.c_str() + 9);
+      } else if (arg.compare(0, 9, "--trials=") == 0) {
+        trials = std::max(1, atoi(arg.c_str() + 9));
+      } else if (arg.compare(0, 8, "--sizes=") == 0) {
+        sizes.clear();
+        std::string list = arg.substr(8);
+        size_t pos = 0;
+        while (pos < list.size()) {
+          size_t comma = list.find(',', pos);
+          if (comma == std::string::npos) {
+            comma = list.size();
+          }
+          sizes.push_back(strtoull(list.substr(pos, comma - pos).c_str(), NULL, 10));
+          pos = comma + 1;
+        }
+      } else if (arg.compare(0, 7, "--json=") == 0) {
+        json_path = arg.substr(7);
+      } else if (arg.compare(0, 6, "--csv=") == 0) {
+        csv_path = arg.substr(6);
+      } else {
+        std::cerr << "usage: " << argv[0]
+                  << " [--warmup=N] [--trials=N] [--sizes=a,b,...] [--json=path] [--csv=path]" << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Run 'fn' warmup + trials times. 'fn' performs 'ops' operations and returns
+// the elapsed nanoseconds of the measured part.
+template<typename FN>
+bench_result run_trials(const bench_options &opt, uint64_t ops, FN fn) {
+  for (int i = 0; i < opt.warmup; ++i) {
+    fn();
+  }
+
+  std::vector<double> per_op;
+  for (int i = 0; i < opt.trials; ++i) {
+    double ns = fn();
+    per_op.push_back(ns / std::max<uint64_t>(ops, 1));
+  }
+
+  bench_result r;
+  r.ops = ops;
+  r.trials = opt.trials;
+  std::sort(per_op.begin(), per_op.end());
+  size_t n = per_op.size();
+  r.median_ns = (n % 2) ? per_op[n / 2] : (per_op[n / 2 - 1] + per_op[n / 2]) / 2;
+  r.min_ns = per_op[0];
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += per_op[i];
+  }
+  r.mean_ns = sum / n;
+  double var = 0;
+  for (size_t i = 0; i < n; ++i) {
+    var += (per_op[i] - r.mean_ns) * (per_op[i] - r.mean_ns);
+  }
+  r.stddev_ns = n > 1 ? std::sqrt(var / (n - 1)) : 0;
+  return r;
+}
+
+class bench_stopwatch {
+public:
+  bench_stopwatch() : start(std::chrono::steady_clock::now()) {
+  }
+
+  double elapsed_ns() const {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start;
+};
+
+// Cheap timestamps for timing single operations: the TSC on x86 (calibrated
+// against steady_clock once), steady_clock elsewhere
+class cycle_clock {
+public:
+  static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  static double ns_per_tick() {
+    static double ratio = calibrate();
+    return ratio;
+  }
+
+  static uint64_t to_ns(uint64_t ticks) {
+    return (uint64_t)(ticks * ns_per_tick());
+  }
+
+private:
+  static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+    bench_stopwatch w;
+    uint64_t start = now();
+    while (w.elapsed_ns() < 20e6) {
+    }
+    uint64_t ticks = now() - start;
+    return w.elapsed_ns() / ticks;
+#else
+    return 1.0;
+#endif
+  }
+};
+
+// Log-linear latency histogram in the spirit of HdrHistogram: values below
+// 2^SUB_BITS are exact, above that every power of two is split into
+// 2^SUB_BITS linear sub-buckets, so the relative error stays below 2^-SUB_BITS.
+class latency_histogram {
+public:
+  static const int SUB_BITS = 5;
+  static const int SUB_COUNT = 1 << SUB_BITS;
+  static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+  latency_histogram() : counts(BUCKETS, 0), total(0), max_value(0), sum(0) {
+  }
+
+  void record(uint64_t v) {
+    counts[index_of(v)] += 1;
+    total += 1;
+    sum += v;
+    if (v > max_value) {
+      max_value = v;
+    }
+  }
+
+  void merge(const latency_histogram &o) {
+    for (int i = 0; i < BUCKETS; ++i) {
+      counts[i] += o.counts[i];
+    }
+    total += o.total;
+    sum += o.sum;
+    max_value = std::max(max_value, o.max_value);
+  }
+
+  uint64_t count() const {
+    return total;
+  }
+
+  uint64_t max() const {
+    return max_value;
+  }
+
+  double mean() const {
+    return total ? (double)sum / total : 0;
+  }
+
+  // Highest value equivalent to the p-th quantile (p in [0, 1])
+  uint64_t percentile(double p) const {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t target = (uint64_t)std::ceil(p * total);
+    if (target == 0) {
+      target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= target) {
+        return std::min(upper_bound_of(i), max_value);
+      }
+    }
+    return max_value;
+  }
+
+private:
+  static int index_of(uint64_t v) {
+    if (v < (uint64_t)SUB_COUNT) {
+      return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    int sub = (int)((v >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+    return (e - SUB_BITS + 1) * SUB_COUNT + sub;
+  }
+
+  static uint64_t upper_bound_of(int idx) {
+    if (idx < SUB_COUNT) {
+      return idx;
+    }
+    int e = idx / SUB_COUNT + SUB_BITS - 1;
+    uint64_t sub = idx % SUB_COUNT;
+    uint64_t low = (1ull << e) | (sub << (e - SUB_BITS));
+    return low + (1ull << (e - SUB_BITS)) - 1;
+  }
+
+private:
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t max_value;
+  uint64_t sum;
+};
+
+inline void print_result(const bench_result &r) {
+  std::cout << r.map << "::" << r.op
+            << " dist=" << r.distribution
+            << " hit=" << r.hit_ratio
+            << " value=" << r.value_size << "B"
+            << " size=" << r.map_size
+            << ": median " << r.median_ns << " ns/op"
+            << " (stddev " << r.stddev_ns << ", min " << r.min_ns
+            << ", " << r.trials << " trials)" << std::endl;
+}
+
+inline void write_csv(const std::string &path, const std::vector<bench_result> &results) {
+  std::ofstream out(path.c_str());
+  out << "map,op,distribution,hit_ratio,value_size,map_size,ops,trials,median_ns,mean_ns,stddev_ns,min_ns\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const bench_result &r = results[i];
+    out << r.map << ',' << r.op << ',' << r.distribution << ',' << r.hit_ratio << ','
+        << r.value_size << ',' << r.map_size << ',' << r.ops << ',' << r.trials << ','
+        << r.median_ns << ',' << r.mean_ns << ',' << r.stddev_ns << ',' << r.min_ns << '\n';
+  }
+}
+
+inline void write_json(const std::string &path, const std::vector<bench_result> &results) {
+  std::ofstream out(path.c_str());
+  out << "[\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const bench_result &r = results[i];
+    out << "  {\"map\": \"" << r.map << "\", \"op\": \"" << r.op
+        << "\", \"distribution\": \"" << r.distribution
+        << "\", \"hit_ratio\": " << r.hit_ratio
+        << ", \"value_size\": " << r.value_size
+        << ", \"map_size\": " << r.map_size
+        << ", \"ops\": " << r.ops
+        << ", \"trials\": " << r.trials
+        << ", \"median_ns\": " << r.median_ns
+        << ", \"mean_ns\": " << r.mean_ns
+        << ", \"stddev_ns\": " << r.stddev_ns
+        << ", \"min_ns\": " << r.min_ns << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "]\n";
+}
+
+inline void write_results(const bench_options &opt, const std::vector<bench_result> &results) {
+  if (!opt.json_path.empty()) {
+    write_json(opt.json_path, results);
+  }
+  if (!opt.csv_path.empty()) {
+    write_csv(opt.csv_path, results);
+  }
+}
+
+#endif
@@ -0,0 +1,81 @@
+// Scale test past 2^32 elements with 64-bit sizes and indices. Built once per
+// engine like bench_suite:
+//   bench_huge_find       index_map<uint64_t, uint32_t, uint64_t>
+//   bench_huge_iteration  index_map<uint64_t, uint32_t, int64_t>
+//
+// The default of 5 billion entries needs several hundred GB of memory, use
+// --size=N to run it on smaller machines.
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include "timer.h"
+#include "bench_harness.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+typedef index_map<uint64_t, uint32_t, int64_t> Map;
+#else
+#include "index_map_for_find.h"
+typedef index_map<uint64_t, uint32_t, uint64_t> Map;
+#endif
+
+// Spread sequential ids over the key space, so the buckets are not filled in order
+static inline uint64_t key_of(uint64_t i) {
+  return i * 0x9E3779B97F4A7C15ull;
+}
+
+int main(int argc, char **argv) {
+  uint64_t element_size = 5000000000ull;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      element_size = strtoull(arg.c_str() + 7, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N]" << endl;
+      return 1;
+    }
+  }
+
+  Map m;
+  const int loops = 10;
+  const uint64_t step = (element_size + loops - 1) / loops;
+  uint64_t inserted = 0;
+
+  for (int loop = 0; loop < loops && inserted < element_size; ++loop) {
+    uint64_t end = std::min(element_size, inserted + step);
+    {
+      std::ostringstream s;
+      s << "index_map::insert (" << inserted << " -> " << end << ")";
+      Timer t(s.str().c_str(), PerElement(end - inserted));
+      for (; inserted < end; ++inserted) {
+        m.insert(std::make_pair(key_of(inserted), (uint32_t)inserted));
+      }
+    }
+
+    {
+      // Sample lookups over everything inserted so far
+      const uint64_t lookups = 10000000;
+      std::ostringstream s;
+      s << "index_map::find   (" << (uint64_t)m.size() << " elements)";
+      uint64_t found = 0;
+      {
+        Timer t(s.str().c_str(), PerElement(lookups));
+        for (uint64_t i = 0; i < lookups; ++i) {
+          uint64_t id = (i * 7919) % inserted;
+          auto it = m.find(key_of(id));
+          if (it != m.end()) {
+            found += (it->second == (uint32_t)id);
+          }
+        }
+      }
+      do_not_optimize(found);
+      if (found != lookups) {
+        cerr << "lost keys: " << (lookups - found) << endl;
+        return 1;
+      }
+    }
+  }
+
+  cout << "size: " << (uint64_t)m.size() << ", buckets: " << (uint64_t)m.bucket_count() << endl;
+  return 0;
+}
@@ -20,7 +20,7 @@ static const int element_size = 100000000;
 
 int test_index_map(index_map<uint64_t, Data> &m) {
   {
-    Timer t("index_map::insert");
+    Timer t("index_map::insert", PerElement(element_size));
     for (int i = 0; i < element_size; ++i) {
       uint64_t key = ((uint64_t)rand() << 32) | rand();
       m.insert(std::make_pair(key, Data(1.0f, 2.0f, 3.0f)));
@@ -28,7 +28,7 @@ int test_index_map(index_map<uint64_t, Data> &m) {
   }
 
   {
-    Timer t("index_map::iteration");
+    Timer t("index_map::iteration", PerElement(10ull * m.size()));
     int total = 0;
     for (int i = 0; i < 10; ++i)
     for (auto it : m) {
@@ -37,7 +37,7 @@ int test_index_map(index_map<uint64_t, Data> &m) {
   }
 
   {
-    Timer t("index_map::find&erase");
+    Timer t("index_map::find&erase", PerElement(5000ull));
     for (int i = 0; i < 5000; ++i) {
       uint64_t key = ((uint64_t)rand() << 32) | rand();
       auto it = m.find(key);
@@ -48,7 +48,7 @@ int test_index_map(index_map<uint64_t, Data> &m) {
   }
 
   {
-    Timer t("index_map::[]");
+    Timer t("index_map::[]", PerElement(5000ull));
     for (int i = 0; i < 5000; ++i) {
       uint64_t key = ((uint64_t)rand() << 32) | rand();
       m[key] = Data();
@@ -58,7 +58,7 @@ int test_index_map(index_map<uint64_t, Data> &m) {
 
 int test_unordered_map(unordered_map<uint64_t, Data> &m) {
   {
-    Timer t("unordered_map::insert");
+    Timer t("unordered_map::insert", PerElement(element_size));
     for (int i = 0; i < element_size; ++i) {
       uint64_t key = ((uint64_t)rand() << 32) | rand();
       m.insert(std::make_pair(key, Data(1.0f, 2.0f, 3.0f)));
@@ -66,7 +66,7 @@ int test_unordered_map(unordered_map<uint64_t, Data> &m) {
   }
 
   {
-    Timer t("unordered_map::iteration");
+    Timer t("unordered_map::iteration", PerElement(10ull * m.size()));
     int total = 0;
     for (int i = 0; i < 10; ++i)
     for (auto it : m) {
@@ -75,7 +75,7 @@ int test_unordered_map(unordered_map<uint64_t, Data> &m) {
   }
 
   {
-    Timer t("unordered_map::find&erase");
+    Timer t("unordered_map::find&erase", PerElement(5000ull));
     for (int i = 0; i < 5000; ++i) {
       uint64_t key = ((uint64_t)rand() << 32) | rand();
       auto it = m.find(key);
@@ -86,7 +86,7 @@ int test_unordered_map(unordered_map<uint64_t, Data> &m) {
   }
 
   {
-    Timer t("unordered_map::[]");
+    Timer t("unordered_map::[]", PerElement(5000ull));
     for (int i = 0; i < 5000; ++i) {
       uint64_t key = ((uint64_t)rand() << 32) | rand();
       m[key] = Data();
@@ -105,4 +105,8 @@ int main() {
   cout << "--------------------------------" << endl;
   
   test_unordered_map(m2);
+
+#ifdef INDEX_MAP_ENABLE_STATS
+  index_map_stats_collect().print(cout);
+#endif
 }
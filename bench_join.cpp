@@ -0,0 +1,126 @@
+// Hash join of a probe column against a build column of unique keys: a loop of
+// find() calls on a default index_map, find_batch() on the same map, and
+// index_map_join with a single partition and with partition_bits_for() the
+// build size. Half of the probe keys match. Every variant writes the matching
+// probe rows and build payloads and must agree on their count and sum.
+#include <iostream>
+#include "bench_harness.h"
+#include "timer.h"
+#include "index_map_join.h"
+
+typedef index_map<uint64_t, uint64_t> Map;
+typedef index_map_join<uint64_t, uint64_t> Join;
+
+static uint64_t checksum(const std::vector<size_t> &rows, const std::vector<uint64_t> &payloads,
+                         size_t matches) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < matches; ++i) {
+    sum += rows[i] ^ payloads[i];
+  }
+  return sum + matches;
+}
+
+static void run_join(const char *label, int bits, const std::vector<uint64_t> &build_keys,
+                     const std::vector<uint64_t> &payloads, const std::vector<uint64_t> &probe_keys,
+                     std::vector<size_t> &rows, std::vector<uint64_t> &out, uint64_t expected) {
+  Join join(bits);
+  std::string build_label = std::string(label) + ", build";
+  {
+    Timer t(build_label.c_str(), PerElement(build_keys.size()));
+    join.build(build_keys.data(), payloads.data(), build_keys.size());
+  }
+  size_t matches;
+  {
+    Timer t((std::string(label) + ", probe").c_str(), PerElement(probe_keys.size()));
+    matches = join.probe(probe_keys.data(), probe_keys.size(), rows.data(), out.data());
+  }
+  cout << "  " << join.partition_count() << " partitions, "
+       << join.memory_usage() / (double)join.size() << " bytes/key" << endl;
+  if (checksum(rows, out, matches) != expected) {
+    cerr << label << ": wrong matches" << endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint64_t> build_sizes = {1000000, 4000000};
+  uint64_t probe_size = 20000000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 8, "--build=") == 0) {
+      build_sizes.assign(1, strtoull(arg.c_str() + 8, NULL, 10));
+    } else if (arg.compare(0, 8, "--probe=") == 0) {
+      probe_size = strtoull(arg.c_str() + 8, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--build=N] [--probe=N]" << endl;
+      return 1;
+    }
+  }
+
+  for (size_t b = 0; b < build_sizes.size(); ++b) {
+    uint64_t n = build_sizes[b];
+    std::vector<uint64_t> build_keys = generate_keys(KEYS_UNIFORM, n, 12345);
+    std::vector<uint64_t> payloads(n);
+    for (uint64_t i = 0; i < n; ++i) {
+      payloads[i] = i * 3 + 1;
+    }
+    // Misses have the top bit set, which generate_keys never does
+    std::vector<uint64_t> probe_keys(probe_size);
+    std::mt19937_64 rng(777);
+    for (uint64_t i = 0; i < probe_size; ++i) {
+      uint64_t key = build_keys[rng() % n];
+      probe_keys[i] = (rng() & 1) ? key : key | (1ull << 63);
+    }
+    std::vector<size_t> rows(probe_size);
+    std::vector<uint64_t> out(probe_size);
+    cout << "== " << n << " build rows, " << probe_size << " probe rows" << endl;
+
+    Map m;
+    {
+      Timer t("index_map, build", PerElement(n));
+      for (uint64_t i = 0; i < n; ++i) {
+        m.insert(std::make_pair(build_keys[i], payloads[i]));
+      }
+    }
+    uint64_t expected;
+    {
+      Timer t("index_map, find() loop", PerElement(probe_size));
+      size_t matches = 0;
+      for (uint64_t i = 0; i < probe_size; ++i) {
+        Map::iterator it = m.find(probe_keys[i]);
+        if (it != m.end()) {
+          rows[matches] = i;
+          out[matches] = it->second;
+          matches += 1;
+        }
+      }
+      expected = checksum(rows, out, matches);
+    }
+    cout << "  " << m.memory_usage() / (double)n << " bytes/key" << endl;
+    {
+      Timer t("index_map, find_batch()", PerElement(probe_size));
+      std::vector<uint64_t *> values(1024);
+      size_t matches = 0;
+      for (uint64_t i = 0; i < probe_size; i += values.size()) {
+        size_t batch = std::min<uint64_t>(values.size(), probe_size - i);
+        m.find_batch(&probe_keys[i], batch, values.data());
+        for (size_t j = 0; j < batch; ++j) {
+          if (values[j] != NULL) {
+            rows[matches] = i + j;
+            out[matches] = *values[j];
+            matches += 1;
+          }
+        }
+      }
+      if (checksum(rows, out, matches) != expected) {
+        cerr << "find_batch: wrong matches" << endl;
+        return 1;
+      }
+    }
+
+    run_join("index_map_join, 1 partition", 0, build_keys, payloads, probe_keys, rows, out, expected);
+    run_join("index_map_join, partitioned", Join::partition_bits_for(n), build_keys, payloads,
+             probe_keys, rows, out, expected);
+  }
+  return 0;
+}
@@ -0,0 +1,171 @@
+// Per-operation latency of insert, find, erase and operator[], recorded into
+// log-linear histograms. Built once per engine like bench_suite:
+//   bench_latency_find       (index_map_for_find.h)
+//   bench_latency_iteration  (index_map_for_iteration.h, -DBENCH_ITERATION_MAP)
+//
+// Every operation (or batch of --batch operations) is timed on its own, so the
+// tail shows the stalls of rehash and buffer growth that the totals hide. The
+// timeline splits the run into windows and marks the windows where the bucket
+// count changed.
+#include <iostream>
+#include <unordered_map>
+#include "bench_harness.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+static const char *engine_name = "index_map_for_iteration";
+#else
+#include "index_map_for_find.h"
+static const char *engine_name = "index_map_for_find";
+#endif
+
+using namespace std;
+
+typedef bench_payload<16> Value;
+typedef index_map<uint64_t, Value> Map;
+
+struct growth_event {
+  uint64_t op;
+  uint64_t size;
+  uint64_t old_buckets;
+  uint64_t new_buckets;
+  uint64_t latency_ns;
+};
+
+struct latency_run {
+  const char *op;
+  latency_histogram hist;
+  // Max latency of each timeline window
+  std::vector<uint64_t> window_max;
+  std::vector<growth_event> events;
+};
+
+static const int timeline_windows = 40;
+
+// Time 'count' operations in batches of 'batch'. 'fn(i)' performs the i-th operation.
+template<typename FN>
+void record_latency(Map &m, latency_run &run, uint64_t count, uint64_t batch, FN fn) {
+  uint64_t window = std::max<uint64_t>(count / timeline_windows, 1);
+  run.window_max.assign((count + window - 1) / window, 0);
+
+  for (uint64_t i = 0; i < count; i += batch) {
+    uint64_t end = std::min(count, i + batch);
+    uint64_t buckets = m.bucket_count();
+
+    uint64_t start = cycle_clock::now();
+    for (uint64_t j = i; j < end; ++j) {
+      fn(j);
+    }
+    uint64_t ns = cycle_clock::to_ns(cycle_clock::now() - start) / (end - i);
+
+    for (uint64_t j = i; j < end; ++j) {
+      run.hist.record(ns);
+    }
+    uint64_t &wmax = run.window_max[i / window];
+    wmax = std::max(wmax, ns);
+
+    if ((uint64_t)m.bucket_count() != buckets) {
+      growth_event e = { i, (uint64_t)m.size(), buckets, (uint64_t)m.bucket_count(), ns };
+      run.events.push_back(e);
+    }
+  }
+}
+
+static void print_run(const latency_run &run, uint64_t count) {
+  const latency_histogram &h = run.hist;
+  cout << engine_name << "::" << run.op << " (" << h.count() << " ops)"
+       << ": p50 " << h.percentile(0.5) << " ns"
+       << ", p99 " << h.percentile(0.99) << " ns"
+       << ", p99.9 " << h.percentile(0.999) << " ns"
+       << ", max " << h.max() << " ns"
+       << ", mean " << h.mean() << " ns" << endl;
+
+  if (run.events.empty()) {
+    return;
+  }
+
+  // Timeline: one row per window, '*' marks windows with growth events
+  uint64_t window = std::max<uint64_t>(count / timeline_windows, 1);
+  uint64_t top = 1;
+  for (size_t w = 0; w < run.window_max.size(); ++w) {
+    top = std::max(top, run.window_max[w]);
+  }
+  size_t e = 0;
+  for (size_t w = 0; w < run.window_max.size(); ++w) {
+    bool grew = false;
+    while (e < run.events.size() && run.events[e].op < (w + 1) * window) {
+      grew = true;
+      ++e;
+    }
+    int bar = (int)(50.0 * std::log((double)run.window_max[w] + 1) / std::log((double)top + 1));
+    cout << "  ops " << w * window << "+\t" << (grew ? '*' : ' ') << ' '
+         << std::string(bar, '#') << ' ' << run.window_max[w] << " ns" << endl;
+  }
+  for (size_t i = 0; i < run.events.size(); ++i) {
+    const growth_event &g = run.events[i];
+    cout << "  growth at op " << g.op << ": size " << g.size
+         << ", buckets " << g.old_buckets << " -> " << g.new_buckets
+         << ", " << g.latency_ns << " ns" << endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  uint64_t count = 1000000;
+  uint64_t batch = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoull(arg.c_str() + 7, NULL, 10);
+    } else if (arg.compare(0, 8, "--batch=") == 0) {
+      batch = std::max<uint64_t>(1, strtoull(arg.c_str() + 8, NULL, 10));
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N] [--batch=B]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, count, 12345);
+  std::vector<uint64_t> lookups = generate_lookups(KEYS_UNIFORM, keys, count, 0.5, 67890);
+  // Half new keys for operator[], the rest already exist
+  std::vector<uint64_t> fresh = generate_keys(KEYS_UNIFORM, count / 2, 424242);
+  const Value value('x');
+  uint64_t sink = 0;
+
+  Map m;
+
+  latency_run insert_run;
+  insert_run.op = "insert";
+  record_latency(m, insert_run, count, batch, [&](uint64_t i) {
+    auto ret = m.insert(std::make_pair(keys[i], value));
+    sink += ret.second;
+  });
+  print_run(insert_run, count);
+
+  latency_run find_run;
+  find_run.op = "find";
+  record_latency(m, find_run, count, batch, [&](uint64_t i) {
+    auto it = m.find(lookups[i]);
+    if (it != m.end()) {
+      sink += it->second.data[0];
+    }
+  });
+  print_run(find_run, count);
+
+  latency_run erase_run;
+  erase_run.op = "erase";
+  record_latency(m, erase_run, count / 2, batch, [&](uint64_t i) {
+    sink += m.erase(keys[i * 2]);
+  });
+  print_run(erase_run, count / 2);
+
+  latency_run index_run;
+  index_run.op = "operator[]";
+  record_latency(m, index_run, count, batch, [&](uint64_t i) {
+    uint64_t key = (i % 2) ? keys[i] : fresh[i / 2];
+    sink += m[key].data[0];
+  });
+  print_run(index_run, count);
+
+  do_not_optimize(sink);
+  return 0;
+}
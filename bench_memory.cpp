@@ -0,0 +1,94 @@
+// Memory per entry of index_map and quotient_index_map (key quotienting)
+// holding the same keys, of index_set against index_map<K, char>, and of many
+// 3-element maps. The default is 100M keys, use --size=N to run it on
+// smaller machines.
+#include <iostream>
+#include <cstdlib>
+#include "index_map_quotient.h"
+#include "timer.h"
+
+struct Data {
+  float f1;
+  float f2;
+  float f3;
+  Data(): Data(0, 0, 0) {}
+  Data(float _f1, float _f2, float _f3) {
+    f1 = _f1;
+    f2 = _f2;
+    f3 = _f3;
+  }
+};
+
+// Ids from a sparse range: 100M keys spread over ~6.4 * 10^9 values
+static inline uint64_t key_of(uint64_t i) {
+  return i * 64 + (i % 7);
+}
+
+template<typename MAP>
+void bench(const char *name, uint64_t element_size) {
+  MAP m;
+  {
+    Timer t(name, PerElement(element_size));
+    for (uint64_t i = 0; i < element_size; ++i) {
+      m.insert(std::make_pair(key_of(i), Data(1.0f, 2.0f, 3.0f)));
+    }
+  }
+  uint64_t bytes = m.memory_usage();
+  cout << name << ": " << element_size << " keys, " << m.bucket_count() << " buckets, "
+       << bytes / 1048576.0 << " MB, " << (double)bytes / element_size << " bytes/entry" << endl;
+}
+
+// Membership only: a map with a dummy value against the key-only set
+void bench_membership(uint64_t element_size) {
+  index_map<uint64_t, char> m;
+  index_set<uint64_t> s;
+  for (uint64_t i = 0; i < element_size; ++i) {
+    m.insert(std::make_pair(key_of(i), 'x'));
+    s.insert(key_of(i));
+  }
+  cout << "index_map<uint64_t, char>: " << (double)m.memory_usage() / element_size << " bytes/entry" << endl;
+  cout << "index_set<uint64_t>: " << (double)s.memory_usage() / element_size << " bytes/entry" << endl;
+}
+
+// Many tiny maps, e.g. per-object attributes: they stay in the inline array
+void bench_small_maps(uint64_t element_size) {
+  uint64_t map_num = std::min<uint64_t>(element_size / 3, 1000000);
+  std::vector<index_map<uint64_t, Data> > maps(map_num);
+  uint64_t bytes = 0;
+  {
+    Timer t("3-element maps", PerElement(map_num));
+    for (uint64_t i = 0; i < map_num; ++i) {
+      for (uint64_t k = 0; k < 3; ++k) {
+        maps[i].insert(std::make_pair(key_of(i * 3 + k), Data(1.0f, 2.0f, 3.0f)));
+      }
+    }
+  }
+  for (uint64_t i = 0; i < map_num; ++i) {
+    bytes += maps[i].memory_usage();
+  }
+  cout << map_num << " maps of 3 keys: " << (double)bytes / map_num << " bytes/map" << endl;
+}
+
+int main(int argc, char **argv) {
+  uint64_t element_size = 100000000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      element_size = strtoull(arg.c_str() + 7, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N]" << endl;
+      return 1;
+    }
+  }
+
+  cout << "sizeof(index_bucket<uint64_t, Data>) = " << sizeof(index_bucket<uint64_t, Data>)
+       << ", record = " << sizeof(std::pair<uint64_t, Data>) << endl;
+  cout << "sizeof(index_bucket<uint32_t, Data>) = " << sizeof(index_bucket<uint32_t, Data>)
+       << ", record = " << sizeof(std::pair<uint32_t, Data>) << endl;
+
+  bench<index_map<uint64_t, Data> >("index_map<uint64_t, Data>", element_size);
+  bench<quotient_index_map<uint64_t, Data, uint32_t> >("quotient_index_map<uint64_t, Data, uint32_t>", element_size);
+  bench_membership(element_size);
+  bench_small_maps(element_size);
+  return 0;
+}
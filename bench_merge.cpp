@@ -0,0 +1,89 @@
+// End-of-job reduction: 8 shards built by separate workers are combined into
+// one map. Compares inserting every element with merge() of each shard and
+// merge_parallel() of all of them. Built once per engine:
+//   bench_merge_find       (index_map_for_find.h)
+//   bench_merge_iteration  (index_map_for_iteration.h, -DBENCH_ITERATION_MAP)
+#include <iostream>
+#include "bench_harness.h"
+#include "timer.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+#else
+#include "index_map_for_find.h"
+#endif
+
+typedef index_map<uint64_t, uint64_t> Map;
+
+static const int shard_num = 8;
+
+// Key i goes to shard i % shard_num. 'sized' reserves every shard for all the
+// keys, so the find map can merge them bucket by bucket (each shard then has
+// the bucket array of the whole map, hence the smaller default size).
+static void build_shards(Map *shards, const std::vector<uint64_t> &keys, bool sized) {
+  for (int s = 0; s < shard_num; ++s) {
+    if (sized) {
+      shards[s].reserve(keys.size());
+    }
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    shards[i % shard_num][keys[i]] = i;
+  }
+}
+
+enum merge_mode { INSERT, MERGE, MERGE_PARALLEL };
+
+static void run(const char *label, const std::vector<uint64_t> &keys, bool sized, merge_mode mode, int threads) {
+  Map shards[shard_num];
+  build_shards(shards, keys, sized);
+  Map *ptrs[shard_num];
+  for (int s = 0; s < shard_num; ++s) {
+    ptrs[s] = &shards[s];
+  }
+
+  Map m;
+  std::string name = std::string(label) + (sized ? ", sized shards" : "");
+  {
+    Timer t(name.c_str(), PerElement(keys.size()));
+    if (mode == INSERT) {
+      for (int s = 0; s < shard_num; ++s) {
+        for (auto it = shards[s].begin(); it != shards[s].end(); ++it) {
+          m[it->first] = it->second;
+        }
+      }
+    } else if (mode == MERGE) {
+      for (int s = 0; s < shard_num; ++s) {
+        m.merge(shards[s]);
+      }
+    } else {
+      m.merge_parallel(ptrs, shard_num, threads);
+    }
+  }
+  do_not_optimize(m.size());
+}
+
+int main(int argc, char **argv) {
+  uint64_t count = 2000000;
+  int threads = 4;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoull(arg.c_str() + 7, NULL, 10);
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      threads = atoi(arg.c_str() + 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N] [--threads=N]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, count, 12345);
+  std::string parallel = "merge_parallel(), " + std::to_string(threads) + " threads";
+
+  for (int sized = 0; sized < 2; ++sized) {
+    run("insert per element", keys, sized, INSERT, threads);
+    run("merge() per shard", keys, sized, MERGE, threads);
+    run(parallel.c_str(), keys, sized, MERGE_PARALLEL, threads);
+  }
+  return 0;
+}
@@ -0,0 +1,113 @@
+// A frozen table of --size keys (100M by default): mphf_index_map built on
+// 1 and --threads threads, against the compacted chained layout of
+// shm_index_map. Reports the build time, the bits per key of the hash
+// function and the time of random hits and misses, one by one and with
+// find_batch().
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include "bench_harness.h"
+#include "timer.h"
+#include "index_map_mphf.h"
+#include "index_map_shm.h"
+
+typedef mphf_index_map<uint64_t, uint64_t> Mphf;
+typedef shm_index_map<uint64_t, uint64_t> Shm;
+
+template<typename M>
+static void lookups(const char *label, const M &m, const std::vector<uint64_t> &hits,
+                    const std::vector<uint64_t> &misses) {
+  uint64_t found = 0;
+  {
+    Timer t((std::string(label) + ", hits").c_str(), PerElement(hits.size()));
+    for (size_t i = 0; i < hits.size(); ++i) {
+      const uint64_t *value = m.find(hits[i]);
+      found += value != NULL ? *value : 0;
+    }
+  }
+  {
+    Timer t((std::string(label) + ", misses").c_str(), PerElement(misses.size()));
+    for (size_t i = 0; i < misses.size(); ++i) {
+      found += m.find(misses[i]) != NULL;
+    }
+  }
+  do_not_optimize(found);
+}
+
+int main(int argc, char **argv) {
+  uint64_t count = 100000000;
+  uint64_t probes = 10000000;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  double gamma = INDEX_MAP_MPHF_GAMMA;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoull(arg.c_str() + 7, NULL, 10);
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      threads = atoi(arg.c_str() + 10);
+    } else if (arg.compare(0, 8, "--gamma=") == 0) {
+      gamma = atof(arg.c_str() + 8);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N] [--threads=N] [--gamma=F]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, count, 12345);
+  std::vector<uint64_t> values(keys.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i] = i + 1;
+  }
+  std::vector<uint64_t> hits(probes), misses(probes);
+  std::mt19937_64 rng(777);
+  for (uint64_t i = 0; i < probes; ++i) {
+    hits[i] = keys[rng() % keys.size()];
+    // generate_keys never sets the top bit
+    misses[i] = keys[rng() % keys.size()] | (1ull << 63);
+  }
+  cout << "== " << keys.size() << " keys, gamma " << gamma << endl;
+
+  {
+    Mphf m(gamma);
+    for (int t = 1; t <= threads; t = t == threads ? threads + 1 : threads) {
+      std::string label = "mphf_index_map, build, " + std::to_string(t) + " thread(s)";
+      Timer timer(label.c_str(), PerElement(keys.size()));
+      m.build_columns(keys.data(), values.data(), keys.size(), t);
+    }
+    cout << "  " << m.index_bits_per_key() << " index bits/key, " << m.level_count() << " levels, "
+         << m.fallback_count() << " fallback keys, " << m.memory_usage() / (double)m.size()
+         << " bytes/key" << endl;
+    lookups("mphf_index_map", m, hits, misses);
+    std::vector<const uint64_t *> batch(1024);
+    uint64_t found = 0;
+    {
+      Timer t("mphf_index_map, find_batch, hits", PerElement(hits.size()));
+      for (size_t i = 0; i < hits.size(); i += batch.size()) {
+        found += m.find_batch(&hits[i], std::min(batch.size(), hits.size() - i), batch.data());
+      }
+    }
+    if (found != hits.size()) {
+      cerr << "find_batch found " << found << " keys out of " << hits.size() << endl;
+      return 1;
+    }
+  }
+
+  {
+    std::string path = "/dev/shm/bench_mphf." + std::to_string((long long)getpid());
+    {
+      std::vector<std::pair<uint64_t, uint64_t> > records(keys.size());
+      for (size_t i = 0; i < keys.size(); ++i) {
+        records[i] = std::make_pair(keys[i], values[i]);
+      }
+      std::vector<uint64_t>().swap(values);
+      Timer t("shm_index_map, build", PerElement(keys.size()));
+      Shm::publish(path, records.begin(), records.end());
+    }
+    Shm m(path);
+    unlink(path.c_str());
+    cout << "  " << (m.mapped_bytes() - m.size() * sizeof(std::pair<uint64_t, uint64_t>)) * 8.0 / m.size()
+         << " index bits/key, " << m.mapped_bytes() / (double)m.size() << " bytes/key" << endl;
+    lookups("shm_index_map", m, hits, misses);
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Per-request maps: every request builds a map of 256 keys, looks them up and
+// drops it. Compares the global heap with pmr_index_map on a monotonic arena
+// that is released after each request, so a request frees nothing one piece
+// at a time. Built once per engine, in C++17 for std::pmr:
+//   bench_pmr_find       (index_map_for_find.h)
+//   bench_pmr_iteration  (index_map_for_iteration.h, -DBENCH_ITERATION_MAP)
+#include <iostream>
+#include "bench_harness.h"
+#include "timer.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+#else
+#include "index_map_for_find.h"
+#endif
+
+static const size_t keys_per_request = 256;
+// Sized for the keys of a request, the default count would dominate
+static const size_t buckets_per_map = 1031;
+
+template<typename Map>
+static uint64_t handle(Map &m, const std::vector<uint64_t> &keys, size_t pos, uint64_t r) {
+  uint64_t found = 0;
+  for (size_t i = 0; i < keys_per_request; ++i) {
+    m[keys[pos + i]] = r;
+  }
+  for (size_t i = 0; i < keys_per_request; ++i) {
+    found += m.find(keys[pos + i]) != m.end();
+  }
+  return found;
+}
+
+int main(int argc, char **argv) {
+  uint64_t requests = 100000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 11, "--requests=") == 0) {
+      requests = strtoull(arg.c_str() + 11, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--requests=N]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, 1 << 20, 12345);
+  unsigned long long n = requests;
+  uint64_t found = 0;
+
+  {
+    Timer t("global heap", PerElement(n));
+    size_t pos = 0;
+    for (uint64_t r = 0; r < requests; ++r) {
+      if (pos + keys_per_request > keys.size()) {
+        pos = 0;
+      }
+      index_map<uint64_t, uint64_t> m(buckets_per_map);
+      found += handle(m, keys, pos, r);
+      pos += keys_per_request;
+    }
+  }
+
+  {
+    std::vector<char> buffer(1 << 20);
+    std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+    Timer t("monotonic arena", PerElement(n));
+    size_t pos = 0;
+    for (uint64_t r = 0; r < requests; ++r) {
+      if (pos + keys_per_request > keys.size()) {
+        pos = 0;
+      }
+      {
+        pmr_index_map<uint64_t, uint64_t> m(buckets_per_map, &arena);
+        found += handle(m, keys, pos, r);
+      }
+      arena.release();
+      pos += keys_per_request;
+    }
+  }
+
+  cout << "  found " << found << endl;
+  return 0;
+}
@@ -0,0 +1,74 @@
+// Time to rebuild the bucket index of a large iteration map: one value at a
+// time into the buckets and their overflow lists, against the counting-sort
+// CSR rebuild of csr_index() with 1 and with --threads threads. Every rehash
+// changes the bucket count, between the same two counts for every mode, so
+// the whole index is rebuilt.
+#include <iostream>
+#include <thread>
+#include "timer.h"
+#include "index_map_for_iteration.h"
+
+typedef index_map<uint64_t, uint32_t> Map;
+
+static void rebuild(const char *label, Map &m, int csr_threads, int64_t buckets) {
+  if (csr_threads > 0) {
+    m.csr_index(true, csr_threads);
+  } else {
+    m.csr_index(false);
+  }
+  for (int trial = 0; trial < 2; ++trial) {
+    Timer t(label, PerElement(m.size()));
+    m.rehash(buckets + 1 - trial);
+  }
+  cout << "  " << m.memory_usage() / (double)m.size() << " bytes/value" << endl;
+}
+
+int main(int argc, char **argv) {
+  int64_t count = 100000000;
+  float load = 4.0f;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoll(arg.c_str() + 7, NULL, 10);
+    } else if (arg.compare(0, 7, "--load=") == 0) {
+      load = atof(arg.c_str() + 7);
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      threads = atoi(arg.c_str() + 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N] [--load=F] [--threads=N]" << endl;
+      return 1;
+    }
+  }
+
+  Map m;
+  m.max_load_factor(load);
+  m.reserve((int)count);
+  {
+    Timer t("insert", PerElement(count));
+    for (int64_t i = 0; i < count; ++i) {
+      // Distinct keys without the top bit, never the hole key
+      uint64_t key = ((uint64_t)i * 0x9E3779B97F4A7C15ull) & ~(1ull << 63);
+      m[key] = (uint32_t)i;
+    }
+  }
+  int64_t buckets = m.bucket_count();
+  cout << m.size() << " values, " << buckets << " buckets" << endl;
+
+  rebuild("rehash, one value at a time", m, 0, buckets);
+  rebuild("rehash, CSR, 1 thread", m, 1, buckets);
+  if (threads > 1) {
+    std::string label = "rehash, CSR, " + std::to_string(threads) + " threads";
+    rebuild(label.c_str(), m, threads, buckets);
+  }
+
+  uint64_t found = 0;
+  for (int64_t i = 0; i < count; i += 1000) {
+    found += m.find(((uint64_t)i * 0x9E3779B97F4A7C15ull) & ~(1ull << 63)) != m.end();
+  }
+  if (found != (uint64_t)(count + 999) / 1000) {
+    cerr << "found " << found << " sampled keys out of " << (count + 999) / 1000 << endl;
+    return 1;
+  }
+  return 0;
+}
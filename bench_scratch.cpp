@@ -0,0 +1,80 @@
+// Per-request scratch map: fill a few keys, look them up, then clear the map
+// for the next request. Compares clear(), which keeps the buckets, with
+// release(), which frees them and starts again from the initial bucket
+// count. Built once per engine:
+//   bench_scratch_find       (index_map_for_find.h)
+//   bench_scratch_iteration  (index_map_for_iteration.h, -DBENCH_ITERATION_MAP)
+#include <iostream>
+#include "bench_harness.h"
+#include "timer.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+#else
+#include "index_map_for_find.h"
+#endif
+
+typedef index_map<uint64_t, uint64_t> Map;
+
+static const size_t keys_per_request = 64;
+
+// Run the requests, 'release' selects how the map is emptied between them
+static uint64_t run(Map &m, const std::vector<uint64_t> &keys, uint64_t requests, bool release) {
+  uint64_t found = 0;
+  size_t pos = 0;
+  for (uint64_t r = 0; r < requests; ++r) {
+    if (pos + keys_per_request > keys.size()) {
+      pos = 0;
+    }
+    for (size_t i = 0; i < keys_per_request; ++i) {
+      m[keys[pos + i]] = r;
+    }
+    for (size_t i = 0; i < keys_per_request; ++i) {
+      found += m.find(keys[pos + i]) != m.end();
+    }
+    pos += keys_per_request;
+    if (release) {
+      m.release();
+    } else {
+      m.clear();
+    }
+  }
+  return found;
+}
+
+int main(int argc, char **argv) {
+  uint64_t requests = 1000000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 11, "--requests=") == 0) {
+      requests = strtoull(arg.c_str() + 11, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--requests=N]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, 1 << 20, 12345);
+  unsigned long long n = requests;
+
+  {
+    Map m;
+    uint64_t found;
+    {
+      Timer t("release() per request", PerElement(n));
+      found = run(m, keys, requests, true);
+    }
+    cout << "  found " << found << endl;
+  }
+
+  {
+    Map m;
+    uint64_t found;
+    {
+      Timer t("clear() per request", PerElement(n));
+      found = run(m, keys, requests, false);
+    }
+    cout << "  found " << found << endl;
+  }
+  return 0;
+}
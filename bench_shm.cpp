@@ -0,0 +1,108 @@
+// Worker processes sharing one lookup table: a loader publishes the table once
+// as a shm_index_map, then every worker maps it and looks keys up. Compared
+// with every worker building its own index_map from the same keys.
+#include <iostream>
+#include <sys/wait.h>
+#include "bench_harness.h"
+#include "timer.h"
+#include "index_map_for_find.h"
+#include "index_map_shm.h"
+
+// Run work() in 'procs' child processes and wait for all of them
+template<typename W>
+static void run_workers(int procs, W work) {
+  for (int p = 0; p < procs; ++p) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      work();
+      _exit(0);
+    }
+  }
+  for (int p = 0; p < procs; ++p) {
+    wait(NULL);
+  }
+}
+
+int main(int argc, char **argv) {
+  uint64_t count = 10000000;
+  int procs = 4;
+  std::string path = "/dev/shm/bench_shm_index_map";
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--size=") == 0) {
+      count = strtoull(arg.c_str() + 7, NULL, 10);
+    } else if (arg.compare(0, 8, "--procs=") == 0) {
+      procs = atoi(arg.c_str() + 8);
+    } else if (arg.compare(0, 7, "--path=") == 0) {
+      path = arg.substr(7);
+    } else {
+      cerr << "usage: " << argv[0] << " [--size=N] [--procs=N] [--path=FILE]" << endl;
+      return 1;
+    }
+  }
+
+  std::vector<uint64_t> keys = generate_keys(KEYS_UNIFORM, count, 12345);
+  std::vector<uint64_t> queries = generate_keys(KEYS_UNIFORM, count, 54321);
+  for (size_t i = 0; i < queries.size(); i += 2) {
+    queries[i] = keys[queries[i] % keys.size()];  // half hits
+  }
+  unsigned long long total = (unsigned long long)procs * count;
+
+  {
+    index_map<uint64_t, uint64_t> m;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      m[keys[i]] = i;
+    }
+    {
+      Timer t("publish", PerElement(count));
+      shm_index_map<uint64_t, uint64_t>::publish(path, m.begin(), m.end());
+    }
+    Timer t("finds in one process, index_map", PerElement(count));
+    uint64_t found = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+      found += m.find(queries[i]) != m.end();
+    }
+    do_not_optimize(found);
+  }
+
+  {
+    Timer t("workers: build own index_map + finds", PerElement(total));
+    run_workers(procs, [&]() {
+      index_map<uint64_t, uint64_t> m;
+      for (size_t i = 0; i < keys.size(); ++i) {
+        m[keys[i]] = i;
+      }
+      uint64_t found = 0;
+      for (size_t i = 0; i < queries.size(); ++i) {
+        found += m.find(queries[i]) != m.end();
+      }
+      do_not_optimize(found);
+    });
+  }
+
+  {
+    Timer t("workers: map shm_index_map + finds", PerElement(total));
+    run_workers(procs, [&]() {
+      shm_index_map<uint64_t, uint64_t> m(path);
+      uint64_t found = 0;
+      for (size_t i = 0; i < queries.size(); ++i) {
+        found += m.find(queries[i]) != NULL;
+      }
+      do_not_optimize(found);
+    });
+  }
+
+  {
+    shm_index_map<uint64_t, uint64_t> m(path);
+    cout << "  segment " << m.mapped_bytes() / 1048576.0 << " MB, shared by all workers" << endl;
+    Timer t("finds in one process, shm_index_map", PerElement(count));
+    uint64_t found = 0;
+    for (size_t i = 0; i < queries.size(); ++i) {
+      found += m.find(queries[i]) != NULL;
+    }
+    do_not_optimize(found);
+    cout << "  found " << found << endl;
+  }
+  unlink(path.c_str());
+  return 0;
+}
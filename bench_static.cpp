@@ -0,0 +1,91 @@
+// Lookups in a fixed key set, as in opcode or protocol-id dispatch:
+// static_index_map, computed at compile time, against index_map and
+// std::unordered_map built at startup from the same entries. 256 and 4096
+// sparse 32-bit keys; 3 lookups out of 4 hit.
+#include <iostream>
+#include <unordered_map>
+#include "bench_harness.h"
+#include "timer.h"
+#include "index_map_for_find.h"
+#include "index_map_static.h"
+
+template<std::size_t N>
+struct columns {
+  uint32_t keys[N];
+  uint32_t values[N];
+};
+
+template<std::size_t N>
+constexpr columns<N> make_columns() {
+  columns<N> c = {};
+  for (std::size_t i = 0; i < N; ++i) {
+    c.keys[i] = (uint32_t)((i + 1) * 2654435761u);
+    c.values[i] = (uint32_t)i;
+  }
+  return c;
+}
+
+constexpr columns<256> small_columns = make_columns<256>();
+constexpr static_index_map<uint32_t, uint32_t, 256> small_table(small_columns.keys, small_columns.values);
+constexpr columns<4096> large_columns = make_columns<4096>();
+constexpr static_index_map<uint32_t, uint32_t, 4096> large_table(large_columns.keys, large_columns.values);
+
+template<typename M>
+static uint64_t lookups(const char *label, const M &m, const std::vector<uint32_t> &keys, uint64_t rounds) {
+  uint64_t sum = 0;
+  Timer t(label, PerElement(keys.size() * rounds));
+  for (uint64_t r = 0; r < rounds; ++r) {
+    for (size_t i = 0; i < keys.size(); ++i) {
+      auto it = m.find(keys[i]);
+      sum += it != m.end() ? it->second : 1;
+    }
+  }
+  do_not_optimize(sum);
+  return sum;
+}
+
+template<std::size_t N>
+static void run(const columns<N> &cols, const static_index_map<uint32_t, uint32_t, N> &table,
+                uint64_t rounds) {
+  std::vector<uint32_t> keys(1 << 16);
+  std::mt19937_64 rng(777);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    uint32_t key = cols.keys[rng() % N];
+    keys[i] = rng() % 4 != 0 ? key : key ^ 1;
+  }
+  cout << "== " << N << " keys" << endl;
+
+  index_map<uint32_t, uint32_t> find_map;
+  std::unordered_map<uint32_t, uint32_t> std_map;
+  {
+    Timer t("index_map + std::unordered_map, build", PerElement(N));
+    for (std::size_t i = 0; i < N; ++i) {
+      find_map[cols.keys[i]] = cols.values[i];
+      std_map[cols.keys[i]] = cols.values[i];
+    }
+  }
+  uint64_t expected = lookups("static_index_map, find", table, keys, rounds);
+  if (lookups("index_map, find", find_map, keys, rounds) != expected ||
+      lookups("std::unordered_map, find", std_map, keys, rounds) != expected) {
+    cerr << "lookups disagree" << endl;
+    exit(1);
+  }
+  cout << "  bytes: static_index_map " << table.memory_usage() << ", index_map "
+       << find_map.memory_usage() << endl;
+}
+
+int main(int argc, char **argv) {
+  uint64_t rounds = 1000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 9, "--rounds=") == 0) {
+      rounds = strtoull(arg.c_str() + 9, NULL, 10);
+    } else {
+      cerr << "usage: " << argv[0] << " [--rounds=N]  (passes over 64K lookups)" << endl;
+      return 1;
+    }
+  }
+  run(small_columns, small_table, rounds);
+  run(large_columns, large_table, rounds);
+  return 0;
+}
@@ -0,0 +1,110 @@
+// Benchmark suite over a workload matrix: key distribution x hit ratio x
+// value size x map size. Built twice by the Makefile, once per engine:
+//   bench_suite_find       (index_map_for_find.h)
+//   bench_suite_iteration  (index_map_for_iteration.h, -DBENCH_ITERATION_MAP)
+#include <iostream>
+#include <unordered_map>
+#include "bench_harness.h"
+
+#ifdef BENCH_ITERATION_MAP
+#include "index_map_for_iteration.h"
+static const char *engine_name = "index_map_for_iteration";
+#else
+#include "index_map_for_find.h"
+static const char *engine_name = "index_map_for_find";
+#endif
+
+using namespace std;
+
+static const double hit_ratios[] = {1.0, 0.5, 0.0};
+static const key_distribution distributions[] = {
+  KEYS_SEQUENTIAL, KEYS_STRIDED, KEYS_UNIFORM, KEYS_ZIPFIAN
+};
+
+template<typename MAP, typename V_T>
+void bench_map(const char *name, const bench_options &opt, key_distribution dist,
+               uint64_t map_size, std::vector<bench_result> &results) {
+  std::vector<uint64_t> keys = generate_keys(dist, map_size, 12345);
+  const V_T value('x');
+
+  // insert: build a fresh map in every trial
+  bench_result r = run_trials(opt, map_size, [&]() {
+    MAP m;
+    bench_stopwatch w;
+    for (uint64_t i = 0; i < map_size; ++i) {
+      auto ret = m.insert(std::make_pair(keys[i], value));
+      do_not_optimize(ret.second);
+    }
+    double ns = w.elapsed_ns();
+    do_not_optimize(m.size());
+    return ns;
+  });
+  r.map = name;
+  r.op = "insert";
+  r.distribution = key_distribution_name(dist);
+  r.hit_ratio = 0;
+  r.value_size = sizeof(V_T);
+  r.map_size = map_size;
+  print_result(r);
+  results.push_back(r);
+
+  MAP m;
+  for (uint64_t i = 0; i < map_size; ++i) {
+    m.insert(std::make_pair(keys[i], value));
+  }
+
+  for (size_t h = 0; h < sizeof(hit_ratios) / sizeof(hit_ratios[0]); ++h) {
+    std::vector<uint64_t> lookups = generate_lookups(dist, keys, map_size, hit_ratios[h], 67890);
+    uint64_t expected_hits = 0;
+
+    bench_result f = run_trials(opt, lookups.size(), [&]() {
+      uint64_t hits = 0;
+      bench_stopwatch w;
+      for (size_t i = 0; i < lookups.size(); ++i) {
+        auto it = m.find(lookups[i]);
+        // Touch the found value, so the lookup cannot be elided
+        if (it != m.end()) {
+          hits += 1 + it->second.data[0];
+        }
+      }
+      double ns = w.elapsed_ns();
+      do_not_optimize(hits);
+      expected_hits = hits;
+      return ns;
+    });
+    do_not_optimize(expected_hits);
+    f.map = name;
+    f.op = "find";
+    f.distribution = key_distribution_name(dist);
+    f.hit_ratio = hit_ratios[h];
+    f.value_size = sizeof(V_T);
+    f.map_size = map_size;
+    print_result(f);
+    results.push_back(f);
+  }
+}
+
+template<typename V_T>
+void bench_value_size(const bench_options &opt, std::vector<bench_result> &results) {
+  for (size_t s = 0; s < opt.sizes.size(); ++s) {
+    for (size_t d = 0; d < sizeof(distributions) / sizeof(distributions[0]); ++d) {
+      bench_map<index_map<uint64_t, V_T>, V_T>(engine_name, opt, distributions[d], opt.sizes[s], results);
+      bench_map<std::unordered_map<uint64_t, V_T>, V_T>("unordered_map", opt, distributions[d], opt.sizes[s], results);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  bench_options opt;
+  if (!opt.parse(argc, argv)) {
+    return 1;
+  }
+
+  std::vector<bench_result> results;
+  bench_value_size<bench_payload<8> >(opt, results);
+  bench_value_size<bench_payload<32> >(opt, results);
+  bench_value_size<bench_payload<128> >(opt, results);
+
+  write_results(opt, results);
+  return 0;
+}
@@ -0,0 +1,421 @@
+#ifndef __INDEX_MAP_ADAPTIVE_H_
+#define __INDEX_MAP_ADAPTIVE_H_
+
+#include <type_traits>
+#include "index_map_for_find.h"
+
+// index_map (index_map_for_find.h) with a direct-addressed mode for dense
+// integer keys, e.g. auto-increment ids.
+//
+// While the keys are sparse they are kept in a regular index_map. When the
+// density size / (max - min + 1) reaches 'enter_density' (0.5 by default) the
+// map switches to an array of records indexed by 'key - base' plus a presence
+// bitmap, so a lookup is a subtraction, a bit test and one record access. It
+// switches back to hashing when the density falls under 'leave_density' (0.25
+// by default). The gap between the two thresholds keeps a map near the limit
+// from converting back and forth.
+//
+// The key range is tracked on insert, so the map switches as soon as it gets
+// dense. Erase does not shrink the range, so in hashed mode it is also
+// recomputed once the map has doubled in size, amortized over the inserts. A mode
+// switch invalidates iterators, like a rehash.
+template<typename K_T, typename V_T, typename S_T = uint32_t>
+class adaptive_index_map {
+  static_assert(std::is_integral<K_T>::value, "adaptive_index_map needs integer keys");
+
+public:
+      class _Iterator;
+      typedef          K_T                       key_type;
+      typedef          V_T                       value_type;
+      typedef typename std::size_t               size_type;
+      typedef          S_T                       index_type;
+      typedef          _Iterator                 iterator;
+
+private:
+      typedef index_map<K_T, V_T, S_T> hash_type;
+
+      // Don't convert tiny maps, the bucket scan is already short
+      static const size_type min_direct_size = 64;
+
+public:
+  adaptive_index_map(double enter_density = 0.5, double leave_density = 0.25):
+      enter_density_(enter_density),
+      leave_density_(leave_density),
+      direct_(false),
+      direct_values_(0),
+      inserts_since_check_(0),
+      base_(0),
+      lo_(0),
+      hi_(0) {
+      assert(leave_density_ < enter_density_);
+  }
+
+  class _Iterator {
+      public:
+          _Iterator(adaptive_index_map *_pmap, size_type _slot, typename hash_type::iterator _hash_it) :
+              pmap(_pmap), slot(_slot), hash_it(_hash_it) {
+          }
+          std::pair<K_T, V_T> &operator*() const {
+              if (pmap->direct_) {
+                  return pmap->slots_[slot];
+              }
+              return *hash_it;
+          }
+          std::pair<K_T, V_T> *operator->() const {
+              return &operator*();
+          }
+          bool operator==(const _Iterator &it) const {
+              return slot == it.slot && hash_it == it.hash_it && pmap == it.pmap;
+          }
+          bool operator!=(const _Iterator &it) const {
+              return !operator==(it);
+          }
+          _Iterator &operator++() {
+              incr();
+              return *this;
+          }
+          _Iterator operator++(int) {
+              _Iterator __tmp(*this);
+              incr();
+              return __tmp;
+          }
+
+      private:
+          void incr() {
+              if (pmap->direct_) {
+                  slot = pmap->next_present(slot + 1);
+              } else {
+                  ++hash_it;
+              }
+          }
+
+      private:
+          adaptive_index_map *pmap;
+          // Record index in direct mode, slots_.size() (0) in hashed mode
+          size_type slot;
+          // hash_.end() in direct mode
+          typename hash_type::iterator hash_it;
+
+          friend class adaptive_index_map;
+  };
+
+  iterator begin() {
+      if (direct_) {
+          return iterator(this, next_present(0), hash_.end());
+      }
+      return iterator(this, slots_.size(), hash_.begin());
+  }
+
+  iterator end() {
+      return iterator(this, slots_.size(), hash_.end());
+  }
+
+  bool empty() const {
+      return size() == 0;
+  }
+
+  size_type size() const {
+      return direct_ ? direct_values_ : hash_.size();
+  }
+
+  // Whether the keys are currently direct-addressed
+  bool is_direct() const {
+      return direct_;
+  }
+
+  // Keys per slot of [min key, max key], an upper bound of the real range is
+  // used in direct mode since erase does not shrink it
+  double density() const {
+      if (direct_) {
+          return direct_values_ / ((double)span(lo_, hi_));
+      }
+      K_T lo, hi;
+      if (!hash_key_range(lo, hi)) {
+          return 0;
+      }
+      return hash_.size() / ((double)span(lo, hi));
+  }
+
+  // Return iterator, and a bool value indicating whether the element was successfully inserted or not
+  std::pair<iterator, bool> insert(const std::pair<K_T, V_T> &value) {
+      if (direct_) {
+          if (unlikely(!in_slots(value.first)) && !extend_slots(value.first)) {
+              to_hashed();
+              return insert(value);
+          }
+          size_type slot = slot_of(value.first);
+          if (is_present(slot)) {
+              return std::make_pair(iterator(this, slot, hash_.end()), false);
+          }
+          set_present(slot, true);
+          slots_[slot] = value;
+          direct_values_ += 1;
+          lo_ = std::min(lo_, value.first);
+          hi_ = std::max(hi_, value.first);
+          return std::make_pair(iterator(this, slot, hash_.end()), true);
+      }
+
+      std::pair<typename hash_type::iterator, bool> ret = hash_.insert(value);
+      if (ret.second) {
+          if (hash_.size() == 1) {
+              lo_ = hi_ = value.first;
+          } else {
+              lo_ = std::min(lo_, value.first);
+              hi_ = std::max(hi_, value.first);
+          }
+          // The range never shrinks on erase, so it is recomputed whenever
+          // the map has doubled since the last check
+          bool dense = hash_.size() >= min_direct_size && hash_.size() >= enter_density_ * span(lo_, hi_);
+          if (unlikely(dense || ++inserts_since_check_ * 2 >= std::max(hash_.size(), (size_type)min_direct_size))) {
+              inserts_since_check_ = 0;
+              if (try_direct()) {
+                  return std::make_pair(iterator(this, slot_of(value.first), hash_.end()), true);
+              }
+          }
+      }
+      return std::make_pair(iterator(this, slots_.size(), ret.first), ret.second);
+  }
+
+  V_T &operator[](const K_T &key) {
+      if (likely(direct_ && in_slots(key))) {
+          size_type slot = slot_of(key);
+          if (likely(is_present(slot))) {
+              return slots_[slot].second;
+          }
+      }
+      return insert(std::make_pair(key, V_T())).first->second;
+  }
+
+  V_T &at(const K_T &key) {
+      iterator it = find(key);
+      if (it == end()) {
+          throw std::out_of_range("Cannot find the key");
+      }
+      return it->second;
+  }
+
+  size_type count(const K_T &key) const {
+      if (direct_) {
+          return (in_slots(key) && is_present(slot_of(key))) ? 1 : 0;
+      }
+      return hash_.count(key);
+  }
+
+  // Find the element by key
+  iterator find(const K_T &key) {
+      if (direct_) {
+          if (in_slots(key)) {
+              size_type slot = slot_of(key);
+              if (is_present(slot)) {
+                  return iterator(this, slot, hash_.end());
+              }
+          }
+          return end();
+      }
+      return iterator(this, slots_.size(), hash_.find(key));
+  }
+
+  // Removes the element with the key equivalent to key
+  size_type erase(const K_T &key) {
+      if (!direct_) {
+          return hash_.erase(key);
+      }
+      if (!in_slots(key) || !is_present(slot_of(key))) {
+          return 0;
+      }
+      size_type slot = slot_of(key);
+      set_present(slot, false);
+      slots_[slot].second = V_T();
+      direct_values_ -= 1;
+      if (direct_values_ < leave_density_ * span(lo_, hi_)) {
+          to_hashed();
+      }
+      return 1;
+  }
+
+  // Remove all the elements, the map goes back to hashed mode
+  void clear() {
+      hash_.clear();
+      release_slots();
+      direct_ = false;
+      direct_values_ = 0;
+      inserts_since_check_ = 0;
+  }
+
+  void swap(adaptive_index_map &other) {
+      std::swap(enter_density_, other.enter_density_);
+      std::swap(leave_density_, other.leave_density_);
+      std::swap(direct_, other.direct_);
+      std::swap(direct_values_, other.direct_values_);
+      std::swap(inserts_since_check_, other.inserts_since_check_);
+      std::swap(base_, other.base_);
+      std::swap(lo_, other.lo_);
+      std::swap(hi_, other.hi_);
+      hash_.swap(other.hash_);
+      slots_.swap(other.slots_);
+      present_.swap(other.present_);
+  }
+
+  // Bytes used by the hashed map or the slots and the bitmap
+  size_type memory_usage() const {
+      return sizeof(*this) + hash_.memory_usage() +
+             slots_.capacity() * sizeof(std::pair<K_T, V_T>) +
+             present_.capacity() * sizeof(uint64_t);
+  }
+
+private:
+  // Number of keys in [lo, hi]. Unsigned math works for signed keys too.
+  // All of a 64-bit K_T would wrap to 0: it saturates instead, a range that
+  // is never dense enough to go or stay direct.
+  static uint64_t span(K_T lo, K_T hi) {
+      uint64_t n = (uint64_t)hi - (uint64_t)lo + 1;
+      return n != 0 ? n : std::numeric_limits<uint64_t>::max();
+  }
+
+  bool in_slots(const K_T &key) const {
+      return (uint64_t)key - (uint64_t)base_ < slots_.size();
+  }
+
+  size_type slot_of(const K_T &key) const {
+      return (size_type)((uint64_t)key - (uint64_t)base_);
+  }
+
+  bool is_present(size_type slot) const {
+      return (present_[slot >> 6] >> (slot & 63)) & 1;
+  }
+
+  void set_present(size_type slot, bool on) {
+      if (on) {
+          present_[slot >> 6] |= 1ull << (slot & 63);
+      } else {
+          present_[slot >> 6] &= ~(1ull << (slot & 63));
+      }
+  }
+
+  // First present slot at or after 'slot', slots_.size() if none
+  size_type next_present(size_type slot) const {
+      size_type words = present_.size();
+      size_type w = slot >> 6;
+      if (w >= words) {
+          return slots_.size();
+      }
+      uint64_t bits = present_[w] & (~0ull << (slot & 63));
+      while (bits == 0) {
+          if (++w == words) {
+              return slots_.size();
+          }
+          bits = present_[w];
+      }
+      return std::min((w << 6) + __builtin_ctzll(bits), slots_.size());
+  }
+
+  bool hash_key_range(K_T &lo, K_T &hi) const {
+      if (hash_.size() == 0) {
+          return false;
+      }
+      typename hash_type::const_iterator it = hash_.begin();
+      lo = hi = it->first;
+      for (; it != hash_.end(); ++it) {
+          lo = std::min(lo, it->first);
+          hi = std::max(hi, it->first);
+      }
+      return true;
+  }
+
+  // Allocate the slots for [lo, hi] with room for 'spare' more keys on each
+  // side, clamped to the range of K_T
+  void allocate_slots(K_T lo, K_T hi, uint64_t spare) {
+      uint64_t below = std::min<uint64_t>(spare, (uint64_t)lo - (uint64_t)std::numeric_limits<K_T>::min());
+      uint64_t above = std::min<uint64_t>(spare, (uint64_t)std::numeric_limits<K_T>::max() - (uint64_t)hi);
+      base_ = (K_T)((uint64_t)lo - below);
+      size_type n = (size_type)(span(lo, hi) + below + above);
+      slots_.assign(n, std::pair<K_T, V_T>());
+      present_.assign((n + 63) / 64, 0);
+  }
+
+  void release_slots() {
+      std::vector<std::pair<K_T, V_T> >().swap(slots_);
+      std::vector<uint64_t>().swap(present_);
+  }
+
+  // Switch to direct mode if the hashed keys are dense enough
+  bool try_direct() {
+      K_T lo, hi;
+      if (hash_.size() < min_direct_size || !hash_key_range(lo, hi) ||
+          hash_.size() < enter_density_ * span(lo, hi)) {
+          return false;
+      }
+
+      allocate_slots(lo, hi, span(lo, hi) / 4);
+      for (typename hash_type::iterator it = hash_.begin(); it != hash_.end(); ++it) {
+          size_type slot = slot_of(it->first);
+          set_present(slot, true);
+          slots_[slot] = *it;
+      }
+      direct_values_ = hash_.size();
+      lo_ = lo;
+      hi_ = hi;
+      direct_ = true;
+      hash_.release();
+      return true;
+  }
+
+  // Make room for a key outside the slots, unless the map would get too sparse
+  bool extend_slots(const K_T &key) {
+      K_T lo = std::min(lo_, key);
+      K_T hi = std::max(hi_, key);
+      uint64_t new_span = span(lo, hi);
+      if (new_span > (uint64_t)std::numeric_limits<size_type>::max() / 2 ||
+          direct_values_ + 1 < leave_density_ * new_span) {
+          return false;
+      }
+
+      std::vector<std::pair<K_T, V_T> > old_slots;
+      std::vector<uint64_t> old_present;
+      old_slots.swap(slots_);
+      old_present.swap(present_);
+      K_T old_base = base_;
+
+      // Geometric growth so that ascending ids extend in amortized O(1)
+      allocate_slots(lo, hi, new_span / 2);
+      for (size_type i = 0; i < old_slots.size(); ++i) {
+          if ((old_present[i >> 6] >> (i & 63)) & 1) {
+              size_type slot = slot_of((K_T)((uint64_t)old_base + i));
+              set_present(slot, true);
+              slots_[slot] = old_slots[i];
+          }
+      }
+      return true;
+  }
+
+  void to_hashed() {
+      hash_type hashed((size_type)direct_values_ * 2 + 1);
+      for (size_type i = next_present(0); i < slots_.size(); i = next_present(i + 1)) {
+          hashed.insert(slots_[i]);
+      }
+      hash_.swap(hashed);
+      release_slots();
+      direct_ = false;
+      direct_values_ = 0;
+      inserts_since_check_ = 0;
+  }
+
+private:
+  double enter_density_;
+  double leave_density_;
+  bool direct_;
+  // Number of keys in direct mode
+  size_type direct_values_;
+  // Inserts in hashed mode since the density was last computed
+  size_type inserts_since_check_;
+  // Key of slots_[0]
+  K_T base_;
+  // Smallest and largest key inserted, a superset of the range after erase
+  K_T lo_;
+  K_T hi_;
+  hash_type hash_;
+  std::vector<std::pair<K_T, V_T> > slots_;
+  std::vector<uint64_t> present_;
+};
+
+#endif
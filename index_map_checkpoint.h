@@ -0,0 +1,285 @@
+#ifndef __INDEX_MAP_CHECKPOINT_H_
+#define __INDEX_MAP_CHECKPOINT_H_
+
+// Incremental checkpoints shared by both index_map engines.
+//
+// Once track_changes() is called, a map records which buckets
+// (index_map_for_find.h) or value slots (index_map_for_iteration.h) were
+// written since its last checkpoint, and write_checkpoint() appends only
+// those to a stream: a delta. The first checkpoint is a full image, and so
+// is the first one after anything that rewrites the whole map (a rehash of
+// the find map, clear(), assignment, merge()). load_checkpoints() replays a
+// full image and the deltas that follow it.
+//
+// Every checkpoint is framed as
+//   index_map_checkpoint_header
+//   payload_bytes of entries
+//   uint64_t checksum of the payload
+// The loader stops at the first checkpoint that is truncated or fails its
+// checksum, such as the one being written when the process died. Keys and
+// values are written as raw bytes and must be trivially copyable.
+
+#include <stdint.h>
+#include <cstring>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#define INDEX_MAP_CHECKPOINT_MAGIC 0x5043504d58444e49ull  // "INDXMPCP"
+
+enum index_map_checkpoint_kind {
+  INDEX_MAP_CHECKPOINT_FULL = 1,   // replaces the contents of the map
+  INDEX_MAP_CHECKPOINT_DELTA = 2   // rewrites the listed buckets or slots
+};
+
+struct index_map_checkpoint_header {
+  uint64_t magic;
+  uint32_t kind;
+  uint16_t key_size;
+  uint16_t value_size;
+  // Bucket count of the find map (0 for a small map), end of the value slots
+  // of the iteration map
+  uint64_t extent;
+  // Buckets or slots in the payload
+  uint64_t entries;
+  uint64_t payload_bytes;
+};
+
+// The buckets or slots written since the last checkpoint, one bit each.
+// The bitmap grows with the highest index marked.
+class index_map_change_set {
+public:
+  index_map_change_set(): full(true) {}
+
+  void mark(uint64_t i) {
+    uint64_t word = i >> 6;
+    if (word >= bits.size()) {
+      bits.resize(word + 1, 0);
+    }
+    bits[word] |= 1ull << (i & 63);
+  }
+
+  // The next checkpoint is a full image
+  void mark_all() {
+    full = true;
+  }
+
+  bool is_full() const {
+    return full;
+  }
+
+  bool is_marked(uint64_t i) const {
+    return (i >> 6) < bits.size() && (bits[i >> 6] >> (i & 63) & 1);
+  }
+
+  // Call f(i) for every marked index below end, in increasing order
+  template<typename F>
+  void for_each(uint64_t end, F f) const {
+    for (uint64_t w = 0; w < bits.size() && (w << 6) < end; ++w) {
+      uint64_t word = bits[w];
+      while (word != 0) {
+        uint64_t i = (w << 6) + __builtin_ctzll(word);
+        if (i >= end) {
+          return;
+        }
+        f(i);
+        word &= word - 1;
+      }
+    }
+  }
+
+  uint64_t count(uint64_t end) const {
+    uint64_t n = 0;
+    for_each(end, [&n](uint64_t) { n += 1; });
+    return n;
+  }
+
+  // Forget the changes, once they are written
+  void reset() {
+    std::fill(bits.begin(), bits.end(), 0);
+    full = false;
+  }
+
+private:
+  std::vector<uint64_t> bits;
+  bool full;
+};
+
+// FNV-1a over the payload, one 64-bit word at a time. The same bytes give
+// the same checksum however they are split into update() calls.
+class index_map_checksum {
+public:
+  index_map_checksum(): hash(0xcbf29ce484222325ull), pending(0), pending_bytes(0) {}
+
+  void update(const void *data, size_t n) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i = 0;
+    // Complete the pending word, then take whole words
+    while (i < n && pending_bytes > 0) {
+      add_byte(p[i++]);
+    }
+    for (; i + 8 <= n; i += 8) {
+      uint64_t word;
+      memcpy(&word, p + i, 8);
+      hash = (hash ^ word) * 0x100000001b3ull;
+    }
+    while (i < n) {
+      add_byte(p[i++]);
+    }
+  }
+
+  uint64_t value() const {
+    return pending_bytes > 0 ? (hash ^ pending) * 0x100000001b3ull : hash;
+  }
+
+private:
+  void add_byte(unsigned char c) {
+    pending |= (uint64_t)c << (8 * pending_bytes);
+    if (++pending_bytes == 8) {
+      hash = (hash ^ pending) * 0x100000001b3ull;
+      pending = 0;
+      pending_bytes = 0;
+    }
+  }
+
+private:
+  uint64_t hash;
+  uint64_t pending;
+  int pending_bytes;
+};
+
+// Writes one checkpoint: the header on construction, then the entries, then
+// the checksum in finish(). Small entries are gathered in a buffer, the
+// stream is written by blocks.
+class index_map_checkpoint_writer {
+public:
+  index_map_checkpoint_writer(std::ostream &_out, const index_map_checkpoint_header &header):
+    out(_out), bytes(0), buffer(buffer_size), used(0) {
+    out.write((const char *)&header, sizeof(header));
+    bytes += sizeof(header);
+  }
+
+  template<typename T>
+  void put(const T &v) {
+    put_bytes(&v, sizeof(v));
+  }
+
+  void put_bytes(const void *data, size_t n) {
+    // data may be NULL then, e.g. the values of an empty map
+    if (n == 0) {
+      return;
+    }
+    bytes += n;
+    if (used + n > buffer_size) {
+      flush();
+    }
+    if (n >= buffer_size) {
+      checksum.update(data, n);
+      out.write((const char *)data, n);
+    } else {
+      memcpy(buffer.data() + used, data, n);
+      used += n;
+    }
+  }
+
+  // Returns the bytes written. Throws std::runtime_error if the stream failed.
+  size_t finish() {
+    flush();
+    uint64_t sum = checksum.value();
+    out.write((const char *)&sum, sizeof(sum));
+    out.flush();
+    if (!out) {
+      throw std::runtime_error("index_map: cannot write the checkpoint");
+    }
+    return bytes + sizeof(sum);
+  }
+
+private:
+  // The checksum is taken by blocks too, it is much faster on long runs
+  void flush() {
+    checksum.update(buffer.data(), used);
+    out.write(buffer.data(), used);
+    used = 0;
+  }
+
+private:
+  static const size_t buffer_size = 1 << 16;
+
+  std::ostream &out;
+  index_map_checksum checksum;
+  size_t bytes;
+  std::vector<char> buffer;
+  size_t used;
+};
+
+// Reads the checkpoints of a stream one by one, each checked whole before
+// its entries are handed out
+class index_map_checkpoint_reader {
+public:
+  index_map_checkpoint_reader(std::istream &_in, size_t key_size, size_t value_size):
+    in(_in), key_bytes(key_size), value_bytes(value_size), pos(0) {}
+
+  // Read the next checkpoint. Returns false at the end of the stream or at a
+  // truncated or corrupt checkpoint.
+  bool next() {
+    if (!in.read((char *)&header, sizeof(header)) ||
+        header.magic != INDEX_MAP_CHECKPOINT_MAGIC ||
+        header.key_size != key_bytes || header.value_size != value_bytes ||
+        (header.kind != INDEX_MAP_CHECKPOINT_FULL && header.kind != INDEX_MAP_CHECKPOINT_DELTA)) {
+      return false;
+    }
+    // Read by chunks, a corrupt length fails at the end of the stream
+    // rather than allocating it upfront
+    const size_t chunk = 1 << 20;
+    payload.clear();
+    while (payload.size() < header.payload_bytes) {
+      size_t n = (size_t)std::min<uint64_t>(chunk, header.payload_bytes - payload.size());
+      size_t at = payload.size();
+      payload.resize(at + n);
+      if (!in.read(&payload[at], n)) {
+        return false;
+      }
+    }
+    uint64_t sum;
+    if (!in.read((char *)&sum, sizeof(sum))) {
+      return false;
+    }
+    index_map_checksum checksum;
+    checksum.update(payload.data(), payload.size());
+    pos = 0;
+    return sum == checksum.value();
+  }
+
+  const index_map_checkpoint_header &get_header() const {
+    return header;
+  }
+
+  template<typename T>
+  T get() {
+    T v;
+    get_bytes(&v, sizeof(v));
+    return v;
+  }
+
+  void get_bytes(void *data, size_t n) {
+    if (pos + n > payload.size()) {
+      throw std::runtime_error("index_map: malformed checkpoint");
+    }
+    if (n > 0) {
+      memcpy(data, payload.data() + pos, n);
+      pos += n;
+    }
+  }
+
+private:
+  std::istream &in;
+  size_t key_bytes;
+  size_t value_bytes;
+  index_map_checkpoint_header header;
+  std::vector<char> payload;
+  size_t pos;
+};
+
+#endif
@@ -0,0 +1,404 @@
+#ifndef __INDEX_MAP_COW_H_
+#define __INDEX_MAP_COW_H_
+
+#include <atomic>
+#include "index_map_for_find.h"
+
+// A copy-on-write variant of index_map (index_map_for_find.h) for cheap forks.
+//
+// The buckets are grouped in pages of INDEX_MAP_COW_PAGE_BUCKETS buckets, and
+// the map holds a directory of page pointers. Pages and the directory are
+// reference counted: snapshot() (and the copy constructor) share both with
+// the new map, which is O(1). The first write to a shared page copies that
+// page only, after copying the directory if it is shared too, so a fork costs
+// memory for the pages its writes touch. Lookups, and inserts or erases that
+// change nothing, never copy.
+//
+// Pages that were never written are not allocated. The reference counts are
+// atomic, so snapshots may be handed to other threads; a single map is not
+// thread-safe, as for index_map. Writes are only done through insert(),
+// operator[], at() and erase(); the iterators are const.
+#define INDEX_MAP_COW_PAGE_BUCKETS 256
+
+template<typename K_T, typename V_T, typename S_T = uint32_t>
+class cow_index_map {
+public:
+      class _Iterator;
+      typedef          K_T                       key_type;
+      typedef          V_T                       value_type;
+      typedef typename std::size_t               size_type;
+      typedef          S_T                       index_type;
+      typedef          _Iterator                 const_iterator;
+      typedef          _Iterator                 iterator;
+
+private:
+      typedef index_bucket<K_T, V_T> bucket_type;
+
+      struct page {
+          std::atomic<int> refs;
+          bucket_type buckets[INDEX_MAP_COW_PAGE_BUCKETS];
+
+          page() : refs(1) {}
+          page(const page &other) : refs(1) {
+              for (int i = 0; i < INDEX_MAP_COW_PAGE_BUCKETS; ++i) {
+                  buckets[i] = other.buckets[i];
+              }
+          }
+      };
+
+      struct directory {
+          std::atomic<int> refs;
+          // NULL for a page that was never written
+          std::vector<page *> pages;
+
+          directory(size_type page_num) : refs(1), pages(page_num, (page *)NULL) {}
+      };
+
+public:
+  cow_index_map(): cow_index_map(INDEX_MAP_INIT_BUCKETS) {}
+
+  cow_index_map(size_type bucket_size):
+      total_values_(0),
+      bucket_size_(bucket_size),
+      dir_(new directory(page_count(bucket_size))) {
+  }
+
+  // O(1), shares all the pages with other
+  cow_index_map(const cow_index_map &other):
+      total_values_(other.total_values_),
+      bucket_size_(other.bucket_size_),
+      dir_(other.dir_) {
+      dir_->refs += 1;
+  }
+
+  cow_index_map &operator=(const cow_index_map &other) {
+      if (dir_ != other.dir_) {
+          other.dir_->refs += 1;
+          unref(dir_);
+          dir_ = other.dir_;
+      }
+      total_values_ = other.total_values_;
+      bucket_size_ = other.bucket_size_;
+      return *this;
+  }
+
+  virtual ~cow_index_map() {
+      unref(dir_);
+  }
+
+  // A fork of the map: O(1), the pages are copied when either map writes them
+  cow_index_map snapshot() const {
+      return cow_index_map(*this);
+  }
+
+  class _Iterator {
+      public:
+          _Iterator(const cow_index_map *_pmap, S_T _bucket_idx, int _value_idx) :
+              pmap(_pmap), bucket_idx(_bucket_idx), value_idx(_value_idx) {
+          }
+          const std::pair<K_T, V_T> &operator*() const {
+              return pmap->bucket_at(bucket_idx)->get_records()[value_idx];
+          }
+          const std::pair<K_T, V_T> *operator->() const {
+              return &(operator*());
+          }
+          bool operator==(const _Iterator &it) const {
+              return bucket_idx == it.bucket_idx && value_idx == it.value_idx && pmap == it.pmap;
+          }
+          bool operator!=(const _Iterator &it) const {
+              return !operator==(it);
+          }
+          _Iterator &operator++() {
+              incr();
+              return *this;
+          }
+          _Iterator operator++(int) {
+              _Iterator __tmp(*this);
+              incr();
+              return __tmp;
+          }
+
+      private:
+          void incr() {
+              if (value_idx + 1 < pmap->records_in(bucket_idx)) {
+                  value_idx += 1;
+                  return;
+              }
+              value_idx = 0;
+              bucket_idx = pmap->next_nonempty_bucket(bucket_idx + 1);
+          }
+
+      private:
+          const cow_index_map *pmap;
+          S_T bucket_idx;
+          int value_idx;
+
+          friend class cow_index_map;
+  };
+
+  const_iterator begin() const {
+      return const_iterator(this, next_nonempty_bucket(0), 0);
+  }
+
+  const_iterator end() const {
+      return const_iterator(this, bucket_size_, 0);
+  }
+
+  bool empty() const {
+      return size() == 0;
+  }
+
+  size_type size() const {
+      return total_values_;
+  }
+
+  size_type bucket_count() const {
+      return bucket_size_;
+  }
+
+  // Return iterator, and a bool value indicating whether the element was successfully inserted or not
+  std::pair<const_iterator, bool> insert(const std::pair<K_T, V_T> &value) {
+      S_T bucket_idx;
+      int value_idx = lookup(value.first, bucket_idx);
+      if (value_idx != -1) {
+          return std::make_pair(const_iterator(this, bucket_idx, value_idx), false);
+      }
+
+      if (unlikely(size() > grow_threshold())) {
+          rehash(next_bucket_count());
+          bucket_idx = get_hash_value(value.first);
+      }
+      std::pair<int, bool> ret = writable_bucket(bucket_idx).insert(value.first, value.second);
+      total_values_ += 1;
+      return std::make_pair(const_iterator(this, bucket_idx, ret.first), true);
+  }
+
+  V_T &operator[](const K_T &key) {
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
+      if (value_idx == -1) {
+          std::pair<const_iterator, bool> ret = insert(std::make_pair(key, V_T()));
+          bucket_idx = ret.first.bucket_idx;
+          value_idx = ret.first.value_idx;
+      }
+      return writable_bucket(bucket_idx).get_records()[value_idx].second;
+  }
+
+  V_T &at(const K_T &key) {
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
+      if (value_idx == -1) {
+          throw std::out_of_range("Cannot find the key");
+      }
+      return writable_bucket(bucket_idx).get_records()[value_idx].second;
+  }
+
+  const V_T &at(const K_T &key) const {
+      const_iterator it = find(key);
+      if (it == end()) {
+          throw std::out_of_range("Cannot find the key");
+      }
+      return it->second;
+  }
+
+  const_iterator find(const K_T &key) const {
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
+      if (value_idx != -1) {
+          return const_iterator(this, bucket_idx, value_idx);
+      }
+      return end();
+  }
+
+  size_type count(const K_T &key) const {
+      S_T bucket_idx;
+      return lookup(key, bucket_idx) != -1 ? 1 : 0;
+  }
+
+  // Removes the element with the key equivalent to key
+  size_type erase(const K_T &key) {
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
+      if (value_idx == -1) {
+          return 0;
+      }
+      writable_bucket(bucket_idx).erase_by_index(value_idx);
+      total_values_ -= 1;
+      return 1;
+  }
+
+  // Remove all the elements, the shared pages are left to the other maps
+  void clear() {
+      unref(dir_);
+      dir_ = new directory(page_count(bucket_size_));
+      total_values_ = 0;
+  }
+
+  // Pages holding buckets, and those of them shared with other maps
+  size_type allocated_pages() const {
+      size_type pages = 0;
+      for (size_type i = 0; i < dir_->pages.size(); ++i) {
+          pages += (dir_->pages[i] != NULL);
+      }
+      return pages;
+  }
+
+  size_type shared_pages() const {
+      size_type pages = 0;
+      for (size_type i = 0; i < dir_->pages.size(); ++i) {
+          pages += (dir_->pages[i] != NULL && (dir_->refs > 1 || dir_->pages[i]->refs > 1));
+      }
+      return pages;
+  }
+
+  // Bytes used by the map alone: its directory if not shared, and the pages
+  // (with their record buffers) no other map references
+  size_type owned_memory_usage() const {
+      size_type bytes = sizeof(*this);
+      if (dir_->refs > 1) {
+          return bytes;
+      }
+      bytes += sizeof(directory) + dir_->pages.capacity() * sizeof(page *);
+      for (size_type i = 0; i < dir_->pages.size(); ++i) {
+          const page *p = dir_->pages[i];
+          if (p != NULL && p->refs == 1) {
+              bytes += sizeof(page) - sizeof(p->buckets);
+              for (int b = 0; b < INDEX_MAP_COW_PAGE_BUCKETS; ++b) {
+                  bytes += p->buckets[b].memory_usage();
+              }
+          }
+      }
+      return bytes;
+  }
+
+private:
+  static size_type page_count(size_type bucket_size) {
+      return (bucket_size + INDEX_MAP_COW_PAGE_BUCKETS - 1) / INDEX_MAP_COW_PAGE_BUCKETS;
+  }
+
+  static void unref(page *p) {
+      if (p != NULL && --p->refs == 0) {
+          delete p;
+      }
+  }
+
+  static void unref(directory *d) {
+      if (--d->refs == 0) {
+          for (size_type i = 0; i < d->pages.size(); ++i) {
+              unref(d->pages[i]);
+          }
+          delete d;
+      }
+  }
+
+  // The bucket for reading, NULL if its page was never written
+  const bucket_type *bucket_at(S_T idx) const {
+      const page *p = dir_->pages[idx / INDEX_MAP_COW_PAGE_BUCKETS];
+      return p != NULL ? &p->buckets[idx % INDEX_MAP_COW_PAGE_BUCKETS] : NULL;
+  }
+
+  int records_in(S_T idx) const {
+      const bucket_type *bucket = bucket_at(idx);
+      return bucket != NULL ? bucket->get_record_num() : 0;
+  }
+
+  // The bucket for writing: the directory, then the page, are copied first
+  // if another map shares them
+  bucket_type &writable_bucket(S_T idx) {
+      if (dir_->refs > 1) {
+          directory *copy = new directory(0);
+          copy->pages = dir_->pages;
+          for (size_type i = 0; i < copy->pages.size(); ++i) {
+              if (copy->pages[i] != NULL) {
+                  copy->pages[i]->refs += 1;
+              }
+          }
+          unref(dir_);
+          dir_ = copy;
+      }
+
+      page *&p = dir_->pages[idx / INDEX_MAP_COW_PAGE_BUCKETS];
+      if (p == NULL) {
+          p = new page();
+      } else if (p->refs > 1) {
+          page *copy = new page(*p);
+          unref(p);
+          p = copy;
+      }
+      return p->buckets[idx % INDEX_MAP_COW_PAGE_BUCKETS];
+  }
+
+  // Find the record of the key, set bucket_idx to its bucket.
+  // Returns the index inside the bucket, -1 means not found.
+  int lookup(const K_T &key, S_T &bucket_idx) const {
+      bucket_idx = get_hash_value(key);
+      const bucket_type *bucket = bucket_at(bucket_idx);
+      int value_idx = bucket != NULL ? bucket->find(key) : -1;
+      INDEX_MAP_STAT_INC(finds);
+      if (value_idx != -1) {
+          INDEX_MAP_STAT_INC(hits);
+      } else {
+          INDEX_MAP_STAT_INC(misses);
+      }
+      return value_idx;
+  }
+
+  S_T next_nonempty_bucket(S_T from) const {
+      while (from < bucket_size_) {
+          if (dir_->pages[from / INDEX_MAP_COW_PAGE_BUCKETS] == NULL) {
+              // Skip the rest of the page
+              from = (from / INDEX_MAP_COW_PAGE_BUCKETS + 1) * INDEX_MAP_COW_PAGE_BUCKETS;
+          } else if (records_in(from) == 0) {
+              ++from;
+          } else {
+              return from;
+          }
+      }
+      return bucket_size_;
+  }
+
+  // Moves every record to a new, unshared directory
+  void rehash(S_T new_bktsize) {
+      INDEX_MAP_STAT_INC(rehashes);
+      INDEX_MAP_STAT_TIMER(rehash_ns);
+
+      directory *old_dir = dir_;
+      S_T old_bktsize = bucket_size_;
+      dir_ = new directory(page_count(new_bktsize));
+      bucket_size_ = new_bktsize;
+
+      for (S_T idx = 0; idx < old_bktsize; ++idx) {
+          const page *p = old_dir->pages[idx / INDEX_MAP_COW_PAGE_BUCKETS];
+          if (p == NULL) {
+              continue;
+          }
+          const bucket_type &bucket = p->buckets[idx % INDEX_MAP_COW_PAGE_BUCKETS];
+          const std::pair<K_T, V_T> *records = bucket.get_records();
+          for (int i = 0; i < bucket.get_record_num(); ++i) {
+              writable_bucket(get_hash_value(records[i].first)).insert_nocheck(records[i].first, records[i].second);
+          }
+      }
+
+      unref(old_dir);
+  }
+
+  size_type grow_threshold() const {
+      return (size_type)(INDEX_MAP_MAX_LOAD_FACTOR * bucket_size_);
+  }
+
+  S_T next_bucket_count() const {
+      size_type n = 2 * (size_type)bucket_size_ + 1;
+      return (S_T)std::min(n, (size_type)std::numeric_limits<S_T>::max());
+  }
+
+  S_T get_hash_value(const K_T key) const {
+      return (S_T)((uint64_t)key % bucket_size_);
+  }
+
+private:
+  S_T total_values_;
+  S_T bucket_size_;
+  directory *dir_;
+};
+
+#endif
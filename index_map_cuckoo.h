@@ -0,0 +1,811 @@
+#ifndef __INDEX_MAP_CUCKOO_H_
+#define __INDEX_MAP_CUCKOO_H_
+
+#include <utility>
+#include <cassert>
+#include <cstdlib>
+#include <stdint.h>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <new>
+#include <stdexcept>
+#include <initializer_list>
+#include "index_map_stats.h"
+#include "index_map_filter.h"
+
+#ifndef likely
+#define likely(x)       __builtin_expect((x),1)
+#define unlikely(x)     __builtin_expect((x),0)
+#endif
+
+// Bucketized cuckoo hashing with the interface of index_map
+// (index_map_for_find.h), for lookups whose worst case does not depend on
+// the keys.
+//
+// Every key lives in one of two buckets, picked by the two halves of a
+// 64-bit hash of the key. A bucket is an array of 'ways' records (8 for
+// records up to 8 bytes, 4 otherwise) aligned to a cache line, so a lookup
+// reads at most two buckets: two cache lines for records up to 16 bytes,
+// however skewed the keys are. When both buckets of a new key are full,
+// keys are moved to their other bucket along the shortest path found by a
+// breadth-first search. The map doubles when there is no path of at most
+// INDEX_MAP_CUCKOO_MAX_PATH moves, or once it is above max_load_factor().
+//
+// Empty slots hold the key K_T(0), the key 0 itself is kept aside in the
+// map. The load factor counts records per slot rather than per bucket:
+// 0.9 by default, where index_map grows at 0.5 records per bucket.
+#define INDEX_MAP_CUCKOO_INIT_BUCKETS 16
+#define INDEX_MAP_CUCKOO_MAX_LOAD_FACTOR 0.9f
+#define INDEX_MAP_CUCKOO_MAX_PATH 5
+// Buckets visited by one displacement search
+#define INDEX_MAP_CUCKOO_MAX_SEARCH 256
+
+template<typename K_T, typename V_T, typename S_T = uint32_t>
+class cuckoo_index_map {
+public:
+      class _Iterator;
+      class _ConstIterator;
+      typedef          K_T                       key_type;
+      typedef          V_T                       value_type;
+      typedef typename std::pair<const K_T, V_T> mapped_type;
+      typedef typename std::size_t               size_type;
+      typedef          S_T                       index_type;
+      typedef typename std::ptrdiff_t            difference_type;
+      typedef          value_type&               reference;
+      typedef          const value_type&         const_reference;
+      typedef          _Iterator                 iterator;
+      typedef          _ConstIterator            const_iterator;
+
+  static const int ways = sizeof(std::pair<K_T, V_T>) <= 8 ? 8 : 4;
+
+private:
+  struct bucket_type {
+      std::pair<K_T, V_T> slots[ways];
+  };
+
+  // A bucket reached by the displacement search: the record in parent_slot
+  // of the parent bucket has this bucket as its other one
+  struct search_node {
+      S_T bucket;
+      int parent;
+      int parent_slot;
+      int depth;
+  };
+
+public:
+  cuckoo_index_map(): cuckoo_index_map(INDEX_MAP_CUCKOO_INIT_BUCKETS) {}
+
+  // bucket_count is rounded up to a power of two
+  explicit cuckoo_index_map(size_type bucket_count):
+      total_values_(0),
+      bucket_size_(0),
+      max_load_factor_(INDEX_MAP_CUCKOO_MAX_LOAD_FACTOR),
+      buckets_(NULL),
+      has_zero_(false),
+      zero_() {
+      allocate_buckets(round_bucket_count(bucket_count));
+  }
+
+  cuckoo_index_map(std::initializer_list<mapped_type> init,
+                   size_type bucket_count = INDEX_MAP_CUCKOO_INIT_BUCKETS):
+      cuckoo_index_map(bucket_count) {
+      for (auto it = init.begin(); it != init.end(); ++it) {
+          insert(*it);
+      }
+  }
+
+  cuckoo_index_map(const cuckoo_index_map &other):
+      total_values_(other.total_values_),
+      bucket_size_(0),
+      max_load_factor_(other.max_load_factor_),
+      buckets_(NULL),
+      has_zero_(other.has_zero_),
+      zero_(other.zero_) {
+      allocate_buckets(other.bucket_size_);
+      std::copy(other.buckets_, other.buckets_ + bucket_size_, buckets_);
+  }
+
+  cuckoo_index_map(cuckoo_index_map&& other): cuckoo_index_map(INDEX_MAP_CUCKOO_INIT_BUCKETS) {
+      swap(other);
+  }
+
+  // Copy and move assignment
+  cuckoo_index_map &operator=(cuckoo_index_map other) {
+      swap(other);
+      return *this;
+  }
+
+  virtual ~cuckoo_index_map() {
+      free_buckets(buckets_, bucket_size_);
+  }
+
+  class _IteratorBase {
+      protected:
+          _IteratorBase(cuckoo_index_map *_pmap, S_T _bucket_idx, int _slot_idx) :
+              pmap(_pmap), bucket_idx(_bucket_idx), slot_idx(_slot_idx) {
+          }
+          std::pair<K_T, V_T> &operator*() const {
+              return pmap->record_at(bucket_idx, slot_idx);
+          }
+          std::pair<K_T, V_T> *operator->() const {
+              return &(pmap->record_at(bucket_idx, slot_idx));
+          }
+          bool operator!=(const _IteratorBase &it) const {
+              return !operator==(it);
+          }
+          bool operator==(const _IteratorBase &it) const {
+              return bucket_idx == it.bucket_idx && slot_idx == it.slot_idx && pmap == it.pmap;
+          }
+          void incr() {
+              pmap->next_record(bucket_idx, slot_idx);
+          }
+
+      private:
+          cuckoo_index_map *pmap;
+          S_T bucket_idx;
+          int slot_idx;
+
+          friend class cuckoo_index_map;
+  };
+
+  class _Iterator : public _IteratorBase {
+      public:
+          _Iterator(cuckoo_index_map *_pmap, S_T _bucket_idx, int _slot_idx) :
+              _IteratorBase(_pmap, _bucket_idx, _slot_idx) {
+          }
+          std::pair<K_T, V_T> &operator*() const {
+              return _IteratorBase::operator*();
+          }
+          std::pair<K_T, V_T> *operator->() const {
+              return _IteratorBase::operator->();
+          }
+          bool operator!=(const iterator &it) const {
+              return _IteratorBase::operator!=(it);
+          }
+          bool operator==(const iterator &it) const {
+              return _IteratorBase::operator==(it);
+          }
+          iterator& operator++() {
+              _IteratorBase::incr();
+              return *this;
+          }
+          iterator operator++(int) {
+              iterator __tmp(*this);
+              _IteratorBase::incr();
+              return __tmp;
+          }
+  };
+
+  class _ConstIterator : public _IteratorBase {
+      public:
+          _ConstIterator(const cuckoo_index_map *_pmap, S_T _bucket_idx, int _slot_idx) :
+              _IteratorBase(const_cast<cuckoo_index_map *>(_pmap), _bucket_idx, _slot_idx) {
+          }
+          _ConstIterator(const _Iterator &it) : _IteratorBase(it) {
+          }
+          const std::pair<K_T, V_T> &operator*() const {
+              return _IteratorBase::operator*();
+          }
+          const std::pair<K_T, V_T> *operator->() const {
+              return _IteratorBase::operator->();
+          }
+          bool operator!=(const const_iterator &it) const {
+              return _IteratorBase::operator!=(it);
+          }
+          bool operator==(const const_iterator &it) const {
+              return _IteratorBase::operator==(it);
+          }
+          const_iterator& operator++() {
+              _IteratorBase::incr();
+              return *this;
+          }
+          const_iterator operator++(int) {
+              const_iterator __tmp(*this);
+              _IteratorBase::incr();
+              return __tmp;
+          }
+  };
+
+  // The buckets in order, then the key 0
+  iterator begin() {
+      S_T bucket_idx = 0;
+      int slot_idx = -1;
+      next_record(bucket_idx, slot_idx);
+      return iterator(this, bucket_idx, slot_idx);
+  }
+
+  const_iterator begin() const {
+      return cbegin();
+  }
+
+  const_iterator cbegin() const {
+      return const_cast<cuckoo_index_map *>(this)->begin();
+  }
+
+  iterator end() {
+      return iterator(this, bucket_size_, 1);
+  }
+
+  const_iterator end() const {
+      return cend();
+  }
+
+  const_iterator cend() const {
+      return const_iterator(this, bucket_size_, 1);
+  }
+
+  bool empty() const {
+      return size() == 0;
+  }
+
+  size_type size() const {
+      return total_values_;
+  }
+
+  size_type max_size() const {
+      return std::numeric_limits<S_T>::max();
+  }
+
+  // Remove all the elements, keeping the buckets
+  void clear() {
+      for (S_T b = 0; b < bucket_size_; ++b) {
+          for (int s = 0; s < ways; ++s) {
+              buckets_[b].slots[s].first = empty_key();
+          }
+      }
+      has_zero_ = false;
+      total_values_ = 0;
+  }
+
+  // Return iterator, and a bool value indicating whether the element was successfully inserted or not
+  std::pair<iterator, bool> insert(const std::pair<K_T, V_T> &value) {
+      return insert_key_value(value.first, value.second);
+  }
+
+  std::pair<iterator, bool> insert(std::pair<K_T, V_T>&& value) {
+      return insert_key_value(value.first, value.second);
+  }
+
+  // The hint is ignored
+  iterator insert(const_iterator hint, const mapped_type &value) {
+      return insert(value).first;
+  }
+
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) {
+      for (auto it = first; it != last; ++it) {
+          insert(*it);
+      }
+  }
+
+  void insert(std::initializer_list<mapped_type> ilist) {
+      for (auto it = ilist.begin(); it != ilist.end(); ++it) {
+          insert(*it);
+      }
+  }
+
+  template<class... Args>
+  std::pair<iterator, bool> emplace(Args&&... args) {
+      std::pair<K_T, V_T> record(std::forward<Args>(args)...);
+      return insert_key_value(record.first, record.second);
+  }
+
+  template<class... Args>
+  iterator emplace_hint(const_iterator hint, Args&&... args) {
+      return emplace(std::forward<Args>(args)...).first;
+  }
+
+  // Removes the element at pos, records do not move
+  iterator erase(const_iterator pos) {
+      iterator next(this, pos.bucket_idx, pos.slot_idx);
+      ++next;
+      erase_at(pos.bucket_idx, pos.slot_idx);
+      return next;
+  }
+
+  iterator erase(const_iterator first, const_iterator last) {
+      iterator cur(this, first.bucket_idx, first.slot_idx);
+      while (cur != iterator(this, last.bucket_idx, last.slot_idx)) {
+          cur = erase(cur);
+      }
+      return cur;
+  }
+
+  size_type erase(const K_T &key) {
+      S_T bucket_idx;
+      int slot_idx;
+      if (!lookup(key, bucket_idx, slot_idx)) {
+          return 0;
+      }
+      erase_at(bucket_idx, slot_idx);
+      return 1;
+  }
+
+  // Removes 'n' keys, the two buckets of a block of keys are prefetched
+  // before they are probed. Returns the number of erased keys.
+  size_type erase_batch(const K_T *keys, size_type n) {
+      const size_type block = 16;
+      size_type erased = 0;
+      for (size_type base = 0; base < n; base += block) {
+          size_type len = std::min(block, n - base);
+          prefetch_buckets(keys + base, len);
+          for (size_type i = 0; i < len; ++i) {
+              erased += erase(keys[base + i]);
+          }
+      }
+      return erased;
+  }
+
+  // Removes all the elements for which pred(const std::pair<K_T, V_T> &) is
+  // true, in one sweep. Returns the number of erased elements.
+  template<typename P>
+  size_type erase_if(P pred) {
+      size_type erased = 0;
+      for (S_T b = 0; b < bucket_size_; ++b) {
+          for (int s = 0; s < ways; ++s) {
+              const std::pair<K_T, V_T> &record = buckets_[b].slots[s];
+              if (record.first != empty_key() && pred(record)) {
+                  erase_at(b, s);
+                  erased += 1;
+              }
+          }
+      }
+      if (has_zero_ && pred(const_cast<const std::pair<K_T, V_T> &>(zero_))) {
+          erase_at(bucket_size_, 0);
+          erased += 1;
+      }
+      return erased;
+  }
+
+  void swap(cuckoo_index_map &other) {
+      std::swap(total_values_, other.total_values_);
+      std::swap(bucket_size_, other.bucket_size_);
+      std::swap(mask_, other.mask_);
+      std::swap(max_load_factor_, other.max_load_factor_);
+      std::swap(grow_threshold_, other.grow_threshold_);
+      std::swap(buckets_, other.buckets_);
+      std::swap(has_zero_, other.has_zero_);
+      std::swap(zero_, other.zero_);
+  }
+
+  V_T &at(const K_T &key) {
+      S_T bucket_idx;
+      int slot_idx;
+      if (!lookup(key, bucket_idx, slot_idx)) {
+          throw std::out_of_range("Cannot find the key");
+      }
+      return record_at(bucket_idx, slot_idx).second;
+  }
+
+  const V_T &at(const K_T &key) const {
+      return const_cast<cuckoo_index_map *>(this)->at(key);
+  }
+
+  V_T &operator[](const K_T &key) {
+      return insert_key_value(key, V_T()).first->second;
+  }
+
+  size_type count(const K_T &key) const {
+      S_T bucket_idx;
+      int slot_idx;
+      return lookup(key, bucket_idx, slot_idx) ? 1 : 0;
+  }
+
+  iterator find(const K_T &key) {
+      S_T bucket_idx;
+      int slot_idx;
+      if (lookup(key, bucket_idx, slot_idx)) {
+          return iterator(this, bucket_idx, slot_idx);
+      }
+      return end();
+  }
+
+  const_iterator find(const K_T &key) const {
+      return const_cast<cuckoo_index_map *>(this)->find(key);
+  }
+
+  // Look up 'n' keys at once: values[i] is set to the value of keys[i], or
+  // NULL if it is absent. Both buckets of a block of keys are prefetched
+  // before they are probed. Returns the number of keys found.
+  size_type find_batch(const K_T *keys, size_type n, V_T **values) {
+      const size_type block = 16;
+      size_type hits = 0;
+      for (size_type base = 0; base < n; base += block) {
+          size_type len = std::min(block, n - base);
+          prefetch_buckets(keys + base, len);
+          for (size_type i = 0; i < len; ++i) {
+              S_T bucket_idx;
+              int slot_idx;
+              if (lookup(keys[base + i], bucket_idx, slot_idx)) {
+                  values[base + i] = &record_at(bucket_idx, slot_idx).second;
+                  hits += 1;
+              } else {
+                  values[base + i] = NULL;
+              }
+          }
+      }
+      return hits;
+  }
+
+  std::pair<iterator, iterator> equal_range(const K_T &key) {
+      iterator it = find(key);
+      if (it == end()) {
+          return std::make_pair(end(), end());
+      }
+      iterator next(it);
+      ++next;
+      return std::make_pair(it, next);
+  }
+
+  std::pair<const_iterator, const_iterator> equal_range(const K_T &key) const {
+      return const_cast<cuckoo_index_map *>(this)->equal_range(key);
+  }
+
+  size_type bucket_count() const {
+      return bucket_size_;
+  }
+
+  size_type max_bucket_count() const {
+      return (size_type)1 << (std::numeric_limits<S_T>::digits - 1);
+  }
+
+  // Returns the number of elements in the bucket with index n
+  size_type bucket_size(size_type n) const {
+      size_type num = 0;
+      for (int s = 0; n < bucket_size_ && s < ways; ++s) {
+          num += buckets_[n].slots[s].first != empty_key();
+      }
+      return num;
+  }
+
+  // Bytes used by the map and its buckets
+  size_type memory_usage() const {
+      return sizeof(*this) + (size_type)bucket_size_ * sizeof(bucket_type);
+  }
+
+  // Records per slot
+  float load_factor() const {
+      return (float)size() / ((size_type)bucket_size_ * ways);
+  }
+
+  float max_load_factor() const {
+      return max_load_factor_;
+  }
+
+  // Set the load factor above which the map doubles, rehashing now if it is
+  // already exceeded. Above ~0.95 inserts mostly fail to find a path.
+  void max_load_factor(float ml) {
+      assert(ml > 0 && ml <= 1);
+      max_load_factor_ = ml;
+      update_grow_threshold();
+      if (size() > grow_threshold_) {
+          rehash(0);
+      }
+  }
+
+  // Set the bucket count to the power of two at or above n, and at least
+  // the count that keeps the load under max_load_factor()
+  void rehash(size_type n) {
+      n = round_bucket_count(std::max(n, min_bucket_count(size())));
+      if (n != bucket_size_) {
+          rehash_to(n);
+      }
+  }
+
+  // Make room for n elements without rehashing
+  void reserve(size_type n) {
+      if (min_bucket_count(n) > bucket_size_) {
+          rehash(min_bucket_count(n));
+      }
+  }
+
+private:
+  static K_T empty_key() {
+      return K_T();
+  }
+
+  std::pair<iterator, bool> insert_key_value(const K_T key, const V_T &val) {
+      S_T bucket_idx;
+      int slot_idx;
+      if (lookup(key, bucket_idx, slot_idx)) {
+          return std::make_pair(iterator(this, bucket_idx, slot_idx), false);
+      }
+      if (key == empty_key()) {
+          zero_ = std::pair<K_T, V_T>(key, val);
+          has_zero_ = true;
+          total_values_ += 1;
+          return std::make_pair(iterator(this, bucket_size_, 0), true);
+      }
+      if (unlikely(size() + 1 > grow_threshold_)) {
+          rehash_to(next_bucket_count());
+      }
+      while (!place(key, val, bucket_idx, slot_idx)) {
+          // No path within INDEX_MAP_CUCKOO_MAX_PATH moves
+          rehash_to(next_bucket_count());
+      }
+      total_values_ += 1;
+      return std::make_pair(iterator(this, bucket_idx, slot_idx), true);
+  }
+
+  // Put a key that is not in the map into a free slot of one of its buckets,
+  // moving other keys to make room. Returns false if there is no room within
+  // INDEX_MAP_CUCKOO_MAX_PATH moves, the map is then unchanged.
+  bool place(const K_T &key, const V_T &val, S_T &bucket_idx, int &slot_idx) {
+      S_T b1, b2;
+      buckets_of(key, b1, b2);
+      if ((slot_idx = free_slot(b1)) != -1) {
+          bucket_idx = b1;
+      } else if ((slot_idx = free_slot(b2)) != -1) {
+          bucket_idx = b2;
+      } else if (!make_room(b1, b2, bucket_idx, slot_idx)) {
+          return false;
+      }
+      buckets_[bucket_idx].slots[slot_idx] = std::pair<K_T, V_T>(key, val);
+      return true;
+  }
+
+  // Breadth-first search from the two full buckets b1 and b2 for the
+  // shortest chain of moves ending in a free slot, then do the moves from
+  // the end of the chain. Sets the freed slot of b1 or b2.
+  bool make_room(S_T b1, S_T b2, S_T &bucket_idx, int &slot_idx) {
+      INDEX_MAP_STAT_INC(cuckoo_searches);
+      search_node queue[INDEX_MAP_CUCKOO_MAX_SEARCH];
+      int tail = 0;
+      queue[tail++] = search_node{b1, -1, -1, 0};
+      if (b2 != b1) {
+          queue[tail++] = search_node{b2, -1, -1, 0};
+      }
+      for (int head = 0; head < tail; ++head) {
+          const search_node node = queue[head];
+          if (node.depth >= INDEX_MAP_CUCKOO_MAX_PATH) {
+              break;
+          }
+          for (int s = 0; s < ways; ++s) {
+              S_T alt = other_bucket(buckets_[node.bucket].slots[s].first, node.bucket);
+              int free_idx = free_slot(alt);
+              if (free_idx != -1) {
+                  // Move every record of the chain one step, from the end
+                  buckets_[alt].slots[free_idx] = buckets_[node.bucket].slots[s];
+                  INDEX_MAP_STAT_INC(cuckoo_moves);
+                  int cur = head;
+                  int cur_slot = s;
+                  while (queue[cur].parent != -1) {
+                      const search_node &n = queue[cur];
+                      buckets_[n.bucket].slots[cur_slot] = buckets_[queue[n.parent].bucket].slots[n.parent_slot];
+                      INDEX_MAP_STAT_INC(cuckoo_moves);
+                      cur_slot = n.parent_slot;
+                      cur = n.parent;
+                  }
+                  bucket_idx = queue[cur].bucket;
+                  slot_idx = cur_slot;
+                  return true;
+              }
+              // A bucket appears once per chain, so that the moves of a
+              // chain do not overwrite each other
+              if (tail < INDEX_MAP_CUCKOO_MAX_SEARCH && !on_chain(queue, head, alt)) {
+                  queue[tail++] = search_node{alt, head, s, node.depth + 1};
+              }
+          }
+      }
+      return false;
+  }
+
+  // Whether the bucket is on the chain that leads to queue[idx]
+  static bool on_chain(const search_node *queue, int idx, S_T bucket) {
+      for (; idx != -1; idx = queue[idx].parent) {
+          if (queue[idx].bucket == bucket) {
+              return true;
+          }
+      }
+      return false;
+  }
+
+  // Find the record of the key, set bucket_idx and slot_idx to its place.
+  // The key 0 is at (bucket_size_, 0).
+  bool lookup(const K_T &key, S_T &bucket_idx, int &slot_idx) const {
+      INDEX_MAP_STAT_INC(finds);
+      bool found;
+      if (unlikely(key == empty_key())) {
+          bucket_idx = bucket_size_;
+          slot_idx = 0;
+          found = has_zero_;
+      } else {
+          S_T b1, b2;
+          buckets_of(key, b1, b2);
+          if ((slot_idx = slot_of(b1, key)) != -1) {
+              bucket_idx = b1;
+          } else {
+              slot_idx = slot_of(b2, key);
+              bucket_idx = b2;
+          }
+          found = slot_idx != -1;
+      }
+      if (found) {
+          INDEX_MAP_STAT_INC(hits);
+      } else {
+          INDEX_MAP_STAT_INC(misses);
+      }
+      return found;
+  }
+
+  int slot_of(S_T bucket_idx, const K_T &key) const {
+      const bucket_type &bucket = buckets_[bucket_idx];
+      for (int s = 0; s < ways; ++s) {
+          if (bucket.slots[s].first == key) {
+              return s;
+          }
+      }
+      return -1;
+  }
+
+  int free_slot(S_T bucket_idx) const {
+      return slot_of(bucket_idx, empty_key());
+  }
+
+  void erase_at(S_T bucket_idx, int slot_idx) {
+      if (bucket_idx == bucket_size_) {
+          has_zero_ = false;
+      } else {
+          buckets_[bucket_idx].slots[slot_idx] = std::pair<K_T, V_T>();
+      }
+      total_values_ -= 1;
+  }
+
+  std::pair<K_T, V_T> &record_at(S_T bucket_idx, int slot_idx) {
+      return bucket_idx < bucket_size_ ? buckets_[bucket_idx].slots[slot_idx] : zero_;
+  }
+
+  // Move to the next record after (bucket_idx, slot_idx), or to end()
+  void next_record(S_T &bucket_idx, int &slot_idx) const {
+      while (bucket_idx < bucket_size_) {
+          while (++slot_idx < ways) {
+              if (buckets_[bucket_idx].slots[slot_idx].first != empty_key()) {
+                  return;
+              }
+          }
+          bucket_idx += 1;
+          slot_idx = -1;
+      }
+      // The key 0, then end()
+      slot_idx = slot_idx < 0 && has_zero_ ? 0 : 1;
+  }
+
+  // The two buckets of a key, from the two halves of its hash
+  void buckets_of(const K_T &key, S_T &b1, S_T &b2) const {
+      uint64_t h = index_map_filter_hash((uint64_t)key, 0x9e3779b97f4a7c15ull);
+      b1 = (S_T)(h & mask_);
+      b2 = (S_T)(((h >> 32) | (h << 32)) & mask_);
+  }
+
+  S_T other_bucket(const K_T &key, S_T bucket_idx) const {
+      S_T b1, b2;
+      buckets_of(key, b1, b2);
+      return bucket_idx == b1 ? b2 : b1;
+  }
+
+  void prefetch_buckets(const K_T *keys, size_type n) const {
+      for (size_type i = 0; i < n; ++i) {
+          S_T b1, b2;
+          buckets_of(keys[i], b1, b2);
+          __builtin_prefetch(&buckets_[b1]);
+          __builtin_prefetch(&buckets_[b2]);
+      }
+  }
+
+  // Buckets aligned to a cache line, with empty slots
+  void allocate_buckets(S_T bucket_size) {
+      void *p = NULL;
+      if (posix_memalign(&p, 64, (size_t)bucket_size * sizeof(bucket_type)) != 0) {
+          throw std::bad_alloc();
+      }
+      buckets_ = (bucket_type *)p;
+      for (S_T b = 0; b < bucket_size; ++b) {
+          ::new ((void *)(buckets_ + b)) bucket_type();
+      }
+      bucket_size_ = bucket_size;
+      mask_ = bucket_size - 1;
+      update_grow_threshold();
+  }
+
+  // Destroy the records of allocate_buckets() before giving the memory back
+  static void free_buckets(bucket_type *buckets, S_T bucket_size) {
+      for (S_T b = 0; b < bucket_size; ++b) {
+          buckets[b].~bucket_type();
+      }
+      free(buckets);
+  }
+
+  // Place every record again in new_size buckets, doubling until they all fit
+  void rehash_to(size_type new_size) {
+      INDEX_MAP_STAT_INC(rehashes);
+      INDEX_MAP_STAT_TIMER(rehash_ns);
+
+      bucket_type *src = buckets_;
+      S_T src_size = bucket_size_;
+      while (true) {
+          if (new_size > max_bucket_count()) {
+              buckets_ = src;
+              bucket_size_ = src_size;
+              mask_ = src_size - 1;
+              update_grow_threshold();
+              throw std::length_error("cuckoo_index_map: cannot place the keys");
+          }
+          allocate_buckets((S_T)new_size);
+          bool placed = true;
+          for (S_T b = 0; placed && b < src_size; ++b) {
+              for (int s = 0; placed && s < ways; ++s) {
+                  const std::pair<K_T, V_T> &record = src[b].slots[s];
+                  S_T bucket_idx;
+                  int slot_idx;
+                  if (record.first != empty_key()) {
+                      placed = place(record.first, record.second, bucket_idx, slot_idx);
+                  }
+              }
+          }
+          if (placed) {
+              break;
+          }
+          free_buckets(buckets_, bucket_size_);
+          new_size *= 2;
+      }
+      free_buckets(src, src_size);
+  }
+
+  void update_grow_threshold() {
+      double threshold = (double)max_load_factor_ * bucket_size_ * ways;
+      grow_threshold_ = (S_T)std::min(threshold, (double)std::numeric_limits<S_T>::max());
+  }
+
+  // Fewest buckets holding n elements under max_load_factor()
+  size_type min_bucket_count(size_type n) const {
+      return (size_type)std::ceil(n / ((double)max_load_factor_ * ways)) + 1;
+  }
+
+  size_type round_bucket_count(size_type n) const {
+      size_type rounded = 1;
+      while (rounded < n && rounded < max_bucket_count()) {
+          rounded *= 2;
+      }
+      return rounded;
+  }
+
+  size_type next_bucket_count() const {
+      return (size_type)bucket_size_ * 2;
+  }
+
+private:
+  S_T total_values_;
+  // A power of two
+  S_T bucket_size_;
+  S_T mask_;
+  float max_load_factor_;
+  // Size above which the map doubles
+  S_T grow_threshold_;
+  bucket_type *buckets_;
+  // The key 0, whose slot value marks empty slots in the buckets
+  bool has_zero_;
+  std::pair<K_T, V_T> zero_;
+};
+
+template<typename K_T, typename V_T, typename S_T>
+bool operator==(const cuckoo_index_map<K_T, V_T, S_T>& lhs,
+                const cuckoo_index_map<K_T, V_T, S_T>& rhs) {
+    if (lhs.size() != rhs.size()) {
+        return false;
+    }
+    for (auto it : lhs) {
+        if (rhs.find(it.first) == rhs.end()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename K_T, typename V_T, typename S_T>
+bool operator!=(const cuckoo_index_map<K_T, V_T, S_T>& lhs,
+                const cuckoo_index_map<K_T, V_T, S_T>& rhs) {
+    return !operator==(lhs, rhs);
+}
+
+#endif
@@ -1,22 +1,77 @@
+#ifndef __INDEX_MAP_FOR_FIND_H_
+#define __INDEX_MAP_FOR_FIND_H_
 #include <utility>
 #include <cstring>
 #include <cassert>
 #include <malloc.h>
+#include <stdint.h>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include "index_map_stats.h"
+#include "index_map_filter.h"
+#include "index_map_checkpoint.h"
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
-template<typename K_T, typename V_T>
-class index_bucket {
+// The record buffer comes from A_T, rebound to std::pair<K_T, V_T>. The
+// allocator is an empty base for std::allocator, so it takes no space.
+template<typename K_T, typename V_T, typename A_T = std::allocator<std::pair<K_T, V_T> > >
+class index_bucket : private std::allocator_traits<A_T>::template rebind_alloc<std::pair<K_T, V_T> > {
+  typedef typename std::allocator_traits<A_T>::template rebind_alloc<std::pair<K_T, V_T> > record_allocator;
+  typedef std::allocator_traits<record_allocator> record_traits;
+
 public:
-  index_bucket() {
+  explicit index_bucket(const A_T &alloc = A_T()): record_allocator(alloc) {
+    record_num = 0;
+    record_capacity = 0;
+    generation = 0;
+    records = NULL;
+  }
+
+  // Deep copy with the allocator of other, the record buffer is sized to the records
+  index_bucket(const index_bucket &other): record_allocator(other) {
     record_num = 0;
     record_capacity = 0;
     records = NULL;
+    *this = other;
+  }
+
+  // The allocator is kept, only the records are copied
+  index_bucket &operator=(const index_bucket &other) {
+    if (this != &other) {
+      delete_records(records, record_capacity);
+      record_num = other.record_num;
+      record_capacity = other.record_num;
+      generation = other.generation;
+      records = new_records(record_num);
+      std::copy(other.records, other.records + record_num, records);
+      const int k_capacity = sizeof(k) / sizeof(k[0]);
+      std::copy(other.k, other.k + std::min(record_num, k_capacity), k);
+    }
+    return *this;
+  }
+
+  ~index_bucket() {
+    delete_records(records, record_capacity);
   }
 
-  virtual ~index_bucket() {
-    delete[] records;
+  // Generation of the map when the bucket was last written, buckets of an
+  // older generation are empty (see index_map::clear)
+  uint32_t get_generation() const {
+    return generation;
+  }
+
+  // Empty the bucket and move it to the generation, keeping its record buffer
+  void renew(uint32_t epoch) {
+    record_num = 0;
+    generation = epoch;
   }
 
   // Returns a pair consisting of value index (inside records) and 
@@ -61,6 +116,17 @@ public:
     add_record(key, val);
   }
 
+  // Append n records whose keys are not in the bucket, growing the record
+  // buffer at most once
+  void append_nocheck(const std::pair<K_T, V_T> *recs, int n) {
+    if (record_num + n > record_capacity) {
+      enlarge_buffer(record_num + n - record_capacity);
+    }
+    for (int i = 0; i < n; ++i) {
+      add_record(recs[i].first, recs[i].second);
+    }
+  }
+
   // Return the index of the found key&value, -1 means not found
   int find(const K_T &key) const {
     const int k_capacity = sizeof(k) / sizeof(k[0]);
@@ -68,9 +134,11 @@ public:
     if (likely(record_num <= k_capacity)) {
       for (int idx = 0; idx < record_num; ++idx) {
         if (k[idx] == key) {
+          INDEX_MAP_STAT_ADD(inline_probes, idx + 1);
           return idx;
         }
       }
+      INDEX_MAP_STAT_ADD(inline_probes, record_num);
       return -1;
     }
 
@@ -78,21 +146,34 @@ public:
     else {
       for (int idx = 0; idx < k_capacity; ++idx) {
         if (k[idx] == key) {
+          INDEX_MAP_STAT_ADD(inline_probes, idx + 1);
           return idx;
         }
       }
+      INDEX_MAP_STAT_ADD(inline_probes, k_capacity);
 
       // Try to find the key in records
       for (int idx = k_capacity; idx < record_num; ++idx) {
         if (records[idx].first == key) {
+          INDEX_MAP_STAT_ADD(overflow_probes, idx - k_capacity + 1);
           return idx;
         }
       }
+      INDEX_MAP_STAT_ADD(overflow_probes, record_num - k_capacity);
 
       return -1;
     }
   }
 
+  // find() comparing the inline keys all at once. For 64-bit integer keys
+  // the 6 keys are compared 2 by 2 with the vector extensions of GCC and
+  // Clang, i.e. SSE2 on x86-64, and only a match is located. Other keys use
+  // find().
+  int find_vector(const K_T &key) const {
+    typedef std::integral_constant<bool, std::is_integral<K_T>::value && sizeof(K_T) == 8> vectorized;
+    return find_vector(key, vectorized());
+  }
+
   // Erase the specified record by key
   // Return the index of erased record inside values, -1 means key not found
   int erase(const K_T &key) {
@@ -123,6 +204,29 @@ public:
     return idx;
   }
 
+  // Erase the records matching pred in one pass, the others keep their order
+  // Return the number of erased records
+  template<typename P>
+  int erase_if(P &pred) {
+    const int k_capacity = sizeof(k) / sizeof(k[0]);
+    int kept = 0;
+    for (int idx = 0; idx < record_num; ++idx) {
+      if (pred(const_cast<const std::pair<K_T, V_T> &>(records[idx]))) {
+        continue;
+      }
+      if (kept != idx) {
+        records[kept] = records[idx];
+        if (kept < k_capacity) {
+          k[kept] = records[kept].first;
+        }
+      }
+      kept += 1;
+    }
+    int erased = record_num - kept;
+    record_num = kept;
+    return erased;
+  }
+
   int get_record_num() const {
     return record_num;
   }
@@ -135,7 +239,62 @@ public:
     return records;
   }
 
+  // Bytes used by the bucket, including its record buffer
+  size_t memory_usage() const {
+    return sizeof(*this) + record_capacity * sizeof(std::pair<K_T, V_T>);
+  }
+
+  // Trim the record buffer to the records
+  void shrink_to_fit() {
+    if (record_capacity > record_num) {
+      std::pair<K_T, V_T> *old_records = records;
+      int old_capacity = record_capacity;
+      record_capacity = record_num;
+      records = new_records(record_num);
+      for (int i = 0; i < record_num; ++i) {
+        records[i] = old_records[i];
+      }
+      delete_records(old_records, old_capacity);
+    }
+  }
+
 private:
+  int find_vector(const K_T &key, std::false_type) const {
+    return find(key);
+  }
+
+  int find_vector(const K_T &key, std::true_type) const {
+    typedef uint64_t lanes __attribute__((vector_size(16)));
+    const int k_capacity = sizeof(k) / sizeof(k[0]);
+    static_assert(k_capacity % 2 == 0, "the inline keys are compared 2 by 2");
+
+    lanes wanted = { (uint64_t)key, (uint64_t)key };
+    uint32_t mask = 0;
+    for (int i = 0; i < k_capacity; i += 2) {
+      lanes pair;
+      memcpy(&pair, k + i, sizeof(pair));
+      lanes equal = pair == wanted;
+      mask |= (uint32_t)((equal[0] & 1) | (equal[1] & 2)) << i;
+    }
+    // The inline keys past record_num are left over from erased records
+    int inline_num = std::min(record_num, k_capacity);
+    mask &= (1u << inline_num) - 1;
+    if (mask != 0) {
+      INDEX_MAP_STAT_ADD(inline_probes, inline_num);
+      return __builtin_ctz(mask);
+    }
+    INDEX_MAP_STAT_ADD(inline_probes, inline_num);
+
+    for (int idx = k_capacity; idx < record_num; ++idx) {
+      if (records[idx].first == key) {
+        INDEX_MAP_STAT_ADD(overflow_probes, idx - k_capacity + 1);
+        return idx;
+      }
+    }
+    INDEX_MAP_STAT_ADD(overflow_probes, std::max(record_num - k_capacity, 0));
+    return -1;
+  }
+
   // Return the index of the new record
   int add_record(const K_T &key, const V_T &val) {
 
@@ -161,13 +320,40 @@ private:
 
   // Expand record capacity by delta
   void enlarge_buffer(int delta) {
+    INDEX_MAP_STAT_INC(enlarge_buffers);
+    INDEX_MAP_STAT_TIMER(enlarge_buffer_ns);
     std::pair<K_T, V_T> *old_records = records;
+    int old_capacity = record_capacity;
     record_capacity += delta;
-    records = new std::pair<K_T, V_T>[record_capacity];
+    records = new_records(record_capacity);
     for (int i = 0; i < record_num; ++i) {
       records[i] = old_records[i];
     }
-    delete[] old_records;
+    delete_records(old_records, old_capacity);
+  }
+
+  // n default constructed records from the allocator, NULL for 0
+  std::pair<K_T, V_T> *new_records(int n) {
+    if (n == 0) {
+      return NULL;
+    }
+    record_allocator &alloc = *this;
+    std::pair<K_T, V_T> *p = record_traits::allocate(alloc, n);
+    for (int i = 0; i < n; ++i) {
+      record_traits::construct(alloc, p + i);
+    }
+    return p;
+  }
+
+  void delete_records(std::pair<K_T, V_T> *p, int n) {
+    if (p == NULL) {
+      return;
+    }
+    record_allocator &alloc = *this;
+    for (int i = 0; i < n; ++i) {
+      record_traits::destroy(alloc, p + i);
+    }
+    record_traits::deallocate(alloc, p, n);
   }
 
 private:
@@ -175,6 +361,8 @@ private:
   int record_num;
   // The capacity of 'records'
   int record_capacity;
+  // See get_generation()
+  uint32_t generation;
   // First 6 keys
   K_T k[6];
   // All key and values
@@ -182,8 +370,26 @@ private:
 };
 
 #define INDEX_MAP_INIT_BUCKETS 8096
+#define INDEX_MAP_MAX_LOAD_FACTOR 0.5f
+// Bytes of the flat array holding the elements of a small map inline, the
+// buckets are only allocated once it is full
+#define INDEX_MAP_SMALL_BYTES 256
+
+// What merge() does with a key present in both maps
+enum index_map_merge_policy {
+  INDEX_MAP_MERGE_KEEP,       // keep the value of the destination
+  INDEX_MAP_MERGE_OVERWRITE   // take the value of the merged map
+};
 
-template<typename K_T, typename V_T>
+// S_T is the type of the map size and the bucket indices: uint32_t keeps
+// the map compact, uint64_t allows more than 2^32 buckets/elements.
+//
+// A_T allocates the bucket array and the record buffers (the optional filter
+// stays on the heap). Like the std containers with std::pmr allocators, the
+// allocator is not propagated by assignment or swap, and swap requires equal
+// allocators.
+template<typename K_T, typename V_T, typename S_T = uint32_t,
+         typename A_T = std::allocator<std::pair<K_T, V_T> > >
 class index_map {
 public:
       class _Iterator;
@@ -192,95 +398,173 @@ public:
       typedef          V_T                       value_type;
       typedef typename std::pair<const K_T, V_T> mapped_type;
       typedef typename std::size_t               size_type;
+      typedef          S_T                       index_type;
       typedef typename std::ptrdiff_t            difference_type;
       typedef          value_type&               reference;
       typedef          const value_type&         const_reference;
       typedef          _Iterator                 iterator;
       typedef          _ConstIterator            const_iterator;
+      typedef          A_T                       allocator_type;
+
+private:
+      typedef          index_bucket<K_T, V_T, A_T> bucket_type;
+      typedef typename std::allocator_traits<A_T>::template rebind_alloc<bucket_type> bucket_allocator;
+      typedef          std::allocator_traits<bucket_allocator> bucket_traits;
 
 public:
   index_map(): index_map(INDEX_MAP_INIT_BUCKETS) {}
 
-  index_map(size_type bucket_size):
+  explicit index_map(const A_T &alloc): index_map(INDEX_MAP_INIT_BUCKETS, alloc) {}
+
+  // The buckets are allocated once the map outgrows its inline array
+  index_map(size_type bucket_size, const A_T &alloc = A_T()):
       total_values_(0),
-      bucket_size_(bucket_size) {
-      allocate_buckets(bucket_size_);
+      bucket_size_(bucket_size),
+      max_load_factor_(INDEX_MAP_MAX_LOAD_FACTOR),
+      epoch_(0),
+      alloc_(alloc),
+      buckets_(NULL),
+      filter_(NULL),
+      changes_(NULL) {
+      update_grow_threshold();
   }
 
   index_map(std::initializer_list<mapped_type> init,
-            size_type bucket_count = INDEX_MAP_INIT_BUCKETS):
+            size_type bucket_count = INDEX_MAP_INIT_BUCKETS,
+            const A_T &alloc = A_T()):
             total_values_(0),
-            bucket_size_(bucket_count) {
-      allocate_buckets(bucket_size_);
+            bucket_size_(bucket_count),
+            max_load_factor_(INDEX_MAP_MAX_LOAD_FACTOR),
+            epoch_(0),
+            alloc_(alloc),
+            buckets_(NULL),
+            filter_(NULL),
+            changes_(NULL) {
+      update_grow_threshold();
       for (auto it = init.begin(); it != init.end(); ++it) {
           insert(*it);
       }
   }
 
-  index_map(const index_map<K_T, V_T> &other) {
+  index_map(const index_map &other):
+      alloc_(std::allocator_traits<A_T>::select_on_container_copy_construction(other.alloc_)) {
       total_values_ = other.total_values_;
       bucket_size_ = other.bucket_size_;
+      max_load_factor_ = other.max_load_factor_;
+      filter_ = other.filter_ ? new negative_lookup_filter(*other.filter_) : NULL;
+      // A copy that tracks changes starts with a full image
+      changes_ = other.changes_ ? new index_map_change_set() : NULL;
+      if (other.buckets_ == NULL) {
+          buckets_ = NULL;
+          epoch_ = 0;
+          update_grow_threshold();
+          std::copy(other.small_, other.small_ + total_values_, small_);
+          return;
+      }
       allocate_buckets(bucket_size_);
 
+      // Buckets are copied whole, the stale ones stay stale under other's generation
+      epoch_ = other.epoch_;
       for (size_type i = 0; i < bucket_size_; ++i) {
-          int rec_num = other.buckets_[i].get_record_num();
-          if (rec_num > 0) {
-              for (int r = 0; r < rec_num; ++r) {
-                  auto records = other.buckets_[i].get_records();
-                  buckets_[i].insert(records[r].first, records[r].second);
-              }
+          if (other.records_in(i) > 0) {
+              buckets_[i] = other.buckets_[i];
           }
       }
   }
 
   // Move constructor
-  index_map(index_map<K_T, V_T>&& other) {
+  index_map(index_map&& other): alloc_(other.alloc_) {
       total_values_ = other.total_values_;
       bucket_size_ = other.bucket_size_;
+      max_load_factor_ = other.max_load_factor_;
+      grow_threshold_ = other.grow_threshold_;
+      epoch_ = other.epoch_;
       buckets_ = other.buckets_;
+      filter_ = other.filter_;
+      changes_ = other.changes_;
+      if (buckets_ == NULL) {
+          std::move(other.small_, other.small_ + total_values_, small_);
+      }
 
       other.total_values_ = 0;
       other.bucket_size_ = 0;
       other.buckets_ = NULL;
+      other.filter_ = NULL;
+      other.changes_ = NULL;
   }
 
 
-  index_map<K_T, V_T> &operator=(const index_map<K_T, V_T> &other) {
-      rehash(other.bucket_size_, other.buckets_, other.bucket_size_);
+  index_map &operator=(const index_map &other) {
+      if (this == &other) {
+          return *this;
+      }
+      delete filter_;
+      filter_ = NULL;
+      max_load_factor_ = other.max_load_factor_;
+      if (other.buckets_ == NULL) {
+          free_buckets(buckets_, bucket_size_);
+          buckets_ = NULL;
+          bucket_size_ = other.bucket_size_;
+          update_grow_threshold();
+          total_values_ = other.total_values_;
+          std::copy(other.small_, other.small_ + total_values_, small_);
+          mark_all_changed();
+      } else {
+          rehash(other.bucket_size_, other.buckets_, other.bucket_size_, other.epoch_);
+      }
+      if (other.filter_) {
+          filter_ = new negative_lookup_filter(*other.filter_);
+      }
       return *this;
   }
 
-  index_map<K_T, V_T> &operator=(index_map<K_T, V_T>&& other) {
-      free_buckets(buckets_);
+  // The storage of other is taken over if the allocators are equal, its
+  // elements are copied otherwise
+  index_map &operator=(index_map&& other) {
+      if (!(alloc_ == other.alloc_)) {
+          return *this = static_cast<const index_map &>(other);
+      }
+      free_buckets(buckets_, bucket_size_);
+      delete filter_;
 
       total_values_ = other.total_values_;
       bucket_size_ = other.bucket_size_;
+      max_load_factor_ = other.max_load_factor_;
+      grow_threshold_ = other.grow_threshold_;
+      epoch_ = other.epoch_;
       buckets_ = other.buckets_;
+      filter_ = other.filter_;
+      if (buckets_ == NULL) {
+          std::move(other.small_, other.small_ + total_values_, small_);
+      }
 
       other.total_values_ = 0;
       other.bucket_size_ = 0;
       other.buckets_ = NULL;
+      other.filter_ = NULL;
+      // Each map keeps its own change tracking
+      mark_all_changed();
+      other.mark_all_changed();
 
       return *this;
   }
 
   virtual ~index_map() {
-      free_buckets(buckets_);
+      free_buckets(buckets_, bucket_size_);
+      delete filter_;
+      delete changes_;
   }
 
   class _IteratorBase {
       protected:
-          _IteratorBase(index_map *_pmap, unsigned int _bucket_idx, int _value_idx) :
+          _IteratorBase(index_map *_pmap, S_T _bucket_idx, int _value_idx) :
               pmap(_pmap), bucket_idx(_bucket_idx), value_idx(_value_idx) {
           }
-          _IteratorBase(const _IteratorBase &it) :
-              pmap(it.pmap), bucket_idx(it.bucket_idx), value_idx(it.value_idx) {
-          }
           std::pair<K_T, V_T> &operator*() const {
-              return pmap->buckets_[bucket_idx].get_records()[value_idx];
+              return pmap->records_of(bucket_idx)[value_idx];
           }
           std::pair<K_T, V_T> *operator->() const {
-              return &(pmap->buckets_[bucket_idx].get_records()[value_idx]);
+              return &(pmap->records_of(bucket_idx)[value_idx]);
           }
           bool operator!=(const _IteratorBase &it) const {
               return !operator==(it);
@@ -289,14 +573,14 @@ public:
               return bucket_idx == it.bucket_idx && value_idx == it.value_idx && pmap == it.pmap;
           }
           void incr() {
-              if (value_idx + 1 < pmap->buckets_[bucket_idx].get_record_num()) {
+              if (value_idx + 1 < pmap->records_in(bucket_idx)) {
                   value_idx += 1;
                   return;
               }
 
-              size_type bucket_count = pmap->bucket_count();
+              size_type bucket_count = pmap->bucket_limit();
               while (++bucket_idx < bucket_count) {
-                  if (pmap->buckets_[bucket_idx].get_record_num() > 0) {
+                  if (pmap->records_in(bucket_idx) > 0) {
                       break;
                   }
               }
@@ -307,7 +591,7 @@ public:
 
       private:
           index_map *pmap;
-          unsigned int bucket_idx;
+          S_T bucket_idx;
           int value_idx;
 
           friend class index_map;
@@ -315,11 +599,9 @@ public:
 
   class _Iterator : public _IteratorBase {
       public:
-          _Iterator(index_map *_pmap, unsigned int _bucket_idx, int _value_idx) :
+          _Iterator(index_map *_pmap, S_T _bucket_idx, int _value_idx) :
               _IteratorBase(_pmap, _bucket_idx, _value_idx) {
           }
-          _Iterator(const _Iterator &it) : _IteratorBase(it) {
-          }
           std::pair<K_T, V_T> &operator*() const {
               return _IteratorBase::operator*();
           }
@@ -345,11 +627,9 @@ public:
 
   class _ConstIterator : public _IteratorBase {
       public:
-          _ConstIterator(const index_map *_pmap, unsigned int _bucket_idx, int _value_idx) :
+          _ConstIterator(const index_map *_pmap, S_T _bucket_idx, int _value_idx) :
               _IteratorBase(const_cast<index_map *>(_pmap), _bucket_idx, _value_idx) {
           }
-          _ConstIterator(const _ConstIterator &it) : _IteratorBase(it) {
-          }
           _ConstIterator(const _Iterator &it) : _IteratorBase(it) {
           }
           const std::pair<K_T, V_T> &operator*() const {
@@ -380,8 +660,8 @@ public:
           return end();
       }
 
-      for (unsigned int i = 0; i < bucket_size_; ++i) {
-          if (buckets_[i].get_record_num() > 0) {
+      for (S_T i = 0; i < bucket_limit(); ++i) {
+          if (records_in(i) > 0) {
               return iterator(this, i, 0);
           }
       }
@@ -399,8 +679,8 @@ public:
           return cend();
       }
 
-      for (unsigned int i = 0; i < bucket_size_; ++i) {
-          if (buckets_[i].get_record_num() > 0) {
+      for (S_T i = 0; i < bucket_limit(); ++i) {
+          if (records_in(i) > 0) {
               return const_iterator(this, i, 0);
           }
       }
@@ -410,7 +690,7 @@ public:
   }
 
   iterator end() {
-      return iterator(this, bucket_size_, 0);
+      return iterator(this, bucket_limit(), 0);
   }
 
   const_iterator end() const {
@@ -418,7 +698,7 @@ public:
   }
 
   const_iterator cend() const {
-      return const_iterator(this, bucket_size_, 0);
+      return const_iterator(this, bucket_limit(), 0);
   }
 
   bool empty() const {
@@ -430,15 +710,43 @@ public:
   }
 
   size_type max_size() const {
-      // 2^32 - 1
-      return 4294967295ll;
+      return std::numeric_limits<S_T>::max();
   }
 
-  // Remove all the elements
+  // Remove all the elements, keeping the buckets and their record buffers.
+  // Only the generation of the map is bumped: buckets of an older generation
+  // read as empty and are emptied when they are next written.
   void clear() {
       total_values_ = 0;
-      free_buckets(buckets_);
-      allocate_buckets(INDEX_MAP_INIT_BUCKETS);
+      if (buckets_ == NULL) {
+          // Small map, nothing to invalidate
+      } else if (unlikely(epoch_ == std::numeric_limits<uint32_t>::max())) {
+          // The generation wraps around, empty all buckets once
+          for (S_T i = 0; i < bucket_size_; ++i) {
+              buckets_[i].renew(0);
+          }
+          epoch_ = 0;
+      } else {
+          epoch_ += 1;
+      }
+      if (filter_) {
+          filter_->reset(filter_capacity());
+      }
+      mark_all_changed();
+  }
+
+  // Remove all the elements and free the buckets, back to an empty small map
+  // with the initial bucket count
+  void release() {
+      total_values_ = 0;
+      free_buckets(buckets_, bucket_size_);
+      buckets_ = NULL;
+      bucket_size_ = INDEX_MAP_INIT_BUCKETS;
+      update_grow_threshold();
+      if (filter_) {
+          filter_->reset(filter_capacity());
+      }
+      mark_all_changed();
   }
 
   // Return iterator, and a bool value indicating whether the element was successfully inserted or not 
@@ -489,14 +797,22 @@ public:
 
   // Removes the element at pos
   iterator erase(const_iterator pos) {
+      if (buckets_ == NULL) {
+          // The next element moves to pos
+          int value_idx = pos.value_idx;
+          erase_small(value_idx);
+          return value_idx < (int)total_values_ ? iterator(this, 0, value_idx) : end();
+      }
+
       K_T key = pos->first;
-      unsigned int bucket_idx = get_hash_value(key);
+      S_T bucket_idx = get_hash_value(key);
       int value_idx = pos.value_idx;
 
       const_iterator ret = ++pos;
 
       if (buckets_[bucket_idx].erase_by_index(value_idx) != -1) {
           total_values_ -= 1;
+          mark_changed(bucket_idx);
       }
 
       return iterator(ret.pmap, ret.bucket_idx, ret.value_idx);
@@ -513,25 +829,141 @@ public:
 
   // Removes the element with the key equivalent to key
   size_type erase(const K_T &key) {
-      unsigned int bucket_idx = get_hash_value(key);
-      if (buckets_[bucket_idx].erase(key) != -1) {
+      if (buckets_ == NULL) {
+          int value_idx = small_find(key);
+          if (value_idx != -1) {
+              erase_small(value_idx);
+              return 1;
+          }
+          return 0;
+      }
+
+      S_T bucket_idx = get_hash_value(key);
+      if (records_in(bucket_idx) > 0 && buckets_[bucket_idx].erase(key) != -1) {
           total_values_ -= 1;
+          mark_changed(bucket_idx);
           return 1;
       }
       return 0;
   }
 
+  // Removes 'n' keys, the buckets of a block of keys are prefetched before
+  // they are probed. Returns the number of erased keys.
+  size_type erase_batch(const K_T *keys, size_type n) {
+      const size_type block = 16;
+      S_T bucket_idx[block];
+      size_type erased = 0;
+
+      if (buckets_ == NULL) {
+          for (size_type i = 0; i < n; ++i) {
+              erased += erase(keys[i]);
+          }
+          return erased;
+      }
+
+      for (size_type base = 0; base < n; base += block) {
+          size_type len = std::min(block, n - base);
+          for (size_type i = 0; i < len; ++i) {
+              bucket_idx[i] = get_hash_value(keys[base + i]);
+              __builtin_prefetch(&buckets_[bucket_idx[i]]);
+          }
+          for (size_type i = 0; i < len; ++i) {
+              if (records_in(bucket_idx[i]) > 0 && buckets_[bucket_idx[i]].erase(keys[base + i]) != -1) {
+                  erased += 1;
+                  mark_changed(bucket_idx[i]);
+              }
+          }
+      }
+      total_values_ -= erased;
+      return erased;
+  }
+
+  // Removes all the elements for which pred(const std::pair<K_T, V_T> &) is
+  // true, compacting every bucket in place in one sweep.
+  // Returns the number of erased elements.
+  template<typename P>
+  size_type erase_if(P pred) {
+      size_type erased = 0;
+      if (buckets_ == NULL) {
+          S_T kept = 0;
+          for (S_T i = 0; i < total_values_; ++i) {
+              if (!pred(const_cast<const std::pair<K_T, V_T> &>(small_[i]))) {
+                  if (kept != i) {
+                      small_[kept] = small_[i];
+                  }
+                  kept += 1;
+              }
+          }
+          erased = total_values_ - kept;
+          total_values_ = kept;
+          return erased;
+      }
+      for (S_T i = 0; i < bucket_size_; ++i) {
+          if (records_in(i) > 0) {
+              int n = buckets_[i].erase_if(pred);
+              if (n > 0) {
+                  erased += n;
+                  mark_changed(i);
+              }
+          }
+      }
+      total_values_ -= erased;
+      return erased;
+  }
+
+  // Merge the elements of other into the map. The map is sized once for
+  // both, and when the bucket count of other is a multiple of ours its
+  // buckets are merged wholesale without hashing the keys.
+  // Returns the number of keys added.
+  size_type merge(const index_map &other, index_map_merge_policy policy = INDEX_MAP_MERGE_KEEP) {
+      return merge(other, policy_combiner(policy));
+  }
+
+  // combine(V_T &value, const V_T &other_value) resolves a key present in both
+  template<typename F>
+  size_type merge(const index_map &other, F combine) {
+      const index_map *shards[] = { &other };
+      return merge_shards(shards, 1, combine, 1);
+  }
+
+  // Merge n maps at once, with 'threads' threads each owning a range of
+  // buckets. The result is the same as n calls of merge() in order. The
+  // threads grow the record buffers concurrently, so an A_T other than
+  // std::allocator, which may not be thread-safe (e.g. the pmr resources),
+  // merges on one thread.
+  size_type merge_parallel(const index_map *const *shards, size_type n, int threads,
+                           index_map_merge_policy policy = INDEX_MAP_MERGE_KEEP) {
+      return merge_parallel(shards, n, threads, policy_combiner(policy));
+  }
+
+  // combine() is called concurrently, for distinct keys
+  template<typename F>
+  size_type merge_parallel(const index_map *const *shards, size_type n, int threads, F combine) {
+      return merge_shards(shards, n, combine, threads);
+  }
+
   void swap(index_map &other) {
       std::swap(buckets_, other.buckets_);
       std::swap(bucket_size_, other.bucket_size_);
       std::swap(total_values_, other.total_values_);
+      std::swap(max_load_factor_, other.max_load_factor_);
+      std::swap(grow_threshold_, other.grow_threshold_);
+      std::swap(epoch_, other.epoch_);
+      std::swap(filter_, other.filter_);
+      std::swap(small_, other.small_);
+      mark_all_changed();
+      other.mark_all_changed();
+  }
+
+  allocator_type get_allocator() const {
+      return alloc_;
   }
 
   V_T &at(const K_T &key) {
-      unsigned int bucket_idx = get_hash_value(key);
-      int value_idx = buckets_[bucket_idx].find(key);
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
       if (value_idx != -1) {
-          return buckets_[bucket_idx].get_records()[value_idx].second;
+          return records_of(bucket_idx)[value_idx].second;
       } else {
           throw std::out_of_range("Cannot find the key");
       }
@@ -542,21 +974,21 @@ public:
   }
 
   V_T &operator[](const K_T &key) {
-      V_T def_val;
+      V_T def_val = V_T();
       std::pair<iterator, bool> ret = insert(std::make_pair(key, def_val));
       return ret.first->second;
   }
 
   size_type count(const K_T &key) const {
-      unsigned int bucket_idx = get_hash_value(key);
-      int value_idx = buckets_[bucket_idx].find(key);
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
       return (value_idx != -1) ? 1 : 0;
   }
 
   // Find the element by key
   iterator find(const K_T &key) {
-      unsigned int bucket_idx = get_hash_value(key);
-      int value_idx = buckets_[bucket_idx].find(key);
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
       if (value_idx != -1) {
           return iterator(this, bucket_idx, value_idx);
       } else {
@@ -565,8 +997,8 @@ public:
   }
 
   const_iterator find(const K_T &key) const {
-      unsigned int bucket_idx = get_hash_value(key);
-      int value_idx = buckets_[bucket_idx].find(key);
+      S_T bucket_idx;
+      int value_idx = lookup(key, bucket_idx);
       if (value_idx != -1) {
           return const_iterator(this, bucket_idx, value_idx);
       } else {
@@ -574,6 +1006,162 @@ public:
       }
   }
 
+  // Look up 'n' keys at once: values[i] is set to the value of keys[i], or
+  // NULL if it is absent. Bucket addresses are computed and prefetched a
+  // block ahead of the probes. Returns the number of keys found.
+  size_type find_batch(const K_T *keys, size_type n, V_T **values) {
+      const size_type block = 16;
+      S_T bucket_idx[block];
+      size_type hits = 0;
+
+      if (buckets_ == NULL) {
+          for (size_type i = 0; i < n; ++i) {
+              int value_idx = lookup(keys[i], bucket_idx[0]);
+              values[i] = value_idx != -1 ? &small_[value_idx].second : NULL;
+              hits += (value_idx != -1);
+          }
+          return hits;
+      }
+
+      for (size_type base = 0; base < n; base += block) {
+          size_type len = std::min(block, n - base);
+
+          // Filter and prefetch the buckets of the whole block
+          for (size_type i = 0; i < len; ++i) {
+              const K_T &key = keys[base + i];
+              if (filtered_out(key)) {
+                  bucket_idx[i] = bucket_size_;
+              } else {
+                  bucket_idx[i] = get_hash_value(key);
+                  __builtin_prefetch(&buckets_[bucket_idx[i]]);
+              }
+          }
+
+          for (size_type i = 0; i < len; ++i) {
+              values[base + i] = NULL;
+              if (bucket_idx[i] == bucket_size_) {
+                  record_lookup(-1);
+                  continue;
+              }
+              bucket_type &bucket = buckets_[bucket_idx[i]];
+              int value_idx = records_in(bucket_idx[i]) > 0 ? bucket.find(keys[base + i]) : -1;
+              record_lookup(value_idx);
+              if (value_idx != -1) {
+                  values[base + i] = &bucket.get_records()[value_idx].second;
+                  hits += 1;
+              }
+          }
+      }
+      return hits;
+  }
+
+  // Look up 'n' keys for a join: for each key found, append its row and a
+  // copy of its value to rows and values, which must hold n entries. The row
+  // of keys[i] is key_rows[i], or i if key_rows is NULL. The buckets of a
+  // block of keys are prefetched before they are probed, and the inline keys
+  // of a bucket are compared at once (see index_bucket::find_vector).
+  // Returns the number of matches written. See index_map_join.h.
+  size_type probe_batch(const K_T *keys, size_type n, const size_t *key_rows,
+                        size_t *rows, V_T *values) const {
+      const size_type block = 16;
+      S_T bucket_idx[block];
+      const std::pair<K_T, V_T> *hits[2][block];
+      size_type hit_rows[2][block];
+      size_type hit_count[2] = {0, 0};
+      size_type matches = 0;
+
+      if (buckets_ == NULL) {
+          for (size_type i = 0; i < n; ++i) {
+              int value_idx = lookup(keys[i], bucket_idx[0]);
+              if (value_idx != -1) {
+                  rows[matches] = key_rows != NULL ? key_rows[i] : i;
+                  values[matches++] = small_[value_idx].second;
+              }
+          }
+          return matches;
+      }
+
+      for (size_type base = 0; base < n; base += block) {
+          size_type len = std::min(block, n - base);
+          for (size_type i = 0; i < len; ++i) {
+              const K_T &key = keys[base + i];
+              if (filtered_out(key)) {
+                  bucket_idx[i] = bucket_size_;
+              } else {
+                  bucket_idx[i] = get_hash_value(key);
+                  __builtin_prefetch(&buckets_[bucket_idx[i]]);
+              }
+          }
+          // Compare the keys and prefetch the records of the hits. The values
+          // of a block are copied out after the compares of the next block,
+          // so their loads overlap with it
+          size_type cur = (base / block) & 1;
+          hit_count[cur] = 0;
+          for (size_type i = 0; i < len; ++i) {
+              int value_idx = -1;
+              if (bucket_idx[i] != bucket_size_ && records_in(bucket_idx[i]) > 0) {
+                  value_idx = buckets_[bucket_idx[i]].find_vector(keys[base + i]);
+              }
+              record_lookup(value_idx);
+              if (value_idx != -1) {
+                  size_type h = hit_count[cur]++;
+                  hits[cur][h] = buckets_[bucket_idx[i]].get_records() + value_idx;
+                  hit_rows[cur][h] = base + i;
+                  __builtin_prefetch(hits[cur][h]);
+              }
+          }
+          matches = copy_hits(hits[cur ^ 1], hit_rows[cur ^ 1], hit_count[cur ^ 1], key_rows,
+                              rows, values, matches);
+          hit_count[cur ^ 1] = 0;
+      }
+      size_type last = ((n - 1) / block) & 1;
+      matches = copy_hits(hits[last], hit_rows[last], hit_count[last], key_rows,
+                          rows, values, matches);
+      return matches;
+  }
+
+  // Put a negative-lookup filter in front of the buckets: a blocked Bloom
+  // filter with 'bits_per_key' bits per key, maintained on insert. Lookups of
+  // absent keys are then mostly answered without touching a bucket.
+  void enable_filter(double bits_per_key = 10) {
+      delete filter_;
+      filter_ = new negative_lookup_filter(bits_per_key, filter_capacity());
+      fill_filter();
+  }
+
+  void disable_filter() {
+      delete filter_;
+      filter_ = NULL;
+  }
+
+  // Build a static xor filter of the current keys (~9.8 bits/key, 0.4% false
+  // positives) for a map that is not going to change. The next insert drops
+  // it and lookups go back to the Bloom filter.
+  void freeze() {
+      if (filter_ == NULL) {
+          enable_filter();
+      }
+      std::vector<uint64_t> keys;
+      keys.reserve(size());
+      for (S_T idx = 0; idx < bucket_limit(); ++idx) {
+          int record_num = records_in(idx);
+          std::pair<K_T, V_T> *records = records_of(idx);
+          for (int i = 0; i < record_num; ++i) {
+              keys.push_back((uint64_t)records[i].first);
+          }
+      }
+      filter_->freeze(keys.data(), keys.size());
+  }
+
+  // Memory and expected false positive rate of the filter
+  index_map_filter_stats filter_stats() const {
+      if (filter_ == NULL) {
+          index_map_filter_stats s = { "none", 0, 0, 1.0 };
+          return s;
+      }
+      return filter_->stats(size());
+  }
+
   // Returns a range containing all elements with the key
   std::pair<iterator, iterator> equal_range(const K_T &key) {
       iterator it = find(key);
@@ -602,46 +1190,281 @@ public:
   }
 
   size_type max_bucket_count() const {
-      // 2^32 - 1
-      return 4294967295ll;
+      return std::numeric_limits<S_T>::max();
   }
 
   // Returns the number of elements in the bucket with index n
   size_type bucket_size(size_type n) const {
-      if (n < bucket_size_) {
-          return buckets_[n].get_record_num();
+      if (n < bucket_size_ && buckets_ == NULL) {
+          size_type num = 0;
+          for (S_T i = 0; i < total_values_; ++i) {
+              num += (get_hash_value(small_[i].first) == n);
+          }
+          return num;
+      } else if (n < bucket_size_) {
+          return records_in(n);
       } else {
           return -1;
       }
   }
 
+  // Bytes used by the map, its buckets and their record buffers
+  size_type memory_usage() const {
+      size_type bytes = sizeof(*this);
+      for (S_T i = 0; buckets_ != NULL && i < bucket_size_; ++i) {
+          bytes += buckets_[i].memory_usage();
+      }
+      return bytes;
+  }
+
   // Return bucket index for the key
   size_type bucket(const K_T &key) const {
-      unsigned int bucket_idx = get_hash_value(key);
+      S_T bucket_idx = get_hash_value(key);
       return bucket_idx;
   }
 
+  // Average number of elements per bucket
+  float load_factor() const {
+      return bucket_size_ > 0 ? (float)size() / bucket_size_ : 0.0f;
+  }
+
+  float max_load_factor() const {
+      return max_load_factor_;
+  }
+
+  // Set the load factor above which the map grows, rehashing now if it is
+  // already exceeded
+  void max_load_factor(float ml) {
+      assert(ml > 0);
+      max_load_factor_ = ml;
+      update_grow_threshold();
+      if (size() > grow_threshold_) {
+          rehash(0);
+      } else if (filter_) {
+          // Sized for the old threshold
+          filter_->reset(filter_capacity());
+          fill_filter();
+      }
+  }
+
+  // Set the bucket count to n, or to the smallest count that keeps the load
+  // under max_load_factor() if n is less
+  // A small map only records the bucket count to allocate.
+  void rehash(size_type n) {
+      n = std::max(n, min_bucket_count(size()));
+      if (buckets_ == NULL) {
+          bucket_size_ = (S_T)std::min(n, max_bucket_count());
+          update_grow_threshold();
+      } else if (n != bucket_size_) {
+          rehash((S_T)std::min(n, max_bucket_count()), buckets_, bucket_size_, epoch_);
+      }
+  }
+
+  // Make room for n elements without rehashing
+  void reserve(size_type n) {
+      size_type buckets = min_bucket_count(n);
+      if (buckets > bucket_size_) {
+          rehash(buckets);
+      }
+  }
+
+  // Shrink the buckets to the current size and trim every record buffer
+  // to its number of records, e.g. after mass erases
+  void shrink_to_fit() {
+      rehash(0);
+      for (S_T i = 0; buckets_ != NULL && i < bucket_size_; ++i) {
+          live_bucket(i).shrink_to_fit();
+      }
+  }
+
+  // Record the buckets written from now on, so that write_checkpoint()
+  // writes only those (see index_map_checkpoint.h). A value changed through
+  // a reference, from at(), find() or an iterator, is not seen: report it
+  // with touch().
+  void track_changes(bool on = true) {
+      delete changes_;
+      changes_ = on ? new index_map_change_set() : NULL;
+  }
+
+  // Mark the bucket of the key as written
+  void touch(const K_T &key) {
+      if (buckets_ != NULL) {
+          mark_changed(get_hash_value(key));
+      }
+  }
+
+  // Append a checkpoint to out: the buckets written since the previous one,
+  // or a full image if there was none, the map does not track changes or is
+  // small, or it was rehashed or cleared since. Returns the bytes written.
+  size_type write_checkpoint(std::ostream &out) {
+      static_assert(std::is_trivially_copyable<K_T>::value && std::is_trivially_copyable<V_T>::value,
+                    "checkpoints store keys and values as raw bytes");
+      bool full = changes_ == NULL || changes_->is_full() || buckets_ == NULL;
+      index_map_checkpoint_header header;
+      header.magic = INDEX_MAP_CHECKPOINT_MAGIC;
+      header.kind = full ? INDEX_MAP_CHECKPOINT_FULL : INDEX_MAP_CHECKPOINT_DELTA;
+      header.key_size = sizeof(K_T);
+      header.value_size = sizeof(V_T);
+      header.extent = buckets_ != NULL ? bucket_size_ : 0;
+      header.entries = 0;
+      header.payload_bytes = 0;
+
+      // Sized first, the header comes before the buckets
+      for_each_checkpoint_bucket(full, [&](S_T idx) {
+          header.entries += 1;
+          header.payload_bytes += sizeof(uint64_t) + sizeof(uint32_t) +
+                                  records_in(idx) * sizeof(std::pair<K_T, V_T>);
+      });
+      // A bucket is written as its index, its record count and its records
+      index_map_checkpoint_writer writer(out, header);
+      for_each_checkpoint_bucket(full, [&](S_T idx) {
+          writer.put((uint64_t)idx);
+          writer.put((uint32_t)records_in(idx));
+          writer.put_bytes(records_of(idx), records_in(idx) * sizeof(std::pair<K_T, V_T>));
+      });
+      size_type bytes = writer.finish();
+      if (changes_) {
+          changes_->reset();
+      }
+      return bytes;
+  }
+
+  // Replace the contents of the map with the full image at the start of in
+  // and the deltas that follow it, with the bucket count of the image.
+  // Stops at the end of the stream or at a truncated or corrupt checkpoint,
+  // and returns the number of checkpoints applied. Throws
+  // std::runtime_error if a delta does not follow the image.
+  size_type load_checkpoints(std::istream &in) {
+      static_assert(std::is_trivially_copyable<K_T>::value && std::is_trivially_copyable<V_T>::value,
+                    "checkpoints store keys and values as raw bytes");
+      index_map_checkpoint_reader reader(in, sizeof(K_T), sizeof(V_T));
+      std::vector<std::pair<K_T, V_T> > records;
+      size_type applied = 0;
+      release();
+      while (reader.next()) {
+          const index_map_checkpoint_header &header = reader.get_header();
+          if (header.kind == INDEX_MAP_CHECKPOINT_FULL) {
+              release();
+              if (header.extent > max_bucket_count()) {
+                  throw std::runtime_error("index_map: checkpoint has more buckets than S_T can index");
+              }
+              if (header.extent > 0) {
+                  allocate_buckets((S_T)header.extent);
+              }
+          } else if (applied == 0 || buckets_ == NULL || header.extent != bucket_size_) {
+              throw std::runtime_error("index_map: checkpoint delta does not follow the loaded image");
+          }
+          for (uint64_t e = 0; e < header.entries; ++e) {
+              uint64_t idx = reader.get<uint64_t>();
+              uint32_t n = reader.get<uint32_t>();
+              records.resize(n);
+              reader.get_bytes(records.data(), n * sizeof(std::pair<K_T, V_T>));
+              if (buckets_ == NULL) {
+                  // The image of a small map
+                  for (uint32_t i = 0; i < n; ++i) {
+                      insert_key_value(records[i].first, records[i].second);
+                  }
+                  continue;
+              }
+              if (idx >= bucket_size_) {
+                  throw std::runtime_error("index_map: malformed checkpoint");
+              }
+              total_values_ -= records_in((S_T)idx);
+              if (size() + n > max_size()) {
+                  throw std::runtime_error("index_map: checkpoint has more values than S_T can count");
+              }
+              bucket_type &bucket = live_bucket((S_T)idx);
+              bucket.renew(epoch_);
+              bucket.append_nocheck(records.data(), n);
+              total_values_ += n;
+          }
+          applied += 1;
+      }
+      if (filter_) {
+          filter_->reset(filter_capacity());
+          fill_filter();
+      }
+      // The next checkpoint of this map follows the loaded ones
+      if (changes_) {
+          changes_->reset();
+      }
+      return applied;
+  }
+
 private:
-  void allocate_buckets(unsigned int bucket_size) {
-      buckets_ = new index_bucket<K_T, V_T>[bucket_size];
+  // Every bucket gets a copy of the allocator for its record buffer
+  void allocate_buckets(S_T bucket_size) {
+      bucket_allocator alloc(alloc_);
+      buckets_ = bucket_traits::allocate(alloc, bucket_size);
+      for (S_T i = 0; i < bucket_size; ++i) {
+          bucket_traits::construct(alloc, buckets_ + i, alloc_);
+      }
       bucket_size_ = bucket_size;
+      epoch_ = 0;
+      update_grow_threshold();
+      mark_all_changed();
+  }
+
+  // The map grows once its size exceeds this. At max_bucket_count() it has
+  // nothing to grow to, only the size limit is left.
+  void update_grow_threshold() {
+      double threshold = (double)max_load_factor_ * bucket_size_;
+      if (bucket_size_ >= max_bucket_count()) {
+          threshold = std::numeric_limits<S_T>::max();
+      }
+      grow_threshold_ = (S_T)std::min(threshold, (double)std::numeric_limits<S_T>::max());
+  }
+
+  // Fewest buckets holding n elements under max_load_factor()
+  size_type min_bucket_count(size_type n) const {
+      return (size_type)std::ceil(n / (double)max_load_factor_) + 1;
   }
 
-  void free_buckets(index_bucket<K_T, V_T> *buckets) {
-      delete[] buckets;
+  void free_buckets(bucket_type *buckets, S_T bucket_size) {
+      if (buckets == NULL) {
+          return;
+      }
+      bucket_allocator alloc(alloc_);
+      for (S_T i = 0; i < bucket_size; ++i) {
+          bucket_traits::destroy(alloc, buckets + i);
+      }
+      bucket_traits::deallocate(alloc, buckets, bucket_size);
   }
 
   std::pair<iterator, bool> insert_key_value(const K_T key, const V_T &val) {
-      // TODO: adjust the value?
-      if (size() * 2 > bucket_size_) {
-          rehash(2 * bucket_size_ + 1, buckets_, bucket_size_);
+      // total_values_ would wrap around S_T
+      if (unlikely(size() == max_size()) && count(key) == 0) {
+          throw std::length_error("index_map: more values than S_T can count");
+      }
+      if (buckets_ == NULL) {
+          int value_idx = small_find(key);
+          if (value_idx != -1) {
+              return std::make_pair(iterator(this, 0, value_idx), false);
+          }
+          if (total_values_ < small_capacity) {
+              small_[total_values_].first = key;
+              small_[total_values_].second = val;
+              total_values_ += 1;
+              if (filter_) {
+                  filter_->add((uint64_t)key);
+              }
+              return std::make_pair(iterator(this, 0, total_values_ - 1), true);
+          }
+          promote(std::max<size_type>(bucket_size_, min_bucket_count(size() + 1)));
+      }
+
+      if (unlikely(size() > grow_threshold_)) {
+          rehash(next_bucket_count(), buckets_, bucket_size_, epoch_);
       }
 
-      unsigned int bucket_idx = get_hash_value(key);
+      S_T bucket_idx = get_hash_value(key);
 
-      std::pair<int, bool> ret = buckets_[bucket_idx].insert(key, val);
+      std::pair<int, bool> ret = writable_bucket(bucket_idx).insert(key, val);
       if (ret.second) {
           total_values_ += 1;
+          if (filter_) {
+              filter_->add((uint64_t)key);
+          }
       }
 
       int value_idx = ret.first;
@@ -649,42 +1472,400 @@ private:
       return std::make_pair(iterator(this, bucket_idx, value_idx), ret.second);
   }
 
-  void rehash(unsigned int new_bktsize, index_bucket<K_T, V_T> *src_buckets, unsigned int src_bktsize) {
-      index_bucket<K_T, V_T> *origin_buckets = buckets_;
+  // src_epoch: generation of the live buckets in src_buckets
+  void rehash(S_T new_bktsize, bucket_type *src_buckets, S_T src_bktsize, uint32_t src_epoch) {
+      INDEX_MAP_STAT_INC(rehashes);
+      INDEX_MAP_STAT_TIMER(rehash_ns);
+
+      bucket_type *origin_buckets = buckets_;
+      S_T origin_size = bucket_size_;
 
       allocate_buckets(new_bktsize);
+      if (filter_) {
+          filter_->reset(filter_capacity());
+      }
 
-      unsigned int values = 0;
+      S_T values = 0;
 
       // Copy values to the new buckets
-      for (unsigned int idx = 0; idx < src_bktsize; ++idx) {
+      for (S_T idx = 0; idx < src_bktsize; ++idx) {
+          if (src_buckets[idx].get_generation() != src_epoch) {
+              continue;
+          }
           int record_num = src_buckets[idx].get_record_num();
           std::pair<K_T, V_T> *records = src_buckets[idx].get_records();
           for (int i = 0; i < record_num; ++i) {
-              unsigned int bucket_idx = get_hash_value(records[i].first);
+              S_T bucket_idx = get_hash_value(records[i].first);
               buckets_[bucket_idx].insert_nocheck(records[i].first, records[i].second);
+              if (filter_) {
+                  filter_->add((uint64_t)records[i].first);
+              }
               values += 1;
           }
       }
 
       total_values_ = values;
 
-      free_buckets(origin_buckets);
+      free_buckets(origin_buckets, origin_size);
+  }
+
+  // Allocate n buckets and move the elements of the inline array to them
+  void promote(size_type n) {
+      allocate_buckets((S_T)std::min(n, max_bucket_count()));
+      for (S_T i = 0; i < total_values_; ++i) {
+          buckets_[get_hash_value(small_[i].first)].insert_nocheck(small_[i].first, small_[i].second);
+          small_[i] = std::pair<K_T, V_T>();
+      }
+  }
+
+  // Index of the key in the inline array, -1 means not found
+  int small_find(const K_T &key) const {
+      for (S_T i = 0; i < total_values_; ++i) {
+          if (small_[i].first == key) {
+              INDEX_MAP_STAT_ADD(inline_probes, i + 1);
+              return (int)i;
+          }
+      }
+      INDEX_MAP_STAT_ADD(inline_probes, total_values_);
+      return -1;
+  }
+
+  // Shift the following elements of the inline array down, keeping their order
+  void erase_small(int idx) {
+      std::move(small_ + idx + 1, small_ + total_values_, small_ + idx);
+      total_values_ -= 1;
+  }
+
+  // Buckets visited by the iterators: a small map is one bucket, its inline array
+  S_T bucket_limit() const {
+      return buckets_ != NULL ? bucket_size_ : 1;
+  }
+
+  std::pair<K_T, V_T> *records_of(S_T idx) {
+      return buckets_ != NULL ? buckets_[idx].get_records() : small_;
+  }
+
+  const std::pair<K_T, V_T> *records_of(S_T idx) const {
+      return buckets_ != NULL ? buckets_[idx].get_records() : small_;
+  }
+
+  // Records in the bucket, 0 for a bucket left over from before a clear()
+  int records_in(S_T idx) const {
+      if (buckets_ == NULL) {
+          return total_values_;
+      }
+      const bucket_type &bucket = buckets_[idx];
+      return likely(bucket.get_generation() == epoch_) ? bucket.get_record_num() : 0;
+  }
+
+  // The bucket, emptied first if it is left over from before a clear()
+  bucket_type &live_bucket(S_T idx) {
+      bucket_type &bucket = buckets_[idx];
+      if (unlikely(bucket.get_generation() != epoch_)) {
+          bucket.renew(epoch_);
+      }
+      return bucket;
+  }
+
+  // live_bucket(), recorded as written for the next checkpoint
+  bucket_type &writable_bucket(S_T idx) {
+      mark_changed(idx);
+      return live_bucket(idx);
+  }
+
+  void mark_changed(S_T idx) {
+      if (unlikely(changes_ != NULL)) {
+          changes_->mark(idx);
+      }
+  }
+
+  void mark_all_changed() {
+      if (changes_ != NULL) {
+          changes_->mark_all();
+      }
+  }
+
+  // Call f(idx) for the buckets of a checkpoint: the non-empty ones for a
+  // full image (the inline array of a small map as bucket 0), the written
+  // ones for a delta
+  template<typename F>
+  void for_each_checkpoint_bucket(bool full, F f) {
+      if (!full) {
+          changes_->for_each(bucket_size_, [&](uint64_t idx) { f((S_T)idx); });
+          return;
+      }
+      for (S_T idx = 0; idx < bucket_limit(); ++idx) {
+          if (records_in(idx) > 0) {
+              f(idx);
+          }
+      }
+  }
+
+  // Find the record of the key, set bucket_idx to its bucket.
+  // Returns the index inside the bucket, -1 means not found.
+  int lookup(const K_T &key, S_T &bucket_idx) const {
+      if (filtered_out(key)) {
+          record_lookup(-1);
+          return -1;
+      }
+      if (buckets_ == NULL) {
+          bucket_idx = 0;
+          int value_idx = small_find(key);
+          record_lookup(value_idx);
+          return value_idx;
+      }
+      bucket_idx = get_hash_value(key);
+      int value_idx = records_in(bucket_idx) > 0 ? buckets_[bucket_idx].find(key) : -1;
+      record_lookup(value_idx);
+      return value_idx;
+  }
+
+  // Add every key to the filter
+  void fill_filter() {
+      for (S_T idx = 0; idx < bucket_limit(); ++idx) {
+          int record_num = records_in(idx);
+          std::pair<K_T, V_T> *records = records_of(idx);
+          for (int i = 0; i < record_num; ++i) {
+              filter_->add((uint64_t)records[i].first);
+          }
+      }
+  }
+
+  // The combine function of a merge policy
+  struct policy_combiner {
+      explicit policy_combiner(index_map_merge_policy policy): overwrite(policy == INDEX_MAP_MERGE_OVERWRITE) {}
+      void operator()(V_T &value, const V_T &other_value) const {
+          if (overwrite) {
+              value = other_value;
+          }
+      }
+      bool overwrite;
+  };
+
+  template<typename F>
+  size_type merge_shards(const index_map *const *shards, size_type n, F combine, int threads) {
+      size_type before = size();
+      size_type total = size();
+      // Bucket count shared by the shards, 1 if they differ
+      S_T shard_buckets = 0;
+      for (size_type s = 0; s < n; ++s) {
+          if (shards[s] == this) {
+              continue;
+          }
+          total += shards[s]->size();
+          if (shards[s]->buckets_ != NULL) {
+              shard_buckets = shard_buckets == 0 || shard_buckets == shards[s]->bucket_size_ ?
+                              shards[s]->bucket_size_ : 1;
+          }
+      }
+
+      // The keys present in several maps are only counted once merged, the
+      // sum of the sizes must fit anyway
+      if (total > max_size()) {
+          throw std::length_error("index_map: more values than S_T can count");
+      }
+
+      // Everything fits in the inline array
+      if (buckets_ == NULL && total <= small_capacity) {
+          for (size_type s = 0; s < n; ++s) {
+              const index_map &shard = *shards[s];
+              for (S_T idx = 0; &shard != this && idx < shard.bucket_limit(); ++idx) {
+                  int record_num = shard.records_in(idx);
+                  const std::pair<K_T, V_T> *records = shard.records_of(idx);
+                  for (int i = 0; i < record_num; ++i) {
+                      std::pair<iterator, bool> ret = insert_key_value(records[i].first, records[i].second);
+                      if (!ret.second) {
+                          combine(ret.first->second, records[i].second);
+                      }
+                  }
+              }
+          }
+          return size() - before;
+      }
+
+      // Size the buckets once, to the common bucket count of the shards if
+      // it is large enough. A map that grows at least doubles, as on insert,
+      // so a series of merges does not rehash every time.
+      size_type need = min_bucket_count(total);
+      if (buckets_ == NULL || bucket_size_ < need) {
+          size_type grown = buckets_ == NULL ? need : std::max<size_type>(need, 2 * (size_type)bucket_size_ + 1);
+          size_type target = shard_buckets >= need ? shard_buckets : std::max<size_type>(grown, bucket_size_);
+          target = std::min(target, max_bucket_count());
+          if (buckets_ == NULL) {
+              promote(target);
+          } else if (target > bucket_size_) {
+              rehash((S_T)target, buckets_, bucket_size_, epoch_);
+          }
+      }
+
+      if (!std::is_same<A_T, std::allocator<std::pair<K_T, V_T> > >::value) {
+          threads = 1;
+      }
+      int workers = (int)std::max<size_type>(1, std::min<size_type>(threads, bucket_size_));
+      std::vector<size_type> added(workers, 0);
+      if (workers == 1) {
+          added[0] = merge_range(shards, n, combine, 0, bucket_size_);
+      } else {
+          std::vector<std::thread> pool;
+          for (int t = 0; t < workers; ++t) {
+              S_T lo = (S_T)((uint64_t)bucket_size_ * t / workers);
+              S_T hi = (S_T)((uint64_t)bucket_size_ * (t + 1) / workers);
+              pool.push_back(std::thread([this, shards, n, combine, lo, hi, t, &added]() {
+                  added[t] = merge_range(shards, n, combine, lo, hi);
+              }));
+          }
+          for (int t = 0; t < workers; ++t) {
+              pool[t].join();
+          }
+      }
+      for (int t = 0; t < workers; ++t) {
+          total_values_ += (S_T)added[t];
+      }
+      // The workers share the change bitmap, the merged buckets are not
+      // marked one by one
+      mark_all_changed();
+
+      // The filter is not thread-safe, it is filled again afterwards
+      if (filter_) {
+          filter_->reset(filter_capacity());
+          fill_filter();
+      }
+      return size() - before;
+  }
+
+  // Merge the records of the shards that fall in the buckets [lo, hi).
+  // Returns the number of keys added.
+  template<typename F>
+  size_type merge_range(const index_map *const *shards, size_type n, F combine, S_T lo, S_T hi) {
+      size_type added = 0;
+      for (size_type s = 0; s < n; ++s) {
+          const index_map &shard = *shards[s];
+          if (&shard == this) {
+              continue;
+          }
+          if (shard.buckets_ != NULL && shard.bucket_size_ % bucket_size_ == 0) {
+              // The keys of bucket i of the shard all hash to bucket
+              // i % bucket_size_ here
+              for (size_type base = 0; base < shard.bucket_size_; base += bucket_size_) {
+                  for (S_T idx = lo; idx < hi; ++idx) {
+                      added += merge_records(idx, shard.records_of((S_T)(base + idx)),
+                                             shard.records_in((S_T)(base + idx)), combine);
+                  }
+              }
+          } else {
+              for (S_T idx = 0; idx < shard.bucket_limit(); ++idx) {
+                  int record_num = shard.records_in(idx);
+                  const std::pair<K_T, V_T> *records = shard.records_of(idx);
+                  for (int i = 0; i < record_num; ++i) {
+                      S_T bucket_idx = get_hash_value(records[i].first);
+                      if (bucket_idx >= lo && bucket_idx < hi) {
+                          added += merge_records(bucket_idx, records + i, 1, combine);
+                      }
+                  }
+              }
+          }
+      }
+      return added;
   }
 
-  unsigned int get_hash_value(const K_T key) const {
-      return (unsigned int)(key % bucket_size_);
+  // Merge records into a bucket. Those of an empty bucket are appended
+  // wholesale, as the keys of a map are distinct.
+  template<typename F>
+  size_type merge_records(S_T idx, const std::pair<K_T, V_T> *records, int n, F &combine) {
+      if (n == 0) {
+          return 0;
+      }
+      bucket_type &bucket = live_bucket(idx);
+      if (bucket.get_record_num() == 0) {
+          bucket.append_nocheck(records, n);
+          return n;
+      }
+      size_type added = 0;
+      for (int i = 0; i < n; ++i) {
+          std::pair<int, bool> ret = bucket.insert(records[i].first, records[i].second);
+          if (ret.second) {
+              added += 1;
+          } else {
+              combine(bucket.get_records()[ret.first].second, records[i].second);
+          }
+      }
+      return added;
+  }
+
+  // Whether the filter proves that the key is absent
+  bool filtered_out(const K_T &key) const {
+      if (filter_ != NULL && !filter_->may_contain((uint64_t)key)) {
+          INDEX_MAP_STAT_INC(filter_negatives);
+          return true;
+      }
+      return false;
+  }
+
+  // Keys the filter is sized for: the map grows past max_load_factor() keys
+  // per bucket
+  size_type filter_capacity() const {
+      return std::max<size_type>((size_type)((double)max_load_factor_ * bucket_size_), size()) + 1;
+  }
+
+  // Account a lookup in the stats, compiles to nothing when stats are off
+  void record_lookup(int value_idx) const {
+      INDEX_MAP_STAT_INC(finds);
+      if (value_idx != -1) {
+          INDEX_MAP_STAT_INC(hits);
+      } else {
+          INDEX_MAP_STAT_INC(misses);
+      }
+      (void)value_idx;
+  }
+
+  // Append the rows and values of 'count' hits of probe_batch() at 'matches'
+  static size_type copy_hits(const std::pair<K_T, V_T> *const *hits, const size_type *hit_rows,
+                             size_type count, const size_t *key_rows, size_t *rows, V_T *values,
+                             size_type matches) {
+      for (size_type h = 0; h < count; ++h) {
+          rows[matches] = key_rows != NULL ? key_rows[hit_rows[h]] : hit_rows[h];
+          values[matches++] = hits[h]->second;
+      }
+      return matches;
+  }
+
+  // Grow to 2n+1 buckets, computed in size_type so it cannot wrap around S_T
+  S_T next_bucket_count() const {
+      size_type n = std::max(2 * (size_type)bucket_size_ + 1, min_bucket_count(size() + 1));
+      return (S_T)std::min(n, max_bucket_count());
+  }
+
+  // Negative keys are taken modulo 2^64 so that the index is in range
+  S_T get_hash_value(const K_T key) const {
+      return (S_T)((uint64_t)key % bucket_size_);
   }
 
 private:
-  unsigned int total_values_;
-  unsigned int bucket_size_;
-  index_bucket<K_T, V_T> *buckets_;
+  S_T total_values_;
+  S_T bucket_size_;
+  float max_load_factor_;
+  // Size above which the map grows: max_load_factor_ * bucket_size_
+  S_T grow_threshold_;
+  // Generation of the live buckets, bumped by clear()
+  uint32_t epoch_;
+  A_T alloc_;
+  // NULL until the map outgrows small_
+  bucket_type *buckets_;
+  // Optional negative-lookup filter, NULL when disabled
+  negative_lookup_filter *filter_;
+  // Buckets written since the last checkpoint, NULL unless track_changes()
+  index_map_change_set *changes_;
+
+  // Elements of a small map, between 1 and 16 pairs in INDEX_MAP_SMALL_BYTES.
+  // They are scanned linearly while buckets_ is NULL.
+  static const S_T small_pairs = INDEX_MAP_SMALL_BYTES / sizeof(std::pair<K_T, V_T>);
+  static const S_T small_capacity = small_pairs < 1 ? 1 : (small_pairs > 16 ? 16 : small_pairs);
+  std::pair<K_T, V_T> small_[small_capacity];
 };
 
-template<typename K_T, typename V_T>
-bool operator==(const index_map<K_T, V_T>& lhs, 
-                const index_map<K_T, V_T>& rhs) {
+template<typename K_T, typename V_T, typename S_T, typename A_T>
+bool operator==(const index_map<K_T, V_T, S_T, A_T>& lhs,
+                const index_map<K_T, V_T, S_T, A_T>& rhs) {
     if (lhs.size() != rhs.size()) {
         return false;
     }
@@ -695,8 +1876,425 @@ bool operator==(const index_map<K_T, V_T>& lhs,
     }
     return true;
 }
-template<typename K_T, typename V_T>
-bool operator!=(const index_map<K_T, V_T>& lhs, 
-                const index_map<K_T, V_T>& rhs) {
+template<typename K_T, typename V_T, typename S_T, typename A_T>
+bool operator!=(const index_map<K_T, V_T, S_T, A_T>& lhs,
+                const index_map<K_T, V_T, S_T, A_T>& rhs) {
     return !operator==(lhs, rhs);
 }
+
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+
+// index_map on a std::pmr::memory_resource, e.g. a monotonic arena
+template<typename K_T, typename V_T, typename S_T = uint32_t>
+using pmr_index_map = index_map<K_T, V_T, S_T, std::pmr::polymorphic_allocator<std::pair<K_T, V_T> > >;
+#endif
+
+// Bucket of index_set: keys only, no values. The keys stay inline while they
+// fit, then all of them move to one heap array, so they are always contiguous.
+template<typename K_T>
+class index_set_bucket {
+public:
+  index_set_bucket() {
+    key_num = 0;
+    key_capacity = 0;
+  }
+
+  ~index_set_bucket() {
+    if (key_capacity > 0) {
+      delete[] keys;
+    }
+  }
+
+  // Returns a pair consisting of the key index and a bool denoting
+  // whether could do the insertion
+  std::pair<int, bool> insert(const K_T &key) {
+    int idx = find(key);
+    if (idx != -1) {
+      return std::make_pair(idx, false);
+    }
+    return std::make_pair(insert_nocheck(key), true);
+  }
+
+  // Return the index of the new key
+  int insert_nocheck(const K_T &key) {
+    if (key_capacity == 0) {
+      if (key_num < inline_capacity) {
+        k[key_num] = key;
+        return key_num++;
+      }
+      move_to_heap(inline_capacity * 2);
+    } else if (key_num == key_capacity) {
+      move_to_heap(key_capacity * 2);
+    }
+    keys[key_num] = key;
+    return key_num++;
+  }
+
+  // Compare all keys without an early exit, so the loop can be vectorized
+  bool contains(const K_T &key) const {
+    const K_T *d = data();
+    bool found = false;
+    for (uint32_t i = 0; i < key_num; ++i) {
+      found |= (d[i] == key);
+    }
+    INDEX_MAP_STAT_ADD(inline_probes, key_num);
+    return found;
+  }
+
+  // Return the index of the key, -1 means not found
+  int find(const K_T &key) const {
+    const K_T *d = data();
+    for (uint32_t i = 0; i < key_num; ++i) {
+      if (d[i] == key) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Erase the key, the last key takes its place
+  // Return the index of the erased key, -1 means key not found
+  int erase(const K_T &key) {
+    int idx = find(key);
+    if (idx != -1) {
+      erase_by_index(idx);
+    }
+    return idx;
+  }
+
+  void erase_by_index(int idx) {
+    K_T *d = data();
+    d[idx] = d[key_num - 1];
+    key_num -= 1;
+
+    // Back to the inline keys
+    if (key_capacity > 0 && key_num <= (uint32_t)inline_capacity) {
+      K_T *old_keys = keys;
+      key_capacity = 0;
+      memcpy(k, old_keys, key_num * sizeof(K_T));
+      delete[] old_keys;
+    }
+  }
+
+  int get_key_num() const {
+    return key_num;
+  }
+
+  K_T *data() {
+    return key_capacity > 0 ? keys : k;
+  }
+
+  const K_T *data() const {
+    return key_capacity > 0 ? keys : k;
+  }
+
+  // Bytes used by the bucket, including its key buffer
+  size_t memory_usage() const {
+    return sizeof(*this) + key_capacity * sizeof(K_T);
+  }
+
+private:
+  void move_to_heap(uint32_t capacity) {
+    INDEX_MAP_STAT_INC(enlarge_buffers);
+    K_T *new_keys = new K_T[capacity];
+    memcpy(new_keys, data(), key_num * sizeof(K_T));
+    if (key_capacity > 0) {
+      delete[] keys;
+    }
+    keys = new_keys;
+    key_capacity = capacity;
+  }
+
+  // Not copyable, the key buffer is owned
+  index_set_bucket(const index_set_bucket &);
+  index_set_bucket &operator=(const index_set_bucket &);
+
+private:
+  // 24 bytes of inline keys: 3 uint64_t, 6 uint32_t
+  static const int inline_capacity = sizeof(K_T) < 24 ? 24 / sizeof(K_T) : 1;
+
+  // Total keys inside the bucket
+  uint32_t key_num;
+  // The capacity of 'keys', 0 while the keys are inline
+  uint32_t key_capacity;
+  union {
+    K_T k[inline_capacity];
+    K_T *keys;
+  };
+};
+
+// A set with the bucket layout of index_map, storing only keys.
+// Buckets hold up to 2 keys on average before the set grows, which keeps
+// most keys inline and the memory per key near sizeof(K_T) + 16 bytes.
+template<typename K_T, typename S_T = uint32_t>
+class index_set {
+public:
+      class _Iterator;
+      typedef          K_T                       key_type;
+      typedef          K_T                       value_type;
+      typedef typename std::size_t               size_type;
+      typedef          S_T                       index_type;
+      typedef          _Iterator                 iterator;
+      typedef          _Iterator                 const_iterator;
+
+public:
+  index_set(): index_set(INDEX_MAP_INIT_BUCKETS) {}
+
+  index_set(size_type bucket_size):
+      total_keys_(0),
+      bucket_size_(bucket_size),
+      buckets_(new index_set_bucket<K_T>[bucket_size]) {
+  }
+
+  index_set(std::initializer_list<K_T> init): index_set() {
+      insert(init.begin(), init.end());
+  }
+
+  index_set(const index_set &other): index_set(other.bucket_size_) {
+      insert(other.begin(), other.end());
+  }
+
+  index_set(index_set &&other):
+      total_keys_(other.total_keys_),
+      bucket_size_(other.bucket_size_),
+      buckets_(other.buckets_) {
+      other.total_keys_ = 0;
+      other.bucket_size_ = 0;
+      other.buckets_ = NULL;
+  }
+
+  index_set &operator=(index_set other) {
+      swap(other);
+      return *this;
+  }
+
+  virtual ~index_set() {
+      delete[] buckets_;
+  }
+
+  // Keys can't be modified in place, so there is only a const iterator
+  class _Iterator {
+      public:
+          _Iterator(const index_set *_pset, S_T _bucket_idx, int _key_idx) :
+              pset(_pset), bucket_idx(_bucket_idx), key_idx(_key_idx) {
+          }
+          const K_T &operator*() const {
+              return pset->buckets_[bucket_idx].data()[key_idx];
+          }
+          const K_T *operator->() const {
+              return &operator*();
+          }
+          bool operator==(const _Iterator &it) const {
+              return bucket_idx == it.bucket_idx && key_idx == it.key_idx && pset == it.pset;
+          }
+          bool operator!=(const _Iterator &it) const {
+              return !operator==(it);
+          }
+          _Iterator &operator++() {
+              incr();
+              return *this;
+          }
+          _Iterator operator++(int) {
+              _Iterator __tmp(*this);
+              incr();
+              return __tmp;
+          }
+
+      private:
+          void incr() {
+              if (key_idx + 1 < pset->buckets_[bucket_idx].get_key_num()) {
+                  key_idx += 1;
+                  return;
+              }
+              key_idx = 0;
+              bucket_idx = pset->next_nonempty_bucket(bucket_idx + 1);
+          }
+
+      private:
+          const index_set *pset;
+          S_T bucket_idx;
+          int key_idx;
+
+          friend class index_set;
+  };
+
+  iterator begin() const {
+      return iterator(this, next_nonempty_bucket(0), 0);
+  }
+
+  iterator end() const {
+      return iterator(this, bucket_size_, 0);
+  }
+
+  bool empty() const {
+      return size() == 0;
+  }
+
+  size_type size() const {
+      return total_keys_;
+  }
+
+  size_type max_size() const {
+      return std::numeric_limits<S_T>::max();
+  }
+
+  // Remove all the keys
+  void clear() {
+      delete[] buckets_;
+      bucket_size_ = INDEX_MAP_INIT_BUCKETS;
+      buckets_ = new index_set_bucket<K_T>[bucket_size_];
+      total_keys_ = 0;
+  }
+
+  // Return iterator, and a bool value indicating whether the key was successfully inserted or not
+  std::pair<iterator, bool> insert(const K_T &key) {
+      if (unlikely(size() == max_size()) && count(key) == 0) {
+          throw std::length_error("index_set: more keys than S_T can count");
+      }
+      if (size() >= 2 * (size_type)bucket_size_ && bucket_size_ < max_size()) {
+          rehash(next_bucket_count());
+      }
+      S_T bucket_idx = get_hash_value(key);
+      std::pair<int, bool> ret = buckets_[bucket_idx].insert(key);
+      if (ret.second) {
+          total_keys_ += 1;
+      }
+      return std::make_pair(iterator(this, bucket_idx, ret.first), ret.second);
+  }
+
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) {
+      for (InputIt it = first; it != last; ++it) {
+          insert(*it);
+      }
+  }
+
+  // Removes the key
+  size_type erase(const K_T &key) {
+      if (buckets_[get_hash_value(key)].erase(key) != -1) {
+          total_keys_ -= 1;
+          return 1;
+      }
+      return 0;
+  }
+
+  // Removes the key at pos, returns the iterator to the next key
+  iterator erase(iterator pos) {
+      buckets_[pos.bucket_idx].erase_by_index(pos.key_idx);
+      total_keys_ -= 1;
+      // The last key of the bucket moved into the erased slot
+      if (pos.key_idx < buckets_[pos.bucket_idx].get_key_num()) {
+          return pos;
+      }
+      return iterator(this, next_nonempty_bucket(pos.bucket_idx + 1), 0);
+  }
+
+  void swap(index_set &other) {
+      std::swap(total_keys_, other.total_keys_);
+      std::swap(bucket_size_, other.bucket_size_);
+      std::swap(buckets_, other.buckets_);
+  }
+
+  size_type count(const K_T &key) const {
+      bool found = buckets_[get_hash_value(key)].contains(key);
+      record_lookup(found);
+      return found ? 1 : 0;
+  }
+
+  iterator find(const K_T &key) const {
+      S_T bucket_idx = get_hash_value(key);
+      int key_idx = buckets_[bucket_idx].find(key);
+      record_lookup(key_idx != -1);
+      return key_idx != -1 ? iterator(this, bucket_idx, key_idx) : end();
+  }
+
+  // Membership of 'n' keys at once: found[i] is set to whether keys[i] is
+  // in the set. The buckets of a block are prefetched before they are
+  // scanned. Returns the number of keys found.
+  size_type count_batch(const K_T *keys, size_type n, bool *found) const {
+      const size_type block = 16;
+      S_T bucket_idx[block];
+      size_type hits = 0;
+
+      for (size_type base = 0; base < n; base += block) {
+          size_type len = std::min(block, n - base);
+          for (size_type i = 0; i < len; ++i) {
+              bucket_idx[i] = get_hash_value(keys[base + i]);
+              __builtin_prefetch(&buckets_[bucket_idx[i]]);
+          }
+          for (size_type i = 0; i < len; ++i) {
+              found[base + i] = buckets_[bucket_idx[i]].contains(keys[base + i]);
+              record_lookup(found[base + i]);
+              hits += found[base + i];
+          }
+      }
+      return hits;
+  }
+
+  size_type bucket_count() const {
+      return bucket_size_;
+  }
+
+  // Bytes used by the buckets and their key buffers
+  size_type memory_usage() const {
+      size_type bytes = sizeof(*this);
+      for (S_T i = 0; i < bucket_size_; ++i) {
+          bytes += buckets_[i].memory_usage();
+      }
+      return bytes;
+  }
+
+private:
+  S_T next_nonempty_bucket(S_T from) const {
+      while (from < bucket_size_ && buckets_[from].get_key_num() == 0) {
+          ++from;
+      }
+      return from;
+  }
+
+  void rehash(S_T new_bktsize) {
+      INDEX_MAP_STAT_INC(rehashes);
+      INDEX_MAP_STAT_TIMER(rehash_ns);
+
+      index_set_bucket<K_T> *old_buckets = buckets_;
+      S_T old_bktsize = bucket_size_;
+      buckets_ = new index_set_bucket<K_T>[new_bktsize];
+      bucket_size_ = new_bktsize;
+
+      for (S_T idx = 0; idx < old_bktsize; ++idx) {
+          int key_num = old_buckets[idx].get_key_num();
+          const K_T *keys = old_buckets[idx].data();
+          for (int i = 0; i < key_num; ++i) {
+              buckets_[get_hash_value(keys[i])].insert_nocheck(keys[i]);
+          }
+      }
+      delete[] old_buckets;
+  }
+
+  void record_lookup(bool found) const {
+      INDEX_MAP_STAT_INC(finds);
+      if (found) {
+          INDEX_MAP_STAT_INC(hits);
+      } else {
+          INDEX_MAP_STAT_INC(misses);
+      }
+  }
+
+  S_T next_bucket_count() const {
+      size_type n = 2 * (size_type)bucket_size_ + 1;
+      return (S_T)std::min(n, max_size());
+  }
+
+  S_T get_hash_value(const K_T key) const {
+      return (S_T)((uint64_t)key % bucket_size_);
+  }
+
+private:
+  S_T total_keys_;
+  S_T bucket_size_;
+  index_set_bucket<K_T> *buckets_;
+};
+
+
+#endif
@@ -1,36 +1,107 @@
 #include <vector>
+#include <memory>
 #include <iostream>
 #include <cstring>
 #include <cassert>
+#include <stdint.h>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <type_traits>
+#include "index_map_stats.h"
+#include "index_map_checkpoint.h"
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
 using namespace std;
 
-template<typename K_T, typename V_T>
-class index_bucket {
+// I_T is the type of value indices and sizes. It must be signed, -1 marks an
+// empty index slot. int keeps the index compact, int64_t scales past 2^31 values.
+//
+// Next to every index the bucket keeps an 8-bit tag of the key, so candidates
+// whose tag differs are rejected without loading the value from value_container.
+// A miss then usually touches only the bucket, a hit the bucket and one value.
+//
+// The bucket only holds indices, the records they point to are either
+// std::pair<K_T, V_T> (index_map) or plain keys (index_set, V_T = void).
+//
+// The overflow list is allocated with A_T, rebound to its types. The
+// allocator is an empty base for std::allocator, so it takes no space.
+//
+// A bucket filled by the CSR rebuild of index_map (see index_map::csr_index)
+// has no list of its own: its overflow is a run of the map's shared array,
+// ended by an index of -1, and the low bit of pindice is set. The run is
+// copied to an own list before the overflow is first changed.
+template<typename K_T, typename V_T, typename I_T = int, typename A_T = std::allocator<K_T> >
+class index_bucket : private A_T {
 public:
-  index_bucket() {
+  // Index of a value in the overflow list, with the tag of its key
+  struct tagged_index {
+    I_T idx;
+    uint8_t tag;
+  };
+
+  typedef typename std::allocator_traits<A_T>::template rebind_alloc<tagged_index> overflow_allocator;
+  typedef std::vector<tagged_index, overflow_allocator> overflow_list;
+
+  explicit index_bucket(const A_T &alloc = A_T()): A_T(alloc) {
     indice[0] = -1;
     indice[1] = -1;
     indice[2] = -1;
     indice[3] = -1;
+    generation = 0;
     pindice = NULL;
   }
 
-  virtual ~index_bucket() {
-    delete pindice;
+  ~index_bucket() {
+    delete_overflow();
+  }
+
+  // Tag of a key: the top byte of a multiplicative hash, the low bits of the
+  // key are mostly the same inside a bucket
+  static uint8_t key_tag(const K_T &key) {
+    return (uint8_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 56);
+  }
+
+  // Generation of the map when the bucket was last written, buckets of an
+  // older generation are empty (see index_map::clear)
+  uint32_t get_generation() const {
+    return generation;
+  }
+
+  // Empty the bucket and move it to the generation
+  void renew(uint32_t epoch) {
+    indice[0] = -1;
+    indice[1] = -1;
+    indice[2] = -1;
+    indice[3] = -1;
+    delete_overflow();
+    generation = epoch;
+  }
+
+  // Key of a record
+  template<typename X>
+  static const K_T &record_key(const std::pair<K_T, X> &record) {
+    return record.first;
+  }
+
+  static const K_T &record_key(const K_T &record) {
+    return record;
   }
 
   // Returns a pair consisting of an address and a bool denoting whether could do the insertion
-  // The address records the index of a value of std::pair<K_T, V_T>
-  std::pair<int *, bool> insert(std::pair<K_T, V_T> *values, const K_T &key, const V_T &val) {
+  // The address records the index of the record of the key
+  template<typename R>
+  std::pair<I_T *, bool> insert(const R *values, const K_T &key) {
+    const uint8_t tag = key_tag(key);
     int i;
     for (i = 0; i < sizeof(indice) / sizeof(indice[0]); ++i) {
-      int idx = indice[i];
+      I_T idx = indice[i];
       if (idx >= 0) {
-        if (values[idx].first == key) {
+        if (tags[i] == tag && record_key(values[idx]) == key) {
           return std::make_pair(&indice[i], false);
         }
       } else {
@@ -40,36 +111,43 @@ public:
 
     // The key does not exist, and there is empty place
     if (i < sizeof(indice) / sizeof(indice[0])) {
+      tags[i] = tag;
       return std::make_pair(&indice[i], true);
     }
 
     // Check in the extended records
+    own_overflow();
     if (pindice != NULL) {
       for (i = 0; i < pindice->size(); ++i) {
-        int idx = (*pindice)[i];
-        if (values[idx].first == key) {
-          return std::make_pair(pindice->data() + i, false);
+        const tagged_index &t = (*pindice)[i];
+        if (t.tag == tag && record_key(values[t.idx]) == key) {
+          return std::make_pair(&(*pindice)[i].idx, false);
         }
       }
-
-      // Still cannot find the key in the extended records
-      pindice->push_back(-1);
-      return std::make_pair(pindice->data() + i, true);
-
     } else {
-      pindice = new std::vector<int>();
-      pindice->push_back(-1);
-      return std::make_pair(pindice->data(), true);
+      pindice = new_overflow();
     }
+
+    // Still cannot find the key in the extended records
+    tagged_index t = { -1, tag };
+    pindice->push_back(t);
+    return std::make_pair(&pindice->back().idx, true);
   }
 
   // This function ONLY record the value index
   // Used when need to rehash the map
-  void record_value_index(int val_idx) {
+  void record_value_index(I_T val_idx, const K_T &key) {
+    tagged_index t = { val_idx, key_tag(key) };
+    record_tagged_index(t);
+  }
+
+  // Same, with the tag of the key already taken
+  void record_tagged_index(const tagged_index &t) {
     int i;
     for (i = 0; i < sizeof(indice) / sizeof(indice[0]); ++i) {
       if (indice[i] < 0) {
-        indice[i] = val_idx;
+        indice[i] = t.idx;
+        tags[i] = t.tag;
         break;
       }
     }
@@ -79,27 +157,30 @@ public:
     }
 
     // Record the index to the list
-    if (pindice != NULL) {
-      pindice->push_back(val_idx);
-    } else {
-      pindice = new std::vector<int>();
-      pindice->push_back(val_idx);
+    own_overflow();
+    if (pindice == NULL) {
+      pindice = new_overflow();
     }
+    pindice->push_back(t);
   }
 
   // Return the index of the found key&value, -1 means not found
-  int find(std::pair<K_T, V_T> *values, const K_T &key) {
+  template<typename R>
+  I_T find(const R *values, const K_T &key) const {
+    const uint8_t tag = key_tag(key);
     int i;
     for (i = 0; i < sizeof(indice) / sizeof(indice[0]); ++i) {
-      int idx = indice[i];
+      I_T idx = indice[i];
       if (idx >= 0) {
-        if (values[idx].first == key) {
+        if (tags[i] == tag && record_key(values[idx]) == key) {
+          INDEX_MAP_STAT_ADD(inline_probes, i + 1);
           return idx;
         }
       } else {
         break;
       }
     }
+    INDEX_MAP_STAT_ADD(inline_probes, i);
 
     // The key does not exist, and there is empty place
     if (i < sizeof(indice) / sizeof(indice[0])) {
@@ -107,13 +188,24 @@ public:
     }
 
     // Check in the extended records
-    if (pindice != NULL) {
+    if (has_run()) {
+      const tagged_index *t = run();
+      for (i = 0; t[i].idx >= 0; ++i) {
+        if (t[i].tag == tag && record_key(values[t[i].idx]) == key) {
+          INDEX_MAP_STAT_ADD(overflow_probes, i + 1);
+          return t[i].idx;
+        }
+      }
+      INDEX_MAP_STAT_ADD(overflow_probes, i);
+    } else if (pindice != NULL) {
       for (i = 0; i < pindice->size(); ++i) {
-        int idx = (*pindice)[i];
-        if (values[idx].first == key) {
-          return idx;
+        const tagged_index &t = (*pindice)[i];
+        if (t.tag == tag && record_key(values[t.idx]) == key) {
+          INDEX_MAP_STAT_ADD(overflow_probes, i + 1);
+          return t.idx;
         }
       }
+      INDEX_MAP_STAT_ADD(overflow_probes, pindice->size());
     }
 
     return -1;
@@ -121,12 +213,14 @@ public:
 
   // Erase the specified record by key
   // Return the index of erased record inside values, -1 means key not found
-  int erase(std::pair<K_T, V_T> *values, const K_T &key) {
+  template<typename R>
+  I_T erase(const R *values, const K_T &key) {
+    const uint8_t tag = key_tag(key);
     int i;
     for (i = 0; i < sizeof(indice) / sizeof(indice[0]); ++i) {
-      int idx = indice[i];
+      I_T idx = indice[i];
       if (idx >= 0) {
-        if (values[idx].first == key) {
+        if (tags[i] == tag && record_key(values[idx]) == key) {
           shrink_slot(i);
           return idx;
         }
@@ -136,14 +230,15 @@ public:
     }
 
     // Check in the extended records
+    own_overflow();
     if (pindice != NULL) {
       for (i = 0; i < pindice->size(); ++i) {
-        int idx = (*pindice)[i];
-        if (values[idx].first == key) {
-          pindice->erase(pindice->begin() + i);
+        const tagged_index &t = (*pindice)[i];
+        if (t.tag == tag && record_key(values[t.idx]) == key) {
+          I_T idx = t.idx;
+          remove_overflow(i);
           if (pindice->empty()) {
-            delete pindice;
-            pindice = NULL;
+            delete_overflow();
           }
           return idx;
         }
@@ -155,24 +250,24 @@ public:
 
   // Erase the specified record by value index
   // Return how many records was erased
-  int erase(int value_idx) {
+  int erase(I_T value_idx) {
     for (int i = 0; i < sizeof(indice) / sizeof(indice[0]); ++i) {
-      int idx = indice[i];
+      I_T idx = indice[i];
       if (idx == value_idx) {
         shrink_slot(i);
-        return idx;
+        return 1;
       }
     }
 
     // Check in the extended records
+    own_overflow();
     if (pindice != NULL) {
       for (int i = 0; i < pindice->size(); ++i) {
-        int idx = (*pindice)[i];
+        I_T idx = (*pindice)[i].idx;
         if (idx == value_idx) {
-          pindice->erase(pindice->begin() + i);
+          remove_overflow(i);
           if (pindice->empty()) {
-            delete pindice;
-            pindice = NULL;
+            delete_overflow();
           }
           return 1;
         }
@@ -182,98 +277,226 @@ public:
     return 0;
   }
 
+  // Bytes used by the bucket, including its overflow list but not a run of
+  // the shared array
+  size_t memory_usage() const {
+    size_t bytes = sizeof(*this);
+    if (pindice != NULL && !has_run()) {
+      bytes += sizeof(*pindice) + pindice->capacity() * sizeof(tagged_index);
+    }
+    return bytes;
+  }
+
+  // Point the index of a moved record to its new place
+  // Return whether old_idx was found
+  bool replace_index(I_T old_idx, I_T new_idx) {
+    for (int i = 0; i < sizeof(indice) / sizeof(indice[0]); ++i) {
+      if (indice[i] == old_idx) {
+        indice[i] = new_idx;
+        return true;
+      }
+    }
+    own_overflow();
+    if (pindice != NULL) {
+      for (int i = 0; i < pindice->size(); ++i) {
+        if ((*pindice)[i].idx == old_idx) {
+          (*pindice)[i].idx = new_idx;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Use a run of the shared array ended by an index of -1 as the overflow
+  // of an empty bucket, see index_map::csr_index. The run must outlive it.
+  void attach_run(const tagged_index *first) {
+    pindice = (overflow_list *)((uintptr_t)first | 1);
+  }
+
 private:
+  typedef typename std::allocator_traits<A_T>::template rebind_alloc<overflow_list> list_allocator;
+  typedef std::allocator_traits<list_allocator> list_traits;
+
+  // The list is constructed in place with a copy of the allocator, which
+  // its buffer then comes from
+  overflow_list *new_overflow() {
+    list_allocator alloc(static_cast<const A_T &>(*this));
+    overflow_list *list = list_traits::allocate(alloc, 1);
+    ::new ((void *)list) overflow_list(overflow_allocator(static_cast<const A_T &>(*this)));
+    return list;
+  }
+
+  bool has_run() const {
+    return ((uintptr_t)pindice & 1) != 0;
+  }
+
+  const tagged_index *run() const {
+    return (const tagged_index *)((uintptr_t)pindice & ~(uintptr_t)1);
+  }
+
+  // Copy a run of the shared array to an own list, before it is changed
+  void own_overflow() {
+    if (has_run()) {
+      const tagged_index *t = run();
+      pindice = new_overflow();
+      for (; t->idx >= 0; ++t) {
+        pindice->push_back(*t);
+      }
+    }
+  }
+
+  void delete_overflow() {
+    if (has_run()) {
+      pindice = NULL;
+    } else if (pindice != NULL) {
+      list_allocator alloc(static_cast<const A_T &>(*this));
+      pindice->~overflow_list();
+      list_traits::deallocate(alloc, pindice, 1);
+      pindice = NULL;
+    }
+  }
+
+  // The order of the overflow list does not matter, fill the hole with the last index
+  void remove_overflow(int i) {
+    (*pindice)[i] = pindice->back();
+    pindice->pop_back();
+  }
+
   void shrink_slot(int idx) {
+    own_overflow();
     // Move one index value from the vector
     if (pindice != NULL) {
-      indice[idx] = pindice->back();
+      INDEX_MAP_STAT_INC(shrink_slot_moves);
+      indice[idx] = pindice->back().idx;
+      tags[idx] = pindice->back().tag;
       pindice->pop_back();
       if (pindice->empty()) {
-        delete pindice;
-        pindice = NULL;
+        delete_overflow();
       }
     }
     // Shrink the array
     else {
       while (idx + 1 < 4) {
+        INDEX_MAP_STAT_INC(shrink_slot_moves);
         indice[idx] = indice[idx + 1];
+        tags[idx] = tags[idx + 1];
         idx += 1;
       }
+      indice[3] = -1;
     }
   }
 
 private:
   // when pindice = NULL, only use the index in indice
-  int indice[4];
-  std::vector<int> *pindice;
+  I_T indice[4];
+  // Tags of the keys in indice
+  uint8_t tags[4];
+  // See get_generation(), fits in the padding before pindice
+  uint32_t generation;
+  // Own overflow list, or a run of the shared array if the low bit is set
+  overflow_list *pindice;
 };
 
-template<typename K_T, typename V_T>
+// Maps up to this size have no buckets, their values are scanned linearly
+#define INDEX_MAP_SMALL_SIZE 8
+
+// The values and the list of holes are allocated with A_T
+template<typename K_T, typename V_T, typename I_T = int,
+         typename A_T = std::allocator<std::pair<K_T, V_T> > >
 class value_container {
+  typedef typename std::allocator_traits<A_T>::template rebind_alloc<std::pair<K_T, V_T> > value_allocator;
+  typedef std::allocator_traits<value_allocator> value_traits;
+  typedef typename std::allocator_traits<A_T>::template rebind_alloc<I_T> slot_allocator;
+
 public:
-  value_container(int _capacity) {
+  value_container(I_T _capacity, const A_T &_alloc = A_T()):
+    alloc(_alloc),
+    available_slots(slot_allocator(_alloc)),
+    changes(NULL) {
     init(_capacity);
   }
 
   virtual ~value_container() {
-    delete[] key_values;
+    delete_values(key_values, capacity);
     key_values = NULL;
+    delete changes;
+  }
+
+  A_T get_allocator() const {
+    return A_T(alloc);
   }
 
   // Clear all the values
   // _capacity: the size of container to keep after clear
-  void clear(int _capacity) {
-    delete[] key_values;
+  void clear(I_T _capacity) {
+    delete_values(key_values, capacity);
     key_values = NULL;
 
     available_slots.clear();
 
     init(_capacity);
+    mark_all();
   }
 
-  int get_size() {
+  I_T get_size() {
     return size;
   }
 
   // Get a value by index
-  std::pair<K_T, V_T> &operator[](int index) {
+  std::pair<K_T, V_T> &operator[](I_T index) {
     assert(index < capacity);
     return key_values[index];
   }
 
-  int get_first_nonempty_slot() {
-    int i;
+  std::pair<K_T, V_T> *data() {
+    return key_values;
+  }
+
+  // Erased slots are marked with this key, index_map rejects it on insert
+  static K_T hole_key() {
+    return (K_T)-1;
+  }
+
+  bool is_hole(I_T index) const {
+    return key_values[index].first == hole_key();
+  }
+
+  I_T get_first_nonempty_slot() {
+    I_T i;
     for (i = 0; i < next_empty_slot; ++i) {
       // Is valid value
-      if (key_values[i].first >= 0) { 
+      if (!is_hole(i)) {
         break;
       }
     }
     return i;
   }
 
-  int get_next_empty_slot() {
+  I_T get_next_empty_slot() {
     return next_empty_slot;
   }
 
+  // Whether insert() has no slot left, all of I_T being used
+  bool full() const {
+    return available_slots.empty() && next_empty_slot == std::numeric_limits<I_T>::max();
+  }
+
   // Return the index inside key_values
-  int insert(const K_T &key, const V_T &val) {
-    int idx = -1;
+  I_T insert(const K_T &key, const V_T &val) {
+    I_T idx = -1;
 
     if (available_slots.empty()) {
       // key_values is full, enlarge the buffer
       if (unlikely(next_empty_slot >= capacity)) {
-        capacity *= 2;
-        std::pair<K_T, V_T> *new_values = new std::pair<K_T, V_T>[capacity];
-
-        // Copy values, consider to use memcpy if value can be directly copied
-        //memcpy(new_values, key_values, next_empty_slot * sizeof(std::pair<K_T, V_T>));
-        for (int i = 0; i < next_empty_slot; ++i) {
-          new_values[i] = key_values[i];
+        if (capacity == std::numeric_limits<I_T>::max()) {
+          throw std::length_error("index_map: more values than I_T can index");
         }
+        INDEX_MAP_STAT_INC(value_grows);
+        INDEX_MAP_STAT_TIMER(value_grow_ns);
 
-        delete[] key_values;
-        key_values = new_values;
+        int64_t grown = std::max<int64_t>((int64_t)capacity * 2, INDEX_MAP_SMALL_SIZE);
+        resize_buffer((I_T)std::min<int64_t>(grown, std::numeric_limits<I_T>::max()));
       }
 
       idx = next_empty_slot;
@@ -288,64 +511,263 @@ public:
     key_values[idx].first = key;
     key_values[idx].second = val;
     size += 1;
+    mark(idx);
 
     return idx;
   }
 
-  void erase(int idx) {
-    key_values[idx].first = -1;
+  void erase(I_T idx) {
+    key_values[idx].first = hole_key();
     size -= 1;
     available_slots.push_back(idx);
+    mark(idx);
+  }
+
+  // Append n slots after the values, to be written through data()
+  // Returns the index of the first one.
+  I_T append(I_T n) {
+    reserve(next_empty_slot + n);
+    I_T first = next_empty_slot;
+    next_empty_slot += n;
+    size += n;
+    for (I_T i = 0; changes != NULL && i < n; ++i) {
+      changes->mark(first + i);
+    }
+    return first;
+  }
+
+  // Turn a value back into a hole without recording the slot for reuse,
+  // fill_holes() must be called afterwards
+  void discard(I_T idx) {
+    key_values[idx].first = hole_key();
+    size -= 1;
+    mark(idx);
+  }
+
+  // Drop all the values, keeping the capacity
+  void reset() {
+    next_empty_slot = 0;
+    size = 0;
+    available_slots.clear();
+    mark_all();
+  }
+
+  I_T get_capacity() const {
+    return capacity;
+  }
+
+  // Make room for n values without growing
+  void reserve(I_T n) {
+    if (n > capacity) {
+      resize_buffer(n);
+    }
+  }
+
+  // Trim the capacity to the values, the holes must be filled first
+  void shrink_to_fit() {
+    assert(available_slots.empty());
+    decltype(available_slots)(available_slots.get_allocator()).swap(available_slots);
+    if (capacity > next_empty_slot) {
+      resize_buffer(std::max<I_T>(next_empty_slot, 1));
+    }
+  }
+
+  I_T get_hole_count() const {
+    return next_empty_slot - size;
+  }
+
+  // Close the holes by moving the last values into them, so that the values
+  // are dense again. moved(from, to) is called for every moved value.
+  template<typename F>
+  void fill_holes(F moved) {
+    I_T lo = 0;
+    I_T hi = next_empty_slot - 1;
+    while (true) {
+      while (lo < hi && !is_hole(lo)) {
+        lo += 1;
+      }
+      while (hi > lo && is_hole(hi)) {
+        hi -= 1;
+      }
+      if (lo >= hi) {
+        break;
+      }
+      key_values[lo] = key_values[hi];
+      key_values[hi].first = hole_key();
+      mark(lo);
+      moved(hi, lo);
+    }
+    next_empty_slot = size;
+    available_slots.clear();
+  }
+
+  // Record the slots written from now on, for the checkpoints of the map
+  void track_changes(bool on) {
+    delete changes;
+    changes = on ? new index_map_change_set() : NULL;
+  }
+
+  // Slots written since the last checkpoint, NULL unless tracked
+  index_map_change_set *get_changes() {
+    return changes;
+  }
+
+  void mark(I_T idx) {
+    if (unlikely(changes != NULL)) {
+      changes->mark(idx);
+    }
+  }
+
+  void mark_all() {
+    if (changes != NULL) {
+      changes->mark_all();
+    }
+  }
+
+  // End the values at 'end', to write slots below it directly through
+  // data(). recount() must be called afterwards.
+  void restore(I_T end) {
+    if (end > capacity) {
+      // Grows geometrically, as on insert, over a series of deltas
+      int64_t grown = std::max<int64_t>((int64_t)capacity * 2, end);
+      resize_buffer((I_T)std::min<int64_t>(grown, std::numeric_limits<I_T>::max()));
+    }
+    next_empty_slot = end;
+  }
+
+  // Count the values and list the holes again after restore()
+  void recount() {
+    size = 0;
+    available_slots.clear();
+    for (I_T i = 0; i < next_empty_slot; ++i) {
+      if (is_hole(i)) {
+        available_slots.push_back(i);
+      } else {
+        size += 1;
+      }
+    }
   }
 
 private:
-  void init(int _capacity) {
+  void resize_buffer(I_T new_capacity) {
+    I_T old_capacity = capacity;
+    capacity = new_capacity;
+    std::pair<K_T, V_T> *new_values = new_values_of(capacity);
+
+    // Copy values, consider to use memcpy if value can be directly copied
+    //memcpy(new_values, key_values, next_empty_slot * sizeof(std::pair<K_T, V_T>));
+    for (I_T i = 0; i < next_empty_slot; ++i) {
+      new_values[i] = key_values[i];
+    }
+
+    delete_values(key_values, old_capacity);
+    key_values = new_values;
+  }
+
+  // n default constructed values from the allocator, NULL for 0
+  std::pair<K_T, V_T> *new_values_of(I_T n) {
+    if (n == 0) {
+      return NULL;
+    }
+    std::pair<K_T, V_T> *p = value_traits::allocate(alloc, n);
+    for (I_T i = 0; i < n; ++i) {
+      value_traits::construct(alloc, p + i);
+    }
+    return p;
+  }
+
+  void delete_values(std::pair<K_T, V_T> *p, I_T n) {
+    if (p == NULL) {
+      return;
+    }
+    for (I_T i = 0; i < n; ++i) {
+      value_traits::destroy(alloc, p + i);
+    }
+    value_traits::deallocate(alloc, p, n);
+  }
+
+  // No buffer is allocated for a capacity of 0 until the first insert
+  void init(I_T _capacity) {
     capacity = _capacity;
     next_empty_slot = 0;
     size = 0;
 
-    key_values = new std::pair<K_T, V_T>[capacity];
+    key_values = new_values_of(capacity);
   }
 
 private:
+  value_allocator alloc;
   // Capacity of key_values
-  int capacity;
+  I_T capacity;
   // Next available slot, all after that are also available
-  int next_empty_slot;
+  I_T next_empty_slot;
   // Total size with values
-  int size;
+  I_T size;
   // Erased slots, that are holes inside key_values
-  std::vector<int> available_slots;
+  std::vector<I_T, slot_allocator> available_slots;
+  // Slots written since the last checkpoint, NULL unless tracked
+  index_map_change_set *changes;
 
   std::pair<K_T, V_T> *key_values;
 };
 
 #define INDEX_MAP_INIT_BUCKETS 8096
+#define INDEX_MAP_MAX_LOAD_FACTOR 0.5f
+
+// What merge() does with a key present in both maps
+enum index_map_merge_policy {
+  INDEX_MAP_MERGE_KEEP,       // keep the value of the destination
+  INDEX_MAP_MERGE_OVERWRITE   // take the value of the merged map
+};
 
-template<typename K_T, typename V_T>
+// A_T allocates the buckets, their overflow lists and value_container.
+// The key (K_T)-1 marks erased values: inserting it throws
+// std::invalid_argument.
+template<typename K_T, typename V_T, typename I_T = int,
+         typename A_T = std::allocator<std::pair<K_T, V_T> > >
 class index_map {
+  typedef index_bucket<K_T, V_T, I_T, A_T> bucket_type;
+  typedef typename std::allocator_traits<A_T>::template rebind_alloc<bucket_type> bucket_allocator;
+  typedef std::allocator_traits<bucket_allocator> bucket_traits;
+
 public:
+  typedef A_T allocator_type;
+
   index_map(): index_map(INDEX_MAP_INIT_BUCKETS) {}
 
-  index_map(int _bucket_size): 
+  explicit index_map(const A_T &alloc): index_map(INDEX_MAP_INIT_BUCKETS, alloc) {}
+
+  // Nothing is allocated until the first insert, and the buckets only once
+  // the map holds more than INDEX_MAP_SMALL_SIZE values
+  index_map(I_T _bucket_size, const A_T &alloc = A_T()):
     bucket_size(_bucket_size),
-    values(_bucket_size) {
-    buckets = new index_bucket<K_T, V_T>[bucket_size];
+    max_load(INDEX_MAP_MAX_LOAD_FACTOR),
+    epoch(0),
+    buckets(NULL),
+    allocated_buckets(0),
+    csr_threads(0),
+    runs(typename bucket_type::overflow_allocator(alloc)),
+    values(0, alloc) {
+    update_grow_threshold();
   }
 
-  index_map(const index_map<K_T, V_T> &m);
+  index_map(const index_map &m);
 
-  index_map<K_T, V_T> &operator=(const index_map<K_T, V_T> &m);
+  index_map &operator=(const index_map &m);
 
   virtual ~index_map() {
-    delete[] buckets;
+    free_buckets();
+  }
+
+  A_T get_allocator() const {
+    return values.get_allocator();
   }
 
   class iterator {
   public:
     iterator(index_map *_pmap) : iterator(_pmap, 0) {
     }
-    iterator(index_map *_pmap, int idx) : pmap(_pmap), cur_index(idx) {
+    iterator(index_map *_pmap, I_T idx) : pmap(_pmap), cur_index(idx) {
     }
     std::pair<K_T, V_T> &operator*() {
       return pmap->values[cur_index];
@@ -358,7 +780,7 @@ public:
       return *this;
     }
     iterator operator++(int) {
-      iterator __tmp(cur_index);
+      iterator __tmp(*this);
       this->incr();
       return __tmp;
     }
@@ -372,13 +794,13 @@ public:
   private:
     void incr() {
       cur_index += 1;
-      int end_idx = pmap->get_end_index();
-      if (likely(cur_index < end_idx && pmap->values[cur_index].first >= 0)) {
+      I_T end_idx = pmap->get_end_index();
+      if (likely(cur_index < end_idx && !pmap->values.is_hole(cur_index))) {
         return;
       }
       while (cur_index < end_idx) {
         // Valid value (not hole)
-        if (pmap->values[cur_index].first >= 0) {
+        if (!pmap->values.is_hole(cur_index)) {
           break;
         } else {
           cur_index += 1;
@@ -388,26 +810,38 @@ public:
 
   private:
     index_map *pmap;
-    int cur_index;
+    I_T cur_index;
 
     friend class index_map;
   };
 
   // Return iterator, and a bool value indicating whether the element was successfully inserted or not 
   std::pair<iterator, bool> insert(const std::pair<K_T, V_T> &value) {
-    // TODO: adjust the value?
-    if (size() * 2 > bucket_size) {
+    const K_T key = value.first;
+    check_key(key);
+    check_room(key);
+
+    if (buckets == NULL) {
+      I_T value_idx = small_find(key);
+      if (value_idx != -1) {
+        return std::make_pair(iterator(this, value_idx), false);
+      }
+      if (size() < INDEX_MAP_SMALL_SIZE) {
+        return std::make_pair(iterator(this, values.insert(key, value.second)), true);
+      }
+      promote();
+    }
+
+    if (unlikely(size() > grow_threshold)) {
       rehash();
     }
 
-    const K_T key = value.first;
-    
-    int bucket_idx = (int)(key % bucket_size);
+    I_T bucket_idx = bucket_of(key);
 
-    std::pair<int *, bool> ret = buckets[bucket_idx].insert(
-                                 &values[0], value.first, value.second);
+    std::pair<I_T *, bool> ret = writable_bucket(bucket_idx).insert(
+                                 values.data(), value.first);
 
-    int value_idx;
+    I_T value_idx;
 
     // Could do the insert, means the key does not exist
     if (ret.second) {
@@ -420,16 +854,93 @@ public:
     return std::make_pair(iterator(this, value_idx), ret.second);
   }
 
-  int size() {
+  I_T size() {
     return values.get_size();
   }
 
+  I_T bucket_count() {
+    return bucket_size;
+  }
+
+  // Values are indexed by I_T
+  I_T max_size() const {
+    return std::numeric_limits<I_T>::max();
+  }
+
   V_T &operator[](const K_T &key) {
-    V_T def_val;
+    V_T def_val = V_T();
     std::pair<iterator, bool> ret = insert(std::make_pair(key, def_val));
+    if (!ret.second) {
+      // The value is about to be written through the reference
+      values.mark(ret.first.cur_index);
+    }
     return ret.first->second;
   }
 
+  // Store init under the key if it is absent, otherwise call fn(V_T &) on
+  // its value. The bucket is probed once and the value is written in place,
+  // where m[key] += x default constructs a value, copies it into the map and
+  // then goes through the iterator. Returns the value.
+  template<typename F>
+  V_T &upsert(const K_T &key, const V_T &init, F fn) {
+    check_key(key);
+    check_room(key);
+    if (buckets == NULL) {
+      I_T value_idx = small_find(key);
+      if (value_idx != -1) {
+        values.mark(value_idx);
+        fn(values[value_idx].second);
+        return values[value_idx].second;
+      }
+      if (size() < INDEX_MAP_SMALL_SIZE) {
+        return values[values.insert(key, init)].second;
+      }
+      promote();
+    }
+
+    if (unlikely(size() > grow_threshold)) {
+      rehash();
+    }
+    return upsert_in(bucket_of(key), key, init, fn);
+  }
+
+  // Add delta to the value of the key, a new key starts at delta
+  V_T &accumulate(const K_T &key, const V_T &delta) {
+    return upsert(key, delta, [&delta](V_T &value) { value += delta; });
+  }
+
+  // accumulate(keys[i], deltas[i]) for the n keys, a group-by over the keys.
+  // The buckets of a block of keys are prefetched before they are probed.
+  // Returns the number of keys added.
+  I_T accumulate_batch(const K_T *keys, const V_T *deltas, size_t n) {
+    const size_t block = 16;
+    I_T bucket_idx[block];
+    I_T before = size();
+    size_t i = 0;
+
+    for (; i < n && buckets == NULL; ++i) {
+      accumulate(keys[i], deltas[i]);
+    }
+    for (size_t base = i; base < n; base += block) {
+      size_t len = std::min(block, n - base);
+      // Grow before the block, its buckets must stay valid
+      if (unlikely(size() > grow_threshold - (I_T)len)) {
+        rehash();
+      }
+      for (size_t j = 0; j < len; ++j) {
+        check_key(keys[base + j]);
+        bucket_idx[j] = bucket_of(keys[base + j]);
+        __builtin_prefetch(&buckets[bucket_idx[j]]);
+      }
+      for (size_t j = 0; j < len; ++j) {
+        const V_T &delta = deltas[base + j];
+        check_room(keys[base + j]);
+        upsert_in(bucket_idx[j], keys[base + j], delta, [&delta](V_T &value) { value += delta; });
+      }
+    }
+    return size() - before;
+  }
+
   iterator begin() {
     return iterator(this, get_begin_index());
   }
@@ -441,12 +952,13 @@ public:
   // Removes the element at pos
   iterator erase(iterator pos) {
     K_T key = pos->first;
-    int bucket_idx = (int)(key % bucket_size);
-    int value_idx = pos.cur_index;
-    
+    I_T value_idx = pos.cur_index;
+
     iterator ret = ++pos;
 
-    buckets[bucket_idx].erase(value_idx);
+    if (buckets != NULL) {
+      buckets[bucket_of(key)].erase(value_idx);
+    }
     values.erase(value_idx);
 
     return ret;
@@ -463,8 +975,16 @@ public:
 
   // Removes the element with the key equivalent to key
   int erase(const K_T &key) {
-    int bucket_idx = (int)(key % bucket_size);
-    int value_idx = buckets[bucket_idx].erase(&values[0], key);
+    I_T value_idx;
+    if (buckets == NULL) {
+      value_idx = small_find(key);
+    } else {
+      I_T bucket_idx = bucket_of(key);
+      if (stale(bucket_idx)) {
+        return 0;
+      }
+      value_idx = buckets[bucket_idx].erase(values.data(), key);
+    }
     if (value_idx != -1) {
       values.erase(value_idx);
       return 1;
@@ -473,56 +993,1029 @@ public:
     }
   }
 
+  // Removes 'n' keys, the buckets of a block of keys are prefetched before
+  // they are probed. Once the holes outnumber the values, the last values are
+  // moved into the holes. Returns the number of erased keys.
+  I_T erase_batch(const K_T *keys, size_t n) {
+    const size_t block = 16;
+    I_T bucket_idx[block];
+    I_T erased = 0;
+
+    if (buckets == NULL) {
+      for (size_t i = 0; i < n; ++i) {
+        erased += erase(keys[i]);
+      }
+      return erased;
+    }
+
+    for (size_t base = 0; base < n; base += block) {
+      size_t len = std::min(block, n - base);
+      for (size_t i = 0; i < len; ++i) {
+        bucket_idx[i] = bucket_of(keys[base + i]);
+        __builtin_prefetch(&buckets[bucket_idx[i]]);
+      }
+      for (size_t i = 0; i < len; ++i) {
+        if (stale(bucket_idx[i])) {
+          continue;
+        }
+        I_T value_idx = buckets[bucket_idx[i]].erase(values.data(), keys[base + i]);
+        if (value_idx != -1) {
+          values.erase(value_idx);
+          erased += 1;
+        }
+      }
+    }
+
+    if (values.get_hole_count() > size()) {
+      fill_holes();
+    }
+    return erased;
+  }
+
+  // Removes all the elements for which pred(const std::pair<K_T, V_T> &) is
+  // true. value_container is swept once; afterwards the last values are
+  // moved into the holes, so only the erased and the moved values touch
+  // their buckets. Invalidates the iterators.
+  // Returns the number of erased elements.
+  template<typename P>
+  I_T erase_if(P pred) {
+    // The buckets of a block of matches are prefetched before they are updated
+    const int block = 16;
+    I_T pending[block];
+    int pending_num = 0;
+    I_T erased = 0;
+
+    I_T end = get_end_index();
+    if (buckets == NULL) {
+      for (I_T i = get_begin_index(); i < end; ++i) {
+        if (!values.is_hole(i) && pred(const_cast<const std::pair<K_T, V_T> &>(values[i]))) {
+          values.erase(i);
+          erased += 1;
+        }
+      }
+      fill_holes();
+      return erased;
+    }
+    for (I_T i = get_begin_index(); i < end; ++i) {
+      if (values.is_hole(i) || !pred(const_cast<const std::pair<K_T, V_T> &>(values[i]))) {
+        continue;
+      }
+      __builtin_prefetch(&buckets[bucket_of(values[i].first)]);
+      pending[pending_num++] = i;
+      if (pending_num == block) {
+        for (int j = 0; j < pending_num; ++j) {
+          buckets[bucket_of(values[pending[j]].first)].erase(pending[j]);
+          values.erase(pending[j]);
+        }
+        erased += pending_num;
+        pending_num = 0;
+      }
+    }
+    for (int j = 0; j < pending_num; ++j) {
+      buckets[bucket_of(values[pending[j]].first)].erase(pending[j]);
+      values.erase(pending[j]);
+    }
+    erased += pending_num;
+
+    fill_holes();
+    return erased;
+  }
+
+  // Merge the elements of other into the map. The values of other are
+  // copied as one range after ours and indexed in a single pass, the keys
+  // already present become holes that are then filled. Invalidates the
+  // iterators. Returns the number of keys added.
+  I_T merge(index_map &other, index_map_merge_policy policy = INDEX_MAP_MERGE_KEEP) {
+    return merge(other, policy_combiner(policy));
+  }
+
+  // combine(V_T &value, const V_T &other_value) resolves a key present in both
+  template<typename F>
+  I_T merge(index_map &other, F combine) {
+    index_map *shards[] = { &other };
+    return merge_shards(shards, 1, combine, 1);
+  }
+
+  // Merge n maps at once with 'threads' threads: they copy the values of
+  // the shards, then each indexes a range of buckets. The result is the
+  // same as n calls of merge() in order. Indexing grows the overflow lists
+  // concurrently, so with an A_T other than std::allocator, which may not
+  // be thread-safe (e.g. the pmr resources), it runs on one thread.
+  I_T merge_parallel(index_map *const *shards, size_t n, int threads,
+                     index_map_merge_policy policy = INDEX_MAP_MERGE_KEEP) {
+    return merge_parallel(shards, n, threads, policy_combiner(policy));
+  }
+
+  // combine() is called concurrently, for distinct keys
+  template<typename F>
+  I_T merge_parallel(index_map *const *shards, size_t n, int threads, F combine) {
+    return merge_shards(shards, n, combine, threads);
+  }
+
   // Find the element by key
   iterator find(const K_T &key) {
-    int bucket_idx = (int)(key % bucket_size);
-    int value_idx = buckets[bucket_idx].find(&values[0], key);
+    I_T value_idx;
+    if (buckets == NULL) {
+      value_idx = small_find(key);
+    } else {
+      I_T bucket_idx = bucket_of(key);
+      value_idx = stale(bucket_idx) ? -1 : buckets[bucket_idx].find(values.data(), key);
+    }
+    INDEX_MAP_STAT_INC(finds);
     if (value_idx != -1) {
+      INDEX_MAP_STAT_INC(hits);
       return iterator(this, value_idx);
     } else {
+      INDEX_MAP_STAT_INC(misses);
       return end();
     }
   }
 
-  // Remove all the elements
+  // Remove all the elements, keeping the buckets and the capacity of
+  // value_container. Only the generation of the map is bumped: buckets of
+  // an older generation read as empty and are emptied when next written.
   void clear() {
+    values.reset();
+    if (buckets == NULL) {
+      // Small map, nothing to invalidate
+    } else if (unlikely(epoch == std::numeric_limits<uint32_t>::max())) {
+      // The generation wraps around, empty all buckets once
+      for (I_T i = 0; i < bucket_size; ++i) {
+        buckets[i].renew(0);
+      }
+      epoch = 0;
+    } else {
+      epoch += 1;
+    }
+  }
+
+  // Remove all the elements and free the memory, back to an empty small map
+  // with the initial bucket count
+  void release() {
     bucket_size = INDEX_MAP_INIT_BUCKETS;
-    
-    delete[] buckets;
-    buckets = new index_bucket<K_T, V_T>[bucket_size];
+    update_grow_threshold();
+    epoch = 0;
+
+    free_buckets();
+
+    values.clear(0);
+  }
+
+  // Bytes used by the buckets, their overflow lists and value_container
+  size_t memory_usage() {
+    size_t bytes = sizeof(*this) + (size_t)values.get_capacity() * sizeof(std::pair<K_T, V_T>) +
+                   values.get_hole_count() * sizeof(I_T) +
+                   runs.capacity() * sizeof(typename bucket_type::tagged_index);
+    for (I_T i = 0; buckets != NULL && i < bucket_size; ++i) {
+      bytes += buckets[i].memory_usage();
+    }
+    return bytes;
+  }
 
-    values.clear(bucket_size);
+  // Average number of elements per bucket
+  float load_factor() {
+    return (float)size() / bucket_size;
+  }
+
+  float max_load_factor() const {
+    return max_load;
+  }
+
+  // Set the load factor above which the map grows, rehashing now if it is
+  // already exceeded
+  void max_load_factor(float ml) {
+    assert(ml > 0);
+    max_load = ml;
+    update_grow_threshold();
+    if (size() > grow_threshold) {
+      rehash(0);
+    }
+  }
+
+  // Set the bucket count to n, or to the smallest count that keeps the load
+  // under max_load_factor() if n is less. A small map only records the
+  // bucket count to allocate.
+  void rehash(int64_t n) {
+    n = std::min<int64_t>(std::max(n, min_bucket_count(size())), std::numeric_limits<I_T>::max());
+    if (buckets == NULL) {
+      bucket_size = (I_T)n;
+      update_grow_threshold();
+    } else if (n != bucket_size) {
+      INDEX_MAP_STAT_INC(rehashes);
+      INDEX_MAP_STAT_TIMER(rehash_ns);
+      bucket_size = (I_T)n;
+      update_grow_threshold();
+      rebuild_index();
+    }
+  }
+
+  // Make room for n elements without rehashing or growing value_container
+  void reserve(I_T n) {
+    values.reserve(n);
+    if (min_bucket_count(n) > bucket_size) {
+      rehash(min_bucket_count(n));
+    }
+  }
+
+  // Fill the holes, trim value_container to the values and shrink the
+  // buckets to the current size, e.g. after mass erases
+  void shrink_to_fit() {
+    fill_holes();
+    values.shrink_to_fit();
+    // Always rebuilt, so the overflow lists are sized to their indices
+    bucket_size = (I_T)std::min<int64_t>(min_bucket_count(size()), std::numeric_limits<I_T>::max());
+    update_grow_threshold();
+    if (buckets != NULL) {
+      rebuild_index();
+    }
+  }
+
+  // Rebuild the index by a counting sort on every rehash, with 'threads'
+  // threads: the values are counted per bucket, grouped by bucket in a flat
+  // array, then the buckets are filled in order. The indices past the 4
+  // inline ones of all buckets are kept in one shared array (compressed
+  // sparse rows) instead of a list per bucket; a bucket copies its run to
+  // its own list when its overflow next changes. Applies from the next
+  // rehash. csr_index(false) indexes the values one by one again.
+  void csr_index(bool on = true, int threads = 1) {
+    assert(threads > 0);
+    csr_threads = on ? threads : 0;
+  }
+
+  // Record the value slots written from now on, so that write_checkpoint()
+  // writes only those (see index_map_checkpoint.h). The buckets are not
+  // written, they are rebuilt on load. A value changed through an iterator
+  // is not seen: report it with touch().
+  void track_changes(bool on = true) {
+    values.track_changes(on);
+  }
+
+  // Mark the slot of the key as written
+  void touch(const K_T &key) {
+    iterator it = find(key);
+    if (it != end()) {
+      values.mark(it.cur_index);
+    }
+  }
+
+  // Append a checkpoint to out: the slots written since the previous one,
+  // or a full image of the slots if there was none, the map does not track
+  // changes, or it was cleared or merged since. Returns the bytes written.
+  size_t write_checkpoint(std::ostream &out) {
+    static_assert(std::is_trivially_copyable<K_T>::value && std::is_trivially_copyable<V_T>::value,
+                  "checkpoints store keys and values as raw bytes");
+    index_map_change_set *changes = values.get_changes();
+    bool full = changes == NULL || changes->is_full();
+    I_T end = get_end_index();
+    index_map_checkpoint_header header;
+    header.magic = INDEX_MAP_CHECKPOINT_MAGIC;
+    header.kind = full ? INDEX_MAP_CHECKPOINT_FULL : INDEX_MAP_CHECKPOINT_DELTA;
+    header.key_size = sizeof(K_T);
+    header.value_size = sizeof(V_T);
+    header.extent = end;
+
+    // A full image is the slots [0, end) with their holes, a delta lists
+    // each written slot with its index
+    if (full) {
+      header.entries = end;
+      header.payload_bytes = (uint64_t)end * sizeof(std::pair<K_T, V_T>);
+    } else {
+      header.entries = changes->count(end);
+      header.payload_bytes = header.entries * (sizeof(uint64_t) + sizeof(std::pair<K_T, V_T>));
+    }
+    index_map_checkpoint_writer writer(out, header);
+    if (full) {
+      writer.put_bytes(values.data(), (size_t)end * sizeof(std::pair<K_T, V_T>));
+    } else {
+      changes->for_each(end, [&](uint64_t idx) {
+        writer.put(idx);
+        writer.put(values[(I_T)idx]);
+      });
+    }
+    size_t bytes = writer.finish();
+    if (changes != NULL) {
+      changes->reset();
+    }
+    return bytes;
+  }
+
+  // Replace the contents of the map with the full image at the start of in
+  // and the deltas that follow it. The slots are written in place and the
+  // buckets rebuilt once at the end. Stops at the end of the stream or at a
+  // truncated or corrupt checkpoint, and returns the number of checkpoints
+  // applied. Throws std::runtime_error if a delta does not follow the image.
+  size_t load_checkpoints(std::istream &in) {
+    static_assert(std::is_trivially_copyable<K_T>::value && std::is_trivially_copyable<V_T>::value,
+                  "checkpoints store keys and values as raw bytes");
+    index_map_checkpoint_reader reader(in, sizeof(K_T), sizeof(V_T));
+    size_t applied = 0;
+    values.reset();
+    while (reader.next()) {
+      const index_map_checkpoint_header &header = reader.get_header();
+      if (header.extent > (uint64_t)std::numeric_limits<I_T>::max()) {
+        throw std::runtime_error("index_map: checkpoint has more values than I_T can index");
+      }
+      I_T end = (I_T)header.extent;
+      if (header.kind == INDEX_MAP_CHECKPOINT_FULL) {
+        values.reset();
+        values.restore(end);
+        reader.get_bytes(values.data(), (size_t)end * sizeof(std::pair<K_T, V_T>));
+      } else if (applied == 0) {
+        throw std::runtime_error("index_map: checkpoint delta does not follow the loaded image");
+      } else {
+        values.restore(end);
+        for (uint64_t e = 0; e < header.entries; ++e) {
+          uint64_t idx = reader.get<uint64_t>();
+          if (idx >= (uint64_t)end) {
+            throw std::runtime_error("index_map: malformed checkpoint");
+          }
+          values[(I_T)idx] = reader.get<std::pair<K_T, V_T> >();
+        }
+      }
+      applied += 1;
+    }
+    values.recount();
+
+    free_buckets();
+    epoch = 0;
+    if (size() > INDEX_MAP_SMALL_SIZE) {
+      bucket_size = (I_T)std::min<int64_t>(std::max<int64_t>(bucket_size, min_bucket_count(size())),
+                                           std::numeric_limits<I_T>::max());
+      update_grow_threshold();
+      rebuild_index();
+    }
+    // The next checkpoint of this map follows the loaded ones
+    if (values.get_changes() != NULL) {
+      values.get_changes()->reset();
+    }
+    return applied;
   }
 
 private:
-  int get_begin_index() {
+  I_T get_begin_index() {
     return values.get_first_nonempty_slot();
   }
 
-  int get_end_index() {
+  I_T get_end_index() {
     return values.get_next_empty_slot();
   }
 
   void rehash() {
-    bucket_size = bucket_size * 3 + 1;
+    INDEX_MAP_STAT_INC(rehashes);
+    INDEX_MAP_STAT_TIMER(rehash_ns);
+
+    // Grow to 3n+1 buckets, without wrapping around I_T
+    int64_t new_size = std::max((int64_t)bucket_size * 3 + 1, min_bucket_count(size() + 1));
+    bucket_size = (I_T)std::min<int64_t>(new_size, std::numeric_limits<I_T>::max());
+    update_grow_threshold();
+
+    rebuild_index();
+  }
+
+  // The map grows once its size exceeds max_load * bucket_size. With the
+  // most buckets I_T can count it has nothing to grow to, only the size
+  // limit is left.
+  void update_grow_threshold() {
+    double threshold = (double)max_load * bucket_size;
+    if (bucket_size == std::numeric_limits<I_T>::max()) {
+      threshold = std::numeric_limits<I_T>::max();
+    }
+    grow_threshold = (I_T)std::min(threshold, (double)std::numeric_limits<I_T>::max());
+  }
+
+  // Fewest buckets holding n elements under max_load
+  int64_t min_bucket_count(int64_t n) const {
+    return (int64_t)std::ceil(n / (double)max_load) + 1;
+  }
+
+  // Make value_container dense, pointing the buckets to the moved values
+  void fill_holes() {
+    if (values.get_hole_count() == 0) {
+      return;
+    }
+    if (buckets == NULL) {
+      values.fill_holes([](I_T, I_T) {});
+      return;
+    }
+    // Moves are queued by blocks, so their buckets can be prefetched
+    const int block = 16;
+    I_T from[block];
+    I_T to[block];
+    int moves = 0;
+    auto flush = [&]() {
+      for (int j = 0; j < moves; ++j) {
+        buckets[bucket_of(values[to[j]].first)].replace_index(from[j], to[j]);
+      }
+      moves = 0;
+    };
+    values.fill_holes([&](I_T f, I_T t) {
+      __builtin_prefetch(&buckets[bucket_of(values[t].first)]);
+      from[moves] = f;
+      to[moves] = t;
+      if (++moves == block) {
+        flush();
+      }
+    });
+    flush();
+  }
 
+  // Index every value again, in one pass over value_container
+  void rebuild_index() {
+    free_buckets();
+    if (csr_threads > 0) {
+      rebuild_csr();
+      return;
+    }
+    bucket_allocator alloc(get_allocator());
+    buckets = bucket_traits::allocate(alloc, bucket_size);
+    for (I_T i = 0; i < bucket_size; ++i) {
+      bucket_traits::construct(alloc, buckets + i, get_allocator());
+    }
+    allocated_buckets = bucket_size;
+    epoch = 0;
+
+    I_T end = get_end_index();
+    for (I_T i = get_begin_index(); i < end; ++i) {
+      if (!values.is_hole(i)) {
+        buckets[bucket_of(values[i].first)].record_value_index(i, values[i].first);
+      }
+    }
+  }
+
+  // Index every value again by a counting sort, see csr_index(). The buckets
+  // are cut in parts of 2^16, whose counters stay in cache:
+  //   1. each thread counts the values of a range of value_container per part
+  //   2. each thread copies the indices of its range to their part, with
+  //      their bucket in the part and their tag; the prefix sums of the
+  //      counts give where
+  //   3. each thread takes whole parts: counts the values per bucket and
+  //      sizes the runs of the part
+  //   4. then groups the indices of the part by bucket and fills its buckets
+  //      in order
+  // Every step keeps the order of value_container, so each bucket ends up
+  // as if its values were indexed one by one. The keys are read in the
+  // first two steps only, both sequential.
+  void rebuild_csr() {
+    typedef typename bucket_type::tagged_index tagged_index;
+    struct part_entry {
+      I_T idx;
+      uint16_t bucket;
+      uint8_t tag;
+    };
+    const int part_bits = 16;
+    const int64_t part_size = (int64_t)1 << part_bits;
+    I_T begin = get_begin_index();
+    I_T end = get_end_index();
+    int64_t parts = ((int64_t)bucket_size + part_size - 1) >> part_bits;
+    int workers = (int)std::max<int64_t>(1, std::min<int64_t>(csr_threads, end - begin));
+
+    std::vector<int64_t> offsets((size_t)workers * parts, 0);
+    std::vector<int64_t> part_begin(parts + 1, 0);
+    std::vector<part_entry> sorted(size());
+    auto range_of = [&](int t, I_T &lo, I_T &hi) {
+      lo = (I_T)(begin + (int64_t)(end - begin) * t / workers);
+      hi = (I_T)(begin + (int64_t)(end - begin) * (t + 1) / workers);
+    };
+    run_workers(workers, [&](int t) {
+      I_T lo, hi;
+      range_of(t, lo, hi);
+      int64_t *count = &offsets[(size_t)t * parts];
+      for (I_T i = lo; i < hi; ++i) {
+        if (!values.is_hole(i)) {
+          count[bucket_of(values[i].first) >> part_bits] += 1;
+        }
+      }
+    });
+    // Part by part, then thread by thread within a part
+    int64_t next = 0;
+    for (int64_t p = 0; p < parts; ++p) {
+      part_begin[p] = next;
+      for (int t = 0; t < workers; ++t) {
+        int64_t n = offsets[(size_t)t * parts + p];
+        offsets[(size_t)t * parts + p] = next;
+        next += n;
+      }
+    }
+    part_begin[parts] = next;
+    run_workers(workers, [&](int t) {
+      I_T lo, hi;
+      range_of(t, lo, hi);
+      int64_t *pos = &offsets[(size_t)t * parts];
+      for (I_T i = lo; i < hi; ++i) {
+        if (!values.is_hole(i)) {
+          I_T b = bucket_of(values[i].first);
+          part_entry e = { i, (uint16_t)b, bucket_type::key_tag(values[i].first) };
+          sorted[pos[b >> part_bits]++] = e;
+        }
+      }
+    });
+
+    // A bucket with more than 4 values owns a run: the indices past the 4th
+    // and the end marker
+    std::vector<int64_t> run_begin(parts + 1, 0);
+    std::vector<std::vector<I_T> > counts(workers, std::vector<I_T>(part_size + 1));
+    auto count_part = [&](int64_t p, std::vector<I_T> &count) {
+      std::fill(count.begin(), count.end(), 0);
+      for (int64_t j = part_begin[p]; j < part_begin[p + 1]; ++j) {
+        count[sorted[j].bucket + 1] += 1;
+      }
+    };
+    run_workers(workers, [&](int t) {
+      for (int64_t p = t; p < parts; p += workers) {
+        count_part(p, counts[t]);
+        int64_t n = 0;
+        for (int64_t b = 1; b <= part_size; ++b) {
+          n += counts[t][b] > 4 ? counts[t][b] - 3 : 0;
+        }
+        run_begin[p + 1] = n;
+      }
+    });
+    for (int64_t p = 0; p < parts; ++p) {
+      run_begin[p + 1] += run_begin[p];
+    }
+    runs.resize(run_begin[parts]);
+
+    bucket_allocator alloc(get_allocator());
+    buckets = bucket_traits::allocate(alloc, bucket_size);
+    allocated_buckets = bucket_size;
+    epoch = 0;
+
+    std::vector<std::vector<tagged_index> > grouped(workers);
+    run_workers(workers, [&](int t) {
+      std::vector<I_T> &count = counts[t];
+      std::vector<tagged_index> &group = grouped[t];
+      for (int64_t p = t; p < parts; p += workers) {
+        // Group the indices of the part by bucket, count[b] becomes the end
+        // of bucket b
+        count_part(p, count);
+        for (int64_t b = 0; b < part_size; ++b) {
+          count[b + 1] += count[b];
+        }
+        group.resize(part_begin[p + 1] - part_begin[p]);
+        for (int64_t j = part_begin[p]; j < part_begin[p + 1]; ++j) {
+          tagged_index e = { sorted[j].idx, sorted[j].tag };
+          group[count[sorted[j].bucket]++] = e;
+        }
+
+        I_T first_bucket = (I_T)(p << part_bits);
+        I_T last_bucket = (I_T)std::min<int64_t>((int64_t)first_bucket + part_size, bucket_size);
+        int64_t run = run_begin[p];
+        I_T j = 0;
+        for (I_T b = first_bucket; b < last_bucket; ++b) {
+          bucket_type *bucket = buckets + b;
+          bucket_traits::construct(alloc, bucket, get_allocator());
+          I_T bucket_end = count[b - first_bucket];
+          for (int k = 0; j < bucket_end && k < 4; ++j, ++k) {
+            bucket->record_tagged_index(group[j]);
+          }
+          if (j < bucket_end) {
+            bucket->attach_run(&runs[run]);
+            for (; j < bucket_end; ++j) {
+              runs[run++] = group[j];
+            }
+            tagged_index last = { -1, 0 };
+            runs[run++] = last;
+          }
+        }
+      }
+    });
+  }
+
+  I_T bucket_of(const K_T &key) const {
+    return (I_T)((uint64_t)key % bucket_size);
+  }
+
+  // The key marking holes in value_container cannot be stored: iteration
+  // would skip it, and fill_holes() would move other values over it
+  static void check_key(const K_T &key) {
+    if (unlikely(key == decltype(values)::hole_key())) {
+      throw std::invalid_argument("index_map: the key (K_T)-1 is reserved");
+    }
+  }
+
+  // A new key is refused once value_container has no slot left, before its
+  // bucket records an index for it
+  void check_room(const K_T &key) {
+    if (unlikely(values.full()) && find(key) == end()) {
+      throw std::length_error("index_map: more values than I_T can index");
+    }
+  }
+
+  // upsert() in the bucket of the key, once the map has buckets
+  template<typename F>
+  V_T &upsert_in(I_T bucket_idx, const K_T &key, const V_T &init, F fn) {
+    std::pair<I_T *, bool> ret = writable_bucket(bucket_idx).insert(values.data(), key);
+    if (ret.second) {
+      I_T value_idx = values.insert(key, init);
+      *ret.first = value_idx;
+      return values[value_idx].second;
+    }
+    values.mark(*ret.first);
+    V_T &value = values[*ret.first].second;
+    fn(value);
+    return value;
+  }
+
+  // Allocate the buckets of a small map and index its values
+  void promote() {
+    bucket_size = (I_T)std::min<int64_t>(std::max<int64_t>(bucket_size, min_bucket_count(size() + 1)),
+                                         std::numeric_limits<I_T>::max());
+    update_grow_threshold();
+    rebuild_index();
+  }
+
+  // Index of the key in value_container by a linear scan, -1 means not found
+  I_T small_find(const K_T &key) {
+    I_T end = get_end_index();
+    for (I_T i = 0; i < end; ++i) {
+      if (values[i].first == key && !values.is_hole(i)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // The combine function of a merge policy
+  struct policy_combiner {
+    explicit policy_combiner(index_map_merge_policy policy): overwrite(policy == INDEX_MAP_MERGE_OVERWRITE) {}
+    void operator()(V_T &value, const V_T &other_value) const {
+      if (overwrite) {
+        value = other_value;
+      }
+    }
+    bool overwrite;
+  };
+
+  template<typename F>
+  I_T merge_shards(index_map *const *shards, size_t n, F combine, int threads) {
+    I_T before = size();
+    int64_t incoming = 0;
+    for (size_t s = 0; s < n; ++s) {
+      if (shards[s] != this) {
+        incoming += shards[s]->size();
+      }
+    }
+    // The values of the shards are copied after ours before the duplicates
+    // are dropped
+    if (get_end_index() + incoming > (int64_t)max_size()) {
+      throw std::length_error("index_map: more values than I_T can index");
+    }
+
+    // Everything fits in a small map
+    if (buckets == NULL && before + incoming <= INDEX_MAP_SMALL_SIZE) {
+      for (size_t s = 0; s < n; ++s) {
+        index_map &shard = *shards[s];
+        I_T end = &shard != this ? shard.get_end_index() : 0;
+        for (I_T i = 0; i < end; ++i) {
+          if (!shard.values.is_hole(i)) {
+            std::pair<iterator, bool> ret = insert(shard.values[i]);
+            if (!ret.second) {
+              combine(ret.first->second, shard.values[i].second);
+            }
+          }
+        }
+      }
+      return size() - before;
+    }
+
+    // Size the buckets once for both. A map that grows at least triples,
+    // as on insert, so a series of merges does not rehash every time.
+    int64_t need = min_bucket_count(before + incoming);
+    if (buckets == NULL) {
+      rehash(std::max<int64_t>(need, bucket_size));
+      rebuild_index();
+    } else if (need > bucket_size) {
+      rehash(std::max<int64_t>(need, (int64_t)bucket_size * 3 + 1));
+    }
+
+    // Copy the values of the shards after ours, each thread copies a share
+    // of the shards
+    I_T first = values.append((I_T)incoming);
+    std::vector<I_T> offsets(n);
+    for (size_t s = 0, next = first; s < n; ++s) {
+      offsets[s] = (I_T)next;
+      next += shards[s] != this ? shards[s]->size() : 0;
+    }
+    int workers = std::max(1, std::min<int>(threads, (int)n));
+    run_workers(workers, [&](int t) {
+      for (size_t s = t; s < n; s += workers) {
+        if (shards[s] == this) {
+          continue;
+        }
+        index_map &shard = *shards[s];
+        I_T end = shard.get_end_index();
+        I_T out = offsets[s];
+        for (I_T i = 0; i < end; ++i) {
+          if (!shard.values.is_hole(i)) {
+            values[out++] = shard.values[i];
+          }
+        }
+      }
+    });
+
+    // Index the new range, each thread owns a range of buckets. Values are
+    // indexed in order, so the first of the duplicates of a key is kept and
+    // the following ones are combined into it.
+    I_T end = get_end_index();
+    if (!std::is_same<A_T, std::allocator<std::pair<K_T, V_T> > >::value) {
+      threads = 1;
+    }
+    workers = (int)std::max<int64_t>(1, std::min<int64_t>(threads, bucket_size));
+    std::vector<std::vector<I_T> > duplicates(workers);
+    run_workers(workers, [&](int t) {
+      I_T lo = (I_T)((int64_t)bucket_size * t / workers);
+      I_T hi = (I_T)((int64_t)bucket_size * (t + 1) / workers);
+      for (I_T i = first; i < end; ++i) {
+        I_T bucket_idx = bucket_of(values[i].first);
+        if (bucket_idx < lo || bucket_idx >= hi) {
+          continue;
+        }
+        std::pair<I_T *, bool> ret = writable_bucket(bucket_idx).insert(values.data(), values[i].first);
+        if (ret.second) {
+          *ret.first = i;
+        } else {
+          combine(values[*ret.first].second, values[i].second);
+          duplicates[t].push_back(i);
+        }
+      }
+    });
+
+    // Other threads read the keys until they are done
+    for (int t = 0; t < workers; ++t) {
+      for (size_t j = 0; j < duplicates[t].size(); ++j) {
+        values.discard(duplicates[t][j]);
+      }
+    }
+    // The workers combined values in place without marking their slots
+    values.mark_all();
+    fill_holes();
+    return size() - before;
+  }
+
+  // Run work(t) for t in [0, workers), on threads if there is more than one
+  template<typename W>
+  static void run_workers(int workers, W work) {
+    if (workers == 1) {
+      work(0);
+      return;
+    }
+    std::vector<std::thread> pool;
+    for (int t = 0; t < workers; ++t) {
+      pool.push_back(std::thread(work, t));
+    }
+    for (int t = 0; t < workers; ++t) {
+      pool[t].join();
+    }
+  }
+
+  void free_buckets() {
+    if (buckets == NULL) {
+      return;
+    }
+    bucket_allocator alloc(get_allocator());
+    for (I_T i = 0; i < allocated_buckets; ++i) {
+      bucket_traits::destroy(alloc, buckets + i);
+    }
+    bucket_traits::deallocate(alloc, buckets, allocated_buckets);
+    buckets = NULL;
+    allocated_buckets = 0;
+    // Release the runs, only the buckets pointed to them
+    typename bucket_type::overflow_list(runs.get_allocator()).swap(runs);
+  }
+
+  // Whether the bucket is left over from before a clear()
+  bool stale(I_T bucket_idx) const {
+    return unlikely(buckets[bucket_idx].get_generation() != epoch);
+  }
+
+  // The bucket, emptied first if it is left over from before a clear()
+  bucket_type &writable_bucket(I_T bucket_idx) {
+    if (stale(bucket_idx)) {
+      buckets[bucket_idx].renew(epoch);
+    }
+    return buckets[bucket_idx];
+  }
+
+private:
+  I_T bucket_size;
+  float max_load;
+  // Size above which the map grows
+  I_T grow_threshold;
+  // Generation of the live buckets, bumped by clear()
+  uint32_t epoch;
+
+  // NULL while the map holds at most INDEX_MAP_SMALL_SIZE values
+  bucket_type *buckets;
+  // Size of the bucket array, bucket_size may already be the next one
+  I_T allocated_buckets;
+  // Threads of the CSR rebuild, 0 when it is off (see csr_index)
+  int csr_threads;
+  // Overflow runs of the buckets filled by the CSR rebuild
+  typename bucket_type::overflow_list runs;
+
+  value_container<K_T, V_T, I_T, A_T> values;
+};
+
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+
+// index_map on a std::pmr::memory_resource, e.g. a monotonic arena
+template<typename K_T, typename V_T, typename I_T = int>
+using pmr_index_map = index_map<K_T, V_T, I_T, std::pmr::polymorphic_allocator<std::pair<K_T, V_T> > >;
+#endif
+
+// A set with the buckets of index_map, storing only keys.
+//
+// The keys are kept dense in one array, without holes: erase moves the last
+// key into the erased slot and updates its index in the bucket. Iteration and
+// bulk scans run over a plain array of K_T, and the memory per key is
+// sizeof(K_T) plus the bucket share. Buckets hold 2 keys on average before
+// the set grows, which still fits most keys in the 4 inline indices.
+template<typename K_T, typename I_T = int>
+class index_set {
+public:
+  typedef const K_T *iterator;
+  typedef const K_T *const_iterator;
+
+  index_set(): index_set(INDEX_MAP_INIT_BUCKETS) {}
+
+  index_set(I_T _bucket_size):
+    bucket_size(_bucket_size) {
+    buckets = new index_bucket<K_T, void, I_T>[bucket_size];
+  }
+
+  index_set(const index_set &s) : index_set(s.bucket_size) {
+    insert(s.begin(), s.end());
+  }
+
+  index_set &operator=(index_set s) {
+    swap(s);
+    return *this;
+  }
+
+  virtual ~index_set() {
     delete[] buckets;
-    buckets = new index_bucket<K_T, V_T>[bucket_size];
+  }
+
+  // Return iterator, and a bool value indicating whether the key was successfully inserted or not
+  std::pair<iterator, bool> insert(const K_T &key) {
+    if ((int64_t)size() >= (int64_t)bucket_size * 2 && bucket_size < std::numeric_limits<I_T>::max()) {
+      rehash();
+    }
+
+    std::pair<I_T *, bool> ret = buckets[bucket_of(key)].insert(keys.data(), key);
+    if (ret.second) {
+      *ret.first = (I_T)keys.size();
+      keys.push_back(key);
+    }
+    return std::make_pair(keys.data() + *ret.first, ret.second);
+  }
+
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) {
+    for (InputIt it = first; it != last; ++it) {
+      insert(*it);
+    }
+  }
+
+  I_T size() const {
+    return (I_T)keys.size();
+  }
+
+  bool empty() const {
+    return keys.empty();
+  }
+
+  I_T bucket_count() const {
+    return bucket_size;
+  }
+
+  iterator begin() const {
+    return keys.data();
+  }
+
+  iterator end() const {
+    return keys.data() + keys.size();
+  }
 
-    // Rehash to buckets
-    int end = get_end_index();
-    for (int i = get_begin_index(); i < end; ++i) {
-      if (values[i].first >= 0) {
-        int bucket_idx = (int)(values[i].first % bucket_size);
-        buckets[bucket_idx].record_value_index(i);
+  // The keys in insertion order, as long as nothing was erased
+  const K_T *data() const {
+    return keys.data();
+  }
+
+  // Removes the key
+  int erase(const K_T &key) {
+    I_T idx = buckets[bucket_of(key)].erase(keys.data(), key);
+    if (idx == -1) {
+      return 0;
+    }
+
+    // Fill the hole with the last key
+    I_T last = (I_T)keys.size() - 1;
+    if (idx != last) {
+      buckets[bucket_of(keys[last])].replace_index(last, idx);
+      keys[idx] = keys[last];
+    }
+    keys.pop_back();
+    return 1;
+  }
+
+  int count(const K_T &key) const {
+    I_T idx = buckets[bucket_of(key)].find(keys.data(), key);
+    record_lookup(idx);
+    return idx != -1 ? 1 : 0;
+  }
+
+  iterator find(const K_T &key) const {
+    I_T idx = buckets[bucket_of(key)].find(keys.data(), key);
+    record_lookup(idx);
+    return idx != -1 ? keys.data() + idx : end();
+  }
+
+  // Membership of 'n' keys at once: found[i] is set to whether keys[i] is
+  // in the set. The buckets of a block are prefetched before they are
+  // probed. Returns the number of keys found.
+  size_t count_batch(const K_T *query, size_t n, bool *found) const {
+    const size_t block = 16;
+    I_T bucket_idx[block];
+    size_t hits = 0;
+
+    for (size_t base = 0; base < n; base += block) {
+      size_t len = std::min(block, n - base);
+      for (size_t i = 0; i < len; ++i) {
+        bucket_idx[i] = bucket_of(query[base + i]);
+        __builtin_prefetch(&buckets[bucket_idx[i]]);
+      }
+      for (size_t i = 0; i < len; ++i) {
+        I_T idx = buckets[bucket_idx[i]].find(keys.data(), query[base + i]);
+        record_lookup(idx);
+        found[base + i] = (idx != -1);
+        hits += found[base + i];
       }
     }
+    return hits;
+  }
+
+  // Remove all the keys
+  void clear() {
+    bucket_size = INDEX_MAP_INIT_BUCKETS;
+
+    delete[] buckets;
+    buckets = new index_bucket<K_T, void, I_T>[bucket_size];
+
+    std::vector<K_T>().swap(keys);
+  }
+
+  void swap(index_set &s) {
+    std::swap(bucket_size, s.bucket_size);
+    std::swap(buckets, s.buckets);
+    keys.swap(s.keys);
+  }
+
+  // Bytes used by the buckets, their overflow lists and the keys
+  size_t memory_usage() const {
+    size_t bytes = sizeof(*this) + keys.capacity() * sizeof(K_T);
+    for (I_T i = 0; i < bucket_size; ++i) {
+      bytes += buckets[i].memory_usage();
+    }
+    return bytes;
+  }
+
+private:
+  I_T bucket_of(const K_T &key) const {
+    return (I_T)((uint64_t)key % bucket_size);
+  }
+
+  void record_lookup(I_T idx) const {
+    INDEX_MAP_STAT_INC(finds);
+    if (idx != -1) {
+      INDEX_MAP_STAT_INC(hits);
+    } else {
+      INDEX_MAP_STAT_INC(misses);
+    }
+  }
+
+  void rehash() {
+    INDEX_MAP_STAT_INC(rehashes);
+    INDEX_MAP_STAT_TIMER(rehash_ns);
+
+    // Grow to 2n+1 buckets, without wrapping around I_T
+    int64_t new_size = (int64_t)bucket_size * 2 + 1;
+    bucket_size = (I_T)std::min<int64_t>(new_size, std::numeric_limits<I_T>::max());
+
+    delete[] buckets;
+    buckets = new index_bucket<K_T, void, I_T>[bucket_size];
+
+    for (I_T i = 0; i < (I_T)keys.size(); ++i) {
+      buckets[bucket_of(keys[i])].record_value_index(i, keys[i]);
+    }
   }
 
 private:
-  int bucket_size;
+  I_T bucket_size;
 
-  index_bucket<K_T, V_T> *buckets;
+  index_bucket<K_T, void, I_T> *buckets;
 
-  value_container<K_T, V_T> values;
+  // All keys, without holes
+  std::vector<K_T> keys;
 };
@@ -0,0 +1,181 @@
+#ifndef __INDEX_MAP_JOIN_H_
+#define __INDEX_MAP_JOIN_H_
+
+// Hash join of two integer-keyed columns on index_map (index_map_for_find.h).
+//
+// build() takes the key and payload columns of the build side. It splits the
+// rows in 2^partition_bits partitions by the top bits of a multiplicative
+// hash of the key, then builds one index_map per partition, one partition at
+// a time. The maps hold INDEX_MAP_JOIN_LOAD_FACTOR keys per bucket, so the
+// inline keys of a bucket are mostly in use and a probe compares them at
+// once. The build keys are expected to be unique, e.g. a primary key; of
+// duplicate keys the first row is kept.
+//
+// probe() looks up a key column and writes the row and the build payload of
+// every key found:
+//   - with a single partition, the column is probed in blocks with
+//     index_map::probe_batch(), which prefetches the buckets of a block and
+//     compares the inline keys of a bucket with vector instructions
+//   - with several partitions, the probe rows are first radix-partitioned
+//     like the build rows, then each partition is probed as a whole, while
+//     its map stays in the L2 cache. The matches come out partition by
+//     partition.
+// partition_bits_for() picks the partitions for a build size.
+#include <stdint.h>
+#include <vector>
+#include "index_map_for_find.h"
+
+#define INDEX_MAP_JOIN_LOAD_FACTOR 3.0f
+// Target size of the map of a partition, about an L2 cache
+#define INDEX_MAP_JOIN_PARTITION_BYTES (512 << 10)
+// Bytes per key of a map at INDEX_MAP_JOIN_LOAD_FACTOR, 44 measured for 64-bit
+// keys and payloads, rounded up
+#define INDEX_MAP_JOIN_BYTES_PER_KEY 48
+
+template<typename K_T, typename V_T>
+class index_map_join {
+public:
+  typedef index_map<K_T, V_T> map_type;
+
+  // 2^partition_bits partitions, 0 for a single map
+  explicit index_map_join(int partition_bits = 0):
+    bits_(partition_bits),
+    maps_((size_t)1 << partition_bits) {
+    assert(partition_bits >= 0 && partition_bits < 32);
+  }
+
+  // Fewest partition bits keeping the map of every partition of n build
+  // rows within INDEX_MAP_JOIN_PARTITION_BYTES
+  static int partition_bits_for(size_t n) {
+    int bits = 0;
+    while (bits < 24 &&
+           (n >> bits) * INDEX_MAP_JOIN_BYTES_PER_KEY > INDEX_MAP_JOIN_PARTITION_BYTES) {
+      bits += 1;
+    }
+    return bits;
+  }
+
+  // Index the n rows (keys[i], payloads[i]), replacing the previous build
+  void build(const K_T *keys, const V_T *payloads, size_t n) {
+    for (size_t p = 0; p < maps_.size(); ++p) {
+      map_type().swap(maps_[p]);
+      maps_[p].max_load_factor(INDEX_MAP_JOIN_LOAD_FACTOR);
+    }
+    if (bits_ == 0) {
+      size_for(maps_[0], n);
+      for (size_t i = 0; i < n; ++i) {
+        maps_[0].insert(std::make_pair(keys[i], payloads[i]));
+      }
+      return;
+    }
+
+    // Group the rows by partition, then fill the maps one by one
+    std::vector<size_t> offsets;
+    count_partitions(keys, n, offsets);
+    std::vector<std::pair<K_T, V_T> > grouped(n);
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < n; ++i) {
+      grouped[next[partition_of(keys[i])]++] = std::make_pair(keys[i], payloads[i]);
+    }
+    for (size_t p = 0; p < maps_.size(); ++p) {
+      size_for(maps_[p], offsets[p + 1] - offsets[p]);
+      for (size_t i = offsets[p]; i < offsets[p + 1]; ++i) {
+        maps_[p].insert(grouped[i]);
+      }
+    }
+  }
+
+  // Look up the n keys. For every key found, append its row (its index in
+  // keys) to rows and the payload of its build row to payloads, which must
+  // hold n entries. Returns the number of matches.
+  size_t probe(const K_T *keys, size_t n, size_t *rows, V_T *payloads) const {
+    if (bits_ == 0) {
+      // Blocks of rows, so the output of a block follows its input closely
+      const size_t block = 4096;
+      size_t matches = 0;
+      for (size_t base = 0; base < n; base += block) {
+        size_t len = std::min(block, n - base);
+        size_t found = maps_[0].probe_batch(keys + base, len, NULL, rows + matches, payloads + matches);
+        for (size_t i = matches; i < matches + found; ++i) {
+          rows[i] += base;
+        }
+        matches += found;
+      }
+      return matches;
+    }
+
+    std::vector<size_t> offsets;
+    count_partitions(keys, n, offsets);
+    std::vector<K_T> grouped_keys(n);
+    std::vector<size_t> grouped_rows(n);
+    std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < n; ++i) {
+      size_t at = next[partition_of(keys[i])]++;
+      grouped_keys[at] = keys[i];
+      grouped_rows[at] = i;
+    }
+    size_t matches = 0;
+    for (size_t p = 0; p < maps_.size(); ++p) {
+      size_t first = offsets[p];
+      matches += maps_[p].probe_batch(grouped_keys.data() + first, offsets[p + 1] - first,
+                                      grouped_rows.data() + first, rows + matches, payloads + matches);
+    }
+    return matches;
+  }
+
+  // Build rows indexed
+  size_t size() const {
+    size_t n = 0;
+    for (size_t p = 0; p < maps_.size(); ++p) {
+      n += maps_[p].size();
+    }
+    return n;
+  }
+
+  size_t partition_count() const {
+    return maps_.size();
+  }
+
+  const map_type &partition(size_t p) const {
+    return maps_[p];
+  }
+
+  // Bytes used by the maps of all partitions
+  size_t memory_usage() const {
+    size_t bytes = sizeof(*this);
+    for (size_t p = 0; p < maps_.size(); ++p) {
+      bytes += maps_[p].memory_usage();
+    }
+    return bytes;
+  }
+
+private:
+  // Set the bucket count of an empty map for n keys. reserve() would keep
+  // the default bucket count of a new map, far too many for a small
+  // partition.
+  static void size_for(map_type &m, size_t n) {
+    m.rehash((size_t)(n / INDEX_MAP_JOIN_LOAD_FACTOR) + 1);
+  }
+
+  size_t partition_of(const K_T &key) const {
+    return bits_ == 0 ? 0 : (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> (64 - bits_));
+  }
+
+  // offsets[p] is the first row of partition p once the rows are grouped by
+  // partition, offsets[partition_count()] is n
+  void count_partitions(const K_T *keys, size_t n, std::vector<size_t> &offsets) const {
+    offsets.assign(maps_.size() + 1, 0);
+    for (size_t i = 0; i < n; ++i) {
+      offsets[partition_of(keys[i]) + 1] += 1;
+    }
+    for (size_t p = 0; p < maps_.size(); ++p) {
+      offsets[p + 1] += offsets[p];
+    }
+  }
+
+private:
+  int bits_;
+  std::vector<map_type> maps_;
+};
+
+#endif
@@ -0,0 +1,391 @@
+#ifndef __INDEX_MAP_MPHF_H_
+#define __INDEX_MAP_MPHF_H_
+
+#include <stdint.h>
+#include <cassert>
+#include <cstdlib>
+#include <cmath>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include "index_map_filter.h"
+
+// A frozen map over a very large key set, built once, e.g. an hourly rebuilt
+// read-only table, on a minimal perfect hash function (BBHash, Limasset et
+// al. 2017).
+//
+// The n keys go through levels of bit arrays. Level l has gamma times as
+// many bits as keys left; a key whose hash position is not shared with any
+// other key sets its bit there, the others go on to the next level. The slot
+// of a key is the rank of its bit among all the set bits, so the slots are
+// exactly [0, n) and the records are stored densely in slot order. The keys
+// left after the last level (INDEX_MAP_MPHF_MAX_LEVELS by default), very
+// few, take the last slots through a sorted fallback list.
+//
+// The bits are stored in blocks of one cache line: the count of set bits
+// before the block, then 7 words of bits. A level costs a single line read,
+// bit and rank together, and the key stored in the slot is compared to
+// reject non-members, so a lookup reads one record line. With gamma 1 the
+// index takes about 3.1 bits per key and a hit tests 2.7 levels on average;
+// with gamma 2, 3.8 bits per key and 1.65 levels. find_batch() walks the
+// levels of a block of keys together, with prefetches.
+//
+// build() and build_columns() run the levels on several threads, with atomic
+// bit updates. Keys must be unique. The map cannot be modified, only built
+// again.
+#define INDEX_MAP_MPHF_GAMMA 1.0
+#define INDEX_MAP_MPHF_MAX_LEVELS 32
+// Words of bits per 64-byte block, after the rank word
+#define INDEX_MAP_MPHF_BLOCK_WORDS 7
+
+template<typename K_T, typename V_T>
+class mphf_index_map {
+public:
+      typedef          K_T                       key_type;
+      typedef          V_T                       value_type;
+      typedef          std::pair<K_T, V_T>       record_type;
+      typedef typename std::vector<record_type>::const_iterator const_iterator;
+      typedef          const_iterator            iterator;
+
+  // Past max_levels, the keys left go to the fallback list: fewer levels
+  // bound the misses of a lookup, at the cost of binary searches
+  explicit mphf_index_map(double gamma = INDEX_MAP_MPHF_GAMMA,
+                          int max_levels = INDEX_MAP_MPHF_MAX_LEVELS):
+      gamma_(gamma),
+      max_levels_(max_levels),
+      blocks_(NULL),
+      block_count_(0) {
+      assert(gamma >= 0.5);
+  }
+
+  mphf_index_map(const mphf_index_map &) = delete;
+  mphf_index_map &operator=(const mphf_index_map &) = delete;
+
+  mphf_index_map(mphf_index_map&& other): mphf_index_map(other.gamma_, other.max_levels_) {
+      swap(other);
+  }
+
+  ~mphf_index_map() {
+      free(blocks_);
+  }
+
+  void swap(mphf_index_map &other) {
+      std::swap(gamma_, other.gamma_);
+      std::swap(max_levels_, other.max_levels_);
+      std::swap(blocks_, other.blocks_);
+      std::swap(block_count_, other.block_count_);
+      levels_.swap(other.levels_);
+      fallback_.swap(other.fallback_);
+      records_.swap(other.records_);
+  }
+
+  // Build from the unique keys of [first, last), e.g. the iterators of an
+  // index_map, replacing the current content
+  template<typename ForwardIt>
+  void build(ForwardIt first, ForwardIt last, int threads = 1) {
+      std::vector<K_T> keys;
+      std::vector<V_T> values;
+      for (ForwardIt it = first; it != last; ++it) {
+          keys.push_back(it->first);
+          values.push_back(it->second);
+      }
+      build_columns(keys.data(), values.data(), keys.size(), threads);
+  }
+
+  // Build from n unique keys and their values. Throws std::invalid_argument
+  // on a duplicate key, leaving the map empty.
+  void build_columns(const K_T *keys, const V_T *values, uint64_t n, int threads = 1) {
+      std::vector<record_type>().swap(records_);
+      int workers = (int)std::max<uint64_t>(1, std::min<uint64_t>(threads, n / 4096 + 1));
+      build_levels(keys, n, workers);
+
+      std::vector<record_type>(n).swap(records_);
+      run_workers(workers, [&](int t) {
+          for (uint64_t i = n * t / workers; i < n * (t + 1) / workers; ++i) {
+              records_[slot_of(keys[i])] = record_type(keys[i], values[i]);
+          }
+      });
+  }
+
+  // The value of the key, NULL if it is absent
+  const V_T *find(const K_T &key) const {
+      uint64_t slot = slot_of(key);
+      if (slot < records_.size() && records_[slot].first == key) {
+          return &records_[slot].second;
+      }
+      return NULL;
+  }
+
+  // Look up 'n' keys at once: values[i] is set to the value of keys[i], or
+  // NULL if it is absent. The keys of a block go through the levels
+  // together: the lines of a level are prefetched for the keys not placed
+  // yet, then tested, then the records of the block are prefetched before
+  // any is read. Returns the number of keys found.
+  uint64_t find_batch(const K_T *keys, uint64_t n, const V_T **values) const {
+      const uint64_t block = 16;
+      uint64_t slots[block];
+      uint64_t pos[block];
+      uint64_t pending[block];
+      uint64_t hits = 0;
+      for (uint64_t base = 0; base < n; base += block) {
+          uint64_t len = std::min(block, n - base);
+          uint64_t left = 0;
+          for (uint64_t i = 0; i < len; ++i) {
+              slots[i] = size();
+              pending[left++] = i;
+          }
+          for (size_t l = 0; l < levels_.size() && left > 0; ++l) {
+              for (uint64_t j = 0; j < left; ++j) {
+                  uint64_t i = pending[j];
+                  pos[i] = levels_[l].offset +
+                           index_map_filter_reduce(level_hash(keys[base + i], l), levels_[l].bits);
+                  __builtin_prefetch(&blocks_[word_of(pos[i])]);
+              }
+              uint64_t still = 0;
+              for (uint64_t j = 0; j < left; ++j) {
+                  uint64_t i = pending[j];
+                  if (blocks_[word_of(pos[i])] >> (pos[i] % 64) & 1) {
+                      slots[i] = rank(pos[i]);
+                      __builtin_prefetch(&records_[slots[i]]);
+                  } else {
+                      pending[still++] = i;
+                  }
+              }
+              left = still;
+          }
+          for (uint64_t j = 0; j < left && !fallback_.empty(); ++j) {
+              slots[pending[j]] = fallback_slot(keys[base + pending[j]]);
+          }
+          for (uint64_t i = 0; i < len; ++i) {
+              const record_type *r = slots[i] < size() ? &records_[slots[i]] : NULL;
+              values[base + i] = r != NULL && r->first == keys[base + i] ? &r->second : NULL;
+              hits += values[base + i] != NULL;
+          }
+      }
+      return hits;
+  }
+
+  const V_T &at(const K_T &key) const {
+      const V_T *value = find(key);
+      if (value == NULL) {
+          throw std::out_of_range("Cannot find the key");
+      }
+      return *value;
+  }
+
+  std::size_t count(const K_T &key) const {
+      return find(key) != NULL;
+  }
+
+  uint64_t size() const {
+      return records_.size();
+  }
+
+  bool empty() const {
+      return records_.empty();
+  }
+
+  // The records, in slot order
+  const_iterator begin() const {
+      return records_.begin();
+  }
+
+  const_iterator end() const {
+      return records_.end();
+  }
+
+  int level_count() const {
+      return (int)levels_.size();
+  }
+
+  // Keys past the last level
+  uint64_t fallback_count() const {
+      return fallback_.size();
+  }
+
+  // Bits per key of the hash function: the levels and the fallback list
+  double index_bits_per_key() const {
+      uint64_t bytes = block_count_ * 64 + levels_.size() * sizeof(mphf_level) +
+                       fallback_.size() * sizeof(fallback_.front());
+      return empty() ? 0 : bytes * 8.0 / size();
+  }
+
+  std::size_t memory_usage() const {
+      return sizeof(*this) + block_count_ * 64 + levels_.capacity() * sizeof(mphf_level) +
+             fallback_.capacity() * sizeof(fallback_.front()) +
+             records_.capacity() * sizeof(record_type);
+  }
+
+private:
+  struct mphf_level {
+      uint64_t offset;  // first bit of the level
+      uint64_t bits;
+  };
+
+  static uint64_t level_hash(const K_T &key, size_t level) {
+      return index_map_filter_hash((uint64_t)key, (level + 1) * 0x9E3779B97F4A7C15ull);
+  }
+
+  // Word of bit 'pos' in blocks_
+  static uint64_t word_of(uint64_t pos) {
+      uint64_t w = pos / 64;
+      return w / INDEX_MAP_MPHF_BLOCK_WORDS * 8 + 1 + w % INDEX_MAP_MPHF_BLOCK_WORDS;
+  }
+
+  // Set bits before 'pos', read from the block of pos. The words are
+  // counted in byte lanes, all of them masked rather than up to pos, and
+  // the lanes summed once: a short straight-line sequence, where a loop of
+  // __builtin_popcountll is a library call per word without -mpopcnt.
+  uint64_t rank(uint64_t pos) const {
+      uint64_t w = pos / 64;
+      const uint64_t *block = blocks_ + w / INDEX_MAP_MPHF_BLOCK_WORDS * 8;
+      uint64_t in_block = w % INDEX_MAP_MPHF_BLOCK_WORDS;
+      uint64_t lanes = 0;
+      for (uint64_t i = 0; i < INDEX_MAP_MPHF_BLOCK_WORDS; ++i) {
+          uint64_t x = block[1 + i] & (i < in_block ? ~0ull : i == in_block ? (1ull << (pos % 64)) - 1 : 0);
+          x = x - ((x >> 1) & 0x5555555555555555ull);
+          x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+          lanes += (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+      }
+      // At most 7 * 8 per byte lane; the sum of the lanes, up to 448, is
+      // taken in 16-bit lanes
+      lanes = (lanes & 0x00ff00ff00ff00ffull) + ((lanes >> 8) & 0x00ff00ff00ff00ffull);
+      return block[0] + ((lanes * 0x0001000100010001ull) >> 48);
+  }
+
+  // Slot of the key if it is a member, otherwise any slot or size()
+  uint64_t slot_of(const K_T &key) const {
+      for (size_t l = 0; l < levels_.size(); ++l) {
+          uint64_t pos = levels_[l].offset + index_map_filter_reduce(level_hash(key, l), levels_[l].bits);
+          if (blocks_[word_of(pos)] >> (pos % 64) & 1) {
+              return rank(pos);
+          }
+      }
+      return fallback_slot(key);
+  }
+
+  // Slot of a key past the last level, size() if it is not in the list
+  uint64_t fallback_slot(const K_T &key) const {
+      typename std::vector<std::pair<K_T, uint64_t> >::const_iterator it =
+          std::lower_bound(fallback_.begin(), fallback_.end(), std::make_pair(key, (uint64_t)0));
+      return it != fallback_.end() && it->first == key ? it->second : size();
+  }
+
+  void build_levels(const K_T *keys, uint64_t n, int workers) {
+      levels_.clear();
+      fallback_.clear();
+      std::vector<uint64_t> words;  // the bits of all levels, before blocking
+      std::vector<K_T> left(keys, keys + n);
+      std::vector<std::vector<K_T> > collided(workers);
+      for (size_t l = 0; (int)l < max_levels_ && !left.empty(); ++l) {
+          uint64_t bits = std::max<uint64_t>(64, (uint64_t)std::ceil(left.size() * gamma_ / 64) * 64);
+          mphf_level level = {words.size() * 64, bits};
+          std::vector<uint64_t> seen(bits / 64, 0), shared(bits / 64, 0);
+          bool atomic = workers > 1;
+          uint64_t m = left.size();
+
+          // Mark the positions taken by one key, then by several
+          run_workers(workers, [&](int t) {
+              for (uint64_t i = m * t / workers; i < m * (t + 1) / workers; ++i) {
+                  uint64_t pos = index_map_filter_reduce(level_hash(left[i], l), bits);
+                  uint64_t bit = 1ull << (pos % 64);
+                  uint64_t before;
+                  if (atomic) {
+                      before = __atomic_fetch_or(&seen[pos / 64], bit, __ATOMIC_RELAXED);
+                  } else {
+                      before = seen[pos / 64];
+                      seen[pos / 64] |= bit;
+                  }
+                  if ((before & bit) != 0) {
+                      if (atomic) {
+                          __atomic_fetch_or(&shared[pos / 64], bit, __ATOMIC_RELAXED);
+                      } else {
+                          shared[pos / 64] |= bit;
+                      }
+                  }
+              }
+          });
+          // The keys of shared positions go to the next level
+          run_workers(workers, [&](int t) {
+              collided[t].clear();
+              for (uint64_t i = m * t / workers; i < m * (t + 1) / workers; ++i) {
+                  uint64_t pos = index_map_filter_reduce(level_hash(left[i], l), bits);
+                  if (shared[pos / 64] >> (pos % 64) & 1) {
+                      collided[t].push_back(left[i]);
+                  }
+              }
+          });
+          for (uint64_t w = 0; w < seen.size(); ++w) {
+              words.push_back(seen[w] & ~shared[w]);
+          }
+          levels_.push_back(level);
+          left.clear();
+          for (int t = 0; t < workers; ++t) {
+              left.insert(left.end(), collided[t].begin(), collided[t].end());
+          }
+      }
+      set_blocks(words);
+
+      // The last keys take the slots after the ranked bits
+      uint64_t placed = n - left.size();
+      std::sort(left.begin(), left.end());
+      if (std::adjacent_find(left.begin(), left.end()) != left.end()) {
+          throw std::invalid_argument("mphf_index_map: duplicate key");
+      }
+      for (uint64_t i = 0; i < left.size(); ++i) {
+          fallback_.push_back(std::make_pair(left[i], placed + i));
+      }
+  }
+
+  // Lay out the bits in blocks of a rank word and 7 bit words
+  void set_blocks(const std::vector<uint64_t> &words) {
+      free(blocks_);
+      blocks_ = NULL;
+      block_count_ = (words.size() + INDEX_MAP_MPHF_BLOCK_WORDS - 1) / INDEX_MAP_MPHF_BLOCK_WORDS;
+      void *p = NULL;
+      if (posix_memalign(&p, 64, std::max<uint64_t>(block_count_, 1) * 64) != 0) {
+          throw std::bad_alloc();
+      }
+      blocks_ = (uint64_t *)p;
+      std::fill(blocks_, blocks_ + block_count_ * 8, 0);
+      uint64_t ranked = 0;
+      for (uint64_t w = 0; w < words.size(); ++w) {
+          uint64_t *block = blocks_ + w / INDEX_MAP_MPHF_BLOCK_WORDS * 8;
+          if (w % INDEX_MAP_MPHF_BLOCK_WORDS == 0) {
+              block[0] = ranked;
+          }
+          block[1 + w % INDEX_MAP_MPHF_BLOCK_WORDS] = words[w];
+          ranked += __builtin_popcountll(words[w]);
+      }
+  }
+
+  // Run work(t) for t in [0, workers), on threads if there is more than one
+  template<typename W>
+  static void run_workers(int workers, W work) {
+      if (workers == 1) {
+          work(0);
+          return;
+      }
+      std::vector<std::thread> pool;
+      for (int t = 0; t < workers; ++t) {
+          pool.push_back(std::thread(work, t));
+      }
+      for (int t = 0; t < workers; ++t) {
+          pool[t].join();
+      }
+  }
+
+private:
+  double gamma_;
+  int max_levels_;
+  uint64_t *blocks_;
+  uint64_t block_count_;
+  std::vector<mphf_level> levels_;
+  std::vector<std::pair<K_T, uint64_t> > fallback_;  // sorted by key
+  std::vector<record_type> records_;
+};
+
+#endif
@@ -0,0 +1,333 @@
+#ifndef __INDEX_MAP_QUOTIENT_H_
+#define __INDEX_MAP_QUOTIENT_H_
+
+#include "index_map_for_find.h"
+
+// A compact variant of index_map (index_map_for_find.h) using key quotienting.
+//
+// The bucket index of a key is 'key % bucket_count', so a bucket only needs
+// the quotient 'key / bucket_count' to tell its keys apart. The buckets store
+// the quotient in the narrower Q_T (e.g. uint32_t for uint64_t keys), both in
+// the inline key cache and in the records, and the full key is rebuilt as
+// 'quotient * bucket_count + bucket index' when iterating.
+//
+// Keys whose quotient does not fit in Q_T are kept in a regular index_map
+// ('spill'), so any key can be stored. Quotienting pays off when the keys are
+// below max(Q_T) * bucket_count, e.g. ids up to ~4 * 10^17 with 10^8 buckets.
+template<typename K_T, typename V_T, typename Q_T = uint32_t, typename S_T = uint32_t>
+class quotient_index_map {
+public:
+      class _Iterator;
+      typedef          K_T                       key_type;
+      typedef          V_T                       value_type;
+      typedef typename std::size_t               size_type;
+      typedef          S_T                       index_type;
+      typedef          _Iterator                 iterator;
+
+      // What the iterator points to, the key is rebuilt from the quotient
+      struct reference {
+          const K_T first;
+          V_T &second;
+          reference(K_T _first, V_T &_second) : first(_first), second(_second) {}
+      };
+
+private:
+      typedef index_bucket<Q_T, V_T> bucket_type;
+      typedef index_map<K_T, V_T, S_T> spill_type;
+
+public:
+  quotient_index_map(): quotient_index_map(INDEX_MAP_INIT_BUCKETS) {}
+
+  quotient_index_map(size_type bucket_size):
+      total_values_(0),
+      bucket_size_(bucket_size),
+      buckets_(new bucket_type[bucket_size]),
+      spill_(1) {
+  }
+
+  virtual ~quotient_index_map() {
+      delete[] buckets_;
+  }
+
+  class _Iterator {
+      public:
+          struct arrow {
+              reference ref;
+              reference *operator->() {
+                  return &ref;
+              }
+          };
+
+          _Iterator(quotient_index_map *_pmap, S_T _bucket_idx, int _value_idx,
+                    typename spill_type::iterator _spill_it) :
+              pmap(_pmap), bucket_idx(_bucket_idx), value_idx(_value_idx), spill_it(_spill_it) {
+          }
+          reference operator*() const {
+              if (bucket_idx < pmap->bucket_size_) {
+                  std::pair<Q_T, V_T> &rec = pmap->buckets_[bucket_idx].get_records()[value_idx];
+                  return reference(pmap->key_of(rec.first, bucket_idx), rec.second);
+              }
+              return reference(spill_it->first, spill_it->second);
+          }
+          arrow operator->() const {
+              arrow a = { operator*() };
+              return a;
+          }
+          bool operator==(const _Iterator &it) const {
+              return bucket_idx == it.bucket_idx && value_idx == it.value_idx &&
+                     spill_it == it.spill_it && pmap == it.pmap;
+          }
+          bool operator!=(const _Iterator &it) const {
+              return !operator==(it);
+          }
+          _Iterator &operator++() {
+              incr();
+              return *this;
+          }
+          _Iterator operator++(int) {
+              _Iterator __tmp(*this);
+              incr();
+              return __tmp;
+          }
+
+      private:
+          void incr() {
+              // Quotient buckets first, then the spilled keys
+              if (bucket_idx < pmap->bucket_size_) {
+                  if (value_idx + 1 < pmap->buckets_[bucket_idx].get_record_num()) {
+                      value_idx += 1;
+                      return;
+                  }
+                  value_idx = 0;
+                  bucket_idx = pmap->next_nonempty_bucket(bucket_idx + 1);
+                  if (bucket_idx == pmap->bucket_size_) {
+                      spill_it = pmap->spill_.begin();
+                  }
+              } else {
+                  ++spill_it;
+              }
+          }
+
+      private:
+          quotient_index_map *pmap;
+          S_T bucket_idx;
+          int value_idx;
+          typename spill_type::iterator spill_it;
+
+          friend class quotient_index_map;
+  };
+
+  iterator begin() {
+      return iterator(this, next_nonempty_bucket(0), 0, spill_.begin());
+  }
+
+  iterator end() {
+      return iterator(this, bucket_size_, 0, spill_.end());
+  }
+
+  bool empty() const {
+      return size() == 0;
+  }
+
+  size_type size() const {
+      return total_values_ + spill_.size();
+  }
+
+  size_type bucket_count() const {
+      return bucket_size_;
+  }
+
+  // Number of keys whose quotient did not fit in Q_T
+  size_type spilled() const {
+      return spill_.size();
+  }
+
+  // Return iterator, and a bool value indicating whether the element was successfully inserted or not
+  std::pair<iterator, bool> insert(const std::pair<K_T, V_T> &value) {
+      if (size() * 2 > (size_type)bucket_size_) {
+          rehash(next_bucket_count());
+      }
+
+      const K_T key = value.first;
+      S_T bucket_idx = get_hash_value(key);
+      uint64_t quotient = quotient_of(key);
+      if (unlikely(quotient > (uint64_t)std::numeric_limits<Q_T>::max())) {
+          std::pair<typename spill_type::iterator, bool> ret = spill_.insert(value);
+          return std::make_pair(iterator(this, bucket_size_, 0, ret.first), ret.second);
+      }
+
+      std::pair<int, bool> ret = buckets_[bucket_idx].insert((Q_T)quotient, value.second);
+      if (ret.second) {
+          total_values_ += 1;
+      }
+      return std::make_pair(iterator(this, bucket_idx, ret.first, spill_.end()), ret.second);
+  }
+
+  V_T &operator[](const K_T &key) {
+      std::pair<iterator, bool> ret = insert(std::make_pair(key, V_T()));
+      return (*ret.first).second;
+  }
+
+  // Find the element by key
+  iterator find(const K_T &key) {
+      int value_idx = -1;
+      S_T bucket_idx = locate(key, value_idx);
+      if (value_idx != -1) {
+          return iterator(this, bucket_idx, value_idx, spill_.end());
+      }
+      if (unlikely(bucket_idx == bucket_size_)) {
+          typename spill_type::iterator it = spill_.find(key);
+          if (it != spill_.end()) {
+              return iterator(this, bucket_size_, 0, it);
+          }
+      }
+      return end();
+  }
+
+  size_type count(const K_T &key) const {
+      int value_idx = -1;
+      S_T bucket_idx = locate(key, value_idx);
+      if (unlikely(bucket_idx == bucket_size_)) {
+          return spill_.count(key);
+      }
+      return (value_idx != -1) ? 1 : 0;
+  }
+
+  V_T &at(const K_T &key) {
+      iterator it = find(key);
+      if (it == end()) {
+          throw std::out_of_range("Cannot find the key");
+      }
+      return (*it).second;
+  }
+
+  // Removes the element with the key equivalent to key
+  size_type erase(const K_T &key) {
+      int value_idx = -1;
+      S_T bucket_idx = locate(key, value_idx);
+      if (unlikely(bucket_idx == bucket_size_)) {
+          return spill_.erase(key);
+      }
+      if (value_idx != -1) {
+          buckets_[bucket_idx].erase_by_index(value_idx);
+          total_values_ -= 1;
+          return 1;
+      }
+      return 0;
+  }
+
+  // Remove all the elements
+  void clear() {
+      delete[] buckets_;
+      bucket_size_ = INDEX_MAP_INIT_BUCKETS;
+      buckets_ = new bucket_type[bucket_size_];
+      total_values_ = 0;
+      spill_.clear();
+  }
+
+  // Bytes used by the buckets, their record buffers and the spilled keys
+  size_type memory_usage() const {
+      size_type bytes = sizeof(*this);
+      for (S_T i = 0; i < bucket_size_; ++i) {
+          bytes += buckets_[i].memory_usage();
+      }
+      if (spill_.size() > 0) {
+          bytes += spill_.memory_usage();
+      }
+      return bytes;
+  }
+
+private:
+  // Return the bucket of the key and set value_idx to its record, or -1.
+  // Returns bucket_size_ when the key can only be in the spill map.
+  S_T locate(const K_T &key, int &value_idx) const {
+      uint64_t quotient = quotient_of(key);
+      if (unlikely(quotient > (uint64_t)std::numeric_limits<Q_T>::max())) {
+          value_idx = -1;
+          return bucket_size_;
+      }
+      S_T bucket_idx = get_hash_value(key);
+      value_idx = buckets_[bucket_idx].find((Q_T)quotient);
+      return bucket_idx;
+  }
+
+  S_T next_nonempty_bucket(S_T from) const {
+      while (from < bucket_size_ && buckets_[from].get_record_num() == 0) {
+          ++from;
+      }
+      return from;
+  }
+
+  K_T key_of(Q_T quotient, S_T bucket_idx) const {
+      return (K_T)((uint64_t)quotient * bucket_size_ + bucket_idx);
+  }
+
+  // The quotients depend on the bucket count, so every key is rebuilt and
+  // re-quotiented. Spilled keys may fit again with more buckets.
+  void rehash(S_T new_bktsize) {
+      INDEX_MAP_STAT_INC(rehashes);
+      INDEX_MAP_STAT_TIMER(rehash_ns);
+
+      bucket_type *old_buckets = buckets_;
+      S_T old_bktsize = bucket_size_;
+      spill_type old_spill(std::move(spill_));
+
+      buckets_ = new bucket_type[new_bktsize];
+      bucket_size_ = new_bktsize;
+      spill_ = spill_type(1);
+      total_values_ = 0;
+
+      for (S_T idx = 0; idx < old_bktsize; ++idx) {
+          int record_num = old_buckets[idx].get_record_num();
+          std::pair<Q_T, V_T> *records = old_buckets[idx].get_records();
+          for (int i = 0; i < record_num; ++i) {
+              K_T key = (K_T)((uint64_t)records[i].first * old_bktsize + idx);
+              insert_nocheck(key, records[i].second);
+          }
+      }
+      for (typename spill_type::iterator it = old_spill.begin(); it != old_spill.end(); ++it) {
+          insert_nocheck(it->first, it->second);
+      }
+
+      delete[] old_buckets;
+  }
+
+  void insert_nocheck(const K_T key, const V_T &val) {
+      uint64_t quotient = quotient_of(key);
+      if (unlikely(quotient > (uint64_t)std::numeric_limits<Q_T>::max())) {
+          spill_.insert(std::make_pair(key, val));
+      } else {
+          buckets_[get_hash_value(key)].insert_nocheck((Q_T)quotient, val);
+          total_values_ += 1;
+      }
+  }
+
+  S_T next_bucket_count() const {
+      size_type n = 2 * (size_type)bucket_size_ + 1;
+      return (S_T)std::min(n, (size_type)std::numeric_limits<S_T>::max());
+  }
+
+  // Negative keys are taken modulo 2^64, as in index_map, so that the
+  // bucket is in range and the quotient is not negative. Most of them spill.
+  S_T get_hash_value(const K_T key) const {
+      return (S_T)((uint64_t)key % bucket_size_);
+  }
+
+  uint64_t quotient_of(const K_T key) const {
+      return (uint64_t)key / bucket_size_;
+  }
+
+private:
+  // Not copyable, buckets are owned
+  quotient_index_map(const quotient_index_map &);
+  quotient_index_map &operator=(const quotient_index_map &);
+
+private:
+  S_T total_values_;
+  S_T bucket_size_;
+  bucket_type *buckets_;
+  // Keys whose quotient overflows Q_T
+  spill_type spill_;
+};
+
+#endif
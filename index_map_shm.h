@@ -0,0 +1,295 @@
+#ifndef __INDEX_MAP_SHM_H_
+#define __INDEX_MAP_SHM_H_
+
+#include <stdint.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A frozen map living in a file-backed mapping, shared by every process that
+// maps it. A file under /dev/shm is a POSIX shared memory segment.
+//
+// The segment holds no pointers, only offsets from its start, so each process
+// maps it read-only at whatever address it gets and looks keys up in place,
+// without copying or deserializing anything:
+//   shm_index_map_header
+//   uint64_t starts[bucket_count + 1]   index of the first record of bucket b
+//   std::pair<K_T, V_T> records[size]   grouped by bucket
+// Bucket b holds the keys with key % bucket_count == b, as in index_map, and
+// its records are scanned contiguously. Keys and values must be trivially
+// copyable.
+//
+// publish() writes a new version next to the path and renames it over the
+// path, so a process opening the path sees the old or the new version, never
+// a partial one. Readers that already mapped the old version keep it until
+// they call reload().
+#define INDEX_MAP_SHM_MAGIC 0x3150414d58444e49ull  // "INDXMAP1"
+#define INDEX_MAP_SHM_KEYS_PER_BUCKET 2
+
+struct shm_index_map_header {
+  uint64_t magic;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint64_t size;
+  uint64_t bucket_count;
+  // Offsets from the start of the segment
+  uint64_t starts_offset;
+  uint64_t records_offset;
+  uint64_t total_bytes;
+};
+
+template<typename K_T, typename V_T>
+class shm_index_map {
+public:
+      typedef          K_T                       key_type;
+      typedef          V_T                       value_type;
+      typedef          std::pair<K_T, V_T>       record_type;
+      typedef          const record_type *       const_iterator;
+      typedef          const_iterator            iterator;
+
+  static_assert(std::is_trivially_copyable<K_T>::value && std::is_trivially_copyable<V_T>::value,
+                "shm_index_map stores keys and values as raw bytes");
+
+  shm_index_map(): base_(NULL), bytes_(0), inode_(0), device_(0) {}
+
+  // Map the version published at path
+  explicit shm_index_map(const std::string &path): shm_index_map() {
+      open(path);
+  }
+
+  shm_index_map(const shm_index_map &) = delete;
+  shm_index_map &operator=(const shm_index_map &) = delete;
+
+  ~shm_index_map() {
+      close();
+  }
+
+  // Build the segment from the unique keys of [first, last), e.g. the
+  // iterators of an index_map, and publish it at path. Throws
+  // std::runtime_error if it cannot be written.
+  template<typename ForwardIt>
+  static void publish(const std::string &path, ForwardIt first, ForwardIt last) {
+      // Counted by hand, the index_map iterators have no iterator_traits
+      uint64_t size = 0;
+      for (ForwardIt it = first; it != last; ++it) {
+          size += 1;
+      }
+      uint64_t bucket_count = size / INDEX_MAP_SHM_KEYS_PER_BUCKET + 1;
+      uint64_t starts_offset = align(sizeof(shm_index_map_header));
+      uint64_t records_offset = align(starts_offset + (bucket_count + 1) * sizeof(uint64_t));
+      uint64_t total_bytes = records_offset + size * sizeof(record_type);
+
+      std::string tmp = path + ".tmp." + std::to_string((long long)getpid());
+      int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+          fail(tmp);
+      }
+      if (ftruncate(fd, total_bytes) != 0) {
+          abandon(fd, tmp);
+      }
+      void *mapped = mmap(NULL, total_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mapped == MAP_FAILED) {
+          abandon(fd, tmp);
+      }
+      char *base = (char *)mapped;
+
+      shm_index_map_header *header = (shm_index_map_header *)base;
+      header->key_size = sizeof(K_T);
+      header->value_size = sizeof(V_T);
+      header->size = size;
+      header->bucket_count = bucket_count;
+      header->starts_offset = starts_offset;
+      header->records_offset = records_offset;
+      header->total_bytes = total_bytes;
+
+      // Count the records of each bucket, turn the counts into the end of
+      // each bucket, then place the records from the end of their bucket
+      uint64_t *starts = (uint64_t *)(base + starts_offset);
+      record_type *records = (record_type *)(base + records_offset);
+      for (ForwardIt it = first; it != last; ++it) {
+          starts[(uint64_t)it->first % bucket_count + 1] += 1;
+      }
+      for (uint64_t b = 0; b < bucket_count; ++b) {
+          starts[b + 1] += starts[b];
+      }
+      for (ForwardIt it = first; it != last; ++it) {
+          uint64_t b = (uint64_t)it->first % bucket_count;
+          uint64_t pos = starts[b + 1] - 1;
+          starts[b + 1] = pos;
+          records[pos] = record_type(it->first, it->second);
+      }
+      // Placing the records moved starts[b + 1] back to the start of bucket b
+      for (uint64_t b = 0; b < bucket_count; ++b) {
+          starts[b] = starts[b + 1];
+      }
+      starts[bucket_count] = size;
+
+      // The magic is written last, a torn segment is never valid
+      header->magic = INDEX_MAP_SHM_MAGIC;
+      munmap(mapped, total_bytes);
+      if (fsync(fd) != 0) {
+          abandon(fd, tmp);
+      }
+      ::close(fd);
+      if (rename(tmp.c_str(), path.c_str()) != 0) {
+          unlink(tmp.c_str());
+          fail(path);
+      }
+  }
+
+  // Map the version published at path, dropping the current one. Throws
+  // std::runtime_error if it cannot be mapped or is not a segment of this
+  // key and value type.
+  void open(const std::string &path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+          fail(path);
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+          ::close(fd);
+          fail(path);
+      }
+      void *mapped = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+      ::close(fd);
+      if (mapped == MAP_FAILED) {
+          fail(path);
+      }
+      const shm_index_map_header *header = (const shm_index_map_header *)mapped;
+      if ((uint64_t)st.st_size < sizeof(shm_index_map_header) ||
+          header->magic != INDEX_MAP_SHM_MAGIC ||
+          header->key_size != sizeof(K_T) || header->value_size != sizeof(V_T) ||
+          header->total_bytes != (uint64_t)st.st_size) {
+          munmap(mapped, st.st_size);
+          throw std::runtime_error(path + ": not a shm_index_map of this key and value type");
+      }
+      // Lookups jump around the segment, read-ahead would only load pages
+      // that are not needed
+      madvise(mapped, st.st_size, MADV_RANDOM);
+
+      close();
+      path_ = path;
+      base_ = (const char *)mapped;
+      bytes_ = st.st_size;
+      inode_ = st.st_ino;
+      device_ = st.st_dev;
+  }
+
+  // Map the latest version if a new one was published since open()
+  // Returns whether the map changed.
+  bool reload() {
+      struct stat st;
+      if (stat(path_.c_str(), &st) != 0) {
+          fail(path_);
+      }
+      if ((uint64_t)st.st_ino == inode_ && (uint64_t)st.st_dev == device_) {
+          return false;
+      }
+      open(path_);
+      return true;
+  }
+
+  void close() {
+      if (base_ != NULL) {
+          munmap((void *)base_, bytes_);
+          base_ = NULL;
+          bytes_ = 0;
+      }
+  }
+
+  bool is_open() const {
+      return base_ != NULL;
+  }
+
+  // The value of the key, NULL if it is absent
+  const V_T *find(const K_T &key) const {
+      const shm_index_map_header *h = header();
+      uint64_t b = (uint64_t)key % h->bucket_count;
+      const uint64_t *starts = (const uint64_t *)(base_ + h->starts_offset);
+      const record_type *records = (const record_type *)(base_ + h->records_offset);
+      for (uint64_t i = starts[b]; i < starts[b + 1]; ++i) {
+          if (records[i].first == key) {
+              return &records[i].second;
+          }
+      }
+      return NULL;
+  }
+
+  const V_T &at(const K_T &key) const {
+      const V_T *value = find(key);
+      if (value == NULL) {
+          throw std::out_of_range("Cannot find the key");
+      }
+      return *value;
+  }
+
+  std::size_t count(const K_T &key) const {
+      return find(key) != NULL;
+  }
+
+  uint64_t size() const {
+      return header()->size;
+  }
+
+  bool empty() const {
+      return size() == 0;
+  }
+
+  uint64_t bucket_count() const {
+      return header()->bucket_count;
+  }
+
+  // The records, grouped by bucket
+  const_iterator begin() const {
+      return (const record_type *)(base_ + header()->records_offset);
+  }
+
+  const_iterator end() const {
+      return begin() + size();
+  }
+
+  // Bytes of the mapping, shared with the other processes that map it
+  std::size_t mapped_bytes() const {
+      return bytes_;
+  }
+
+private:
+  const shm_index_map_header *header() const {
+      return (const shm_index_map_header *)base_;
+  }
+
+  static uint64_t align(uint64_t offset) {
+      const uint64_t a = alignof(record_type) > 8 ? alignof(record_type) : 8;
+      return (offset + a - 1) / a * a;
+  }
+
+  static void fail(const std::string &path) {
+      throw std::runtime_error(path + ": " + strerror(errno));
+  }
+
+  // Remove a partly written version
+  static void abandon(int fd, const std::string &tmp) {
+      int err = errno;
+      ::close(fd);
+      unlink(tmp.c_str());
+      errno = err;
+      fail(tmp);
+  }
+
+private:
+  std::string path_;
+  const char *base_;
+  std::size_t bytes_;
+  // Identity of the mapped file, to notice a new version in reload()
+  uint64_t inode_;
+  uint64_t device_;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef __INDEX_MAP_STATIC_H_
+#define __INDEX_MAP_STATIC_H_
+
+#if __cplusplus < 201402L
+#error "index_map_static.h needs C++14 constexpr"
+#endif
+
+#include <cstddef>
+#include <stdint.h>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// A read-only map over a key set known at build time, e.g. opcode or
+// protocol-id dispatch, with the find/at/count API of index_map
+// (index_map_for_find.h). Declared constexpr, the whole table is computed by
+// the compiler and lives in the binary: nothing is built at startup.
+//
+//   constexpr std::pair<uint32_t, int> entries[] = {{0x10, 1}, {0x20, 2}};
+//   constexpr static_index_map<uint32_t, int, 2> opcodes(entries);
+//   static_assert(opcodes.at(0x20) == 2, "");
+//
+// The perfect hash is hash-and-displace: a first hash splits the keys in
+// groups of INDEX_MAP_STATIC_KEYS_PER_GROUP on average, then each group,
+// largest first, gets the first seed that sends all its keys to free slots
+// of the table. A lookup hashes the key with the seed of its group and
+// compares the key in that one slot. Empty slots hold a key that hashes to
+// another slot, so they never match.
+//
+// Keys are integers and must be distinct; a duplicate key, or a group with no
+// seed, makes the constant evaluation fail. Large key sets may need a higher
+// -fconstexpr-ops-limit (GCC) or -fconstexpr-steps (Clang).
+#define INDEX_MAP_STATIC_KEYS_PER_GROUP 4
+// Seeds tried for a group before giving up
+#define INDEX_MAP_STATIC_MAX_SEED 65535
+
+// Smallest power of two at least n
+constexpr std::size_t static_index_map_slots(std::size_t n) {
+  std::size_t p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+template<typename K_T, typename V_T, std::size_t N>
+class static_index_map {
+public:
+      struct record {
+          K_T first;
+          V_T second;
+      };
+
+      typedef          K_T                       key_type;
+      typedef          V_T                       value_type;
+      typedef          record                    mapped_type;
+      typedef typename std::size_t               size_type;
+      typedef          const record *            iterator;
+      typedef          const record *            const_iterator;
+
+  static_assert(std::is_integral<K_T>::value, "static_index_map keys are integers");
+  static_assert(N > 0, "static_index_map needs at least one key");
+
+  // Groups of the first-level hash
+  static constexpr size_type group_count = (N + INDEX_MAP_STATIC_KEYS_PER_GROUP - 1) /
+                                           INDEX_MAP_STATIC_KEYS_PER_GROUP;
+  // Slots of the table, a power of two at least 1.25 N: load 0.4 to 0.8
+  static constexpr size_type slot_count = static_index_map_slots(N + N / 4);
+
+  constexpr explicit static_index_map(const std::pair<K_T, V_T> (&entries)[N]):
+      slots_(),
+      seeds_() {
+      K_T keys[N] = {};
+      V_T values[N] = {};
+      for (size_type i = 0; i < N; ++i) {
+          keys[i] = entries[i].first;
+          values[i] = entries[i].second;
+      }
+      build(keys, values);
+  }
+
+  // Keys and values as two columns
+  constexpr static_index_map(const K_T (&keys)[N], const V_T (&values)[N]):
+      slots_(),
+      seeds_() {
+      build(keys, values);
+  }
+
+  constexpr size_type size() const {
+      return N;
+  }
+
+  constexpr bool empty() const {
+      return false;
+  }
+
+  constexpr size_type max_size() const {
+      return N;
+  }
+
+  constexpr size_type bucket_count() const {
+      return slot_count;
+  }
+
+  constexpr float load_factor() const {
+      return (float)N / slot_count;
+  }
+
+  // Bytes of the table and the group seeds
+  constexpr size_type memory_usage() const {
+      return sizeof(*this);
+  }
+
+  // Only the end of find(): the table is not iterable
+  constexpr const_iterator end() const {
+      return slots_ + slot_count;
+  }
+
+  constexpr const_iterator find(const K_T &key) const {
+      const record &r = slots_[slot_of(key)];
+      return r.first == key ? &r : end();
+  }
+
+  constexpr size_type count(const K_T &key) const {
+      return slots_[slot_of(key)].first == key ? 1 : 0;
+  }
+
+  constexpr const V_T &at(const K_T &key) const {
+      const record &r = slots_[slot_of(key)];
+      return r.first == key ? r.second : (throw std::out_of_range("Cannot find the key"), r.second);
+  }
+
+private:
+  static constexpr uint64_t hash(const K_T &key, uint64_t seed) {
+      uint64_t x = (uint64_t)key ^ (seed * 0x9E3779B97F4A7C15ull);
+      x ^= x >> 32;
+      x *= 0xD6E8FEB86659FD93ull;
+      x ^= x >> 32;
+      return x;
+  }
+
+  static constexpr size_type group_of(const K_T &key) {
+      return (size_type)(((hash(key, 0) >> 32) * group_count) >> 32);
+  }
+
+  static constexpr size_type slot_of(const K_T &key, uint16_t seed) {
+      return (size_type)(hash(key, seed) & (slot_count - 1));
+  }
+
+  constexpr size_type slot_of(const K_T &key) const {
+      return slot_of(key, seeds_[group_of(key)]);
+  }
+
+  constexpr void build(const K_T *keys, const V_T *values) {
+      // Group the keys by their first-level hash
+      size_type starts[group_count + 1] = {};
+      size_type members[N] = {};
+      for (size_type i = 0; i < N; ++i) {
+          starts[group_of(keys[i]) + 1] += 1;
+      }
+      size_type largest = 0;
+      for (size_type g = 0; g < group_count; ++g) {
+          largest = starts[g + 1] > largest ? starts[g + 1] : largest;
+          starts[g + 1] += starts[g];
+      }
+      size_type next[group_count] = {};
+      for (size_type g = 0; g < group_count; ++g) {
+          next[g] = starts[g];
+      }
+      for (size_type i = 0; i < N; ++i) {
+          members[next[group_of(keys[i])]++] = i;
+      }
+
+      // Largest groups first, while the table has the most free slots
+      bool used[slot_count] = {};
+      for (size_type size = largest; size > 0; --size) {
+          for (size_type g = 0; g < group_count; ++g) {
+              if (starts[g + 1] - starts[g] == size) {
+                  place_group(g, members + starts[g], size, keys, values, used);
+              }
+          }
+      }
+
+      for (size_type s = 0; s < slot_count; ++s) {
+          if (!used[s]) {
+              K_T filler = 0;
+              while (slot_of(filler) == s) {
+                  filler += 1;
+              }
+              slots_[s].first = filler;
+              // Set again: GCC rejects the constant otherwise
+              slots_[s].second = V_T();
+          }
+      }
+  }
+
+  // Find the first seed sending the keys of group g to distinct free slots
+  constexpr void place_group(size_type g, const size_type *group, size_type size,
+                             const K_T *keys, const V_T *values, bool *used) {
+      for (size_type a = 0; a < size; ++a) {
+          for (size_type b = a + 1; b < size; ++b) {
+              if (keys[group[a]] == keys[group[b]]) {
+                  throw std::invalid_argument("static_index_map: duplicate key");
+              }
+          }
+      }
+      for (uint32_t seed = 1; seed <= INDEX_MAP_STATIC_MAX_SEED; ++seed) {
+          bool fits = true;
+          for (size_type a = 0; a < size && fits; ++a) {
+              size_type s = slot_of(keys[group[a]], (uint16_t)seed);
+              fits = !used[s];
+              for (size_type b = 0; b < a && fits; ++b) {
+                  fits = slot_of(keys[group[b]], (uint16_t)seed) != s;
+              }
+          }
+          if (fits) {
+              seeds_[g] = (uint16_t)seed;
+              for (size_type a = 0; a < size; ++a) {
+                  size_type s = slot_of(keys[group[a]], (uint16_t)seed);
+                  used[s] = true;
+                  slots_[s].first = keys[group[a]];
+                  slots_[s].second = values[group[a]];
+              }
+              return;
+          }
+      }
+      throw std::length_error("static_index_map: no perfect hash found");
+  }
+
+private:
+  record slots_[slot_count];
+  uint16_t seeds_[group_count];
+};
+
+template<typename K_T, typename V_T, std::size_t N>
+constexpr std::size_t static_index_map<K_T, V_T, N>::group_count;
+
+template<typename K_T, typename V_T, std::size_t N>
+constexpr std::size_t static_index_map<K_T, V_T, N>::slot_count;
+
+// Deduces N from the entries:
+//   constexpr auto m = make_static_index_map<uint32_t, int>({{1, 10}, {2, 20}});
+template<typename K_T, typename V_T, std::size_t N>
+constexpr static_index_map<K_T, V_T, N> make_static_index_map(const std::pair<K_T, V_T> (&entries)[N]) {
+  return static_index_map<K_T, V_T, N>(entries);
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef __INDEX_MAP_STATS_H_
+#define __INDEX_MAP_STATS_H_
+
+// Optional hot-path instrumentation shared by both index_map engines.
+//
+// Define INDEX_MAP_ENABLE_STATS before including an index_map header (or pass
+// -DINDEX_MAP_ENABLE_STATS) to turn the counters on. When it is not defined,
+// every INDEX_MAP_STAT_* macro expands to nothing and the maps are identical
+// to an uninstrumented build.
+//
+// Counters live in a thread_local block written only by its thread, with
+// relaxed atomic loads and stores: the hot path is a plain add, without a
+// locked instruction. index_map_stats_collect() sums the blocks of all live
+// threads, while they count, plus the counts left behind by threads that
+// already exited.
+
+#ifdef INDEX_MAP_ENABLE_STATS
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+struct index_map_stats {
+  // Lookups issued through find()/count()/at()
+  uint64_t finds;
+  uint64_t hits;
+  uint64_t misses;
+  // Misses answered by the negative-lookup filter
+  uint64_t filter_negatives;
+  // Keys compared in the inline cache and in the overflow records
+  uint64_t inline_probes;
+  uint64_t overflow_probes;
+  // Rehash of the whole map
+  uint64_t rehashes;
+  uint64_t rehash_ns;
+  // Growth of a bucket's record buffer (find map)
+  uint64_t enlarge_buffers;
+  uint64_t enlarge_buffer_ns;
+  // Growth of value_container (iteration map)
+  uint64_t value_grows;
+  uint64_t value_grow_ns;
+  // Index moves done by shrink_slot() on erase (iteration map)
+  uint64_t shrink_slot_moves;
+  // Displacement searches on insert into two full buckets, and the records
+  // they moved (cuckoo map)
+  uint64_t cuckoo_searches;
+  uint64_t cuckoo_moves;
+
+  index_map_stats() {
+    reset();
+  }
+
+  void reset() {
+    finds = hits = misses = filter_negatives = 0;
+    inline_probes = overflow_probes = 0;
+    rehashes = rehash_ns = 0;
+    enlarge_buffers = enlarge_buffer_ns = 0;
+    value_grows = value_grow_ns = 0;
+    shrink_slot_moves = 0;
+    cuckoo_searches = cuckoo_moves = 0;
+  }
+
+  index_map_stats &operator+=(const index_map_stats &o) {
+    finds += o.finds;
+    hits += o.hits;
+    misses += o.misses;
+    filter_negatives += o.filter_negatives;
+    inline_probes += o.inline_probes;
+    overflow_probes += o.overflow_probes;
+    rehashes += o.rehashes;
+    rehash_ns += o.rehash_ns;
+    enlarge_buffers += o.enlarge_buffers;
+    enlarge_buffer_ns += o.enlarge_buffer_ns;
+    value_grows += o.value_grows;
+    value_grow_ns += o.value_grow_ns;
+    shrink_slot_moves += o.shrink_slot_moves;
+    cuckoo_searches += o.cuckoo_searches;
+    cuckoo_moves += o.cuckoo_moves;
+    return *this;
+  }
+
+  void print(std::ostream &os) const {
+    os << "finds: " << finds << " (hits " << hits << ", misses " << misses << ")" << std::endl;
+    os << "filter negatives: " << filter_negatives << std::endl;
+    os << "probes: inline " << inline_probes << ", overflow " << overflow_probes << std::endl;
+    os << "rehash: " << rehashes << " times, " << rehash_ns / 1e6 << " ms" << std::endl;
+    os << "enlarge_buffer: " << enlarge_buffers << " times, " << enlarge_buffer_ns / 1e6 << " ms" << std::endl;
+    os << "value_container grow: " << value_grows << " times, " << value_grow_ns / 1e6 << " ms" << std::endl;
+    os << "shrink_slot moves: " << shrink_slot_moves << std::endl;
+    os << "cuckoo: " << cuckoo_searches << " searches, " << cuckoo_moves << " moves" << std::endl;
+  }
+};
+
+// A counter added to by one thread and read by any. The add is a relaxed
+// load and store, not a read-modify-write, as no other thread adds to it.
+class index_map_stat_counter {
+public:
+  index_map_stat_counter() : value(0) {
+  }
+
+  void add(uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  uint64_t get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+
+  // From another thread, an add running at the same time may be kept
+  void reset() {
+    value.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> value;
+};
+
+// The counter block of a thread, the fields of index_map_stats
+struct index_map_thread_counters {
+  index_map_stat_counter finds;
+  index_map_stat_counter hits;
+  index_map_stat_counter misses;
+  index_map_stat_counter filter_negatives;
+  index_map_stat_counter inline_probes;
+  index_map_stat_counter overflow_probes;
+  index_map_stat_counter rehashes;
+  index_map_stat_counter rehash_ns;
+  index_map_stat_counter enlarge_buffers;
+  index_map_stat_counter enlarge_buffer_ns;
+  index_map_stat_counter value_grows;
+  index_map_stat_counter value_grow_ns;
+  index_map_stat_counter shrink_slot_moves;
+  index_map_stat_counter cuckoo_searches;
+  index_map_stat_counter cuckoo_moves;
+
+  void add_to(index_map_stats &s) const {
+    s.finds += finds.get();
+    s.hits += hits.get();
+    s.misses += misses.get();
+    s.filter_negatives += filter_negatives.get();
+    s.inline_probes += inline_probes.get();
+    s.overflow_probes += overflow_probes.get();
+    s.rehashes += rehashes.get();
+    s.rehash_ns += rehash_ns.get();
+    s.enlarge_buffers += enlarge_buffers.get();
+    s.enlarge_buffer_ns += enlarge_buffer_ns.get();
+    s.value_grows += value_grows.get();
+    s.value_grow_ns += value_grow_ns.get();
+    s.shrink_slot_moves += shrink_slot_moves.get();
+    s.cuckoo_searches += cuckoo_searches.get();
+    s.cuckoo_moves += cuckoo_moves.get();
+  }
+
+  void reset() {
+    finds.reset();
+    hits.reset();
+    misses.reset();
+    filter_negatives.reset();
+    inline_probes.reset();
+    overflow_probes.reset();
+    rehashes.reset();
+    rehash_ns.reset();
+    enlarge_buffers.reset();
+    enlarge_buffer_ns.reset();
+    value_grows.reset();
+    value_grow_ns.reset();
+    shrink_slot_moves.reset();
+    cuckoo_searches.reset();
+    cuckoo_moves.reset();
+  }
+};
+
+// Registry of the per-thread counter blocks
+class index_map_stats_registry {
+public:
+  static index_map_stats_registry &instance() {
+    static index_map_stats_registry registry;
+    return registry;
+  }
+
+  void attach(index_map_thread_counters *c) {
+    std::lock_guard<std::mutex> lock(mutex);
+    live.push_back(c);
+  }
+
+  // Called when a thread exits, keep its counts in 'retired'
+  void detach(index_map_thread_counters *c) {
+    std::lock_guard<std::mutex> lock(mutex);
+    c->add_to(retired);
+    live.erase(std::remove(live.begin(), live.end(), c), live.end());
+  }
+
+  index_map_stats collect() {
+    std::lock_guard<std::mutex> lock(mutex);
+    index_map_stats total = retired;
+    for (size_t i = 0; i < live.size(); ++i) {
+      live[i]->add_to(total);
+    }
+    return total;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    retired.reset();
+    for (size_t i = 0; i < live.size(); ++i) {
+      live[i]->reset();
+    }
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<index_map_thread_counters *> live;
+  index_map_stats retired;
+};
+
+struct index_map_thread_stats {
+  index_map_thread_counters stats;
+
+  index_map_thread_stats() {
+    index_map_stats_registry::instance().attach(&stats);
+  }
+
+  ~index_map_thread_stats() {
+    index_map_stats_registry::instance().detach(&stats);
+  }
+};
+
+inline index_map_thread_counters &index_map_local_stats() {
+  static thread_local index_map_thread_stats local;
+  return local.stats;
+}
+
+// Aggregate the counters of all threads
+inline index_map_stats index_map_stats_collect() {
+  return index_map_stats_registry::instance().collect();
+}
+
+inline void index_map_stats_reset() {
+  index_map_stats_registry::instance().reset();
+}
+
+// Add the elapsed time of a scope to a counter
+class index_map_stats_timer {
+public:
+  index_map_stats_timer(index_map_stat_counter &_counter) :
+      counter(_counter), start(std::chrono::steady_clock::now()) {
+  }
+
+  ~index_map_stats_timer() {
+    counter.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+  }
+
+private:
+  index_map_stat_counter &counter;
+  std::chrono::steady_clock::time_point start;
+};
+
+#define INDEX_MAP_STAT_ADD(field, n)  (index_map_local_stats().field.add(n))
+#define INDEX_MAP_STAT_INC(field)     INDEX_MAP_STAT_ADD(field, 1)
+#define INDEX_MAP_STAT_TIMER(field) \
+  index_map_stats_timer __index_map_stats_timer_##field(index_map_local_stats().field)
+
+#else
+
+#define INDEX_MAP_STAT_ADD(field, n)  ((void)0)
+#define INDEX_MAP_STAT_INC(field)     ((void)0)
+#define INDEX_MAP_STAT_TIMER(field)   ((void)0)
+
+#endif // INDEX_MAP_ENABLE_STATS
+
+#endif
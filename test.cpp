@@ -1,6 +1,15 @@
 #include <unordered_map>
+#include <unordered_set>
 #include <iostream>
+#include <sstream>
 #include "index_map_for_find.h"
+#include "index_map_quotient.h"
+#include "index_map_adaptive.h"
+#include "index_map_cow.h"
+#include "index_map_shm.h"
+#include "index_map_cuckoo.h"
+#include "index_map_join.h"
+#include "index_map_mphf.h"
 
 using namespace std;
 
@@ -19,6 +28,34 @@ struct Data {
   }
 };
 
+// Allocator counting the bytes it holds, shared by its copies and rebinds
+template<typename T>
+struct counting_allocator {
+  typedef T value_type;
+  size_t *bytes;
+  explicit counting_allocator(size_t *_bytes): bytes(_bytes) {}
+  template<typename U>
+  counting_allocator(const counting_allocator<U> &other): bytes(other.bytes) {}
+  T *allocate(size_t n) {
+    *bytes += n * sizeof(T);
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) {
+    *bytes -= n * sizeof(T);
+    ::operator delete(p);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const counting_allocator<T> &a, const counting_allocator<U> &b) {
+  return a.bytes == b.bytes;
+}
+
+template<typename T, typename U>
+bool operator!=(const counting_allocator<T> &a, const counting_allocator<U> &b) {
+  return a.bytes != b.bytes;
+}
+
 void test_constructor() {
     // default constructor: empty map
     index_map<int, std::string> m1;
@@ -144,6 +181,36 @@ void test_clear() {
   assert(m.find(0) == m.end());
   assert(m.find(1) == m.end());
   assert(m.begin() == m.end());
+
+  // clear() keeps the buckets, stale buckets must not leak old keys
+  for (int i = 0; i < 10000; ++i) {
+    m[i] = value;
+  }
+  size_t buckets = m.bucket_count();
+  for (int round = 0; round < 5; ++round) {
+    m.clear();
+    assert(m.bucket_count() == buckets);
+    assert(m.begin() == m.end());
+    for (int i = round; i < 10000; i += 5) {
+      m[i] = Data(i, round, 0);
+    }
+    assert(m.size() == (size_t)(10000 - round + 4) / 5);
+    size_t n = 0;
+    for (auto it = m.begin(); it != m.end(); ++it, ++n) {
+      assert(it->first % 5 == (uint64_t)round);
+    }
+    assert(n == m.size());
+    for (int i = 0; i < 10000; ++i) {
+      assert(m.count(i) == (size_t)(i % 5 == round));
+    }
+    assert(m.erase(round + 1) == 0);
+  }
+
+  m.release();
+  assert(m.size() == 0);
+  assert(m.bucket_count() < buckets);
+  m[7] = value;
+  assert(m.size() == 1 && m.count(7) == 1);
 }
 
 void test_insert() {
@@ -159,9 +226,9 @@ void test_insert() {
 
   // find existing value
   auto it = m.find(123ll);
-  assert(it->second.f1 = 3);
-  assert(it->second.f2 = 5);
-  assert(it->second.f3 = 7);
+  assert(it->second.f1 == 3);
+  assert(it->second.f2 == 5);
+  assert(it->second.f3 == 7);
 
   // insert again
   ret = m.insert(std::make_pair(123ll, Data(1, 5, 7)));
@@ -339,6 +406,1044 @@ void test_equal() {
     assert(m1 != m2);
 }
 
+void test_64bit_index() {
+    index_map<uint64_t, int, uint64_t> m(5);
+    assert(m.max_size() > 4294967295ull);
+    assert(m.max_bucket_count() > 4294967295ull);
+    for (uint64_t i = 0; i < 1000; ++i) {
+        m[i << 40] = (int)i;
+    }
+    assert(m.size() == 1000);
+    for (uint64_t i = 0; i < 1000; ++i) {
+        assert(m.at(i << 40) == (int)i);
+    }
+    assert(m.count(7) == 0);
+
+    index_map<uint64_t, int> compact;
+    assert(compact.max_size() == 4294967295u);
+}
+
+void test_quotient() {
+    quotient_index_map<uint64_t, int> m;
+    unordered_map<uint64_t, int> u;
+    for (int i = 0; i < 100000; ++i) {
+        // Mix small ids with keys whose quotient overflows uint32_t
+        uint64_t key = (i % 3 == 0) ? ((uint64_t)rand() << 33 | rand()) : (uint64_t)rand() * 1000;
+        int value = rand();
+        assert(m.insert(std::make_pair(key, value)).second == u.insert(std::make_pair(key, value)).second);
+    }
+    assert(m.size() == u.size());
+    assert(m.spilled() > 0);
+
+    size_t n = 0;
+    for (auto it = m.begin(); it != m.end(); ++it) {
+        assert(u.at(it->first) == it->second);
+        n += 1;
+    }
+    assert(n == u.size());
+
+    for (auto &p : u) {
+        assert(m.count(p.first) == 1);
+        assert(m.at(p.first) == p.second);
+    }
+    assert(m.count(1) == u.count(1));
+
+    size_t erased = 0;
+    for (auto &p : u) {
+        if (p.first & 1) {
+            erased += m.erase(p.first);
+        }
+    }
+    assert(m.size() == u.size() - erased);
+
+    // Negative keys, bucketed modulo 2^64 like in index_map
+    quotient_index_map<int64_t, int> neg;
+    for (int64_t i = -2000; i < 2000; ++i) {
+        neg[i] = (int)i;
+    }
+    assert(neg.size() == 4000 && neg.spilled() > 0);
+    for (int64_t i = -2000; i < 2000; ++i) {
+        assert(neg.at(i) == (int)i);
+    }
+    assert(neg.count(-2001) == 0 && neg.find(2000) == neg.end());
+    size_t visited = 0;
+    for (auto it = neg.begin(); it != neg.end(); ++it, ++visited) {
+        assert(it->first >= -2000 && it->first < 2000 && it->second == (int)it->first);
+    }
+    assert(visited == 4000);
+}
+
+void test_filter() {
+    index_map<uint64_t, int> m;
+    m.enable_filter();
+    for (uint64_t i = 0; i < 20000; ++i) {
+        m[i * 7] = (int)i;
+    }
+
+    // No false negatives, across the rehashes done while inserting
+    for (uint64_t i = 0; i < 20000; ++i) {
+        assert(m.count(i * 7) == 1);
+        assert(m.at(i * 7) == (int)i);
+    }
+    for (uint64_t i = 0; i < 20000; ++i) {
+        assert(m.find(i * 7 + 3) == m.end());
+    }
+    assert(strcmp(m.filter_stats().kind, "bloom") == 0);
+    assert(m.filter_stats().expected_fpp < 0.05);
+
+    m.freeze();
+    assert(strcmp(m.filter_stats().kind, "xor") == 0);
+    for (uint64_t i = 0; i < 20000; ++i) {
+        assert(m.count(i * 7) == 1);
+    }
+
+    // Copies keep the filter, an insert thaws it
+    index_map<uint64_t, int> copy(m);
+    assert(strcmp(copy.filter_stats().kind, "xor") == 0);
+    copy[1] = 1;
+    assert(strcmp(copy.filter_stats().kind, "bloom") == 0);
+    assert(copy.count(1) == 1 && copy.count(7) == 1);
+
+    m.clear();
+    assert(m.count(7) == 0);
+    m[7] = 1;
+    assert(m.count(7) == 1);
+
+    m.disable_filter();
+    assert(strcmp(m.filter_stats().kind, "none") == 0);
+
+    // Sized for the keys the buckets hold at the configured load factor
+    index_map<uint64_t, int> dense(100000);
+    dense.max_load_factor(4);
+    for (uint64_t i = 0; i < 350000; ++i) {
+        dense[i * 7] = (int)i;
+    }
+    size_t buckets = dense.bucket_count();
+    dense.enable_filter(10);
+    assert(dense.bucket_count() == buckets);
+    assert(dense.filter_stats().bits_per_key >= 10 && dense.filter_stats().expected_fpp < 0.05);
+    dense.max_load_factor(8);
+    for (uint64_t i = 350000; i < 700000; ++i) {
+        dense[i * 7] = (int)i;
+    }
+    assert(dense.bucket_count() == buckets);
+    assert(dense.filter_stats().bits_per_key >= 10 && dense.filter_stats().expected_fpp < 0.05);
+}
+
+void test_find_batch() {
+    index_map<uint64_t, int> m;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        m[i * 2] = (int)i;
+    }
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        keys.push_back(i);
+    }
+    for (int filtered = 0; filtered < 2; ++filtered) {
+        if (filtered) {
+            m.enable_filter();
+        }
+        std::vector<int *> values(keys.size());
+        assert(m.find_batch(keys.data(), keys.size(), values.data()) == 500);
+        for (uint64_t i = 0; i < keys.size(); ++i) {
+            if (i % 2 == 0) {
+                assert(values[i] != NULL && *values[i] == (int)(i / 2));
+            } else {
+                assert(values[i] == NULL);
+            }
+        }
+    }
+}
+
+void test_adaptive() {
+    adaptive_index_map<int64_t, int> m;
+    unordered_map<int64_t, int> u;
+
+    // Auto-increment ids go direct
+    for (int64_t i = -500; i < 5000; ++i) {
+        m[i] = (int)i;
+        u[i] = (int)i;
+    }
+    assert(m.is_direct());
+    assert(m.size() == u.size());
+    assert(m.insert(std::make_pair((int64_t)7, 0)).second == false);
+    assert(m.at(7) == 7);
+    assert(m.count(5000) == 0 && m.count(-501) == 0);
+    assert(m.find(9999) == m.end());
+
+    // Ascending ids keep it direct
+    for (int64_t i = 5000; i < 20000; ++i) {
+        m[i] = (int)i;
+        u[i] = (int)i;
+    }
+    assert(m.is_direct());
+
+    size_t n = 0;
+    for (auto it = m.begin(); it != m.end(); ++it) {
+        assert(u.at(it->first) == it->second);
+        n += 1;
+    }
+    assert(n == u.size());
+
+    // Erasing most keys makes it sparse again
+    for (int64_t i = -500; i < 20000; ++i) {
+        if (i % 8 != 0) {
+            assert(m.erase(i) == 1);
+            u.erase(i);
+        }
+    }
+    assert(!m.is_direct());
+    assert(m.size() == u.size());
+    for (auto &p : u) {
+        assert(m.at(p.first) == p.second);
+    }
+
+    // A far away key is hashed, not direct-addressed
+    adaptive_index_map<uint64_t, int> s;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        s[i] = 1;
+    }
+    assert(s.is_direct());
+    s[1ull << 60] = 2;
+    assert(!s.is_direct());
+    assert(s.size() == 1001 && s.at(1ull << 60) == 2 && s.at(999) == 1);
+
+    s.clear();
+    assert(s.empty() && s.begin() == s.end());
+
+    // Keys at both ends of K_T span all of it, which is never dense
+    adaptive_index_map<uint64_t, int> wide;
+    wide[0] = 1;
+    wide[~0ull] = 2;
+    for (uint64_t i = 1; i < 100; ++i) {
+        wide[i << 40] = 3;
+    }
+    assert(!wide.is_direct() && wide.density() > 0 && wide.size() == 101);
+    assert(wide.at(0) == 1 && wide.at(~0ull) == 2);
+    adaptive_index_map<uint64_t, int> dense;
+    for (uint64_t i = 0; i < 100; ++i) {
+        dense[i] = 1;
+    }
+    assert(dense.is_direct());
+    dense[~0ull] = 2;
+    assert(!dense.is_direct() && dense.size() == 101 && dense.at(~0ull) == 2 && dense.at(99) == 1);
+    adaptive_index_map<int64_t, int> wide_signed;
+    for (int64_t i = 0; i < 100; ++i) {
+        wide_signed[i] = 1;
+    }
+    wide_signed[std::numeric_limits<int64_t>::min()] = 2;
+    wide_signed[std::numeric_limits<int64_t>::max()] = 3;
+    assert(!wide_signed.is_direct() && wide_signed.size() == 102);
+    assert(wide_signed.at(std::numeric_limits<int64_t>::min()) == 2 && wide_signed.at(std::numeric_limits<int64_t>::max()) == 3);
+}
+
+void test_erase_batch_if() {
+    index_map<uint64_t, int> m;
+    unordered_map<uint64_t, int> u;
+    for (int i = 0; i < 20000; ++i) {
+        uint64_t key = (uint64_t)rand() % 50000;
+        m[key] = i;
+        u[key] = i;
+    }
+
+    std::vector<uint64_t> drop;
+    for (uint64_t key = 0; key < 50000; key += 3) {
+        drop.push_back(key);
+    }
+    size_t expected = 0;
+    for (size_t i = 0; i < drop.size(); ++i) {
+        expected += u.erase(drop[i]);
+    }
+    assert(m.erase_batch(drop.data(), drop.size()) == expected);
+    assert(m.size() == u.size());
+
+    size_t erased = m.erase_if([](const std::pair<uint64_t, int> &p) { return p.second % 5 == 0; });
+    expected = 0;
+    for (auto it = u.begin(); it != u.end(); ) {
+        if (it->second % 5 == 0) {
+            it = u.erase(it);
+            expected += 1;
+        } else {
+            ++it;
+        }
+    }
+    assert(erased == expected);
+    assert(m.size() == u.size());
+
+    // The inline key cache still matches the records
+    for (uint64_t key = 0; key < 50000; ++key) {
+        assert(m.count(key) == u.count(key));
+    }
+    size_t n = 0;
+    for (auto it = m.begin(); it != m.end(); ++it) {
+        assert(u.at(it->first) == it->second);
+        n += 1;
+    }
+    assert(n == u.size());
+}
+
+void test_load_factor() {
+    index_map<uint64_t, int> m(7);
+    assert(m.max_load_factor() == 0.5f);
+    m.max_load_factor(2.0f);
+    m.reserve(10000);
+    size_t buckets = m.bucket_count();
+    assert(buckets * 2 >= 10000);
+    for (uint64_t i = 0; i < 10000; ++i) {
+        m[i] = (int)i;
+    }
+    // No rehash while filling the reserved room
+    assert(m.bucket_count() == buckets);
+    assert(m.load_factor() <= 2.0f);
+
+    for (uint64_t i = 0; i < 10000; ++i) {
+        if (i % 10 != 0) {
+            m.erase(i);
+        }
+    }
+    size_t before = m.memory_usage();
+    m.shrink_to_fit();
+    assert(m.memory_usage() < before / 4);
+    assert(m.size() == 1000);
+    for (uint64_t i = 0; i < 10000; ++i) {
+        assert(m.count(i) == (i % 10 == 0 ? 1u : 0u));
+    }
+
+    m.rehash(5000);
+    assert(m.bucket_count() == 5000);
+    m.max_load_factor(0.25f);
+    assert(m.load_factor() <= 0.25f);
+    for (uint64_t i = 0; i < 10000; i += 10) {
+        assert(m.at(i) == (int)i);
+    }
+
+    // Past the load factor at the most buckets S_T can count
+    index_map<uint64_t, int, uint16_t> capped;
+    for (uint64_t i = 0; i < 60000; ++i) {
+        capped[i * 3] = (int)i;
+    }
+    assert(capped.bucket_count() == capped.max_bucket_count() && capped.size() == 60000);
+    index_map<uint64_t, int, uint16_t> more;
+    for (uint64_t i = 0; i < 5000; ++i) {
+        more[i * 3 + 1] = (int)i;
+    }
+    assert(capped.merge(more) == 5000 && capped.bucket_count() == capped.max_bucket_count());
+    for (uint64_t i = 0; i < 60000; ++i) {
+        assert(capped.at(i * 3) == (int)i && (i >= 5000 || capped.at(i * 3 + 1) == (int)i));
+    }
+
+    // Past the most values S_T can count, new keys are refused
+    size_t refused = 0;
+    for (uint64_t i = 0; i < 10000; ++i) {
+        try {
+            capped[i * 3 + 2] = 1;
+        } catch (const std::length_error &) {
+            refused += 1;
+        }
+    }
+    assert(capped.size() == capped.max_size() && refused == 10000 - (capped.max_size() - 65000));
+    capped[0] = 7;
+    assert(capped.at(0) == 7);
+    try {
+        capped.merge(more);
+    } catch (const std::length_error &) {
+        refused += 1;
+    }
+    size_t visited = 0;
+    for (auto it = capped.begin(); it != capped.end(); ++it) {
+        visited += 1;
+    }
+    assert(refused == 10000 - (capped.max_size() - 65000) + 1 && visited == capped.max_size());
+}
+
+void test_set() {
+    index_set<uint64_t> s(7);
+    unordered_set<uint64_t> u;
+    for (int i = 0; i < 50000; ++i) {
+        uint64_t key = (uint64_t)rand() % 100000;
+        assert(s.insert(key).second == u.insert(key).second);
+    }
+    assert(s.size() == u.size());
+    assert(s.bucket_count() * 2 >= s.size());
+
+    size_t n = 0;
+    for (auto it = s.begin(); it != s.end(); ++it) {
+        assert(u.count(*it) == 1);
+        n += 1;
+    }
+    assert(n == u.size());
+
+    // Erase through keys and through iterators
+    for (uint64_t key = 0; key < 50000; ++key) {
+        assert(s.erase(key) == u.erase(key));
+    }
+    for (auto it = s.begin(); it != s.end(); ) {
+        if (*it % 3 == 0) {
+            u.erase(*it);
+            it = s.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    assert(s.size() == u.size());
+
+    std::vector<uint64_t> query;
+    for (uint64_t key = 49000; key < 51000; ++key) {
+        query.push_back(key);
+    }
+    bool found[2000];
+    size_t hits = s.count_batch(query.data(), query.size(), found);
+    size_t expected = 0;
+    for (size_t i = 0; i < query.size(); ++i) {
+        assert(found[i] == (u.count(query[i]) == 1));
+        assert(s.count(query[i]) == u.count(query[i]));
+        assert((s.find(query[i]) != s.end()) == found[i]);
+        expected += found[i];
+    }
+    assert(hits == expected);
+
+    index_set<uint64_t> copy(s);
+    index_set<uint64_t> moved(std::move(s));
+    assert(copy.size() == u.size() && moved.size() == u.size());
+    copy.clear();
+    assert(copy.empty() && copy.count(50001) == 0);
+}
+
+void test_small_map() {
+  // No buckets while the elements fit in the inline array
+  index_map<uint64_t, Data> m;
+  assert(m.memory_usage() == sizeof(m));
+  assert(m.bucket_count() == INDEX_MAP_INIT_BUCKETS);
+  for (int i = 0; i < 5; ++i) {
+    m[i * 1000] = Data(i, i, i);
+  }
+  assert(m.memory_usage() == sizeof(m));
+  assert(m.size() == 5 && m.count(2000) == 1 && m.count(1) == 0);
+  assert(m.insert(std::make_pair(3000ull, Data())).second == false);
+
+  // Copies, moves and erases of a small map
+  index_map<uint64_t, Data> copy(m);
+  assert(copy == m);
+  index_map<uint64_t, Data> moved(std::move(copy));
+  assert(moved == m && copy.size() == 0);
+  assert(moved.erase(0) == 1 && moved.erase(0) == 0);
+  int n = 0;
+  for (auto it = moved.begin(); it != moved.end(); ++it, ++n) {
+    assert(it->second.f1 * 1000 == (int)it->first);
+  }
+  assert(n == 4);
+
+  // Promoted to buckets as it grows, the elements are kept
+  for (int i = 0; i < 1000; ++i) {
+    m[i * 1000] = Data(i, i, i);
+  }
+  assert(m.memory_usage() > sizeof(m));
+  assert(m.size() == 1000);
+  for (int i = 0; i < 1000; ++i) {
+    assert(m.at(i * 1000).f1 == i);
+  }
+
+  // Back to the inline array after release()
+  m.release();
+  m[7] = Data(7, 7, 7);
+  assert(m.memory_usage() == sizeof(m) && m.at(7).f1 == 7);
+  m = moved;
+  assert(m == moved && m.memory_usage() == sizeof(m));
+}
+
+void test_cow() {
+  cow_index_map<uint64_t, int> base;
+  std::unordered_map<uint64_t, int> u;
+  for (int i = 0; i < 100000; ++i) {
+    uint64_t key = (uint64_t)rand() * 7;
+    base[key] = i;
+    u[key] = i;
+  }
+  assert(base.size() == u.size());
+  size_t pages = base.allocated_pages();
+  size_t full = base.owned_memory_usage();
+  assert(base.shared_pages() == 0);
+
+  // A fork shares every page until it writes
+  cow_index_map<uint64_t, int> fork = base.snapshot();
+  assert(fork.size() == base.size());
+  assert(fork.shared_pages() == pages && fork.owned_memory_usage() == sizeof(fork));
+  assert(fork.count(u.begin()->first) == 1);
+  assert(fork.insert(std::make_pair(u.begin()->first, -1)).second == false);
+  assert(fork.erase(1) == 0);
+  assert(fork.shared_pages() == pages);
+
+  // Writes copy only the touched pages, base is unchanged
+  uint64_t first = u.begin()->first;
+  fork[first] = -1;
+  fork[3] = 3;
+  assert(fork.erase(first) == 1);
+  fork[first] = -2;
+  assert(fork.shared_pages() >= pages - 2);
+  assert(fork.owned_memory_usage() < full / 10);
+  assert(base.at(first) == u[first] && base.count(3) == 0);
+  assert(fork.at(first) == -2 && fork.at(3) == 3);
+  assert(fork.size() == base.size() + 1);
+
+  size_t n = 0;
+  for (auto it = base.begin(); it != base.end(); ++it, ++n) {
+    assert(u[it->first] == it->second);
+  }
+  assert(n == u.size());
+
+  // Forks of forks, and maps outliving their origin
+  cow_index_map<uint64_t, int> *grand = new cow_index_map<uint64_t, int>(fork);
+  fork.clear();
+  assert(fork.size() == 0 && fork.begin() == fork.end());
+  (*grand)[5] = 5;
+  for (int i = 0; i < 100000; ++i) {
+    (*grand)[i * 13] = i;  // grows, rehashing into private pages
+  }
+  assert(grand->at(3) == 3 && grand->at(first) == -2);
+  assert(grand->shared_pages() == 0);
+  base = *grand;
+  delete grand;
+  assert(base.at(3) == 3 && base.at(13 * 99999) == 99999);
+}
+
+void test_merge() {
+  // Reference: shard s holds the keys i with i % 5 == s and 1000 * s + i as
+  // value, shards 0 and 1 also hold the even keys of the destination
+  index_map<uint64_t, int> dst(7);
+  unordered_map<uint64_t, int> keep, overwrite, sum;
+  for (uint64_t k = 0; k < 3000; k += 2) {
+    dst[k] = -1;
+    keep[k] = overwrite[k] = sum[k] = -1;
+  }
+  std::vector<index_map<uint64_t, int> > shards(4, index_map<uint64_t, int>(40001));
+  shards[3] = index_map<uint64_t, int>(500);  // not a multiple of the others
+  for (int s = 0; s < 4; ++s) {
+    for (uint64_t k = s; k < 20000; k += 5) {
+      shards[s][k] = 1000 * s + (int)k;
+      keep.insert(std::make_pair(k, 1000 * s + (int)k));
+      overwrite[k] = 1000 * s + (int)k;
+      sum[k] += 1000 * s + (int)k;
+    }
+  }
+  // The shards of the common bucket count are merged bucket by bucket
+  for (int s = 0; s < 3; ++s) {
+    assert(shards[s].bucket_count() == shards[0].bucket_count());
+  }
+
+  auto check = [](index_map<uint64_t, int> &m, unordered_map<uint64_t, int> &u) {
+    assert(m.size() == u.size());
+    for (auto it = u.begin(); it != u.end(); ++it) {
+      assert(m.at(it->first) == it->second);
+    }
+    size_t n = 0;
+    for (auto it = m.begin(); it != m.end(); ++it, ++n) {
+    }
+    assert(n == u.size());
+  };
+
+  index_map<uint64_t, int> m1(dst);
+  size_t added = 0;
+  for (int s = 0; s < 4; ++s) {
+    added += m1.merge(shards[s]);
+  }
+  assert(added == keep.size() - dst.size());
+  check(m1, keep);
+
+  index_map<uint64_t, int> m2(dst);
+  for (int s = 0; s < 4; ++s) {
+    m2.merge(shards[s], INDEX_MAP_MERGE_OVERWRITE);
+  }
+  check(m2, overwrite);
+
+  // Several shards at once on 3 threads, the same as merging in order
+  const index_map<uint64_t, int> *ptrs[] = { &shards[0], &shards[1], &shards[2], &shards[3] };
+  for (int threads = 1; threads <= 3; threads += 2) {
+    index_map<uint64_t, int> m3(dst);
+    m3.enable_filter();
+    assert(m3.merge_parallel(ptrs, 4, threads) == keep.size() - dst.size());
+    check(m3, keep);
+    for (uint64_t k = 20000; k < 21000; ++k) {
+      assert(m3.count(k) == 0);
+    }
+
+    index_map<uint64_t, int> m4(dst);
+    m4.merge_parallel(ptrs, 4, threads, [](int &value, const int &other) { value += other; });
+    check(m4, sum);
+  }
+
+  // Into an empty map, which takes the bucket count of the shards
+  index_map<uint64_t, int> empty;
+  const index_map<uint64_t, int> *same[] = { &shards[0], &shards[1] };
+  empty.merge_parallel(same, 2, 2);
+  assert(empty.bucket_count() == shards[0].bucket_count());
+  assert(empty.size() == shards[0].size() + shards[1].size());
+
+  // Small maps stay small, and a map merged into itself is unchanged
+  index_map<uint64_t, int> a, b;
+  a[1] = 1;
+  a[2] = 2;
+  b[2] = 20;
+  b[3] = 30;
+  assert(a.merge(b, INDEX_MAP_MERGE_OVERWRITE) == 1);
+  assert(a.memory_usage() == sizeof(a));
+  assert(a.size() == 3 && a.at(2) == 20 && a.at(3) == 30);
+  assert(a.merge(a) == 0 && a.size() == 3);
+  b.merge(m1);
+  assert(b.size() == m1.size() && b.at(2) == 20);
+}
+
+void test_allocator() {
+  typedef counting_allocator<std::pair<uint64_t, int> > alloc_type;
+  typedef index_map<uint64_t, int, uint32_t, alloc_type> map_type;
+  size_t bytes = 0, other_bytes = 0;
+  {
+    map_type m(7, alloc_type(&bytes));
+    for (int i = 0; i < 10; ++i) {
+      m[i] = i;
+    }
+    assert(bytes == 0);  // still small
+    for (int i = 0; i < 10000; ++i) {
+      m[i * 3] = i;
+    }
+    // The buckets and every record buffer come from the allocator
+    assert(bytes == m.memory_usage() - sizeof(m));
+    size_t one = bytes;
+
+    map_type copy(m);
+    assert(copy == m && bytes == one + copy.memory_usage() - sizeof(copy));
+    m.erase_if([](const std::pair<uint64_t, int> &v) { return v.first % 2 == 0; });
+    m.shrink_to_fit();
+    assert(bytes == m.memory_usage() - sizeof(m) + copy.memory_usage() - sizeof(copy));
+
+    // Assignment keeps the allocator of the destination
+    map_type other(7, alloc_type(&other_bytes));
+    other = copy;
+    assert(other == copy && other.get_allocator() == alloc_type(&other_bytes));
+    assert(other_bytes == other.memory_usage() - sizeof(other));
+    other = std::move(m);  // different allocators: copied
+    assert(other.size() == m.size() && other_bytes == other.memory_usage() - sizeof(other));
+
+    // Not std::allocator, whose thread-safety is known: merged on one thread
+    size_t merged_bytes = 0;
+    map_type merged(7, alloc_type(&merged_bytes));
+    const map_type *shards[] = { &other, &copy };
+    assert(merged.merge_parallel(shards, 2, 4) == copy.size());
+    assert(merged == copy && merged_bytes == merged.memory_usage() - sizeof(merged));
+    copy.release();
+    assert(bytes == m.memory_usage() - sizeof(m));
+  }
+  assert(bytes == 0 && other_bytes == 0);
+}
+
+void test_shm() {
+  index_map<uint64_t, int> m;
+  for (int i = 0; i < 10000; ++i) {
+    m[(uint64_t)rand() * 3] = i;
+  }
+  std::string path = "/tmp/index_map_test_shm." + std::to_string((long long)getpid());
+  shm_index_map<uint64_t, int>::publish(path, m.begin(), m.end());
+
+  shm_index_map<uint64_t, int> reader(path);
+  assert(reader.size() == m.size());
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    assert(*reader.find(it->first) == it->second);
+  }
+  assert(reader.find(1) == NULL && reader.count(1) == 0);
+  size_t n = 0;
+  for (auto it = reader.begin(); it != reader.end(); ++it, ++n) {
+    assert(m.at(it->first) == it->second);
+  }
+  assert(n == m.size());
+  bool thrown = false;
+  try {
+    reader.at(1);
+  } catch (const std::out_of_range &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  // A new version: open readers keep the old one until they reload
+  m[1] = -1;
+  shm_index_map<uint64_t, int>::publish(path, m.begin(), m.end());
+  assert(reader.count(1) == 0);
+  shm_index_map<uint64_t, int> late(path);
+  assert(late.at(1) == -1);
+  assert(reader.reload() && reader.at(1) == -1 && reader.size() == m.size());
+  assert(!reader.reload());
+
+  // Other key or value types are refused
+  thrown = false;
+  try {
+    shm_index_map<uint64_t, uint64_t> wrong(path);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  index_map<uint64_t, int> empty;
+  shm_index_map<uint64_t, int>::publish(path, empty.begin(), empty.end());
+  assert(reader.reload() && reader.empty() && reader.find(1) == NULL);
+  unlink(path.c_str());
+}
+
+void test_checkpoint() {
+  typedef index_map<uint64_t, uint64_t> Map;
+  Map m;
+  m.track_changes();
+  for (uint64_t i = 0; i < 10000; ++i) {
+    m[i * 7] = i;
+  }
+  std::stringstream journal;
+  size_t full = m.write_checkpoint(journal);
+
+  // Only the written buckets go into a delta
+  for (uint64_t i = 0; i < 100; ++i) {
+    m.erase(i * 7);
+    m[i * 7 + 1] = i;
+  }
+  m.at(700) = 42;
+  m.touch(700);
+  size_t delta = m.write_checkpoint(journal);
+  assert(delta < full / 10);
+  assert(m.write_checkpoint(journal) < 100);
+
+  // A map tracking changes when it loads carries on the journal
+  Map loaded;
+  loaded.track_changes();
+  std::stringstream replay(journal.str());
+  assert(loaded.load_checkpoints(replay) == 3);
+  assert(loaded == m && loaded.at(700) == 42 && loaded.bucket_count() == m.bucket_count());
+  loaded[5] = 5;
+  loaded.erase(14);
+  std::string before = journal.str();
+  assert(loaded.write_checkpoint(journal) < 100);
+  Map again;
+  std::stringstream replay_all(journal.str());
+  assert(again.load_checkpoints(replay_all) == 4 && again == loaded);
+
+  // A torn or corrupt last checkpoint is dropped
+  std::string torn = journal.str();
+  std::stringstream truncated(torn.substr(0, torn.size() - 3));
+  assert(again.load_checkpoints(truncated) == 3 && again == m);
+  torn[before.size() + sizeof(index_map_checkpoint_header) + 2] ^= 1;
+  std::stringstream corrupt(torn);
+  assert(again.load_checkpoints(corrupt) == 3 && again == m);
+
+  // A rehash or a clear() makes the next checkpoint a full image
+  for (uint64_t i = 0; i < 20000; ++i) {
+    m[i * 11 + 3] = i;
+  }
+  std::stringstream grown;
+  m.write_checkpoint(grown);
+  m.clear();
+  m[1] = 1;
+  m.write_checkpoint(grown);
+  assert(again.load_checkpoints(grown) == 2 && again == m);
+
+  // Small maps and maps without tracking write full images
+  Map small, untracked;
+  small[3] = 4;
+  std::stringstream small_image, untracked_image;
+  small.write_checkpoint(small_image);
+  assert(again.load_checkpoints(small_image) == 1 && again == small);
+  untracked[9] = 9;
+  untracked.write_checkpoint(untracked_image);
+  assert(again.load_checkpoints(untracked_image) == 1 && again == untracked);
+
+  // A delta without its image is refused
+  std::stringstream orphan(journal.str().substr(full));
+  bool thrown = false;
+  try {
+    again.load_checkpoints(orphan);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void test_cuckoo() {
+  cuckoo_index_map<uint64_t, uint64_t> m;
+  unordered_map<uint64_t, uint64_t> ref;
+  // Multiples of a power of two, all in one bucket of index_map at that size
+  for (uint64_t i = 0; i < 100000; ++i) {
+    m[i << 16] = i;
+    ref[i << 16] = i;
+  }
+  assert(m.size() == ref.size() && m.count(0) == 1 && m.at(0) == 0);
+  assert(m.load_factor() <= m.max_load_factor() && m.load_factor() > m.max_load_factor() / 2.5);
+  for (auto it = ref.begin(); it != ref.end(); ++it) {
+    assert(m.find(it->first)->second == it->second);
+  }
+  assert(m.find(1) == m.end() && !m.insert(std::make_pair((uint64_t)65536, (uint64_t)9)).second);
+
+  // Iteration visits every record once, the key 0 included
+  size_t n = 0;
+  for (auto it = m.begin(); it != m.end(); ++it, ++n) {
+    assert(ref.at(it->first) == it->second);
+  }
+  assert(n == ref.size());
+
+  for (uint64_t i = 0; i < 100000; i += 2) {
+    assert(m.erase(i << 16) == 1);
+    ref.erase(i << 16);
+  }
+  assert(m.erase(0) == 0 && m.size() == ref.size() && m.count(0) == 0);
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    keys.push_back(i << 16);
+  }
+  std::vector<uint64_t *> values(keys.size());
+  assert(m.find_batch(keys.data(), keys.size(), values.data()) == 500);
+  assert(values[0] == NULL && *values[1] == 1);
+  assert(m.erase_batch(keys.data(), keys.size()) == 500);
+  assert(m.erase_if([](const std::pair<uint64_t, uint64_t> &r) { return r.second % 3 == 0; }) > 0);
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    assert(it->second % 3 != 0 && it->second >= 1000);
+  }
+
+  cuckoo_index_map<uint64_t, uint64_t> copy(m);
+  assert(copy == m);
+  copy[0] = 1;
+  assert(copy != m);
+  cuckoo_index_map<uint64_t, uint64_t> moved(std::move(copy));
+  assert(moved.at(0) == 1 && moved.size() == m.size() + 1);
+  m = moved;
+  assert(m == moved);
+
+  // Dense load: 4-way buckets, 95% of the slots
+  cuckoo_index_map<uint64_t, uint64_t> dense(1024);
+  dense.max_load_factor(0.95f);
+  for (uint64_t i = 1; i <= 3800; ++i) {
+    dense[i * 2654435761ull] = i;
+  }
+  assert(dense.bucket_count() == 1024 && dense.load_factor() > 0.92f);
+  for (uint64_t i = 1; i <= 3800; ++i) {
+    assert(dense.at(i * 2654435761ull) == i);
+  }
+
+  dense.clear();
+  assert(dense.empty() && dense.begin() == dense.end() && dense.bucket_count() == 1024);
+  dense.reserve(100000);
+  size_t buckets = dense.bucket_count();
+  for (uint64_t i = 1; i <= 100000; ++i) {
+    dense[i] = i;
+  }
+  assert(dense.bucket_count() == buckets);
+
+  // Records up to 8 bytes get 8-way buckets
+  cuckoo_index_map<uint32_t, uint32_t> narrow;
+  assert((cuckoo_index_map<uint32_t, uint32_t>::ways == 8 && cuckoo_index_map<uint64_t, uint64_t>::ways == 4));
+  for (uint32_t i = 0; i < 50000; ++i) {
+    narrow[i * 7] = i;
+  }
+  for (uint32_t i = 0; i < 50000; ++i) {
+    assert(narrow.at(i * 7) == i);
+  }
+
+  // Non-trivial values are destroyed with their buckets, on rehash too
+  cuckoo_index_map<uint64_t, std::string> strings(16);
+  for (uint64_t i = 0; i < 2000; ++i) {
+    strings[i] = std::string(100, (char)('a' + i % 26));
+  }
+  assert(strings.size() == 2000 && strings.bucket_count() > 16);
+  for (uint64_t i = 0; i < 2000; i += 3) {
+    assert(strings.at(i) == std::string(100, (char)('a' + i % 26)));
+    strings.erase(i);
+  }
+  cuckoo_index_map<uint64_t, std::string> strings_copy(strings);
+  assert(strings_copy == strings && strings_copy.count(3) == 0 && strings_copy.at(4).size() == 100);
+}
+
+void test_mphf() {
+  mphf_index_map<uint64_t, uint64_t> empty;
+  assert(empty.empty() && empty.find(1) == NULL && empty.count(0) == 0);
+
+  // Built from an index_map, on one thread and on four
+  index_map<uint64_t, uint64_t> m;
+  for (uint64_t i = 0; i < 200000; ++i) {
+    m[i * 2654435761ull] = i;
+  }
+  for (int threads = 1; threads <= 4; threads += 3) {
+    mphf_index_map<uint64_t, uint64_t> f;
+    f.build(m.begin(), m.end(), threads);
+    assert(f.size() == m.size() && f.level_count() > 1);
+    assert(f.index_bits_per_key() > 2.5 && f.index_bits_per_key() < 3.5);
+    for (auto it = m.begin(); it != m.end(); ++it) {
+      assert(f.at(it->first) == it->second);
+    }
+    // Every slot holds a key of the map
+    for (auto it = f.begin(); it != f.end(); ++it) {
+      assert(m.at(it->first) == it->second);
+    }
+    for (uint64_t i = 0; i < 200000; ++i) {
+      assert(f.count(i * 2654435761ull + 1) == 0);
+    }
+    vector<uint64_t> probe;
+    for (uint64_t i = 0; i < 1000; ++i) {
+      probe.push_back(i * 2654435761ull + (i % 3 == 0));
+    }
+    vector<const uint64_t *> found(probe.size());
+    assert(f.find_batch(probe.data(), probe.size(), found.data()) == 666);
+    for (uint64_t i = 0; i < 1000; ++i) {
+      assert(i % 3 == 0 ? found[i] == NULL : *found[i] == i);
+    }
+  }
+
+  // Columns, with 3 levels and keys left for the fallback list
+  vector<uint32_t> keys, values;
+  for (uint32_t i = 0; i < 5000; ++i) {
+    keys.push_back(i * 7);
+    values.push_back(i);
+  }
+  mphf_index_map<uint32_t, uint32_t> g(1.0, 3);
+  g.build_columns(keys.data(), values.data(), keys.size());
+  assert(g.size() == 5000 && g.fallback_count() > 0);
+  for (uint32_t i = 0; i < 5000; ++i) {
+    assert(*g.find(i * 7) == i && g.count(i * 7 + 1) == 0);
+  }
+  vector<const uint32_t *> column(keys.size());
+  assert(g.find_batch(keys.data(), keys.size(), column.data()) == keys.size());
+
+  keys.push_back(7);
+  values.push_back(0);
+  bool thrown = false;
+  try {
+    g.build_columns(keys.data(), values.data(), keys.size());
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  assert(thrown && g.empty() && g.find(7) == NULL);
+}
+
+void test_join() {
+  // probe_batch compares the inline keys at once, erased keys stay behind
+  // in the inline array and must not match
+  index_map<uint64_t, uint64_t> m(1000);
+  m.max_load_factor(16.0f);
+  for (uint64_t i = 1; i <= 9; ++i) {
+    m[i * 1000] = i;
+  }
+  assert(m.erase(2000) == 1);
+  assert(m.erase(9000) == 1);
+  uint64_t keys[] = { 1000, 2000, 3000, 8000, 9000, 7, 6000 };
+  size_t key_rows[] = { 10, 11, 12, 13, 14, 15, 16 };
+  size_t rows[7];
+  uint64_t values[7];
+  assert(m.probe_batch(keys, 7, key_rows, rows, values) == 4);
+  assert(rows[0] == 10 && values[0] == 1);
+  assert(rows[1] == 12 && values[1] == 3);
+  assert(rows[2] == 13 && values[2] == 8);
+  assert(rows[3] == 16 && values[3] == 6);
+  assert(m.probe_batch(keys, 3, NULL, rows, values) == 2);
+  assert(rows[0] == 0 && rows[1] == 2);
+  for (uint64_t i = 1; i <= 5; ++i) {
+    m.erase(i * 1000);
+  }
+  assert(m.size() == 3);
+  assert(m.probe_batch(keys, 7, NULL, rows, values) == 2);
+  assert(rows[0] == 3 && rows[1] == 6);
+
+  // Joins against a reference, the last build row of a key is a duplicate
+  const size_t build_n = 100000, probe_n = 300000;
+  vector<uint64_t> build_keys, payloads, probe_keys;
+  unordered_map<uint64_t, uint64_t> ref;
+  for (size_t i = 0; i < build_n; ++i) {
+    build_keys.push_back(i * 2654435761ull % 1000003);
+    payloads.push_back(i);
+    ref.insert(std::make_pair(build_keys.back(), i));
+  }
+  build_keys.push_back(build_keys[5]);
+  payloads.push_back(12345678);
+  for (size_t i = 0; i < probe_n; ++i) {
+    probe_keys.push_back(i * 7 % 1000003);
+  }
+
+  int bits[] = { 0, 3, index_map_join<uint64_t, uint64_t>::partition_bits_for(build_n) };
+  assert(bits[2] > 0);
+  for (int b = 0; b < 3; ++b) {
+    index_map_join<uint64_t, uint64_t> join(bits[b]);
+    join.build(build_keys.data(), payloads.data(), build_keys.size());
+    assert(join.size() == build_n);
+    assert(join.partition_count() == (size_t)1 << bits[b]);
+    vector<size_t> out_rows(probe_n);
+    vector<uint64_t> out_payloads(probe_n);
+    size_t matches = join.probe(probe_keys.data(), probe_n, out_rows.data(), out_payloads.data());
+
+    size_t expected = 0;
+    for (size_t i = 0; i < probe_n; ++i) {
+      expected += ref.count(probe_keys[i]);
+    }
+    assert(matches == expected && matches > 0);
+    vector<bool> seen(probe_n, false);
+    for (size_t j = 0; j < matches; ++j) {
+      size_t row = out_rows[j];
+      assert(row < probe_n && !seen[row]);
+      seen[row] = true;
+      assert(ref.at(probe_keys[row]) == out_payloads[j]);
+    }
+  }
+}
+
+void test_stats() {
+#ifdef INDEX_MAP_ENABLE_STATS
+    index_map_stats_reset();
+
+    index_map<uint64_t, Data> m(7);
+    for (uint64_t i = 0; i < 100; ++i) {
+        m[i] = Data();
+    }
+    assert(m.find(3) != m.end());
+    assert(m.find(1000) == m.end());
+    assert(m.count(5) == 1);
+
+    index_map_stats s = index_map_stats_collect();
+    assert(s.finds == 3);
+    assert(s.hits == 2);
+    assert(s.misses == 1);
+    assert(s.inline_probes > 0);
+    assert(s.rehashes > 0);
+    assert(s.enlarge_buffers > 0);
+
+    // Most misses are answered by the filter
+    m.enable_filter();
+    index_map_stats_reset();
+    for (uint64_t i = 1000; i < 2000; ++i) {
+        assert(m.count(i) == 0);
+    }
+    s = index_map_stats_collect();
+    assert(s.misses == 1000);
+    assert(s.filter_negatives > 900);
+
+    // At the most buckets S_T can count, inserts no longer rehash
+    index_map<uint64_t, int, uint16_t> capped;
+    for (uint64_t i = 0; i < 40000; ++i) {
+        capped[i] = (int)i;
+    }
+    assert(capped.bucket_count() == capped.max_bucket_count());
+    index_map_stats_reset();
+    for (uint64_t i = 40000; i < 60000; ++i) {
+        capped[i] = (int)i;
+    }
+    assert(index_map_stats_collect().rehashes == 0);
+
+    // Collected while another thread counts
+    index_map_stats_reset();
+    std::thread finder([&m]() {
+        for (uint64_t i = 0; i < 100000; ++i) {
+            m.count(i % 100);
+        }
+    });
+    uint64_t seen = 0;
+    while (seen < 100000) {
+        uint64_t finds = index_map_stats_collect().finds;
+        assert(finds >= seen);
+        seen = finds;
+    }
+    finder.join();
+    assert(index_map_stats_collect().finds == 100000);
+#endif
+}
+
 void compare_unordered_map() {
   index_map<uint64_t, Data> m;
   unordered_map<uint64_t, Data> u;
@@ -383,6 +1488,24 @@ int main() {
   test_equal_range();
   test_enumerate();
   test_equal();
+  test_64bit_index();
+  test_quotient();
+  test_filter();
+  test_find_batch();
+  test_adaptive();
+  test_erase_batch_if();
+  test_load_factor();
+  test_set();
+  test_small_map();
+  test_cow();
+  test_merge();
+  test_allocator();
+  test_shm();
+  test_checkpoint();
+  test_cuckoo();
+  test_join();
+  test_mphf();
+  test_stats();
 
   compare_unordered_map();
 
@@ -0,0 +1,777 @@
+#include <unordered_map>
+#include <unordered_set>
+#include <iostream>
+#include <sstream>
+#include "index_map_for_iteration.h"
+
+using namespace std;
+
+struct Data {
+  float f1;
+  float f2;
+  float f3;
+  Data(): Data(1.0f, 2.0f, 3.0f) {}
+  Data(float _f1, float _f2, float _f3) {
+    this->f1 = _f1;
+    this->f2 = _f2;
+    this->f3 = _f3;
+  }
+  bool operator==(const Data &d) const {
+    return f1 == d.f1 && f2 == d.f2 && f3 == d.f3;
+  }
+};
+
+// Allocator counting the bytes it holds, shared by its copies and rebinds
+template<typename T>
+struct counting_allocator {
+  typedef T value_type;
+  size_t *bytes;
+  explicit counting_allocator(size_t *_bytes): bytes(_bytes) {}
+  template<typename U>
+  counting_allocator(const counting_allocator<U> &other): bytes(other.bytes) {}
+  T *allocate(size_t n) {
+    *bytes += n * sizeof(T);
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) {
+    *bytes -= n * sizeof(T);
+    ::operator delete(p);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const counting_allocator<T> &a, const counting_allocator<U> &b) {
+  return a.bytes == b.bytes;
+}
+
+template<typename T, typename U>
+bool operator!=(const counting_allocator<T> &a, const counting_allocator<U> &b) {
+  return a.bytes != b.bytes;
+}
+
+void test_insert_find() {
+  index_map<int, Data> m;
+  auto ret = m.insert(std::make_pair(123, Data(3, 5, 7)));
+  assert(ret.second);
+  assert(ret.first->first == 123);
+  assert(ret.first->second == Data(3, 5, 7));
+
+  ret = m.insert(std::make_pair(123, Data(1, 5, 7)));
+  assert(!ret.second);
+  assert(ret.first->second == Data(3, 5, 7));
+
+  assert(m.find(123) != m.end());
+  assert(m.find(124) == m.end());
+  assert(m.size() == 1);
+}
+
+void test_erase() {
+  index_map<int, int> m;
+  for (int i = 0; i < 100; ++i) {
+    m[i] = i;
+  }
+  for (int i = 0; i < 100; i += 2) {
+    assert(m.erase(i) == 1);
+  }
+  assert(m.erase(0) == 0);
+  assert(m.size() == 50);
+
+  int count = 0;
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    assert(it->first % 2 == 1);
+    count += 1;
+  }
+  assert(count == 50);
+}
+
+void test_bucket_overflow() {
+  // All keys land in bucket 0, 4 inline indices plus the overflow list
+  index_map<int, int> m(1000);
+  for (int i = 0; i < 8; ++i) {
+    m[i * 1000] = i;
+  }
+  assert(m.size() == 8);
+  for (int i = 0; i < 8; ++i) {
+    assert(m.find(i * 1000)->second == i);
+  }
+  assert(m.find(8000) == m.end());
+
+  // Erase from the inline part and from the overflow list
+  assert(m.erase(1000) == 1);
+  assert(m.erase(6000) == 1);
+  assert(m.erase(6000) == 0);
+  for (int i = 0; i < 8; ++i) {
+    assert((m.find(i * 1000) != m.end()) == (i != 1 && i != 6));
+  }
+
+  // Drain a full inline part without overflow
+  index_map<int, int> f(1000);
+  for (int i = 0; i < 4; ++i) {
+    f[i * 1000] = i;
+  }
+  assert(f.erase(1000) == 1);
+  assert(f.erase(3000) == 1);
+  assert(f.find(3000) == f.end());
+  f[5000] = 5;
+  assert(f.find(5000)->second == 5);
+  assert(f.size() == 3);
+}
+
+void test_64bit_index() {
+  index_map<int64_t, int, int64_t> m(7);
+  for (int64_t i = 0; i < 10000; ++i) {
+    m[i << 33] = (int)i;
+  }
+  assert(m.size() == 10000);
+  for (int64_t i = 0; i < 10000; ++i) {
+    auto it = m.find(i << 33);
+    assert(it != m.end());
+    assert(it->second == (int)i);
+  }
+}
+
+void test_erase_batch_if() {
+  // Unsigned keys: holes are marked with (K_T)-1, not by the sign
+  index_map<uint64_t, int> m;
+  unordered_map<uint64_t, int> u;
+  for (int i = 0; i < 20000; ++i) {
+    uint64_t key = ((uint64_t)rand() << 33) | rand();
+    m[key] = i;
+    u[key] = i;
+  }
+
+  std::vector<uint64_t> drop;
+  for (auto &p : u) {
+    if (p.second % 3 == 0) {
+      drop.push_back(p.first);
+    }
+  }
+  drop.push_back(12345);  // absent
+  assert(m.erase_batch(drop.data(), drop.size()) == (int)drop.size() - 1);
+  for (size_t i = 0; i + 1 < drop.size(); ++i) {
+    u.erase(drop[i]);
+  }
+  assert(m.size() == (int)u.size());
+
+  // The hole key itself is rejected, the map is left unchanged
+  int size = m.size();
+  int rejected = 0;
+  uint64_t hole = ~0ull;
+  int delta = 1;
+  try { m[hole] = 7; } catch (const std::invalid_argument &) { rejected += 1; }
+  try { m.insert(std::make_pair(hole, 7)); } catch (const std::invalid_argument &) { rejected += 1; }
+  try { m.accumulate(hole, 7); } catch (const std::invalid_argument &) { rejected += 1; }
+  try { m.accumulate_batch(&hole, &delta, 1); } catch (const std::invalid_argument &) { rejected += 1; }
+  assert(rejected == 4 && m.size() == size && m.find(hole) == m.end());
+  index_map<uint64_t, int> small;
+  try { small[hole] = 7; } catch (const std::invalid_argument &) { rejected += 1; }
+  assert(rejected == 5 && small.size() == 0 && small.begin() == small.end());
+
+  int erased = m.erase_if([](const std::pair<uint64_t, int> &p) { return p.second % 5 == 0; });
+  int expected = 0;
+  for (auto it = u.begin(); it != u.end(); ) {
+    if (it->second % 5 == 0) {
+      it = u.erase(it);
+      expected += 1;
+    } else {
+      ++it;
+    }
+  }
+  assert(erased == expected);
+  assert(m.size() == (int)u.size());
+
+  // The values are dense again, and every key is still indexed
+  int count = 0;
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    assert(u.at(it->first) == it->second);
+    count += 1;
+  }
+  assert(count == (int)u.size());
+  for (auto &p : u) {
+    assert(m.find(p.first) != m.end() && m.find(p.first)->second == p.second);
+  }
+
+  // Holes are reused after the compaction
+  m[7] = 7;
+  assert(m.find(7)->second == 7 && m.size() == (int)u.size() + 1);
+}
+
+void test_load_factor() {
+  index_map<int64_t, int> m(7);
+  assert(m.max_load_factor() == 0.5f);
+  m.max_load_factor(2.0f);
+  m.reserve(10000);
+  int buckets = m.bucket_count();
+  assert(buckets * 2 >= 10000);
+  for (int i = 0; i < 10000; ++i) {
+    m[i] = i;
+  }
+  // No rehash while filling the reserved room
+  assert(m.bucket_count() == buckets);
+  assert(m.load_factor() <= 2.0f);
+
+  for (int i = 0; i < 10000; ++i) {
+    if (i % 10 != 0) {
+      m.erase(i);
+    }
+  }
+  size_t before = m.memory_usage();
+  m.shrink_to_fit();
+  assert(m.memory_usage() < before / 4);
+  assert(m.size() == 1000);
+  assert(m.bucket_count() < buckets);
+  for (int i = 0; i < 10000; ++i) {
+    assert((m.find(i) != m.end()) == (i % 10 == 0));
+  }
+
+  m.rehash(5000);
+  assert(m.bucket_count() == 5000);
+  m.max_load_factor(0.25f);
+  assert(m.load_factor() <= 0.25f);
+  for (int i = 0; i < 10000; i += 10) {
+    assert(m.find(i)->second == i);
+  }
+
+  // Past the load factor at the most buckets I_T can count
+  index_map<int64_t, int, int16_t> capped;
+  for (int i = 0; i < 20000; ++i) {
+    capped[i * 3] = i;
+  }
+  assert(capped.bucket_count() == std::numeric_limits<int16_t>::max() && capped.size() == 20000);
+  std::vector<int64_t> keys;
+  std::vector<int> ones(10000, 1);
+  for (int i = 0; i < 10000; ++i) {
+    keys.push_back(i * 3 + 1);
+  }
+  assert(capped.accumulate_batch(keys.data(), ones.data(), keys.size()) == 10000);
+  assert(capped.bucket_count() == std::numeric_limits<int16_t>::max() && capped.size() == 30000);
+  for (int i = 0; i < 20000; ++i) {
+    assert(capped.find(i * 3)->second == i);
+    assert(i >= 10000 || capped.find(i * 3 + 1)->second == 1);
+  }
+
+  // Past the most values I_T can index, new keys are refused
+  int refused = 0;
+  for (int i = 0; i < 40000; ++i) {
+    try {
+      capped[i * 3 + 2] = i;
+    } catch (const std::length_error &) {
+      refused += 1;
+    }
+  }
+  assert(capped.size() == capped.max_size() && refused == 40000 - (capped.max_size() - 30000));
+  capped[0] += 1;
+  assert(capped.accumulate(3, 1) == 2 && capped.find(0)->second == 1);
+  int delta = 1;
+  int64_t absent = -7;
+  try { capped.accumulate_batch(&absent, &delta, 1); } catch (const std::length_error &) { refused += 1; }
+  index_map<int64_t, int, int16_t> other;
+  other[-3] = 1;
+  try { capped.merge(other); } catch (const std::length_error &) { refused += 1; }
+  assert(refused == 40000 - (capped.max_size() - 30000) + 2 && capped.size() == capped.max_size());
+  int visited = 0;
+  for (auto it = capped.begin(); it != capped.end(); ++it) {
+    visited += 1;
+  }
+  assert(visited == capped.max_size());
+  capped.erase(0);
+  capped[-3] = 1;
+  assert(capped.size() == capped.max_size() && capped.find(-3)->second == 1);
+}
+
+void test_clear() {
+  index_map<int64_t, int> m(7);
+  for (int i = 0; i < 10000; ++i) {
+    m[i] = i;
+  }
+  int buckets = m.bucket_count();
+  for (int round = 0; round < 5; ++round) {
+    m.clear();
+    assert(m.size() == 0);
+    assert(m.begin() == m.end());
+    assert(m.bucket_count() == buckets);
+    // Old keys are still in value_container's buffer but must not be found
+    assert(m.find(round + 1) == m.end());
+    assert(m.erase(round + 1) == 0);
+    for (int i = round; i < 10000; i += 5) {
+      m[i] = round;
+    }
+    int n = 0;
+    for (auto it = m.begin(); it != m.end(); ++it, ++n) {
+      assert(it->first % 5 == round && it->second == round);
+    }
+    assert(n == (int)m.size());
+    for (int i = 0; i < 10000; ++i) {
+      assert((m.find(i) != m.end()) == (i % 5 == round));
+    }
+  }
+
+  m.release();
+  assert(m.size() == 0);
+  assert(m.bucket_count() < buckets);
+  m[3] = 3;
+  assert(m.find(3)->second == 3);
+}
+
+void test_small_map() {
+  index_map<int64_t, int> m;
+  size_t empty = m.memory_usage();
+  assert(empty == sizeof(m));
+  for (int i = 0; i < INDEX_MAP_SMALL_SIZE; ++i) {
+    m[i * 100] = i;
+  }
+  // Only the values are allocated, no buckets
+  assert(m.memory_usage() < empty + INDEX_MAP_SMALL_SIZE * sizeof(std::pair<int64_t, int>) + 1);
+  assert(m.find(300)->second == 3 && m.find(301) == m.end());
+  assert(m.erase(300) == 1 && m.find(300) == m.end());
+  m[300] = 3;
+
+  for (int i = 0; i < 1000; ++i) {
+    m[i * 100] = i;
+  }
+  assert((int)m.size() == 1000);
+  for (int i = 0; i < 1000; ++i) {
+    assert(m.find(i * 100)->second == i);
+  }
+
+  m.release();
+  assert(m.memory_usage() == empty);
+  m[5] = 5;
+  assert(m.find(5)->second == 5 && (int)m.size() == 1);
+}
+
+void test_merge() {
+  // Shard s holds the keys i with i % 5 == s, shards 0 and 1 also hold the
+  // even keys of the destination
+  // index_map is not copyable, each destination is filled again
+  auto fill = [](index_map<int64_t, int> &dst) {
+    for (int64_t k = 0; k < 3000; k += 2) {
+      dst[k] = -1;
+    }
+    dst.erase(100);  // leaves a hole
+  };
+  unordered_map<int64_t, int> keep, overwrite;
+  for (int64_t k = 0; k < 3000; k += 2) {
+    keep[k] = overwrite[k] = -1;
+  }
+  keep.erase(100);
+  overwrite.erase(100);
+  const int dst_size = (int)keep.size();
+  index_map<int64_t, int> shards[4];
+  for (int s = 0; s < 4; ++s) {
+    for (int64_t k = s; k < 20000; k += 5) {
+      shards[s][k] = 1000 * s + (int)k;
+      keep.insert(std::make_pair(k, 1000 * s + (int)k));
+      overwrite[k] = 1000 * s + (int)k;
+    }
+    shards[s].erase(s);
+  }
+  // Key s is left to the destination, which holds the even ones
+  for (int s = 0; s < 4; ++s) {
+    if (s % 2 == 0) {
+      keep[s] = overwrite[s] = -1;
+    } else {
+      keep.erase(s);
+      overwrite.erase(s);
+    }
+  }
+
+  auto check = [](index_map<int64_t, int> &m, unordered_map<int64_t, int> &u) {
+    assert(m.size() == (int)u.size());
+    for (auto it = u.begin(); it != u.end(); ++it) {
+      assert(m.find(it->first)->second == it->second);
+    }
+    size_t n = 0;
+    for (auto it = m.begin(); it != m.end(); ++it, ++n) {
+      assert(u[it->first] == it->second);
+    }
+    assert(n == u.size());
+  };
+
+  index_map<int64_t, int> m1(7);
+  fill(m1);
+  int added = 0;
+  for (int s = 0; s < 4; ++s) {
+    added += m1.merge(shards[s]);
+  }
+  assert(added == (int)keep.size() - dst_size);
+  check(m1, keep);
+
+  index_map<int64_t, int> *ptrs[] = { &shards[0], &shards[1], &shards[2], &shards[3] };
+  for (int threads = 1; threads <= 3; threads += 2) {
+    index_map<int64_t, int> m2(7);
+    fill(m2);
+    assert(m2.merge_parallel(ptrs, 4, threads, INDEX_MAP_MERGE_OVERWRITE) == (int)keep.size() - dst_size);
+    check(m2, overwrite);
+    m2[100000] = 1;
+    assert(m2.find(100000)->second == 1);
+  }
+
+  // Small maps stay small, and a map merged into itself is unchanged
+  index_map<int64_t, int> a, b;
+  size_t empty = a.memory_usage();
+  a[1] = 1;
+  a[2] = 2;
+  b[2] = 20;
+  b[3] = 30;
+  assert(a.merge(b, [](int &value, const int &other) { value += other; }) == 1);
+  assert(a.size() == 3 && a.find(2)->second == 22 && a.find(3)->second == 30);
+  assert(a.memory_usage() < empty + INDEX_MAP_SMALL_SIZE * sizeof(std::pair<int64_t, int>) + 1);
+  assert(a.merge(a) == 0 && a.size() == 3);
+  b.merge(m1);
+  assert(b.size() == m1.size() + 1 && b.find(2)->second == 20);  // m1 has no key 3
+}
+
+void test_allocator() {
+  typedef counting_allocator<std::pair<int64_t, int> > alloc_type;
+  size_t bytes = 0;
+  {
+    index_map<int64_t, int, int, alloc_type> m(7, alloc_type(&bytes));
+    assert(m.get_allocator() == alloc_type(&bytes));
+    for (int i = 0; i < 10000; ++i) {
+      m[i * 7] = i;  // long overflow lists in 7 buckets at first
+    }
+    assert(bytes > 10000 * sizeof(std::pair<int64_t, int>));
+    for (int i = 0; i < 10000; i += 2) {
+      m.erase(i * 7);
+    }
+    for (int i = 1; i < 10000; i += 2) {
+      assert(m.find(i * 7)->second == i);
+    }
+    // Instantiates the members that build containers of their own
+    m.shrink_to_fit();
+    m.csr_index();
+    m.rehash(20011);
+    index_map<int64_t, int, int, alloc_type> other(7, alloc_type(&bytes));
+    other[3] = 3;
+    assert(m.merge(other) == 1 && m.erase_if([](const std::pair<int64_t, int> &p) { return p.first == 3; }) == 1);
+    for (int i = 1; i < 10000; i += 2) {
+      assert(m.find(i * 7)->second == i);
+    }
+    m.release();
+    m[1] = 1;
+    assert(bytes > 0);
+  }
+  assert(bytes == 0);
+}
+
+void test_checkpoint() {
+  typedef index_map<int64_t, int64_t> Map;
+  // index_map is not copyable, loaded maps are compared with a reference
+  unordered_map<int64_t, int64_t> ref;
+  auto same = [&ref](Map &loaded) {
+    if (loaded.size() != (int)ref.size()) {
+      return false;
+    }
+    for (auto it = ref.begin(); it != ref.end(); ++it) {
+      auto found = loaded.find(it->first);
+      if (found == loaded.end() || found->second != it->second) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  Map m;
+  m.track_changes();
+  for (int64_t i = 0; i < 10000; ++i) {
+    m[i * 7] = ref[i * 7] = i;
+  }
+  std::stringstream journal;
+  size_t full = m.write_checkpoint(journal);
+
+  // Only the written slots go into a delta, erased ones as holes
+  for (int64_t i = 0; i < 100; ++i) {
+    m.erase(i * 7);
+    ref.erase(i * 7);
+    m[i * 7 + 1] = ref[i * 7 + 1] = i;
+  }
+  m[700] = ref[700] = 42;
+  m.find(707)->second = ref[707] = 43;
+  m.touch(707);
+  size_t delta = m.write_checkpoint(journal);
+  assert(delta < full / 10);
+
+  Map loaded;
+  loaded.track_changes();
+  std::stringstream replay(journal.str());
+  assert(loaded.load_checkpoints(replay) == 2 && same(loaded));
+
+  // The loaded map carries on the journal
+  loaded[5] = ref[5] = 5;
+  loaded.erase(14);
+  ref.erase(14);
+  assert(loaded.write_checkpoint(journal) < 100);
+  Map again;
+  std::stringstream replay_all(journal.str());
+  assert(again.load_checkpoints(replay_all) == 3 && same(again));
+
+  // A torn last checkpoint is dropped
+  std::stringstream truncated(journal.str().substr(0, journal.str().size() - 3));
+  assert(again.load_checkpoints(truncated) == 2 && again.find(5) == again.end());
+
+  // Erasing a batch moves values into the holes, the moves are deltas too
+  std::vector<int64_t> drop;
+  for (int64_t i = 100; i < 6000; ++i) {
+    drop.push_back(i * 7);
+    ref.erase(i * 7);
+  }
+  loaded.erase_batch(drop.data(), drop.size());
+  loaded.write_checkpoint(journal);
+  std::stringstream replay_batch(journal.str());
+  assert(again.load_checkpoints(replay_batch) == 4 && same(again));
+
+  // clear() makes the next checkpoint a full image
+  loaded.clear();
+  loaded[1] = 1;
+  ref.clear();
+  ref[1] = 1;
+  std::stringstream image;
+  loaded.write_checkpoint(image);
+  assert(again.load_checkpoints(image) == 1 && same(again));
+
+  // The image of an empty map, which has no value buffer
+  Map empty;
+  ref.clear();
+  std::stringstream empty_image;
+  assert(empty.write_checkpoint(empty_image) > 0);
+  assert(again.load_checkpoints(empty_image) == 1 && same(again));
+
+  // A delta without its image is refused
+  std::stringstream orphan(journal.str().substr(full));
+  bool thrown = false;
+  try {
+    again.load_checkpoints(orphan);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void test_csr_index() {
+  typedef index_map<int64_t, int64_t> Map;
+  unordered_map<int64_t, int64_t> ref;
+  auto same = [&ref](Map &m) {
+    if (m.size() != (int)ref.size()) {
+      return false;
+    }
+    int count = 0;
+    for (auto it = m.begin(); it != m.end(); ++it) {
+      auto found = ref.find(it->first);
+      if (found == ref.end() || found->second != it->second) {
+        return false;
+      }
+      count += 1;
+    }
+    return count == (int)ref.size();
+  };
+
+  for (int threads = 1; threads <= 3; ++threads) {
+    ref.clear();
+    Map m(7);
+    m.csr_index(true, threads);
+    // A high load, so that most buckets overflow into runs. 100003 buckets
+    // span several parts of the rebuild.
+    m.max_load_factor(8.0f);
+    for (int64_t i = 1; i <= 500000; ++i) {
+      m[i * 7] = i;
+      ref[i * 7] = i;
+    }
+    m.rehash(100003);
+    assert(m.bucket_count() == 100003);
+    assert(same(m));
+    for (auto it = ref.begin(); it != ref.end(); ++it) {
+      assert(m.find(it->first)->second == it->second);
+    }
+    assert(m.find(-5) == m.end());
+
+    // Changes copy the runs to own lists
+    for (int64_t i = 1; i <= 500000; i += 7) {
+      assert(m.erase(i * 7) == 1);
+      ref.erase(i * 7);
+    }
+    for (int64_t i = 1; i <= 500000; i += 5) {
+      m[i * 7] = -i;
+      ref[i * 7] = -i;
+      m[i * 7 + 100003 * 4000000ll] = i;
+      ref[i * 7 + 100003 * 4000000ll] = i;
+    }
+    assert(same(m));
+    assert(m.erase_if([](const std::pair<int64_t, int64_t> &r) { return r.second % 11 == 0; }) > 0);
+    for (auto it = ref.begin(); it != ref.end();) {
+      it = it->second % 11 == 0 ? ref.erase(it) : std::next(it);
+    }
+    assert(same(m));
+
+    // Rebuilt by shrink_to_fit, then cleared and refilled
+    m.shrink_to_fit();
+    assert(same(m));
+    m.clear();
+    assert(m.find(1) == m.end());
+    ref.clear();
+    for (int64_t i = 0; i < 1000; ++i) {
+      m[i * 7] = i;
+      ref[i * 7] = i;
+    }
+    assert(same(m));
+  }
+
+  // Same contents as the rebuild one value at a time, in less memory
+  Map a(7), b(7);
+  a.max_load_factor(100.0f);
+  b.max_load_factor(100.0f);
+  b.csr_index();
+  for (int64_t i = 1; i < 100000; ++i) {
+    a[i] = i;
+    b[i] = i;
+  }
+  a.rehash(1001);
+  b.rehash(1001);
+  assert(b.memory_usage() < a.memory_usage());
+  for (int64_t i = 1; i < 100000; ++i) {
+    assert(a.find(i)->second == b.find(i)->second);
+  }
+  b.csr_index(false);
+  b.rehash(997);
+  assert(b.find(99999)->second == 99999);
+}
+
+void test_accumulate() {
+  index_map<int64_t, int64_t> m(7);
+  // Small map, then buckets
+  assert(m.accumulate(5, 3) == 3);
+  assert(m.accumulate(5, 4) == 7);
+  assert(m.upsert(6, 10, [](int64_t &v) { v *= 2; }) == 10);
+  assert(m.upsert(6, 10, [](int64_t &v) { v *= 2; }) == 20);
+  assert(m.size() == 2);
+
+  unordered_map<int64_t, int64_t> ref;
+  vector<int64_t> keys, deltas;
+  for (int i = 0; i < 100000; ++i) {
+    keys.push_back((i * 7919) % 5003);
+    deltas.push_back(i % 13 - 6);
+  }
+  index_map<int64_t, int64_t> g(7);
+  assert(g.accumulate_batch(keys.data(), deltas.data(), 3) == 3);
+  assert(g.accumulate_batch(keys.data() + 3, deltas.data() + 3, keys.size() - 3) == 5003 - 3);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ref[keys[i]] += deltas[i];
+    m.accumulate(keys[i], deltas[i]);
+  }
+  assert(g.size() == (int)ref.size());
+  for (auto it = ref.begin(); it != ref.end(); ++it) {
+    assert(g.find(it->first)->second == it->second);
+    assert(m.find(it->first)->second == it->second + (it->first == 5 ? 7 : it->first == 6 ? 20 : 0));
+  }
+
+  // Values that are not numbers
+  index_map<int, Data> d(7);
+  for (int i = 0; i < 100; ++i) {
+    d.upsert(i % 10, Data(0, 0, 0), [](Data &v) { v.f1 += 1; });
+  }
+  assert(d.size() == 10);
+  assert(d.find(3)->second == Data(9, 0, 0));
+
+  // Updates are recorded for the next checkpoint
+  index_map<int64_t, int64_t> c(7);
+  for (int i = 0; i < 1000; ++i) {
+    c[i] = i;
+  }
+  c.track_changes();
+  std::stringstream journal;
+  c.write_checkpoint(journal);
+  int64_t k = 500, delta = 1;
+  c.accumulate_batch(&k, &delta, 1);
+  c.accumulate(600, 2);
+  c.write_checkpoint(journal);
+  index_map<int64_t, int64_t> loaded;
+  std::stringstream in(journal.str());
+  assert(loaded.load_checkpoints(in) == 2);
+  assert(loaded.find(500)->second == 501);
+  assert(loaded.find(600)->second == 602);
+}
+
+void test_set() {
+  index_set<uint64_t> s(7);
+  unordered_set<uint64_t> u;
+  for (int i = 0; i < 50000; ++i) {
+    uint64_t key = (uint64_t)rand() % 100000;
+    assert(s.insert(key).second == u.insert(key).second);
+  }
+  assert(s.size() == (int)u.size());
+
+  // Erase half, the keys stay dense
+  for (uint64_t key = 0; key < 100000; key += 2) {
+    assert(s.erase(key) == (int)u.erase(key));
+  }
+  assert(s.size() == (int)u.size());
+  assert(s.end() - s.begin() == s.size());
+  for (auto it = s.begin(); it != s.end(); ++it) {
+    assert(u.count(*it) == 1);
+    assert(s.find(*it) == it);
+  }
+
+  std::vector<uint64_t> query;
+  for (uint64_t key = 0; key < 1000; ++key) {
+    query.push_back(key);
+  }
+  bool found[1000];
+  size_t hits = s.count_batch(query.data(), query.size(), found);
+  size_t expected = 0;
+  for (uint64_t key = 0; key < 1000; ++key) {
+    assert(found[key] == (u.count(key) == 1));
+    assert(s.count(key) == (int)u.count(key));
+    expected += u.count(key);
+  }
+  assert(hits == expected);
+
+  index_set<uint64_t> copy(s);
+  s.clear();
+  assert(s.empty() && s.count(1) == 0);
+  assert(copy.size() == (int)u.size());
+}
+
+void compare_unordered_map() {
+  index_map<int64_t, Data> m;
+  unordered_map<int64_t, Data> u;
+
+  for (int i = 0; i < 100000; ++i) {
+    int64_t key = ((int64_t)rand() << 31) | rand();
+    Data value = Data(rand(), rand(), rand());
+    auto ret1 = m.insert(std::make_pair(key, value));
+    auto ret2 = u.insert(std::make_pair(key, value));
+    assert(ret1.second == ret2.second);
+  }
+
+  int count = 0;
+  for (auto it : m) {
+    assert(u[it.first] == it.second);
+    count += 1;
+  }
+  assert(count == (int)u.size());
+
+  for (auto it : u) {
+    assert(m[it.first] == it.second);
+  }
+}
+
+int main() {
+  test_insert_find();
+  test_erase();
+  test_bucket_overflow();
+  test_64bit_index();
+  test_erase_batch_if();
+  test_load_factor();
+  test_clear();
+  test_small_map();
+  test_merge();
+  test_allocator();
+  test_checkpoint();
+  test_csr_index();
+  test_accumulate();
+  test_set();
+
+  compare_unordered_map();
+
+  return 0;
+}
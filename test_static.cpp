@@ -0,0 +1,94 @@
+// Tests of static_index_map (index_map_static.h), which needs C++14
+#include <cassert>
+#include <iostream>
+#include <unordered_map>
+#include "index_map_static.h"
+
+using namespace std;
+
+// Opcode dispatch, looked up at compile time as well
+constexpr std::pair<uint8_t, int> opcode_entries[] = {
+  {0x00, 1}, {0x01, 2}, {0x10, 3}, {0x20, 4}, {0x7f, 5}, {0xff, 6}
+};
+constexpr static_index_map<uint8_t, int, 6> opcodes(opcode_entries);
+static_assert(opcodes.at(0x7f) == 5 && opcodes.at(0x00) == 1, "");
+static_assert(opcodes.count(0x02) == 0 && opcodes.find(0x30) == opcodes.end(), "");
+static_assert(opcodes.find(0x10)->second == 3, "");
+
+constexpr auto ports = make_static_index_map<int32_t, uint16_t>({{-1, 1}, {80, 2}, {443, 3}});
+static_assert(ports.size() == 3 && ports.at(-1) == 1 && ports.count(0) == 0, "");
+
+template<std::size_t N>
+struct columns {
+  uint64_t keys[N];
+  uint32_t values[N];
+};
+
+// N distinct spread-out keys, the value of keys[i] is i
+template<std::size_t N>
+constexpr columns<N> make_columns() {
+  columns<N> c = {};
+  for (std::size_t i = 0; i < N; ++i) {
+    c.keys[i] = (i + 1) * 0x9E3779B97F4A7C15ull;
+    c.values[i] = (uint32_t)i;
+  }
+  return c;
+}
+
+constexpr columns<5000> big_columns = make_columns<5000>();
+constexpr static_index_map<uint64_t, uint32_t, 5000> big(big_columns.keys, big_columns.values);
+
+void test_lookup() {
+  for (std::size_t i = 0; i < 5000; ++i) {
+    assert(big.count(big_columns.keys[i]) == 1);
+    assert(big.at(big_columns.keys[i]) == i);
+    assert(big.find(big_columns.keys[i])->first == big_columns.keys[i]);
+  }
+  // Misses, the fillers of the empty slots included
+  for (uint64_t key = 0; key < 100000; ++key) {
+    assert(big.count(key) == 0 && big.find(key) == big.end());
+  }
+  assert(big.load_factor() > 0.4f && big.load_factor() <= 0.8f);
+  assert(big.bucket_count() == 8192);
+
+  bool thrown = false;
+  try {
+    big.at(1);
+  } catch (const std::out_of_range &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+void test_runtime_build() {
+  // The same table built at run time, for key sets only known then
+  std::pair<uint32_t, uint32_t> entries[300];
+  std::unordered_map<uint32_t, uint32_t> ref;
+  for (uint32_t i = 0; i < 300; ++i) {
+    entries[i] = std::make_pair(i * i * 7 + 3, i);
+    ref[i * i * 7 + 3] = i;
+  }
+  static_index_map<uint32_t, uint32_t, 300> m(entries);
+  for (uint32_t key = 0; key < 700000; ++key) {
+    auto it = ref.find(key);
+    assert(m.count(key) == (it != ref.end() ? 1u : 0u));
+    if (it != ref.end()) {
+      assert(m.at(key) == it->second);
+    }
+  }
+
+  entries[299].first = entries[0].first;
+  bool thrown = false;
+  try {
+    static_index_map<uint32_t, uint32_t, 300> dup(entries);
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+int main() {
+  test_lookup();
+  test_runtime_build();
+  return 0;
+}
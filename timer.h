@@ -1,27 +1,211 @@
 #ifndef __TIMER_H_
 #define __TIMER_H_
 #include <sys/time.h>
+#include <stdint.h>
 #include <string>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 using namespace std;
 
+// Hardware performance counters of the calling thread, read through
+// perf_event_open. Each counter is opened on its own, so the ones the kernel
+// or the container refuses are simply reported as unavailable.
+class PerfCounters {
+public:
+  enum Event {
+    CYCLES,
+    INSTRUCTIONS,
+    L1D_MISSES,
+    LLC_MISSES,
+    DTLB_MISSES,
+    BRANCH_MISSES,
+    EVENT_NUM
+  };
+
+  PerfCounters() {
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      fds[i] = -1;
+      values[i] = 0;
+    }
+#ifdef __linux__
+    // Allow to turn off the counters, e.g. when another profiler is attached
+    if (getenv("INDEX_MAP_NO_PERF") == NULL) {
+      fds[CYCLES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+      fds[INSTRUCTIONS] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+      fds[L1D_MISSES] = open_event(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D));
+      fds[LLC_MISSES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+      fds[DTLB_MISSES] = open_event(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB));
+      fds[BRANCH_MISSES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    }
+#endif
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      if (fds[i] >= 0) {
+        close(fds[i]);
+      }
+    }
+#endif
+  }
+
+  // Whether at least one counter could be opened
+  bool available() const {
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      if (fds[i] >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void start() {
+#ifdef __linux__
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      if (fds[i] >= 0) {
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  void stop() {
+#ifdef __linux__
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      if (fds[i] < 0) {
+        continue;
+      }
+      ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+      // value, time enabled, time running
+      uint64_t data[3] = { 0, 0, 0 };
+      if (read(fds[i], data, sizeof(data)) != (ssize_t)sizeof(data)) {
+        values[i] = 0;
+        continue;
+      }
+      // Scale up when the counter was multiplexed with others
+      if (data[2] > 0 && data[2] < data[1]) {
+        values[i] = (uint64_t)((double)data[0] * data[1] / data[2]);
+      } else {
+        values[i] = data[0];
+      }
+    }
+#endif
+  }
+
+  bool has(Event e) const {
+    return fds[e] >= 0;
+  }
+
+  uint64_t value(Event e) const {
+    return values[e];
+  }
+
+  // Print all counters divided by 'elements'
+  void print(ostream &os, uint64_t elements) const {
+    static const char *names[EVENT_NUM] = {
+      "cycles", "instructions", "L1D-misses", "LLC-misses", "dTLB-misses", "branch-misses"
+    };
+    if (!available()) {
+      os << " [perf counters unavailable]";
+      return;
+    }
+    if (elements == 0) {
+      elements = 1;
+    }
+    os << " [per element:";
+    for (int i = 0; i < EVENT_NUM; ++i) {
+      os << " " << names[i] << "=";
+      if (fds[i] >= 0) {
+        os << (double)values[i] / elements;
+      } else {
+        os << "n/a";
+      }
+    }
+    os << "]";
+  }
+
+private:
+#ifdef __linux__
+  static uint64_t cache_event(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
+
+  static int open_event(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+#endif
+
+private:
+  int fds[EVENT_NUM];
+  uint64_t values[EVENT_NUM];
+};
+
+// The number of elements a Timer divides its hardware counters by. A type
+// of its own, so that Timer(name, 0) still means no total time.
+struct PerElement {
+  explicit PerElement(unsigned long long _count) : count(_count) {
+  }
+
+  unsigned long long count;
+};
+
 class Timer {
 public:
-  Timer(const char *_name) : name(_name), pTotalTime(NULL) {
+  Timer(const char *_name) : name(_name), pTotalTime(NULL), elements(0) {
     gettimeofday(&start, NULL);
   }
 
-  Timer(const char *_name, float *_pTotal) : name(_name), pTotalTime(_pTotal) {
+  Timer(const char *_name, float *_pTotal) : name(_name), pTotalTime(_pTotal), elements(0) {
     gettimeofday(&start, NULL);
   }
 
+  // Also collect hardware counters and print them per element
+  Timer(const char *_name, PerElement _elements) :
+      name(_name), pTotalTime(NULL), elements(_elements.count), perf(new PerfCounters()) {
+    perf->start();
+    gettimeofday(&start, NULL);
+  }
+
+  // Times one scope, and owns the counters
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
   ~Timer() {
     gettimeofday(&end, NULL);
+    if (perf) {
+      perf->stop();
+    }
     float interval = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000.0f;
     if (pTotalTime) {
       *pTotalTime += interval;
     }
-    cout << name << ": " << interval << " ms" << endl;
+    cout << name << ": " << interval << " ms";
+    if (perf) {
+      perf->print(cout, elements);
+    }
+    cout << endl;
   }
 
 private:
@@ -29,6 +213,8 @@ private:
   struct timeval start;
   struct timeval end;
   float *pTotalTime;
+  unsigned long long elements;
+  std::unique_ptr<PerfCounters> perf;
 };
 
 #endif